@@ -0,0 +1,1059 @@
+/*
+  The DDSM conversion core: the digitizer calibration functions, the
+  kernels that unpack and calibrate rows of raw pixel data, and the
+  histogram (sidecar) file format. These are shared by ddsmraw2pnm and
+  the other programs in this directory, each of which is compiled from
+  a single file that includes this header (see the comment at the top
+  of each program).
+*/
+
+#ifndef DDSMCORE_H
+#define DDSMCORE_H
+
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Define the three digitizer names.
+const std::string dba = "dba";
+const std::string howtek_mgh = "howtek-mgh";
+const std::string howtek_ismd = "howtek-ismd";
+const std::string lumisys = "lumisys";
+
+// Define the maximum Optical Density value that will map to an output
+// grey level value of 65535.
+const double maxOD = 4.0;
+
+// Define the number of bits used to represent the raw data and the
+// output data. The define the maximum unsigned integer that can be
+// represented using that number of bits.
+const unsigned int numBits = 16;
+const unsigned int maxUnsignedIntWithNumBits = 65535;
+
+// Define the limits of the raw values that the calibration functions
+// accept; values outside of these limits are clamped to them (see the
+// calibration functions for why). The dba digitizer's raw value of
+// zero is special and is not clamped.
+const unsigned int dbaMinRaw = 4;
+const unsigned int dbaMaxRaw = 64064;
+const unsigned int howtekMghMaxRaw = 4006;
+const unsigned int howtekIsmdMaxRaw = 4003;
+const unsigned int lumisysMinRaw = 61;
+const unsigned int lumisysMaxRaw = 4097;
+
+// Check that the input values does not lie outside of the range 0 to
+// 65535. Return true if the input value is in the range, otherwise
+// return false.
+inline bool checkRange(unsigned int i)
+{
+  const bool retVal = (i <= maxUnsignedIntWithNumBits);
+  if(!retVal)
+    {
+      std::cerr << "Data outside range. Data is: " << i << std::endl;
+    }
+
+  return retVal;
+}
+
+// Convert an optical density value to our normalised grey level
+// quantity. retVal must point to a memory location that we can write
+// to (i.e, it will return the result) and od is the optical density
+// value we operate on. This functio will return true if everything is
+// OK, otherwise it will return false.
+inline bool od2NormGreyLevel(unsigned int* retVal, const double od)
+{
+  *retVal = static_cast<unsigned int>((static_cast<double>(maxUnsignedIntWithNumBits) / maxOD) * od);
+  if(*retVal > maxUnsignedIntWithNumBits)
+    {
+      // There's a problem.
+      std::cerr << "Optical density value was out of range; value was " << od << std::endl;
+      return false;
+    }
+
+  // The dat from the digitizer is inverted, so uninvert.
+  *retVal = maxUnsignedIntWithNumBits - *retVal;
+
+  // Now perform quadratic companding, so we give more binary
+  // precision to the high grey levels. The quadratic maps zero to
+  // zero and 65535 to 65535 and is quadratic in between.
+  *retVal = static_cast<unsigned int>((1.0/static_cast<double>(maxUnsignedIntWithNumBits)) * (static_cast<double>(*retVal) * static_cast<double>(*retVal)));
+
+  // Force things to be in range.
+  /* 
+     if(*retVal > maxUnsignedIntWithNumBits)
+     {
+     *retVal = maxUnsignedIntWithNumBits;
+     }
+  */
+
+  // Everything's OK.
+  return true;
+}
+
+// The calibration function for the dba digitizer. retVal must point
+// to a memory location we can write an unsigned int to; raw is the
+// input argument. We return true if everything was OK, false
+// otherwise.
+inline bool dbaCalibration(unsigned int* retVal, unsigned int raw)
+{
+  double rawDouble = 0.0;
+
+  if(0 != raw)
+    {
+      // Need to correct for input that is over 64064, as the equation
+      // below will give -ve results for such data!
+      if(raw > dbaMaxRaw)
+	{
+	  raw = dbaMaxRaw;
+	}
+
+      // Need to correct for input that is less than 4, as this will
+      // generate optical density values that are greater than 4.0
+      // (which is currently set as the value of maxOD).
+      if(raw < dbaMinRaw)
+	{
+	  raw = dbaMinRaw;
+	}
+
+      rawDouble = static_cast<double>(raw);
+      rawDouble = (log10(rawDouble) - 4.80662) / (-1.07553);
+      // Above eqn from: http://marathon.csee.usf.edu/Mammography/DDSM/calibrate/DBA_Scanner_info.html
+    }
+
+  // Now convert to our normalised grey level.
+  return od2NormGreyLevel(retVal, rawDouble); // Returns true if OK, false otherwise.
+}
+
+// The calibration function for the howtek-ismd digitizer. retVal must
+// point to a memory location we can write an unsigned int to; raw is
+// the input argument. We return true if everything was OK, false
+// otherwise.
+inline bool howtekMghCalibration(unsigned int* retVal, unsigned int raw)
+{
+  // Need to correct for input values that are over 4006, as the eqn
+  // below gives -ve results for such data.
+  if(raw > howtekMghMaxRaw)
+    {
+      raw = howtekMghMaxRaw; 
+    }
+
+  // Convert from raw to optical density.
+  double od = 3.789 + ((-0.00094568) * static_cast<double>(raw));
+
+  // Now convert to our normalised grey level.
+  return od2NormGreyLevel(retVal, od); // Returns true if OK, false otherwise.
+}
+
+// The calibration function for the howtek-ismd digitizer. retVal must
+// point to a memory location we can write an unsigned int to; raw is
+// the input argument. We return true if everything was OK, false
+// otherwise.
+inline bool howtekIsmdCalibration(unsigned int* retVal, unsigned int raw)
+{
+  // Need to correct for input values that are over 4003, as the eqn
+  // below gives -ve results for such data.
+  if(raw > howtekIsmdMaxRaw)
+    {
+      raw = howtekIsmdMaxRaw; 
+    }  
+
+  // Convert from raw to optical density.
+  double od = 3.96604096240593 + ((-0.00099055807612) * static_cast<double>(raw));
+
+  // Now convert to our normalised grey level.
+  return od2NormGreyLevel(retVal, od); // Returns true if OK, false otherwise.
+}
+
+// The calibration function for the lumisys digitizer.
+inline bool lumisysCalibration(unsigned int* retVal, unsigned int raw)
+{
+  // Need to correct for input values that are less than 58, as the
+  // eqn below gives results over 4.0 (our choice for maxOD, but check
+  // this!) for such data.
+  if(raw < lumisysMinRaw)
+    {
+      raw = lumisysMinRaw; 
+    }  
+
+  // Need to correct for input values that are over 4097, as the eqn
+  // below gives -ve results for such data.
+  if(raw > lumisysMaxRaw)
+    {
+      raw = lumisysMaxRaw; 
+    }
+
+  // Convert from raw to optical density.
+  double od = (static_cast<double>(raw) - 4096.99) / (-1009.01);
+
+  // Now convert to our normalised grey level.
+  return od2NormGreyLevel(retVal, od); // Returns true if OK, false otherwise.
+}
+
+// The type of the calibration functions.
+typedef bool (*CalibrationFunc)(unsigned int* retVal, unsigned int raw);
+
+// Return the calibration function for the digitizer with the given
+// name, or NULL if the name is not one of the four digitizer names.
+inline CalibrationFunc getCalibrationFunction(const std::string& digitizer)
+{
+  if(digitizer.compare(dba) == 0)
+    {
+      return dbaCalibration;
+    }
+  else if(digitizer.compare(howtek_mgh) == 0)
+    {
+      return howtekMghCalibration;
+    }
+  else if(digitizer.compare(howtek_ismd) == 0)
+    {
+      return howtekIsmdCalibration;
+    }
+  else if(digitizer.compare(lumisys) == 0)
+    {
+      return lumisysCalibration;
+    }
+
+  return NULL;
+}
+
+// Get the range of raw values that a calibration function uses
+// without clamping: values below *minRaw or above *maxRaw are clamped.
+inline void getCalibrationRange(CalibrationFunc calibrationFunc, unsigned int* minRaw, unsigned int* maxRaw)
+{
+  *minRaw = 0;
+  *maxRaw = maxUnsignedIntWithNumBits;
+  if(calibrationFunc == dbaCalibration)
+    {
+      *minRaw = dbaMinRaw;
+      *maxRaw = dbaMaxRaw;
+    }
+  else if(calibrationFunc == howtekMghCalibration)
+    {
+      *maxRaw = howtekMghMaxRaw;
+    }
+  else if(calibrationFunc == howtekIsmdCalibration)
+    {
+      *maxRaw = howtekIsmdMaxRaw;
+    }
+  else if(calibrationFunc == lumisysCalibration)
+    {
+      *minRaw = lumisysMinRaw;
+      *maxRaw = lumisysMaxRaw;
+    }
+}
+
+// This function checks the calibration functions to make sure they
+// produce output with a suitable range of values. The function
+// returns true if the functions are OK and false otherwise.
+inline bool checkCalibrationFunctions(void)
+{
+  // Define an array of functions pointers to test.
+  bool (*calibrationFuncs[4])(unsigned int*, unsigned int) = 
+    {
+      dbaCalibration, howtekMghCalibration, howtekIsmdCalibration, lumisysCalibration
+    };
+
+  // Define an array of digitizer names for output.
+  std::string digitizerNames[4] = {dba, howtek_mgh, howtek_ismd, lumisys};
+
+  // Iterate over the digitizer/calibration functions.
+  bool (*thisCalibrationFunc)(unsigned int*, unsigned int) = NULL;
+  for(unsigned int i = 0; i < 4; i++)
+    {
+      thisCalibrationFunc = calibrationFuncs[i];
+
+      // Iterate over every possible input value and see if calling
+      // the calibration function on it gives a result that is out of
+      // bounds.
+      unsigned int outVal = 0; // This is where we'll store the returned value from the calibration functions.
+      for(unsigned int inVal = 0; inVal <= maxUnsignedIntWithNumBits; inVal++)
+	{
+	  // Call the function.
+	  (*thisCalibrationFunc)(&outVal, inVal);
+
+	  // Test the return value.
+	  if(outVal > maxUnsignedIntWithNumBits)
+	    {
+	      std::cerr << "The calibration function for the " << digitizerNames[i] << " digitizer has a range problem." << std::endl;
+	      std::cerr << "The input value that generated this error was " << inVal << std::endl;
+	      return false; // It's broken.
+	    }
+	}
+    }
+
+  // If we get here, everything's OK.
+  return true;
+}
+
+// Unpack a row of raw data into pixel values. The raw data consists
+// of byte pairs, most significant byte first; rawBytes must therefore
+// hold 2 * numCols bytes and pixels must have room for numCols
+// values.
+inline void unpackRow(const unsigned char* rawBytes, unsigned int* pixels, const int numCols)
+{
+  for(int col = 0; col < numCols; col++)
+    {
+      pixels[col] = (256 * static_cast<unsigned int>(rawBytes[2 * col])) // Most significant byte.
+	+ static_cast<unsigned int>(rawBytes[(2 * col) + 1]); // Least significant byte.
+    }
+}
+
+// Apply calibration to a row of pixel values, in place. Return true
+// if the calibration function thinks everything is OK and every
+// calibrated value is in range, otherwise return false.
+inline bool calibrateRow(unsigned int* pixels,
+			 const int numCols,
+			 bool (*calibrationFunc)(unsigned int* retVal, unsigned int raw))
+{
+  for(int col = 0; col < numCols; col++)
+    {
+      const bool okSoFar = (*calibrationFunc)(&pixels[col], pixels[col]);
+
+      // Check to make sure the range is OK.
+      if(!checkRange(pixels[col]) || !okSoFar)
+	{
+	  std::cerr << "Error: A pixel value error was detected. Pixel value is: " << pixels[col] << std::endl;
+	  return false;
+	}
+    }
+
+  return true;
+}
+
+// Return a comment string that will be embedded in the PNM file
+// (ImageMagick's convert utility maintains the comment). We pass in a
+// function pointer which lets us work out which digitizer was used
+// and therefore how many bits/pixel the scanner operated at.
+inline std::string getPnmCommentString(bool (*calibrationFunc)(unsigned int* retVal, unsigned int raw))
+{
+  // Define the number of bits per pixel used by the digitizers.
+  unsigned char bitsPerPixel = 12;
+  if(calibrationFunc == dbaCalibration)
+    {
+      // Only the DBA scanner digitized at 16 bits per pixel.
+      bitsPerPixel = 16;
+    }
+
+  std::string retVal = "# Generated by ddsmraw2pnm. Original data was digitized at ";
+  retVal += bitsPerPixel;
+  retVal += " bits/pixel.\n";
+  return retVal;
+}
+
+// Check that a raw file holds exactly numRows x numCols pixels (i.e.
+// that it is 2 * numRows * numCols bytes long). Returns true if it
+// does; the file position is left at the start of the file.
+inline bool checkRawFileSize(FILE* input, const int numRows, const int numCols)
+{
+  const bool ok = (fseek(input, 0, SEEK_END) == 0)
+    && (ftell(input) == 2 * static_cast<long>(numRows) * numCols);
+  return (fseek(input, 0, SEEK_SET) == 0) && ok;
+}
+
+// Read, unpack and calibrate the numSpanCols pixels of a row of a raw
+// file (of an image with numCols columns) that start at column
+// firstCol, seeking straight to them so that nothing else of the file
+// is read or calibrated. rawBytes is scratch space (it is resized as
+// needed) and pixels must have room for numSpanCols values. Returns
+// true on success.
+inline bool readCalibratedRowSpan(FILE* input,
+				  const int numCols,
+				  const int row,
+				  const int firstCol,
+				  const int numSpanCols,
+				  CalibrationFunc calibrationFunc,
+				  std::vector<unsigned char>* rawBytes,
+				  unsigned int* pixels)
+{
+  const size_t numBytes = 2 * static_cast<size_t>(numSpanCols);
+  rawBytes->resize(std::max(rawBytes->size(), numBytes));
+  const long offset = 2 * (static_cast<long>(row) * numCols + firstCol);
+  if(fseek(input, offset, SEEK_SET) != 0 || fread(&(*rawBytes)[0], 1, numBytes, input) != numBytes)
+    {
+      return false;
+    }
+
+  unpackRow(&(*rawBytes)[0], pixels, numSpanCols);
+  return calibrateRow(pixels, numSpanCols, calibrationFunc);
+}
+
+// A rectangle of an image: numRows x numCols pixels whose top-left
+// pixel is at (top, left).
+struct ImageRegion
+{
+  int top;
+  int left;
+  int numRows;
+  int numCols;
+};
+
+// Read the calibrated pixels of several regions of a raw file (of an
+// image with numCols columns) in one pass down the rows they cover.
+// On each row, only the runs of columns that the regions cover are
+// read (see readCalibratedRowSpan()), however the regions overlap.
+// Each row of each region is handed, in order of row, to
+// rowFunc(region, y, pixels), where region indexes regions, y counts
+// from the region's top and pixels holds the region's numCols values.
+// The regions must lie inside the image. Returns true on success; on
+// failure *failedRow (if not NULL) is the row that could not be read
+// or calibrated.
+template <typename RowFunc>
+inline bool readCalibratedRegions(FILE* input,
+				  const int numCols,
+				  CalibrationFunc calibrationFunc,
+				  const std::vector<ImageRegion>& regions,
+				  RowFunc rowFunc,
+				  int* failedRow)
+{
+  // The regions in order of left column, so that each row's runs can
+  // be merged in one pass.
+  std::vector<std::pair<int, size_t> > byLeft;
+  int firstRow = -1;
+  int endRow = -1;
+  for(size_t i = 0; i < regions.size(); i++)
+    {
+      byLeft.push_back(std::make_pair(regions[i].left, i));
+      firstRow = (firstRow < 0) ? regions[i].top : std::min(firstRow, regions[i].top);
+      endRow = std::max(endRow, regions[i].top + regions[i].numRows);
+    }
+  std::sort(byLeft.begin(), byLeft.end());
+
+  std::vector<unsigned char> rawBytes;
+  std::vector<unsigned int> pixels;
+  for(int row = firstRow; row < endRow; row++)
+    {
+      for(size_t i = 0; i < byLeft.size(); )
+	{
+	  // Gather the run of columns covered by this region and any that
+	  // overlap it on this row.
+	  const ImageRegion& first = regions[byLeft[i].second];
+	  if(row < first.top || row >= first.top + first.numRows)
+	    {
+	      i++;
+	      continue;
+	    }
+	  const int runLeft = first.left;
+	  int runEnd = first.left + first.numCols;
+	  size_t j = i + 1;
+	  for(; j < byLeft.size() && byLeft[j].first <= runEnd; j++)
+	    {
+	      const ImageRegion& next = regions[byLeft[j].second];
+	      if(row >= next.top && row < next.top + next.numRows)
+		{
+		  runEnd = std::max(runEnd, next.left + next.numCols);
+		}
+	    }
+
+	  pixels.resize(runEnd - runLeft);
+	  if(!readCalibratedRowSpan(input, numCols, row, runLeft, runEnd - runLeft, calibrationFunc, &rawBytes, &pixels[0]))
+	    {
+	      if(NULL != failedRow)
+		{
+		  *failedRow = row;
+		}
+	      return false;
+	    }
+
+	  // Hand the row to the regions the run covers.
+	  for(size_t k = i; k < j; k++)
+	    {
+	      const ImageRegion& region = regions[byLeft[k].second];
+	      if(row >= region.top && row < region.top + region.numRows)
+		{
+		  rowFunc(byLeft[k].second, row - region.top, &pixels[region.left - runLeft]);
+		}
+	    }
+	  i = j;
+	}
+    }
+
+  return true;
+}
+
+// The histograms of the raw and calibrated pixel values of an image;
+// raw[v] is the number of pixels whose raw value is v, and similarly
+// for calibrated.
+const unsigned int numHistogramBins = maxUnsignedIntWithNumBits + 1;
+struct PixelHistograms
+{
+  std::vector<unsigned int> raw;
+  std::vector<unsigned int> calibrated;
+};
+
+// Make both histograms empty (but of the right size).
+inline void clearHistograms(PixelHistograms* histograms)
+{
+  histograms->raw.assign(numHistogramBins, 0);
+  histograms->calibrated.assign(numHistogramBins, 0);
+}
+
+// Add the counts in one set of histograms (e.g. those of one thread)
+// to another.
+inline void mergeHistograms(PixelHistograms* into, const PixelHistograms& from)
+{
+  for(unsigned int v = 0; v < numHistogramBins; v++)
+    {
+      into->raw[v] += from.raw[v];
+      into->calibrated[v] += from.calibrated[v];
+    }
+}
+
+// Count the values in a row of pixels (which must all be at most
+// maxUnsignedIntWithNumBits) into a histogram.
+inline void histogramRow(const unsigned int* pixels, const int numCols, std::vector<unsigned int>& histogram)
+{
+  for(int col = 0; col < numCols; col++)
+    {
+      histogram[pixels[col]]++;
+    }
+}
+
+// Write a 32-bit unsigned integer to a file in little-endian byte
+// order (so that the histogram file does not depend on the machine
+// that wrote it). Returns true on success.
+inline bool writeLittleEndian32(FILE* output, const unsigned int value)
+{
+  const unsigned char bytes[4] =
+    {
+      static_cast<unsigned char>(value & 0xff),
+      static_cast<unsigned char>((value >> 8) & 0xff),
+      static_cast<unsigned char>((value >> 16) & 0xff),
+      static_cast<unsigned char>((value >> 24) & 0xff)
+    };
+  return fwrite(bytes, 1, 4, output) == 4;
+}
+
+// Write a 64-bit unsigned integer to a file in little-endian byte
+// order, as two 32-bit halves, the low half first. Returns true on
+// success.
+inline bool writeLittleEndian64(FILE* output, const unsigned long long value)
+{
+  return writeLittleEndian32(output, static_cast<unsigned int>(value & 0xffffffffULL))
+    && writeLittleEndian32(output, static_cast<unsigned int>(value >> 32));
+}
+
+// Write one histogram sparsely: the number of non-empty bins, then a
+// (value, count) pair for each non-empty bin in increasing order of
+// value. Returns true on success.
+inline bool writeSparseHistogram(FILE* output, const std::vector<unsigned int>& histogram)
+{
+  unsigned int numNonEmptyBins = 0;
+  for(unsigned int v = 0; v < histogram.size(); v++)
+    {
+      numNonEmptyBins += (histogram[v] > 0) ? 1 : 0;
+    }
+
+  bool ok = writeLittleEndian32(output, numNonEmptyBins);
+  for(unsigned int v = 0; v < histogram.size() && ok; v++)
+    {
+      if(histogram[v] > 0)
+	{
+	  ok = writeLittleEndian32(output, v) && writeLittleEndian32(output, histogram[v]);
+	}
+    }
+
+  return ok;
+}
+
+// Write the histogram (sidecar) file. The format is compact and
+// simple to read from any language; all integers are unsigned, 32
+// bits and little-endian:
+//
+//   "DDSMHIST"            8 bytes of magic.
+//   version               Currently 1.
+//   num-rows, num-cols    The image dimensions.
+//   digitizer             16 bytes: the digitizer name, padded with NULs.
+//   raw histogram         See writeSparseHistogram().
+//   calibrated histogram  See writeSparseHistogram().
+//
+// Returns true on success.
+inline bool writeHistogramFile(const std::string& histogramFile,
+			const int numRows,
+			const int numCols,
+			const std::string& digitizer,
+			const PixelHistograms& histograms)
+{
+  FILE* output = fopen(histogramFile.c_str(), "wb");
+  if(NULL == output)
+    {
+      return false;
+    }
+
+  char digitizerField[16];
+  memset(digitizerField, 0, sizeof(digitizerField));
+  strncpy(digitizerField, digitizer.c_str(), sizeof(digitizerField) - 1);
+
+  bool ok = (fwrite("DDSMHIST", 1, 8, output) == 8);
+  ok = ok && writeLittleEndian32(output, 1);
+  ok = ok && writeLittleEndian32(output, numRows);
+  ok = ok && writeLittleEndian32(output, numCols);
+  ok = ok && (fwrite(digitizerField, 1, sizeof(digitizerField), output) == sizeof(digitizerField));
+  ok = ok && writeSparseHistogram(output, histograms.raw);
+  ok = ok && writeSparseHistogram(output, histograms.calibrated);
+
+  ok = (fclose(output) == 0) && ok;
+  return ok;
+}
+
+// Count the pixels whose raw values a calibration function clamps,
+// given the histogram of the raw values; *numLow counts those clamped
+// up to the minimum and *numHigh those clamped down to the maximum.
+inline void countClampedPixels(CalibrationFunc calibrationFunc,
+			       const std::vector<unsigned int>& rawHistogram,
+			       unsigned long long* numLow,
+			       unsigned long long* numHigh)
+{
+  unsigned int minRaw = 0;
+  unsigned int maxRaw = 0;
+  getCalibrationRange(calibrationFunc, &minRaw, &maxRaw);
+
+  *numLow = 0;
+  *numHigh = 0;
+  for(unsigned int v = 0; v < rawHistogram.size(); v++)
+    {
+      if(v < minRaw && !(v == 0 && calibrationFunc == dbaCalibration))
+	{
+	  *numLow += rawHistogram[v];
+	}
+      else if(v > maxRaw)
+	{
+	  *numHigh += rawHistogram[v];
+	}
+    }
+}
+
+// Read a 32-bit little-endian unsigned integer (as written by
+// writeLittleEndian32()) from a file. Returns true on success.
+inline bool readLittleEndian32(FILE* input, unsigned int* value)
+{
+  unsigned char bytes[4];
+  if(fread(bytes, 1, 4, input) != 4)
+    {
+      return false;
+    }
+
+  *value = static_cast<unsigned int>(bytes[0])
+    | (static_cast<unsigned int>(bytes[1]) << 8)
+    | (static_cast<unsigned int>(bytes[2]) << 16)
+    | (static_cast<unsigned int>(bytes[3]) << 24);
+  return true;
+}
+
+// Read one histogram written by writeSparseHistogram(). The histogram
+// must already be the right size. Returns true on success.
+inline bool readSparseHistogram(FILE* input, std::vector<unsigned int>& histogram)
+{
+  unsigned int numNonEmptyBins = 0;
+  bool ok = readLittleEndian32(input, &numNonEmptyBins) && numNonEmptyBins <= histogram.size();
+  for(unsigned int i = 0; i < numNonEmptyBins && ok; i++)
+    {
+      unsigned int v = 0;
+      unsigned int count = 0;
+      ok = readLittleEndian32(input, &v) && readLittleEndian32(input, &count) && v < histogram.size();
+      if(ok)
+	{
+	  histogram[v] = count;
+	}
+    }
+
+  return ok;
+}
+
+// Read a histogram (sidecar) file written by writeHistogramFile().
+// Returns true on success.
+inline bool readHistogramFile(const std::string& histogramFile,
+			      int* numRows,
+			      int* numCols,
+			      std::string* digitizer,
+			      PixelHistograms* histograms)
+{
+  FILE* input = fopen(histogramFile.c_str(), "rb");
+  if(NULL == input)
+    {
+      return false;
+    }
+
+  char magic[8];
+  char digitizerField[17];
+  memset(digitizerField, 0, sizeof(digitizerField));
+  unsigned int version = 0;
+  unsigned int rows = 0;
+  unsigned int cols = 0;
+  clearHistograms(histograms);
+
+  bool ok = (fread(magic, 1, 8, input) == 8) && (memcmp(magic, "DDSMHIST", 8) == 0);
+  ok = ok && readLittleEndian32(input, &version) && version == 1;
+  ok = ok && readLittleEndian32(input, &rows) && readLittleEndian32(input, &cols);
+  ok = ok && (fread(digitizerField, 1, 16, input) == 16);
+  ok = ok && readSparseHistogram(input, histograms->raw);
+  ok = ok && readSparseHistogram(input, histograms->calibrated);
+  fclose(input);
+
+  *numRows = static_cast<int>(rows);
+  *numCols = static_cast<int>(cols);
+  *digitizer = digitizerField;
+  return ok;
+}
+
+// Build the calibration look-up table for a digitizer: entry v is the
+// calibrated value of the raw value v, so that a pixel can be
+// calibrated by a look-up rather than a call to the calibration
+// function. Returns false if the calibration function reports a
+// problem.
+inline bool makeCalibrationTable(CalibrationFunc calibrationFunc, std::vector<unsigned int>* table)
+{
+  table->resize(numHistogramBins);
+  for(unsigned int v = 0; v < numHistogramBins; v++)
+    {
+      (*table)[v] = v;
+    }
+
+  return calibrateRow(&(*table)[0], numHistogramBins, calibrationFunc);
+}
+
+// Finding the breast. Most of a mammogram is air, which calibrates to
+// low grey levels; the breast is brighter. We find the breast's
+// bounding box by thresholding the calibrated grey levels and
+// projecting the thresholded image onto the rows and columns: the box
+// spans the rows (and columns) with enough pixels above the threshold.
+// As the threshold isn't known until every pixel has been seen, the
+// projections are kept for a range of thresholds at once: each row and
+// column keeps a coarse histogram of its grey levels, in bins of
+// breastBinWidth grey levels.
+const unsigned int breastBinWidth = 1024;
+const unsigned int numBreastBins = numHistogramBins / breastBinWidth;
+
+// A row (or column) is part of the breast if at least this fraction
+// of its pixels are above the threshold.
+const double breastProjectionFraction = 0.01;
+
+// The histogram of an image's calibrated grey levels, and the coarse
+// histograms of each of its rows and columns.
+struct BreastProjections
+{
+  int numRows;
+  int numCols;
+  std::vector<unsigned long long> histogram;
+  std::vector<unsigned int> rowBins; // numBreastBins per row.
+  std::vector<unsigned int> colBins; // numBreastBins per column.
+};
+
+inline void initBreastProjections(BreastProjections* projections, const int numRows, const int numCols)
+{
+  projections->numRows = numRows;
+  projections->numCols = numCols;
+  projections->histogram.assign(numHistogramBins, 0);
+  projections->rowBins.assign(static_cast<size_t>(numRows) * numBreastBins, 0);
+  projections->colBins.assign(static_cast<size_t>(numCols) * numBreastBins, 0);
+}
+
+// Add a row of calibrated pixel values to the projections.
+inline void addRowToBreastProjections(BreastProjections* projections, const int row, const unsigned int* pixels)
+{
+  unsigned int* rowBins = &projections->rowBins[static_cast<size_t>(row) * numBreastBins];
+  for(int col = 0; col < projections->numCols; col++)
+    {
+      const unsigned int bin = pixels[col] / breastBinWidth;
+      projections->histogram[pixels[col]]++;
+      rowBins[bin]++;
+      projections->colBins[static_cast<size_t>(col) * numBreastBins + bin]++;
+    }
+}
+
+// Choose the grey level that best separates a histogram into two
+// classes (Otsu's method: the threshold that maximises the variance
+// between the classes). Pixels at or above the threshold are in the
+// upper class. When the classes are well separated every threshold in
+// the gap between them is equally good, so we take the middle of the
+// gap rather than its lower edge.
+inline unsigned int getOtsuThreshold(const std::vector<unsigned long long>& histogram)
+{
+  double total = 0.0;
+  double sum = 0.0;
+  for(unsigned int v = 0; v < histogram.size(); v++)
+    {
+      total += static_cast<double>(histogram[v]);
+      sum += static_cast<double>(v) * static_cast<double>(histogram[v]);
+    }
+
+  double lowerCount = 0.0;
+  double lowerSum = 0.0;
+  double bestVariance = -1.0;
+  unsigned int bestThreshold = 0;
+  unsigned int lastBestThreshold = 0;
+  for(unsigned int v = 0; v + 1 < histogram.size(); v++)
+    {
+      lowerCount += static_cast<double>(histogram[v]);
+      lowerSum += static_cast<double>(v) * static_cast<double>(histogram[v]);
+      const double upperCount = total - lowerCount;
+      if(lowerCount == 0.0 || upperCount == 0.0)
+	{
+	  continue;
+	}
+
+      const double difference = lowerSum / lowerCount - (sum - lowerSum) / upperCount;
+      const double variance = lowerCount * upperCount * difference * difference;
+      if(variance > bestVariance)
+	{
+	  bestVariance = variance;
+	  bestThreshold = v + 1;
+	  lastBestThreshold = v + 1;
+	}
+      else if(variance == bestVariance && histogram[v] == 0)
+	{
+	  lastBestThreshold = v + 1;
+	}
+    }
+
+  return bestThreshold + (lastBestThreshold - bestThreshold) / 2;
+}
+
+// The first and last (inclusive) of count lines (rows or columns)
+// that have at least minPixels pixels in or above bin firstBin, or
+// false if there are none.
+inline bool findBreastExtent(const std::vector<unsigned int>& bins,
+			     const int count,
+			     const unsigned int firstBin,
+			     const double minPixels,
+			     int* first,
+			     int* last)
+{
+  *first = -1;
+  *last = -1;
+  for(int i = 0; i < count; i++)
+    {
+      unsigned int numAbove = 0;
+      for(unsigned int b = firstBin; b < numBreastBins; b++)
+	{
+	  numAbove += bins[static_cast<size_t>(i) * numBreastBins + b];
+	}
+      if(numAbove > 0 && numAbove >= minPixels)
+	{
+	  *first = (*first < 0) ? i : *first;
+	  *last = i;
+	}
+    }
+
+  return *first >= 0;
+}
+
+// Find the bounding box of the breast, widened by margin pixels on
+// each side (but kept inside the image). threshold is rounded down to
+// a multiple of breastBinWidth. If no row or column has enough pixels
+// above the threshold the box is the whole image. Returns whether the
+// breast was found.
+inline bool findBreastRegion(const BreastProjections& projections,
+			     const unsigned int threshold,
+			     const int margin,
+			     ImageRegion* region)
+{
+  const unsigned int firstBin = std::min(threshold / breastBinWidth, numBreastBins - 1);
+  int top = 0;
+  int bottom = 0;
+  int left = 0;
+  int right = 0;
+  const bool found = findBreastExtent(projections.rowBins, projections.numRows, firstBin,
+				      breastProjectionFraction * projections.numCols, &top, &bottom)
+    && findBreastExtent(projections.colBins, projections.numCols, firstBin,
+			breastProjectionFraction * projections.numRows, &left, &right);
+  if(!found)
+    {
+      top = 0;
+      left = 0;
+      bottom = projections.numRows - 1;
+      right = projections.numCols - 1;
+    }
+
+  region->top = std::max(top - margin, 0);
+  region->left = std::max(left - margin, 0);
+  region->numRows = std::min(bottom + margin, projections.numRows - 1) - region->top + 1;
+  region->numCols = std::min(right + margin, projections.numCols - 1) - region->left + 1;
+  return found;
+}
+
+// Escape a string for use in JSON (in the reports and dumps that
+// the programs write).
+inline std::string jsonString(const std::string& s)
+{
+  std::string escaped = "\"";
+  for(unsigned int i = 0; i < s.size(); i++)
+    {
+      const unsigned char c = static_cast<unsigned char>(s[i]);
+      if(c == '"' || c == '\\')
+	{
+	  escaped += '\\';
+	  escaped += s[i];
+	}
+      else if(c < 0x20)
+	{
+	  char code[8];
+	  snprintf(code, sizeof(code), "\\u%04x", c);
+	  escaped += code;
+	}
+      else
+	{
+	  escaped += s[i];
+	}
+    }
+
+  return escaped + "\"";
+}
+
+// Multi-resolution pyramids. Level k of a pyramid is the image
+// downsampled by a factor of 2^k in each direction, each pixel being
+// the mean of the (up to) 2^k x 2^k block of full-resolution pixels
+// it covers; blocks at the right and bottom edges of an image whose
+// dimensions aren't multiples of 2^k are simply smaller. We build all
+// levels in a single pass over the full-resolution rows: each level
+// keeps the horizontal sums of the current row (made from the level
+// above's by adding adjacent pairs) and accumulates them down the
+// rows of the current block, so only one row per level is held in
+// memory. The sums fit in 32 bits for up to maxPyramidLevels levels.
+const unsigned int maxPyramidLevels = 8;
+
+// One level of a pyramid that is being built.
+struct PyramidLevel
+{
+  int scale; // The downsampling factor, 2^k.
+  int numRows; // The dimensions of this level.
+  int numCols;
+  std::vector<unsigned int> rowSums; // Sums over each block's columns of the current full-resolution row.
+  std::vector<unsigned int> blockSums; // rowSums accumulated over the rows of the current block.
+  int numRowsSummed; // How many full-resolution rows are in blockSums.
+  std::vector<unsigned int> row; // The most recent downsampled row.
+  bool rowReady; // Whether addRowToPyramid() just finished a row (in row).
+};
+
+// Set up a pyramid with numLevels levels (levels 1 to numLevels) for
+// an image with the given dimensions.
+inline void initPyramid(std::vector<PyramidLevel>* levels, const unsigned int numLevels, const int numRows, const int numCols)
+{
+  levels->resize(numLevels);
+  for(unsigned int k = 0; k < numLevels; k++)
+    {
+      PyramidLevel& level = (*levels)[k];
+      level.scale = 1 << (k + 1);
+      level.numRows = (numRows + level.scale - 1) / level.scale;
+      level.numCols = (numCols + level.scale - 1) / level.scale;
+      level.rowSums.assign(level.numCols, 0);
+      level.blockSums.assign(level.numCols, 0);
+      level.numRowsSummed = 0;
+      level.row.assign(level.numCols, 0);
+      level.rowReady = false;
+    }
+}
+
+// Add adjacent pairs of values: dst[j] = src[2j] + src[2j + 1], for
+// numDst values of dst; if numSrc is odd, the last value of dst is
+// just the last value of src.
+inline void addAdjacentPairs(const unsigned int* src, const int numSrc, unsigned int* dst, const int numDst)
+{
+  int j = 0;
+#ifdef __SSE2__
+  // Four pairs at a time: gather the even and odd values of eight
+  // consecutive source values and add them.
+  for(; 2 * j + 8 <= numSrc; j += 4)
+    {
+      const __m128 a = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * j)));
+      const __m128 b = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * j + 4)));
+      const __m128i evens = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+      const __m128i odds = _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + j), _mm_add_epi32(evens, odds));
+    }
+#endif
+  for(; j < numDst; j++)
+    {
+      dst[j] = (2 * j + 1 < numSrc) ? src[2 * j] + src[2 * j + 1] : src[2 * j];
+    }
+}
+
+// Accumulate one row of values into another: dst[j] += src[j].
+inline void accumulateRow(const unsigned int* src, unsigned int* dst, const int num)
+{
+  int j = 0;
+#ifdef __SSE2__
+  for(; j + 4 <= num; j += 4)
+    {
+      const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + j));
+      const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + j));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + j), _mm_add_epi32(a, b));
+    }
+#endif
+  for(; j < num; j++)
+    {
+      dst[j] += src[j];
+    }
+}
+
+// Add the next full-resolution row (of calibrated pixel values) to
+// the pyramid; lastRow says whether it is the last row of the image.
+// Afterwards, each level whose rowReady flag is set has a new
+// downsampled row in its row member (the rows of a level become ready
+// in order).
+inline void addRowToPyramid(std::vector<PyramidLevel>& levels, const unsigned int* pixels, const int numCols, const bool lastRow)
+{
+  const unsigned int* src = pixels;
+  int numSrc = numCols;
+  for(unsigned int k = 0; k < levels.size(); k++)
+    {
+      PyramidLevel& level = levels[k];
+      addAdjacentPairs(src, numSrc, &level.rowSums[0], level.numCols);
+      accumulateRow(&level.rowSums[0], &level.blockSums[0], level.numCols);
+      level.numRowsSummed++;
+
+      level.rowReady = (level.numRowsSummed == level.scale) || lastRow;
+      if(level.rowReady)
+	{
+	  // Divide each block's sum by its area, rounding to the nearest
+	  // grey level.
+	  for(int j = 0; j < level.numCols; j++)
+	    {
+	      const unsigned int blockCols = static_cast<unsigned int>(std::min(level.scale, numCols - j * level.scale));
+	      const unsigned int area = blockCols * static_cast<unsigned int>(level.numRowsSummed);
+	      level.row[j] = static_cast<unsigned int>((static_cast<unsigned long long>(level.blockSums[j]) + area / 2) / area);
+	      level.blockSums[j] = 0;
+	    }
+	  level.numRowsSummed = 0;
+	}
+
+      // The next level is made from this level's sums.
+      src = &level.rowSums[0];
+      numSrc = level.numCols;
+    }
+}
+
+// Find a file of the corpus, given its path on the FTP server, under
+// root: either at that path (i.e. in a mirror of the server) or
+// directly in root (i.e. as get-ddsm-mammo downloads it). Returns the
+// empty string if it is in neither place.
+inline std::string findCorpusFile(const std::string& root, const std::string& path)
+{
+  const size_t slash = path.rfind('/');
+  const std::string candidates[2] =
+    {
+      root + ((path[0] == '/') ? "" : "/") + path,
+      root + "/" + ((slash == std::string::npos) ? path : path.substr(slash + 1))
+    };
+  for(unsigned int i = 0; i < 2; i++)
+    {
+      FILE* file = fopen(candidates[i].c_str(), "rb");
+      if(NULL != file)
+	{
+	  fclose(file);
+	  return candidates[i];
+	}
+    }
+
+  return "";
+}
+
+#endif // DDSMCORE_H
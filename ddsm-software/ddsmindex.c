@@ -0,0 +1,507 @@
+/*
+  The following is very brief; full program documentation can be found
+  by compiling this program as described and running it without
+  arguments, or by reading the displayProgramHelp() function.
+
+  This program builds an index of the ground truth of the whole DDSM
+  corpus, parsing every OVERLAY file (as listed in info-file.txt)
+  using several threads into a single file (see ddsmindex.h), and
+  queries that index: by image name, and by pathology, lesion type,
+  subtlety and assessment. Queries memory-map the index and so take
+  milliseconds, without reading a single OVERLAY file.
+
+  Compilation: Compile this file using gcc: "g++ -Wall -O2 -pthread ddsmindex.c -o ddsmindex"
+*/
+
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+
+#include "ddsmcore.h"
+#include "ddsmoverlay.h"
+#include "ddsmindex.h"
+
+// These are program error codes and messages.
+const int success = 0; // The code to return on program success.
+const int syntax_error = -1; // Exit code if the user invokes program incorrectly.
+const char* syntax_error_msg = ""; // We'll output a message manually if the program is not called correctly.
+const int file_error = -4;
+const char* file_error_msg = "A file error was detected at runtime.";
+const int info_file_error = -14;
+const char* info_file_error_msg = "Could not read the info file, or it lists no OVERLAY files.";
+const int index_error = -15;
+const char* index_error_msg = "Could not read the index file; was it written by \"ddsmindex build\"?";
+
+// This is the name of the file that lists the files on the DDSM FTP
+// server (as used by get-ddsm-mammo), from which we take the OVERLAY
+// files to index.
+const std::string defaultInfoFile = "info-file.txt";
+
+// The commands.
+const std::string buildCommand = "build";
+const std::string queryCommand = "query";
+
+// These are the optional arguments that may follow the mandatory ones.
+const std::string infoOption = "--info"; // Takes a value.
+const std::string rootOption = "--root"; // Takes a value.
+const std::string threadsOption = "--threads"; // Takes a value.
+const std::string imageOption = "--image"; // Takes a value.
+const std::string pathologyOption = "--pathology"; // Takes a value.
+const std::string lesionOption = "--lesion"; // Takes a value.
+const std::string minSubtletyOption = "--min-subtlety"; // Takes a value.
+const std::string maxSubtletyOption = "--max-subtlety"; // Takes a value.
+const std::string minAssessmentOption = "--min-assessment"; // Takes a value.
+const std::string maxAssessmentOption = "--max-assessment"; // Takes a value.
+const std::string chainsOption = "--chains";
+
+// The options that the user may specify after the mandatory
+// arguments.
+struct ProgramOptions
+{
+  // For building.
+  std::string infoFile; // The info file that lists the OVERLAY files.
+  std::string root; // Where the OVERLAY files are.
+  unsigned int numThreads; // The number of OVERLAY files to parse at once.
+
+  // For querying; -1 (or empty) means "any".
+  std::string image;
+  int pathology; // A Pathology.
+  int lesionKind; // A LesionKind bit.
+  int minSubtlety;
+  int maxSubtlety;
+  int minAssessment;
+  int maxAssessment;
+  bool chains; // Whether to print the chain codes.
+};
+
+
+// Display program help information.
+void displayProgramHelp()
+{
+  // We'll define the help message as an array of strings that we'll
+  // iterate over. The end of the array is marked with a special
+  // string called endString.
+  const std::string endString = "<<<END"; // Marks the end of the message.
+
+  // Here's the message array.
+  std::string
+    helpMessage[] =
+    {
+      "ddsmindex",
+      "=========\n",
+
+      "Build and query an index of the ground truth of the whole DDSM corpus.\n",
+
+      "Usage: ddsmindex build <index-file> [build-options]",
+      "       ddsmindex query <index-file> [query-options]\n",
+
+      "* <index-file> is the name of the index file to build or query.\n",
+
+      "\"build\" parses every OVERLAY file listed in the info file, using several",
+      "threads, and writes what they contain (each abnormality's lesion types,",
+      "assessment, subtlety and pathology, and the chain codes and bounding boxes of",
+      "its outlines) to <index-file>, whose name it then writes to standard output.",
+      "OVERLAY files that are missing or can't be parsed are reported on standard",
+      "error and left out of the index; an image whose OVERLAY file is left out is",
+      "simply not in the index. [build-options] may be any of the following:\n",
+
+      "  --info <info-file>  The file listing the DDSM FTP server's files (the",
+      "                      default is info-file.txt).",
+      "  --root <dir>        Where the OVERLAY files are (the default is the current",
+      "                      directory). Each file is looked for at <dir>/<path>, where",
+      "                      <path> is its path on the FTP server (i.e. in a mirror of",
+      "                      the server), and then at <dir>/<name>, where <name> is its",
+      "                      file name (i.e. as get-ddsm-mammo downloads it).",
+      "  --threads <n>       Parse <n> files at once (the default is the number of",
+      "                      processors).\n",
+
+      "\"query\" writes the abnormalities that match all of the [query-options] to",
+      "standard output, one per line, as tab-separated columns: the image name (e.g.",
+      "A_1509_1.RIGHT_CC), the abnormality number, the pathology, the assessment, the",
+      "subtlety, the boundary's bounding box (top, left, bottom and right rows and",
+      "columns, counting from 0), the boundary's area in pixels, the number of cores and",
+      "the lesion types. The number of matches and how long the query took are written",
+      "to standard error. [query-options] may be any of the following:\n",
+
+      "  --image <name>          Only the abnormalities of the image <name>.",
+      "  --pathology <p>         Only abnormalities whose pathology is <p>: MALIGNANT,",
+      "                          BENIGN, BENIGN_WITHOUT_CALLBACK or UNPROVEN.",
+      "  --lesion <type>         Only abnormalities with a lesion of type <type>: mass",
+      "                          or calcification.",
+      "  --min-subtlety <n>      Only abnormalities whose subtlety is at least <n>.",
+      "  --max-subtlety <n>      Only abnormalities whose subtlety is at most <n>.",
+      "  --min-assessment <n>    Only abnormalities whose assessment is at least <n>.",
+      "  --max-assessment <n>    Only abnormalities whose assessment is at most <n>.",
+      "  --chains                Follow each abnormality with its outlines, one per line:",
+      "                          \"boundary\" or \"core<m>\", then the start column and row",
+      "                          and the chain code, as in the OVERLAY file.",
+
+      endString
+    };
+
+  // Now print the message line by line.
+  unsigned int i = 0; // An iterator.
+  std::string thisLine = ""; // We'll change this.
+  while((thisLine = helpMessage[i]) != endString)
+    {
+      std::cout << thisLine << std::endl; // Print the line.
+      i++; // Increment iterator.
+    }
+}
+
+
+// Function that exits with an error code and a particular error
+// message.
+void exitWith(const int errorCode, const char* errorMsg)
+{
+  std::cerr << errorMsg << std::endl;
+  exit(errorCode);
+}
+
+
+// Read the info file and return a map from each image name (e.g.
+// "A_1509_1.RIGHT_CC") to the path of its OVERLAY file on the FTP
+// server (e.g.
+// "/pub/DDSM/cases/cancers/cancer_08/case1509/A_1509_1.RIGHT_CC.OVERLAY").
+// A few images are listed in two volumes; they map to the last of
+// their paths. The map is empty if the file can't be read.
+std::map<std::string, std::string> readOverlayPaths(const std::string& infoFile)
+{
+  const std::string suffix = ".OVERLAY";
+  std::map<std::string, std::string> paths;
+  std::ifstream info(infoFile.c_str());
+  std::string line;
+  while(std::getline(info, line))
+    {
+      // Strip any trailing whitespace (e.g. a carriage return).
+      line = line.substr(0, line.find_last_not_of(" \t\r\n") + 1);
+      if(line.size() <= suffix.size() || line.compare(line.size() - suffix.size(), suffix.size(), suffix) != 0)
+	{
+	  continue; // Not an OVERLAY file.
+	}
+
+      const size_t slash = line.rfind('/');
+      const std::string name = (slash == std::string::npos) ? line : line.substr(slash + 1);
+      paths[name.substr(0, name.size() - suffix.size())] = line;
+    }
+
+  return paths;
+}
+
+// Find and parse an OVERLAY file, given its path on the FTP server.
+// Returns an empty string on success, or otherwise a description of
+// the problem.
+std::string parseOverlayPath(const std::string& root, const std::string& path, Overlay* overlay)
+{
+  const std::string file = findCorpusFile(root, path);
+  std::ifstream input(file.c_str());
+  if(file.empty() || !input)
+    {
+      const size_t slash = path.rfind('/');
+      return root + "/" + ((slash == std::string::npos) ? path : path.substr(slash + 1)) + ": not found";
+    }
+
+  int errorLine = 0;
+  if(!parseOverlay(input, overlay, &errorLine))
+    {
+      return (errorLine > 0)
+	? file + " line " + std::to_string(errorLine) + ": could not be parsed"
+	: file + ": its abnormalities and outlines are inconsistent";
+    }
+
+  return "";
+}
+
+
+// Everything the worker threads share. Each thread claims the next
+// OVERLAY file using the atomic counter and parses it into its own
+// slot; the failures are protected by the mutex.
+struct BuildState
+{
+  std::string root;
+  std::vector<std::string> paths; // The OVERLAY files, in order of image name.
+  std::vector<Overlay> overlays; // One per path.
+  std::vector<unsigned char> parsed; // Whether each overlay was parsed (not vector<bool>, whose elements share words).
+  std::atomic<size_t> nextJob;
+
+  std::mutex mutex;
+  unsigned int numFailures;
+};
+
+// The body of each worker thread: claim OVERLAY files until there are
+// none left.
+void parseOverlays(BuildState* state)
+{
+  size_t job = 0;
+  while((job = state->nextJob++) < state->paths.size())
+    {
+      const std::string problem = parseOverlayPath(state->root, state->paths[job], &state->overlays[job]);
+      if(!problem.empty())
+	{
+	  std::lock_guard<std::mutex> lock(state->mutex);
+	  std::cerr << "Skipping " << problem << "." << std::endl;
+	  state->numFailures++;
+	  continue;
+	}
+
+      state->parsed[job] = true;
+    }
+}
+
+// Build an index file.
+void buildIndex(const std::string& indexFile, const ProgramOptions& options)
+{
+  const std::map<std::string, std::string> paths = readOverlayPaths(options.infoFile);
+  if(paths.empty())
+    {
+      exitWith(info_file_error, info_file_error_msg);
+    }
+
+  // Parse the OVERLAY files.
+  BuildState state;
+  state.root = options.root;
+  std::vector<std::string> names;
+  for(std::map<std::string, std::string>::const_iterator i = paths.begin(); i != paths.end(); ++i)
+    {
+      names.push_back(i->first);
+      state.paths.push_back(i->second);
+    }
+  state.overlays.resize(state.paths.size());
+  state.parsed.assign(state.paths.size(), false);
+  state.nextJob = 0;
+  state.numFailures = 0;
+  std::vector<std::thread> threads;
+  for(unsigned int t = 0; t < options.numThreads; t++)
+    {
+      threads.push_back(std::thread(parseOverlays, &state));
+    }
+  for(unsigned int t = 0; t < threads.size(); t++)
+    {
+      threads[t].join();
+    }
+
+  // Assemble the index, in order of image name (which the map has
+  // already sorted them into).
+  IndexBuilder builder;
+  initIndexBuilder(&builder);
+  for(size_t i = 0; i < names.size(); i++)
+    {
+      if(state.parsed[i])
+	{
+	  addImageToIndex(&builder, names[i], state.overlays[i]);
+	  state.overlays[i] = Overlay();
+	}
+    }
+  if(!writeIndexFile(indexFile, builder))
+    {
+      exitWith(file_error, file_error_msg);
+    }
+
+  std::cerr << "Indexed " << builder.numImages << " images (" << builder.numAbnormalities << " abnormalities, "
+	    << builder.numOutlines << " outlines); skipped " << state.numFailures << "." << std::endl;
+}
+
+
+// Write an abnormality, and (if asked to) its outlines, as described
+// in displayProgramHelp().
+void writeQueryResult(const AnnotationIndex& index, const unsigned int abnormality, const bool chains)
+{
+  const unsigned int image = getIndexColumn<unsigned int>(index, abnormalityImageColumn)[abnormality];
+  const unsigned int outline = getIndexColumn<unsigned int>(index, abnormalityFirstOutlineColumn)[abnormality];
+  const unsigned int numOutlines = getIndexColumn<unsigned int>(index, abnormalityNumOutlinesColumn)[abnormality];
+  printf("%s\t%u\t%s\t%d\t%d\t%d\t%d\t%d\t%d\t%.1f\t%u\t%s\n",
+	 getIndexString(index, getIndexColumn<unsigned int>(index, imageNameColumn)[image]),
+	 getIndexColumn<unsigned int>(index, abnormalityNumberColumn)[abnormality],
+	 getIndexString(index, getIndexColumn<unsigned int>(index, abnormalityPathologyTextColumn)[abnormality]),
+	 getIndexColumn<signed char>(index, abnormalityAssessmentColumn)[abnormality],
+	 getIndexColumn<signed char>(index, abnormalitySubtletyColumn)[abnormality],
+	 getIndexColumn<int>(index, outlineTopColumn)[outline],
+	 getIndexColumn<int>(index, outlineLeftColumn)[outline],
+	 getIndexColumn<int>(index, outlineBottomColumn)[outline],
+	 getIndexColumn<int>(index, outlineRightColumn)[outline],
+	 getIndexColumn<float>(index, abnormalityAreaColumn)[abnormality],
+	 numOutlines - 1,
+	 getIndexString(index, getIndexColumn<unsigned int>(index, abnormalityLesionTypesColumn)[abnormality]));
+
+  if(!chains)
+    {
+      return;
+    }
+
+  ChainCode chainCode;
+  for(unsigned int i = outline; i < outline + numOutlines; i++)
+    {
+      getIndexChainCode(index, i, &chainCode);
+      const unsigned int core = getIndexColumn<unsigned int>(index, outlineCoreColumn)[i];
+      std::string line = (core == 0) ? "boundary" : "core" + std::to_string(core);
+      line += "\t" + std::to_string(chainCode.startCol) + "\t" + std::to_string(chainCode.startRow) + "\t";
+      for(size_t j = 0; j < chainCode.directions.size(); j++)
+	{
+	  line += static_cast<char>('0' + chainCode.directions[j]);
+	  line += ' ';
+	}
+      printf("%s#\n", line.c_str());
+    }
+}
+
+// Query an index file, writing the matching abnormalities to stdout.
+void queryIndex(const std::string& indexFile, const ProgramOptions& options)
+{
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  AnnotationIndex index;
+  if(!openAnnotationIndex(indexFile, &index))
+    {
+      exitWith(index_error, index_error_msg);
+    }
+
+  // Work out which abnormalities to look at: those of one image, or
+  // all of them.
+  unsigned int first = 0;
+  unsigned int last = index.numAbnormalities;
+  if(!options.image.empty())
+    {
+      const int image = findIndexImage(index, options.image);
+      first = (image < 0) ? 0 : getIndexColumn<unsigned int>(index, imageFirstAbnormalityColumn)[image];
+      last = (image < 0) ? 0 : first + getIndexColumn<unsigned int>(index, imageNumAbnormalitiesColumn)[image];
+    }
+
+  // Filter them, looking only at the columns we filter on.
+  const signed char* assessments = getIndexColumn<signed char>(index, abnormalityAssessmentColumn);
+  const signed char* subtleties = getIndexColumn<signed char>(index, abnormalitySubtletyColumn);
+  const unsigned char* pathologies = getIndexColumn<unsigned char>(index, abnormalityPathologyColumn);
+  const unsigned char* lesionKinds = getIndexColumn<unsigned char>(index, abnormalityLesionKindsColumn);
+  unsigned int numMatches = 0;
+  for(unsigned int i = first; i < last; i++)
+    {
+      if((options.pathology >= 0 && pathologies[i] != options.pathology)
+	 || (options.lesionKind >= 0 && (lesionKinds[i] & options.lesionKind) == 0)
+	 || (options.minSubtlety >= 0 && subtleties[i] < options.minSubtlety)
+	 || (options.maxSubtlety >= 0 && (subtleties[i] < 0 || subtleties[i] > options.maxSubtlety))
+	 || (options.minAssessment >= 0 && assessments[i] < options.minAssessment)
+	 || (options.maxAssessment >= 0 && (assessments[i] < 0 || assessments[i] > options.maxAssessment)))
+	{
+	  continue;
+	}
+
+      writeQueryResult(index, i, options.chains);
+      numMatches++;
+    }
+  closeAnnotationIndex(&index);
+
+  fflush(stdout);
+  const double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  std::cerr << numMatches << " matched in " << milliseconds << " ms." << std::endl;
+}
+
+
+// Entry point.
+int main(int argc, char* argv[])
+{
+  // Do some error checking to make sure that the user invoked us
+  // properly.
+  if(argc < 3 || (argv[1] != buildCommand && argv[1] != queryCommand))
+    {
+      // Output some help info and then exit.
+      displayProgramHelp();
+      exitWith(syntax_error, syntax_error_msg);
+    }
+
+  const std::string command = argv[1];
+  const std::string indexFile = argv[2];
+
+  // Read any options that follow the mandatory arguments; each
+  // command only accepts its own.
+  ProgramOptions options;
+  options.infoFile = defaultInfoFile;
+  options.root = ".";
+  options.numThreads = std::thread::hardware_concurrency();
+  options.numThreads = (options.numThreads > 0) ? options.numThreads : 1;
+  options.pathology = -1;
+  options.lesionKind = -1;
+  options.minSubtlety = -1;
+  options.maxSubtlety = -1;
+  options.minAssessment = -1;
+  options.maxAssessment = -1;
+  options.chains = false;
+  const bool building = (command == buildCommand);
+  for(int i = 3; i < argc; i++)
+    {
+      const std::string option = argv[i];
+      const bool hasValue = (i + 1 < argc);
+      const std::string value = hasValue ? argv[i + 1] : "";
+      if(building && option.compare(infoOption) == 0 && hasValue)
+	{
+	  options.infoFile = argv[++i];
+	}
+      else if(building && option.compare(rootOption) == 0 && hasValue)
+	{
+	  options.root = argv[++i];
+	}
+      else if(building && option.compare(threadsOption) == 0 && hasValue && atoi(argv[i + 1]) > 0)
+	{
+	  options.numThreads = static_cast<unsigned int>(atoi(argv[++i]));
+	}
+      else if(!building && option.compare(imageOption) == 0 && hasValue)
+	{
+	  options.image = argv[++i];
+	}
+      else if(!building && option.compare(pathologyOption) == 0 && hasValue && getPathology(value) != otherPathology)
+	{
+	  options.pathology = getPathology(argv[++i]);
+	}
+      else if(!building && option.compare(lesionOption) == 0 && (value == "mass" || value == "calcification"))
+	{
+	  options.lesionKind = (value == "mass") ? massLesion : calcificationLesion;
+	  i++;
+	}
+      else if(!building && option.compare(minSubtletyOption) == 0 && hasValue && atoi(argv[i + 1]) >= 0)
+	{
+	  options.minSubtlety = atoi(argv[++i]);
+	}
+      else if(!building && option.compare(maxSubtletyOption) == 0 && hasValue && atoi(argv[i + 1]) >= 0)
+	{
+	  options.maxSubtlety = atoi(argv[++i]);
+	}
+      else if(!building && option.compare(minAssessmentOption) == 0 && hasValue && atoi(argv[i + 1]) >= 0)
+	{
+	  options.minAssessment = atoi(argv[++i]);
+	}
+      else if(!building && option.compare(maxAssessmentOption) == 0 && hasValue && atoi(argv[i + 1]) >= 0)
+	{
+	  options.maxAssessment = atoi(argv[++i]);
+	}
+      else if(!building && option.compare(chainsOption) == 0)
+	{
+	  options.chains = true;
+	}
+      else
+	{
+	  // Unknown option, so output some help info and then exit.
+	  displayProgramHelp();
+	  exitWith(syntax_error, syntax_error_msg);
+	}
+    }
+
+  if(building)
+    {
+      buildIndex(indexFile, options);
+
+      // Everything's OK, so send the name of the index file to stdout.
+      std::cout << indexFile << std::endl;
+    }
+  else
+    {
+      queryIndex(indexFile, options);
+    }
+
+  exit(success);
+}
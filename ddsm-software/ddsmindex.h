@@ -0,0 +1,507 @@
+/*
+  The DDSM annotation index: the ground truth of every OVERLAY file in
+  the corpus in one file, laid out so that it can be memory-mapped and
+  searched in place. Index files are written by "ddsmindex build" and
+  searched by "ddsmindex query", using the functions below.
+
+  The file holds a header, a table of where each column starts, and
+  then the columns themselves. Each column is an array with one value
+  per image, per abnormality or per outline (boundary or core), so
+  that filtering (e.g. on pathology and subtlety) scans only the
+  arrays it needs. Images are sorted by name, so that an image can be
+  found by binary search; each image's abnormalities, and each
+  abnormality's outlines, are consecutive. Strings (image names,
+  lesion types and pathologies) are NUL-terminated and kept in a
+  string pool, and the chain codes in a chain pool with one direction
+  per byte; the columns hold offsets into the pools.
+
+  All values are little-endian; since the index is used in place, it
+  can only be read on little-endian machines (which the header's byte
+  order mark lets us check). Every column starts on an 8-byte
+  boundary.
+
+    "DDSMINDX"          8 bytes of magic.
+    version             32-bit; currently 1.
+    byte-order-mark     32-bit; 0x01020304.
+    num-images          32-bit.
+    num-abnormalities   32-bit.
+    num-outlines        32-bit.
+    num-columns         32-bit; numIndexColumns.
+    column-offsets      64-bit; for each column, where it starts.
+    column-sizes        64-bit; for each column, its size in bytes.
+*/
+
+#ifndef DDSMINDEX_H
+#define DDSMINDEX_H
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ddsmcore.h"
+#include "ddsmoverlay.h"
+
+// The columns of an index file, in the order they are stored.
+enum IndexColumn
+  {
+    imageNameColumn, // uint32: offset of the image name in the string pool.
+    imageFirstAbnormalityColumn, // uint32.
+    imageNumAbnormalitiesColumn, // uint32.
+
+    abnormalityImageColumn, // uint32: the image the abnormality belongs to.
+    abnormalityNumberColumn, // uint32: as given in the OVERLAY file.
+    abnormalityAssessmentColumn, // int8: -1 if not recorded.
+    abnormalitySubtletyColumn, // int8: -1 if not recorded.
+    abnormalityPathologyColumn, // uint8: a Pathology.
+    abnormalityLesionKindsColumn, // uint8: LesionKind bits.
+    abnormalityPathologyTextColumn, // uint32: offset in the string pool.
+    abnormalityLesionTypesColumn, // uint32: offset in the string pool; the lesion types, separated by "; ".
+    abnormalityFirstOutlineColumn, // uint32: the boundary; the cores follow it.
+    abnormalityNumOutlinesColumn, // uint32.
+    abnormalityAreaColumn, // float: the area of the boundary, in pixels (see OutlineFeatures).
+
+    outlineAbnormalityColumn, // uint32.
+    outlineCoreColumn, // uint32: 0 for the boundary, m for the m-th core.
+    outlineStartRowColumn, // int32.
+    outlineStartColColumn, // int32.
+    outlineChainOffsetColumn, // uint64: offset of the directions in the chain pool.
+    outlineChainLengthColumn, // uint32.
+    outlineTopColumn, // int32: the bounding box (inclusive).
+    outlineLeftColumn, // int32.
+    outlineBottomColumn, // int32.
+    outlineRightColumn, // int32.
+
+    stringPoolColumn,
+    chainPoolColumn,
+
+    numIndexColumns
+  };
+
+// The pathologies that DDSM uses, so that they can be filtered on
+// cheaply.
+enum Pathology
+  {
+    otherPathology,
+    malignantPathology,
+    benignPathology,
+    benignWithoutCallbackPathology,
+    unprovenPathology
+  };
+
+// The kinds of lesion an abnormality has, as bits: the first word of
+// each of its lesion types.
+const unsigned char massLesion = 1;
+const unsigned char calcificationLesion = 2;
+const unsigned char otherLesion = 4;
+
+// The size of the fixed part of the header, before the column offsets.
+const size_t indexHeaderSize = 32;
+
+// Classify a PATHOLOGY.
+inline Pathology getPathology(const std::string& pathology)
+{
+  if(pathology == "MALIGNANT")
+    {
+      return malignantPathology;
+    }
+  else if(pathology == "BENIGN")
+    {
+      return benignPathology;
+    }
+  else if(pathology == "BENIGN_WITHOUT_CALLBACK")
+    {
+      return benignWithoutCallbackPathology;
+    }
+  else if(pathology == "UNPROVEN")
+    {
+      return unprovenPathology;
+    }
+
+  return otherPathology;
+}
+
+// Classify the LESION_TYPEs of an abnormality.
+inline unsigned char getLesionKinds(const std::vector<std::string>& lesionTypes)
+{
+  unsigned char kinds = 0;
+  for(size_t i = 0; i < lesionTypes.size(); i++)
+    {
+      const std::string kind = lesionTypes[i].substr(0, lesionTypes[i].find(' '));
+      kinds |= (kind == "MASS") ? massLesion : ((kind == "CALCIFICATION") ? calcificationLesion : otherLesion);
+    }
+
+  return kinds;
+}
+
+// The columns of an index that is being built, before they are
+// written.
+struct IndexBuilder
+{
+  std::vector<std::vector<unsigned char> > columns;
+  unsigned int numImages;
+  unsigned int numAbnormalities;
+  unsigned int numOutlines;
+};
+
+inline void initIndexBuilder(IndexBuilder* builder)
+{
+  builder->columns.assign(numIndexColumns, std::vector<unsigned char>());
+  builder->numImages = 0;
+  builder->numAbnormalities = 0;
+  builder->numOutlines = 0;
+}
+
+// Append a value to a column (in the machine's byte order, which is
+// checked to be little-endian when the index is written).
+template <typename T>
+inline void appendToColumn(IndexBuilder* builder, const IndexColumn column, const T value)
+{
+  std::vector<unsigned char>& bytes = builder->columns[column];
+  const size_t size = bytes.size();
+  bytes.resize(size + sizeof(T));
+  memcpy(&bytes[size], &value, sizeof(T));
+}
+
+// Append a string to the string pool, returning its offset.
+inline unsigned int appendString(IndexBuilder* builder, const std::string& s)
+{
+  std::vector<unsigned char>& pool = builder->columns[stringPoolColumn];
+  const unsigned int offset = static_cast<unsigned int>(pool.size());
+  pool.insert(pool.end(), s.begin(), s.end());
+  pool.push_back(0);
+  return offset;
+}
+
+// Add an image and its abnormalities to an index. Images must be
+// added in order of name.
+inline void addImageToIndex(IndexBuilder* builder, const std::string& imageName, const Overlay& overlay)
+{
+  appendToColumn<unsigned int>(builder, imageNameColumn, appendString(builder, imageName));
+  appendToColumn<unsigned int>(builder, imageFirstAbnormalityColumn, builder->numAbnormalities);
+  appendToColumn<unsigned int>(builder, imageNumAbnormalitiesColumn, static_cast<unsigned int>(overlay.abnormalities.size()));
+
+  for(size_t i = 0; i < overlay.abnormalities.size(); i++)
+    {
+      const Abnormality& abnormality = overlay.abnormalities[i];
+      std::string lesionTypes;
+      for(size_t j = 0; j < abnormality.lesionTypes.size(); j++)
+	{
+	  lesionTypes += ((j > 0) ? "; " : "") + abnormality.lesionTypes[j];
+	}
+      OutlineFeatures boundary;
+      computeOutlineFeatures(abnormality.boundary, &boundary);
+
+      appendToColumn<unsigned int>(builder, abnormalityImageColumn, builder->numImages);
+      appendToColumn<unsigned int>(builder, abnormalityNumberColumn, static_cast<unsigned int>(abnormality.number));
+      appendToColumn<signed char>(builder, abnormalityAssessmentColumn, static_cast<signed char>(std::min(abnormality.assessment, 127)));
+      appendToColumn<signed char>(builder, abnormalitySubtletyColumn, static_cast<signed char>(std::min(abnormality.subtlety, 127)));
+      appendToColumn<unsigned char>(builder, abnormalityPathologyColumn, static_cast<unsigned char>(getPathology(abnormality.pathology)));
+      appendToColumn<unsigned char>(builder, abnormalityLesionKindsColumn, getLesionKinds(abnormality.lesionTypes));
+      appendToColumn<unsigned int>(builder, abnormalityPathologyTextColumn, appendString(builder, abnormality.pathology));
+      appendToColumn<unsigned int>(builder, abnormalityLesionTypesColumn, appendString(builder, lesionTypes));
+      appendToColumn<unsigned int>(builder, abnormalityFirstOutlineColumn, builder->numOutlines);
+      appendToColumn<unsigned int>(builder, abnormalityNumOutlinesColumn, static_cast<unsigned int>(abnormality.cores.size() + 1));
+      appendToColumn<float>(builder, abnormalityAreaColumn, static_cast<float>(boundary.numPixels));
+
+      for(size_t j = 0; j <= abnormality.cores.size(); j++)
+	{
+	  const ChainCode& chainCode = (j == 0) ? abnormality.boundary : abnormality.cores[j - 1];
+	  OutlineFeatures features;
+	  computeOutlineFeatures(chainCode, &features);
+	  std::vector<unsigned char>& chainPool = builder->columns[chainPoolColumn];
+
+	  appendToColumn<unsigned int>(builder, outlineAbnormalityColumn, builder->numAbnormalities);
+	  appendToColumn<unsigned int>(builder, outlineCoreColumn, static_cast<unsigned int>(j));
+	  appendToColumn<int>(builder, outlineStartRowColumn, chainCode.startRow);
+	  appendToColumn<int>(builder, outlineStartColColumn, chainCode.startCol);
+	  appendToColumn<unsigned long long>(builder, outlineChainOffsetColumn, chainPool.size());
+	  appendToColumn<unsigned int>(builder, outlineChainLengthColumn, static_cast<unsigned int>(chainCode.directions.size()));
+	  appendToColumn<int>(builder, outlineTopColumn, features.top);
+	  appendToColumn<int>(builder, outlineLeftColumn, features.left);
+	  appendToColumn<int>(builder, outlineBottomColumn, features.bottom);
+	  appendToColumn<int>(builder, outlineRightColumn, features.right);
+	  chainPool.insert(chainPool.end(), chainCode.directions.begin(), chainCode.directions.end());
+	  builder->numOutlines++;
+	}
+      builder->numAbnormalities++;
+    }
+  builder->numImages++;
+}
+
+// Whether this machine is little-endian.
+inline bool isLittleEndian()
+{
+  const unsigned int one = 1;
+  unsigned char firstByte = 0;
+  memcpy(&firstByte, &one, 1);
+  return firstByte == 1;
+}
+
+// Write 64-bit unsigned integers little-endian. Returns true on
+// success.
+inline bool writeIndexOffsets(FILE* output, const std::vector<unsigned long long>& values)
+{
+  bool ok = true;
+  for(size_t i = 0; i < values.size() && ok; i++)
+    {
+      ok = writeLittleEndian64(output, values[i]);
+    }
+
+  return ok;
+}
+
+// Write an index file. Returns true on success.
+inline bool writeIndexFile(const std::string& indexFile, const IndexBuilder& builder)
+{
+  if(!isLittleEndian())
+    {
+      return false;
+    }
+
+  // Work out where each column goes.
+  std::vector<unsigned long long> offsets(numIndexColumns);
+  std::vector<unsigned long long> sizes(numIndexColumns);
+  unsigned long long offset = indexHeaderSize + 16 * numIndexColumns;
+  for(unsigned int c = 0; c < numIndexColumns; c++)
+    {
+      offset = (offset + 7) & ~7ULL;
+      offsets[c] = offset;
+      sizes[c] = builder.columns[c].size();
+      offset += sizes[c];
+    }
+
+  FILE* output = fopen(indexFile.c_str(), "wb");
+  if(NULL == output)
+    {
+      return false;
+    }
+
+  bool ok = (fwrite("DDSMINDX", 1, 8, output) == 8)
+    && writeLittleEndian32(output, 1)
+    && writeLittleEndian32(output, 0x01020304)
+    && writeLittleEndian32(output, builder.numImages)
+    && writeLittleEndian32(output, builder.numAbnormalities)
+    && writeLittleEndian32(output, builder.numOutlines)
+    && writeLittleEndian32(output, numIndexColumns)
+    && writeIndexOffsets(output, offsets)
+    && writeIndexOffsets(output, sizes);
+  const unsigned char padding[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  for(unsigned int c = 0; c < numIndexColumns && ok; c++)
+    {
+      const long position = ftell(output);
+      ok = (position >= 0)
+	&& fwrite(padding, 1, offsets[c] - position, output) == offsets[c] - position
+	&& (sizes[c] == 0 || fwrite(&builder.columns[c][0], 1, sizes[c], output) == sizes[c]);
+    }
+
+  return (fclose(output) == 0) && ok;
+}
+
+
+// An index file mapped into memory.
+struct AnnotationIndex
+{
+  const unsigned char* data;
+  size_t size;
+  unsigned int numImages;
+  unsigned int numAbnormalities;
+  unsigned int numOutlines;
+  const unsigned char* columns[numIndexColumns];
+};
+
+// The values of a column of a mapped index.
+template <typename T>
+inline const T* getIndexColumn(const AnnotationIndex& index, const IndexColumn column)
+{
+  return reinterpret_cast<const T*>(index.columns[column]);
+}
+
+// Read a 32-bit or 64-bit little-endian value from a mapped index.
+inline unsigned long long getIndexHeaderValue(const unsigned char* bytes, const int numBytes)
+{
+  unsigned long long value = 0;
+  for(int i = numBytes - 1; i >= 0; i--)
+    {
+      value = (value << 8) | bytes[i];
+    }
+
+  return value;
+}
+
+// Check that every value of a mapped index that refers to something
+// else refers to something that exists: that each string offset is in
+// the string pool (which ends in a NUL, so every string ends within
+// it), each chain code is in the chain pool, and each range of
+// abnormalities or outlines and each image or abnormality number is
+// within its table. Queries can then follow them without checking.
+inline bool checkIndexReferences(const AnnotationIndex& index, const unsigned long long stringPoolSize, const unsigned long long chainPoolSize)
+{
+  const unsigned char* strings = index.columns[stringPoolColumn];
+  bool ok = (stringPoolSize == 0 || strings[stringPoolSize - 1] == 0);
+
+  const unsigned int* names = getIndexColumn<unsigned int>(index, imageNameColumn);
+  const unsigned int* firstAbnormalities = getIndexColumn<unsigned int>(index, imageFirstAbnormalityColumn);
+  const unsigned int* numAbnormalities = getIndexColumn<unsigned int>(index, imageNumAbnormalitiesColumn);
+  for(unsigned int i = 0; i < index.numImages && ok; i++)
+    {
+      ok = names[i] < stringPoolSize
+	&& static_cast<unsigned long long>(firstAbnormalities[i]) + numAbnormalities[i] <= index.numAbnormalities;
+    }
+
+  const unsigned int* images = getIndexColumn<unsigned int>(index, abnormalityImageColumn);
+  const unsigned int* pathologyTexts = getIndexColumn<unsigned int>(index, abnormalityPathologyTextColumn);
+  const unsigned int* lesionTypes = getIndexColumn<unsigned int>(index, abnormalityLesionTypesColumn);
+  const unsigned int* firstOutlines = getIndexColumn<unsigned int>(index, abnormalityFirstOutlineColumn);
+  const unsigned int* numOutlines = getIndexColumn<unsigned int>(index, abnormalityNumOutlinesColumn);
+  for(unsigned int i = 0; i < index.numAbnormalities && ok; i++)
+    {
+      ok = images[i] < index.numImages && pathologyTexts[i] < stringPoolSize && lesionTypes[i] < stringPoolSize
+	&& static_cast<unsigned long long>(firstOutlines[i]) + numOutlines[i] <= index.numOutlines;
+    }
+
+  const unsigned int* abnormalities = getIndexColumn<unsigned int>(index, outlineAbnormalityColumn);
+  const unsigned long long* chainOffsets = getIndexColumn<unsigned long long>(index, outlineChainOffsetColumn);
+  const unsigned int* chainLengths = getIndexColumn<unsigned int>(index, outlineChainLengthColumn);
+  for(unsigned int i = 0; i < index.numOutlines && ok; i++)
+    {
+      ok = abnormalities[i] < index.numAbnormalities
+	&& chainOffsets[i] <= chainPoolSize && chainLengths[i] <= chainPoolSize - chainOffsets[i];
+    }
+
+  return ok;
+}
+
+// Map an index file into memory and check it. Returns true on
+// success; on failure nothing needs to be closed.
+inline bool openAnnotationIndex(const std::string& indexFile, AnnotationIndex* index)
+{
+  index->data = NULL;
+  const int fd = open(indexFile.c_str(), O_RDONLY);
+  if(fd < 0)
+    {
+      return false;
+    }
+  struct stat status;
+  if(fstat(fd, &status) != 0 || static_cast<size_t>(status.st_size) < indexHeaderSize + 16 * numIndexColumns)
+    {
+      close(fd);
+      return false;
+    }
+  index->size = static_cast<size_t>(status.st_size);
+  void* mapping = mmap(NULL, index->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(mapping == MAP_FAILED)
+    {
+      return false;
+    }
+  index->data = static_cast<const unsigned char*>(mapping);
+
+  // Check the header, that each column is within the file, is aligned
+  // and is the size it should be, and what the columns refer to.
+  const unsigned char* header = index->data;
+  index->numImages = static_cast<unsigned int>(getIndexHeaderValue(header + 16, 4));
+  index->numAbnormalities = static_cast<unsigned int>(getIndexHeaderValue(header + 20, 4));
+  index->numOutlines = static_cast<unsigned int>(getIndexHeaderValue(header + 24, 4));
+  bool ok = memcmp(header, "DDSMINDX", 8) == 0
+    && getIndexHeaderValue(header + 8, 4) == 1
+    && getIndexHeaderValue(header + 12, 4) == 0x01020304
+    && getIndexHeaderValue(header + 28, 4) == numIndexColumns
+    && isLittleEndian();
+  const unsigned long long numValues[3] = {index->numImages, index->numAbnormalities, index->numOutlines};
+  unsigned long long poolSizes[2] = {0, 0}; // Of the string and chain pools.
+  for(unsigned int c = 0; c < numIndexColumns && ok; c++)
+    {
+      const unsigned long long offset = getIndexHeaderValue(header + indexHeaderSize + 8 * c, 8);
+      const unsigned long long size = getIndexHeaderValue(header + indexHeaderSize + 8 * (numIndexColumns + c), 8);
+      ok = (offset % 8 == 0) && offset <= index->size && size <= index->size - offset;
+
+      // The size of each value of the columns of images, abnormalities
+      // and outlines.
+      unsigned long long valueSize = 4;
+      if(c == abnormalityAssessmentColumn || c == abnormalitySubtletyColumn
+	 || c == abnormalityPathologyColumn || c == abnormalityLesionKindsColumn)
+	{
+	  valueSize = 1;
+	}
+      else if(c == outlineChainOffsetColumn)
+	{
+	  valueSize = 8;
+	}
+      const int table = (c < abnormalityImageColumn) ? 0 : ((c < outlineAbnormalityColumn) ? 1 : 2);
+      ok = ok && (c >= stringPoolColumn || size == valueSize * numValues[table]);
+      index->columns[c] = index->data + offset;
+      if(c >= stringPoolColumn)
+	{
+	  poolSizes[c - stringPoolColumn] = size;
+	}
+    }
+  ok = ok && checkIndexReferences(*index, poolSizes[0], poolSizes[1]);
+
+  if(!ok)
+    {
+      munmap(const_cast<unsigned char*>(index->data), index->size);
+      index->data = NULL;
+    }
+  return ok;
+}
+
+// Unmap an index.
+inline void closeAnnotationIndex(AnnotationIndex* index)
+{
+  if(NULL != index->data)
+    {
+      munmap(const_cast<unsigned char*>(index->data), index->size);
+      index->data = NULL;
+    }
+}
+
+// A string from the string pool of an index.
+inline const char* getIndexString(const AnnotationIndex& index, const unsigned int offset)
+{
+  return reinterpret_cast<const char*>(index.columns[stringPoolColumn]) + offset;
+}
+
+// Find an image by name, by binary search. Returns its position, or
+// -1 if the index doesn't have it.
+inline int findIndexImage(const AnnotationIndex& index, const std::string& imageName)
+{
+  const unsigned int* names = getIndexColumn<unsigned int>(index, imageNameColumn);
+  unsigned int low = 0;
+  unsigned int high = index.numImages;
+  while(low < high)
+    {
+      const unsigned int middle = low + (high - low) / 2;
+      const int order = strcmp(getIndexString(index, names[middle]), imageName.c_str());
+      if(order == 0)
+	{
+	  return static_cast<int>(middle);
+	}
+      else if(order < 0)
+	{
+	  low = middle + 1;
+	}
+      else
+	{
+	  high = middle;
+	}
+    }
+
+  return -1;
+}
+
+// Get an outline's chain code from an index.
+inline void getIndexChainCode(const AnnotationIndex& index, const unsigned int outline, ChainCode* chainCode)
+{
+  const unsigned char* directions = index.columns[chainPoolColumn] + getIndexColumn<unsigned long long>(index, outlineChainOffsetColumn)[outline];
+  chainCode->startRow = getIndexColumn<int>(index, outlineStartRowColumn)[outline];
+  chainCode->startCol = getIndexColumn<int>(index, outlineStartColColumn)[outline];
+  chainCode->directions.assign(directions, directions + getIndexColumn<unsigned int>(index, outlineChainLengthColumn)[outline]);
+}
+
+#endif // DDSMINDEX_H
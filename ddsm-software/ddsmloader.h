@@ -0,0 +1,465 @@
+/*
+  The DDSM image loader: serves calibrated (and optionally downsampled)
+  images, given only their names, to a program that consumes them one
+  after another (e.g. to train a model), decoding the next few on a
+  pool of threads while the program works on the current one, so that
+  the program never waits for a file to be read and calibrated.
+
+  Images are found through info-file.txt (the list of the DDSM FTP
+  server's files, as used by get-ddsm-mammo): each image's ".ics" file
+  gives its dimensions and digitizer, and its pixels are read from the
+  raw ("LJPEG.1") file written by the DDSM's "jpeg -d -s". Both are
+  looked for under a root directory, either at their path on the FTP
+  server or directly in the root (as get-ddsm-mammo leaves them).
+
+  Images are served in a shuffled (or the given) order, to any number
+  of consumer threads, each of which gets the next image in order that
+  no other has asked for. At most numAhead images beyond those being
+  waited for are decoded ahead, and the decoded images that have not
+  been served yet (and those being decoded) never take more than
+  memoryBudget bytes, except that one image is always allowed so that
+  an image bigger than the budget is still loaded. Once an image is
+  served, its memory belongs to the caller.
+
+  A loader is used as follows:
+
+    ImageLoader loader;
+    openImageLoader(&loader, sources, options);
+    LoadedImage image;
+    while(nextLoadedImage(&loader, &image)) { ... }
+    closeImageLoader(&loader);
+*/
+
+#ifndef DDSMLOADER_H
+#define DDSMLOADER_H
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "ddsmcore.h"
+
+// An image to load: where its raw file is, and what the image's .ics
+// file says about it.
+struct ImageSource
+{
+  std::string name; // E.g. "A_1509_1.RIGHT_CC".
+  std::string rawFile;
+  std::string icsFile; // The .ics file of the image's case.
+  int numRows;
+  int numCols;
+  std::string digitizer; // One of the digitizer names, e.g. howtek_mgh.
+  std::string overlayFile; // Empty if the image has no OVERLAY file (e.g. normals).
+};
+
+// Return the name of the .ics file of the case that an image belongs
+// to: "A_1509_1.RIGHT_CC" belongs to "A-1509-1.ics".
+inline std::string getIcsName(const std::string& imageName)
+{
+  std::string name = imageName.substr(0, imageName.rfind('.'));
+  std::replace(name.begin(), name.end(), '_', '-');
+  return name + ".ics";
+}
+
+// Read an image's dimensions and digitizer from its case's .ics file,
+// which has lines such as
+//
+//   DIGITIZER HOWTEK
+//   RIGHT_CC LINES 4696 PIXELS_PER_LINE 3024 BITS_PER_PIXEL 12 RESOLUTION 43.5 OVERLAY
+//
+// The Howtek digitizer is the MGH one for "A" cases and the ISMD one for
+// "D" cases. Returns true if the image's dimensions and a known
+// digitizer were found.
+inline bool readIcsFile(const std::string& icsFile,
+			const std::string& imageName,
+			int* numRows,
+			int* numCols,
+			std::string* digitizer)
+{
+  const std::string view = imageName.substr(imageName.rfind('.') + 1);
+  *numRows = 0;
+  *numCols = 0;
+  digitizer->clear();
+
+  std::ifstream input(icsFile.c_str());
+  std::string line;
+  while(std::getline(input, line))
+    {
+      std::istringstream words(line);
+      std::string keyword;
+      words >> keyword;
+      if(keyword == "DIGITIZER")
+	{
+	  std::string name;
+	  words >> name;
+	  std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+	  if(name == "howtek")
+	    {
+	      name = (!imageName.empty() && toupper(imageName[0]) == 'D') ? howtek_ismd : howtek_mgh;
+	    }
+	  *digitizer = name;
+	}
+      else if(keyword == view)
+	{
+	  std::string linesKeyword;
+	  std::string pixelsKeyword;
+	  words >> linesKeyword >> *numRows >> pixelsKeyword >> *numCols;
+	  if(linesKeyword != "LINES" || pixelsKeyword != "PIXELS_PER_LINE")
+	    {
+	      *numRows = 0;
+	      *numCols = 0;
+	    }
+	}
+    }
+
+  return *numRows > 0 && *numCols > 0 && NULL != getCalibrationFunction(*digitizer);
+}
+
+// Find the images with the given names through the info file and the
+// files under root. The images that are found are added to sources,
+// in the order of names; for each one that isn't, a description of the
+// problem is added to failures. An image's OVERLAY file is optional,
+// but one that is listed must be under root. Returns false if the info
+// file can't be read.
+inline bool resolveImageSources(const std::string& infoFile,
+				const std::string& root,
+				const std::vector<std::string>& names,
+				std::vector<ImageSource>* sources,
+				std::vector<std::string>* failures)
+{
+  // The FTP server paths of the images, of their OVERLAY files and of
+  // the .ics files, by name.
+  std::map<std::string, std::string> imagePaths;
+  std::map<std::string, std::string> overlayPaths;
+  std::map<std::string, std::string> icsPaths;
+  std::ifstream info(infoFile.c_str());
+  if(!info)
+    {
+      return false;
+    }
+  std::string line;
+  while(std::getline(info, line))
+    {
+      // Strip any trailing whitespace (e.g. a carriage return).
+      line = line.substr(0, line.find_last_not_of(" \t\r\n") + 1);
+      const size_t slash = line.rfind('/');
+      const std::string name = (slash == std::string::npos) ? line : line.substr(slash + 1);
+      if(name.size() > 6 && name.compare(name.size() - 6, 6, ".LJPEG") == 0)
+	{
+	  imagePaths[name.substr(0, name.size() - 6)] = line;
+	}
+      else if(name.size() > 8 && name.compare(name.size() - 8, 8, ".OVERLAY") == 0)
+	{
+	  overlayPaths[name.substr(0, name.size() - 8)] = line;
+	}
+      else if(name.size() > 4 && name.compare(name.size() - 4, 4, ".ics") == 0)
+	{
+	  icsPaths[name] = line;
+	}
+    }
+
+  for(size_t i = 0; i < names.size(); i++)
+    {
+      ImageSource source;
+      source.name = names[i];
+      std::map<std::string, std::string>::const_iterator imagePath = imagePaths.find(names[i]);
+      std::map<std::string, std::string>::const_iterator icsPath = icsPaths.find(getIcsName(names[i]));
+      if(imagePath == imagePaths.end() || icsPath == icsPaths.end())
+	{
+	  failures->push_back(names[i] + ": not in " + infoFile);
+	  continue;
+	}
+
+      std::map<std::string, std::string>::const_iterator overlayPath = overlayPaths.find(names[i]);
+      source.icsFile = findCorpusFile(root, icsPath->second);
+      source.rawFile = findCorpusFile(root, imagePath->second + ".1");
+      source.overlayFile = (overlayPath == overlayPaths.end()) ? "" : findCorpusFile(root, overlayPath->second);
+      if(source.icsFile.empty() || source.rawFile.empty())
+	{
+	  failures->push_back(names[i] + ": the .ics or LJPEG.1 file is not under " + root);
+	}
+      else if(overlayPath != overlayPaths.end() && source.overlayFile.empty())
+	{
+	  failures->push_back(names[i] + ": the OVERLAY file is not under " + root);
+	}
+      else if(!readIcsFile(source.icsFile, names[i], &source.numRows, &source.numCols, &source.digitizer))
+	{
+	  failures->push_back(source.icsFile + ": no dimensions or digitizer for " + names[i]);
+	}
+      else
+	{
+	  sources->push_back(source);
+	}
+    }
+
+  return true;
+}
+
+// How a loader loads and serves images.
+struct ImageLoaderOptions
+{
+  unsigned int numThreads; // The number of threads that decode images.
+  unsigned int numAhead; // How many images may be decoded ahead of the one being waited for.
+  unsigned long long memoryBudget; // In bytes; see the comment at the top of this file.
+  unsigned int downsampleLevels; // Serve level k of each image's pyramid (0 for full resolution).
+  bool shuffle; // Serve the images in a random order, rather than in order.
+  unsigned int seed; // The seed of the random order.
+};
+
+// An image, as served by a loader. If problem isn't empty, the image
+// couldn't be loaded and has no pixels.
+struct LoadedImage
+{
+  std::string name;
+  size_t source; // Which of the loader's sources the image is.
+  int numRows;
+  int numCols;
+  std::vector<unsigned short> pixels; // Calibrated, row by row.
+  std::string problem;
+};
+
+// Return the number of bytes of the pixels of an image as it will be
+// served.
+inline unsigned long long getLoadedImageSize(const ImageSource& source, const unsigned int downsampleLevels)
+{
+  const unsigned long long scale = 1ULL << downsampleLevels;
+  return 2 * ((source.numRows + scale - 1) / scale) * ((source.numCols + scale - 1) / scale);
+}
+
+// Load an image: read its raw file a band of rows at a time,
+// calibrate it by table look-up and, if downsampleLevels > 0, reduce
+// it through a pyramid (see addRowToPyramid()) as the rows go by, so
+// that the full-resolution image is never held in memory.
+inline void loadImage(const ImageSource& source,
+		      const std::vector<unsigned int>& calibrationTable,
+		      const unsigned int downsampleLevels,
+		      LoadedImage* image)
+{
+  image->name = source.name;
+  image->problem.clear();
+  image->pixels.clear();
+
+  std::vector<PyramidLevel> pyramid;
+  initPyramid(&pyramid, downsampleLevels, source.numRows, source.numCols);
+  image->numRows = pyramid.empty() ? source.numRows : pyramid.back().numRows;
+  image->numCols = pyramid.empty() ? source.numCols : pyramid.back().numCols;
+
+  FILE* input = fopen(source.rawFile.c_str(), "rb");
+  if(NULL == input)
+    {
+      image->problem = source.rawFile + ": could not be opened";
+      return;
+    }
+  if(!checkRawFileSize(input, source.numRows, source.numCols))
+    {
+      fclose(input);
+      image->problem = source.rawFile + ": does not hold " + std::to_string(source.numRows) + " x "
+	+ std::to_string(source.numCols) + " pixels";
+      return;
+    }
+
+  image->pixels.resize(static_cast<size_t>(image->numRows) * image->numCols);
+  const int numBandRows = 64;
+  std::vector<unsigned char> rawBytes(2 * static_cast<size_t>(source.numCols) * numBandRows);
+  std::vector<unsigned int> pixels(static_cast<size_t>(source.numCols) * numBandRows);
+  size_t outputRow = 0;
+  for(int bandStart = 0; bandStart < source.numRows && image->problem.empty(); bandStart += numBandRows)
+    {
+      const int bandRows = std::min(numBandRows, source.numRows - bandStart);
+      const size_t numPixels = static_cast<size_t>(source.numCols) * bandRows;
+      if(fread(&rawBytes[0], 1, 2 * numPixels, input) != 2 * numPixels)
+	{
+	  image->problem = source.rawFile + ": could not be read";
+	  break;
+	}
+
+      unpackRow(&rawBytes[0], &pixels[0], static_cast<int>(numPixels));
+      for(size_t i = 0; i < numPixels; i++)
+	{
+	  pixels[i] = calibrationTable[pixels[i]];
+	}
+
+      for(int row = 0; row < bandRows; row++)
+	{
+	  const unsigned int* rowPixels = &pixels[static_cast<size_t>(row) * source.numCols];
+	  if(!pyramid.empty())
+	    {
+	      addRowToPyramid(pyramid, rowPixels, source.numCols, bandStart + row == source.numRows - 1);
+	      rowPixels = pyramid.back().rowReady ? &pyramid.back().row[0] : NULL;
+	    }
+	  if(NULL != rowPixels)
+	    {
+	      std::copy(rowPixels, rowPixels + image->numCols, &image->pixels[outputRow * image->numCols]);
+	      outputRow++;
+	    }
+	}
+    }
+
+  fclose(input);
+  if(!image->problem.empty())
+    {
+      image->pixels.clear();
+    }
+}
+
+// The state of a loader. The members below the mutex are shared by the
+// threads and guarded by it.
+struct ImageLoader
+{
+  std::vector<ImageSource> sources;
+  ImageLoaderOptions options;
+  std::vector<size_t> order; // The order in which sources are served.
+  std::map<std::string, std::vector<unsigned int> > calibrationTables; // By digitizer name.
+  std::vector<std::thread> threads;
+
+  std::mutex mutex;
+  std::condition_variable canStart; // Signalled when a thread may be able to start an image.
+  std::condition_variable canServe; // Signalled when an image has been loaded.
+  size_t nextJob; // The position in order of the next image to start.
+  size_t nextServed; // The position in order of the next image to serve.
+  size_t numWaiting; // How many of the images before nextServed are being waited for.
+  std::map<size_t, LoadedImage> ready; // Loaded but not yet served, by position in order.
+  unsigned long long bytesReserved; // By the images in ready and those being loaded.
+  bool stopping;
+};
+
+// The work of each of a loader's threads: start the next image in
+// order whenever the look-ahead and the memory budget allow it.
+inline void runImageLoader(ImageLoader* loader)
+{
+  std::unique_lock<std::mutex> lock(loader->mutex);
+  while(true)
+    {
+      loader->canStart.wait(lock, [loader]()
+			    {
+			      if(loader->stopping || loader->nextJob >= loader->order.size())
+				{
+				  return true;
+				}
+			      const unsigned long long size =
+				getLoadedImageSize(loader->sources[loader->order[loader->nextJob]], loader->options.downsampleLevels);
+			      // The images being waited for skip the look-ahead limit
+			      // (but not the memory budget).
+			      return (loader->nextJob < loader->nextServed
+				      || loader->nextJob <= loader->nextServed - loader->numWaiting + loader->options.numAhead)
+				&& (loader->bytesReserved == 0 || loader->bytesReserved + size <= loader->options.memoryBudget);
+			    });
+      if(loader->stopping || loader->nextJob >= loader->order.size())
+	{
+	  return;
+	}
+
+      const size_t job = loader->nextJob++;
+      const ImageSource& source = loader->sources[loader->order[job]];
+      loader->bytesReserved += getLoadedImageSize(source, loader->options.downsampleLevels);
+      lock.unlock();
+
+      LoadedImage image;
+      loadImage(source, loader->calibrationTables.find(source.digitizer)->second, loader->options.downsampleLevels, &image);
+      image.source = loader->order[job];
+
+      lock.lock();
+      std::swap(loader->ready[job], image);
+      loader->canServe.notify_all();
+    }
+}
+
+// Start loading images from sources, whose digitizers must be known
+// ones. Returns false if a calibration table could not be made.
+inline bool openImageLoader(ImageLoader* loader, const std::vector<ImageSource>& sources, const ImageLoaderOptions& options)
+{
+  loader->sources = sources;
+  loader->options = options;
+  loader->options.numThreads = std::max(options.numThreads, 1U);
+  loader->options.downsampleLevels = std::min(options.downsampleLevels, maxPyramidLevels);
+  loader->nextJob = 0;
+  loader->nextServed = 0;
+  loader->numWaiting = 0;
+  loader->ready.clear();
+  loader->bytesReserved = 0;
+  loader->stopping = false;
+
+  loader->order.resize(sources.size());
+  for(size_t i = 0; i < sources.size(); i++)
+    {
+      loader->order[i] = i;
+    }
+  if(options.shuffle)
+    {
+      std::mt19937 random(options.seed);
+      std::shuffle(loader->order.begin(), loader->order.end(), random);
+    }
+
+  loader->calibrationTables.clear();
+  for(size_t i = 0; i < sources.size(); i++)
+    {
+      std::vector<unsigned int>& table = loader->calibrationTables[sources[i].digitizer];
+      if(table.empty() && !makeCalibrationTable(getCalibrationFunction(sources[i].digitizer), &table))
+	{
+	  return false;
+	}
+    }
+
+  for(unsigned int t = 0; t < loader->options.numThreads; t++)
+    {
+      loader->threads.push_back(std::thread(runImageLoader, loader));
+    }
+  return true;
+}
+
+// Wait for the next image and hand it over. Several threads may call
+// this at once: each claims its image before waiting for it, so no two
+// get the same one. Returns false once every image has been served (or
+// the loader is being closed).
+inline bool nextLoadedImage(ImageLoader* loader, LoadedImage* image)
+{
+  std::unique_lock<std::mutex> lock(loader->mutex);
+  if(loader->stopping || loader->nextServed >= loader->order.size())
+    {
+      return false;
+    }
+
+  const size_t job = loader->nextServed++;
+  loader->numWaiting++;
+  loader->canStart.notify_all(); // The image may be one that couldn't start before.
+  loader->canServe.wait(lock, [loader, job]() { return loader->stopping || loader->ready.count(job) > 0; });
+  loader->numWaiting--;
+  if(loader->ready.count(job) == 0)
+    {
+      return false;
+    }
+
+  std::swap(*image, loader->ready[job]);
+  loader->ready.erase(job);
+  loader->bytesReserved -= getLoadedImageSize(loader->sources[loader->order[job]], loader->options.downsampleLevels);
+  loader->canStart.notify_all();
+  return true;
+}
+
+// Stop a loader (whether or not every image has been served) and wait
+// for its threads to finish.
+inline void closeImageLoader(ImageLoader* loader)
+{
+  {
+    std::lock_guard<std::mutex> lock(loader->mutex);
+    loader->stopping = true;
+  }
+  loader->canStart.notify_all();
+  loader->canServe.notify_all();
+  for(unsigned int t = 0; t < loader->threads.size(); t++)
+    {
+      loader->threads[t].join();
+    }
+  loader->threads.clear();
+  loader->ready.clear();
+}
+
+#endif // DDSMLOADER_H
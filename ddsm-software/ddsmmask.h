@@ -0,0 +1,862 @@
+/*
+  Masks of the outlines in DDSM OVERLAY files: which pixels of a
+  mammogram lie inside a boundary or core. get_ddsm_groundtruth.m
+  makes a mask by drawing the chain code into a zeros() image the
+  size of the whole mammogram and then filling it with imfill(); here
+  we turn the chain code into a polygon and fill it with a scanline
+  algorithm that only visits the rows and columns of the outline's
+  bounding box, so the cost is proportional to the size of the
+  lesion, not of the image. Masks can be stored compactly in a mask
+  file (see writeMaskFile()) and decoded from it into any region of
+  an image.
+
+  Chain code coordinates are used as they are recorded in the OVERLAY
+  file, as row and column numbers counting from 0 (as ddsmraw2pnm and
+  ddsmtiles count them). get_ddsm_groundtruth.m uses them as MATLAB
+  indices, which count from 1.
+*/
+
+#ifndef DDSMMASK_H
+#define DDSMMASK_H
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "ddsmcore.h"
+#include "ddsmoverlay.h"
+
+// How to decide which pixels are inside a polygon whose edges cross:
+// with the even-odd rule a pixel is inside if a ray from it crosses
+// the polygon an odd number of times; with the non-zero rule, if the
+// polygon winds around it at all.
+enum FillRule
+  {
+    evenOddFill,
+    nonZeroFill
+  };
+
+// A binary mask covering the rectangle of numRows x numCols pixels
+// whose top-left pixel is at (top, left). Each row is packed into
+// rowBytes bytes, eight pixels to a byte with the leftmost pixel in
+// the most significant bit (as in a binary PBM file).
+struct BinaryMask
+{
+  int top;
+  int left;
+  int numRows;
+  int numCols;
+  int rowBytes;
+  std::vector<unsigned char> bits;
+};
+
+// Make an empty (all zero) mask covering a rectangle.
+inline void initBinaryMask(BinaryMask* mask, const int top, const int left, const int numRows, const int numCols)
+{
+  mask->top = top;
+  mask->left = left;
+  mask->numRows = std::max(numRows, 0);
+  mask->numCols = std::max(numCols, 0);
+  mask->rowBytes = (mask->numCols + 7) / 8;
+  mask->bits.assign(static_cast<size_t>(mask->rowBytes) * mask->numRows, 0);
+}
+
+// Whether the pixel at (row, col), in image coordinates, is set.
+// Pixels outside the mask's rectangle are never set.
+inline bool getMaskPixel(const BinaryMask& mask, const int row, const int col)
+{
+  const int y = row - mask.top;
+  const int x = col - mask.left;
+  if(y < 0 || y >= mask.numRows || x < 0 || x >= mask.numCols)
+    {
+      return false;
+    }
+
+  return (mask.bits[static_cast<size_t>(y) * mask.rowBytes + x / 8] >> (7 - x % 8)) & 1;
+}
+
+// Set the pixels from..to (inclusive, counting from the left of the
+// mask) of a packed row, a byte at a time where we can.
+inline void setMaskSpan(unsigned char* row, const int from, const int to)
+{
+  const int firstByte = from / 8;
+  const int lastByte = to / 8;
+  const unsigned char firstBits = static_cast<unsigned char>(0xff >> (from % 8));
+  const unsigned char lastBits = static_cast<unsigned char>(0xff << (7 - to % 8));
+  if(firstByte == lastByte)
+    {
+      row[firstByte] |= firstBits & lastBits;
+      return;
+    }
+
+  row[firstByte] |= firstBits;
+  if(lastByte > firstByte + 1)
+    {
+      memset(row + firstByte + 1, 0xff, lastByte - firstByte - 1);
+    }
+  row[lastByte] |= lastBits;
+}
+
+// The vertices of the polygon traced by a chain code: the centre of
+// each pixel it visits, starting with the first. The polygon is
+// closed by joining the last vertex to the first (which a well-formed
+// chain code returns to anyway).
+inline void getChainCodeVertices(const ChainCode& chainCode, std::vector<int>* rows, std::vector<int>* cols)
+{
+  rows->resize(chainCode.directions.size() + 1);
+  cols->resize(chainCode.directions.size() + 1);
+  int row = chainCode.startRow;
+  int col = chainCode.startCol;
+  (*rows)[0] = row;
+  (*cols)[0] = col;
+  for(size_t i = 0; i < chainCode.directions.size(); i++)
+    {
+      row += chainCodeRowSteps[chainCode.directions[i]];
+      col += chainCodeColSteps[chainCode.directions[i]];
+      (*rows)[i + 1] = row;
+      (*cols)[i + 1] = col;
+    }
+}
+
+// The range of rows fromRow <= y < toRow, of the numRows rows
+// starting at row top, whose centre lines are crossed by the edge of a
+// polygon from vertex i to vertex j (an edge from row r0 to row r1 >
+// r0 crosses the rows r0 <= row < r1, so a vertex on a row's centre
+// line is counted once). Horizontal edges cross no rows.
+inline void getEdgeRows(const std::vector<double>& rows,
+			const size_t i,
+			const size_t j,
+			const int top,
+			const int numRows,
+			int* fromRow,
+			int* toRow)
+{
+  const double low = std::min(rows[i], rows[j]);
+  const double high = std::max(rows[i], rows[j]);
+  *fromRow = std::max(static_cast<int>(ceil(low)) - top, 0);
+  *toRow = std::min(static_cast<int>(ceil(high)) - top, numRows);
+}
+
+// Work out which pixels of a row are inside a polygon, from the
+// columns and winding directions of the polygon's crossings of the
+// row's centre line (sorted by column): the spans of pixels from
+// where the row goes inside the polygon to where it comes out again,
+// as (first, last) columns, clipped to the columns 0 to numCols - 1.
+inline void getFillSpans(const std::pair<double, int>* crossings,
+			 const int numCrossings,
+			 const FillRule fillRule,
+			 const int numCols,
+			 std::vector<std::pair<int, int> >* spans)
+{
+  spans->clear();
+  int winding = 0;
+  double entered = 0.0;
+  for(int c = 0; c < numCrossings; c++)
+    {
+      const int before = winding;
+      winding = (fillRule == evenOddFill) ? (winding ^ 1) : (winding + crossings[c].second);
+      if(before == 0 && winding != 0)
+	{
+	  entered = crossings[c].first;
+	}
+      else if(before != 0 && winding == 0)
+	{
+	  const int from = std::max(static_cast<int>(ceil(entered)), 0);
+	  const int to = std::min(static_cast<int>(floor(crossings[c].first)), numCols - 1);
+	  if(from <= to)
+	    {
+	      spans->push_back(std::make_pair(from, to));
+	    }
+	}
+    }
+}
+
+// Fill a polygon (whose vertices need not be whole numbers) into a
+// mask, which must already cover the area to fill: each pixel whose
+// centre is inside the polygon or on its edge is set. We work out
+// where each edge crosses the centre line of each pixel row it spans,
+// bucket the crossings by row, and then fill between them according
+// to fillRule. This takes time proportional to the polygon's
+// perimeter plus the mask's area.
+inline void fillPolygon(const std::vector<double>& rows,
+			const std::vector<double>& cols,
+			const FillRule fillRule,
+			BinaryMask* mask)
+{
+  const size_t numVertices = rows.size();
+  if(numVertices < 2 || mask->numRows == 0 || mask->numCols == 0)
+    {
+      return;
+    }
+
+  // Count the crossings on each row, so that we can store them (as a
+  // column and a winding direction) in one array, row by row.
+  std::vector<int> rowStarts(mask->numRows + 1, 0);
+  int fromRow = 0;
+  int toRow = 0;
+  for(size_t i = 0; i < numVertices; i++)
+    {
+      getEdgeRows(rows, i, (i + 1) % numVertices, mask->top, mask->numRows, &fromRow, &toRow);
+      for(int y = fromRow; y < toRow; y++)
+	{
+	  rowStarts[y + 1]++;
+	}
+    }
+  for(int y = 0; y < mask->numRows; y++)
+    {
+      rowStarts[y + 1] += rowStarts[y];
+    }
+
+  std::vector<int> next(rowStarts.begin(), rowStarts.end() - 1);
+  std::vector<std::pair<double, int> > crossings(rowStarts[mask->numRows]);
+  for(size_t i = 0; i < numVertices; i++)
+    {
+      const size_t j = (i + 1) % numVertices;
+      getEdgeRows(rows, i, j, mask->top, mask->numRows, &fromRow, &toRow);
+      if(fromRow >= toRow)
+	{
+	  continue;
+	}
+
+      const int direction = (rows[j] > rows[i]) ? 1 : -1;
+      const double slope = (cols[j] - cols[i]) / (rows[j] - rows[i]);
+      for(int y = fromRow; y < toRow; y++)
+	{
+	  const double col = cols[i] + (y + mask->top - rows[i]) * slope;
+	  crossings[next[y]++] = std::make_pair(col - mask->left, direction);
+	}
+    }
+
+  // Fill the inside of the polygon on each row.
+  std::vector<std::pair<int, int> > spans;
+  for(int y = 0; y < mask->numRows; y++)
+    {
+      std::sort(crossings.begin() + rowStarts[y], crossings.begin() + rowStarts[y + 1]);
+      getFillSpans(crossings.empty() ? NULL : &crossings[rowStarts[y]], rowStarts[y + 1] - rowStarts[y], fillRule, mask->numCols, &spans);
+      unsigned char* row = &mask->bits[static_cast<size_t>(y) * mask->rowBytes];
+      for(size_t i = 0; i < spans.size(); i++)
+	{
+	  setMaskSpan(row, spans[i].first, spans[i].second);
+	}
+    }
+}
+
+// Fill the part of the mask of a chain code (the pixels it passes
+// through and every pixel they enclose, as imfill(..., 'holes') would
+// fill them) that lies in the rectangle that mask covers. rows and
+// cols are the chain code's vertices (see getChainCodeVertices()).
+inline void fillChainCode(const std::vector<int>& rows, const std::vector<int>& cols, const FillRule fillRule, BinaryMask* mask)
+{
+  // Fill the inside of the polygon, then set the pixels on the chain
+  // itself (some of which, e.g. at the bottom of the outline, have
+  // their centres on a horizontal edge and so are not filled).
+  fillPolygon(std::vector<double>(rows.begin(), rows.end()), std::vector<double>(cols.begin(), cols.end()), fillRule, mask);
+  for(size_t i = 0; i < rows.size(); i++)
+    {
+      const int y = rows[i] - mask->top;
+      const int x = cols[i] - mask->left;
+      if(y >= 0 && y < mask->numRows && x >= 0 && x < mask->numCols)
+	{
+	  mask->bits[static_cast<size_t>(y) * mask->rowBytes + x / 8] |= static_cast<unsigned char>(0x80 >> (x % 8));
+	}
+    }
+}
+
+// Make the mask of a chain code, in a mask covering just its bounding
+// box.
+inline void rasterizeChainCode(const ChainCode& chainCode, const FillRule fillRule, BinaryMask* mask)
+{
+  std::vector<int> rows;
+  std::vector<int> cols;
+  getChainCodeVertices(chainCode, &rows, &cols);
+
+  const int top = *std::min_element(rows.begin(), rows.end());
+  const int left = *std::min_element(cols.begin(), cols.end());
+  initBinaryMask(mask,
+		 top,
+		 left,
+		 *std::max_element(rows.begin(), rows.end()) - top + 1,
+		 *std::max_element(cols.begin(), cols.end()) - left + 1);
+  fillChainCode(rows, cols, fillRule, mask);
+}
+
+// Masks at reduced resolution. At scale s, pixel (R, C) of a reduced
+// mask covers the s x s block of full-resolution pixels from (R s,
+// C s) to (R s + s - 1, C s + s - 1), as a pixel of level k of a
+// ddsmraw2pnm pyramid does for s = 2^k.
+
+// Divide, rounding towards minus infinity (outlines can stray to
+// negative coordinates).
+inline int floorDivide(const int numerator, const int denominator)
+{
+  return (numerator >= 0) ? numerator / denominator : -((-numerator + denominator - 1) / denominator);
+}
+
+// Make a binary mask of a chain code at 1/scale of full resolution
+// directly, by scaling the polygon it traces to the reduced
+// resolution and filling that: a reduced pixel is set if its centre
+// is inside the scaled polygon, which is (to within the resolution of
+// the outline) when at least half of its block of the full-resolution
+// mask is set. Nothing is made at full resolution.
+inline void rasterizeChainCodeAtScale(const ChainCode& chainCode, const int scale, const FillRule fillRule, BinaryMask* mask)
+{
+  if(scale <= 1)
+    {
+      rasterizeChainCode(chainCode, fillRule, mask);
+      return;
+    }
+
+  // Full-resolution pixel centre r lies at (r + 0.5) / scale - 0.5 in
+  // reduced pixel coordinates.
+  std::vector<int> rows;
+  std::vector<int> cols;
+  getChainCodeVertices(chainCode, &rows, &cols);
+  std::vector<double> scaledRows(rows.size());
+  std::vector<double> scaledCols(cols.size());
+  for(size_t i = 0; i < rows.size(); i++)
+    {
+      scaledRows[i] = (rows[i] + 0.5) / scale - 0.5;
+      scaledCols[i] = (cols[i] + 0.5) / scale - 0.5;
+    }
+
+  const int top = floorDivide(*std::min_element(rows.begin(), rows.end()), scale);
+  const int left = floorDivide(*std::min_element(cols.begin(), cols.end()), scale);
+  initBinaryMask(mask,
+		 top,
+		 left,
+		 floorDivide(*std::max_element(rows.begin(), rows.end()), scale) - top + 1,
+		 floorDivide(*std::max_element(cols.begin(), cols.end()), scale) - left + 1);
+  fillPolygon(scaledRows, scaledCols, fillRule, mask);
+}
+
+// A mask at 1/scale of full resolution, each of whose pixels is the
+// fraction (from 0 to 1) of its block of the full-resolution mask
+// that is set.
+struct CoverageMask
+{
+  int top;
+  int left;
+  int numRows;
+  int numCols;
+  int scale;
+  std::vector<float> coverage; // Row by row.
+};
+
+// Make a coverage mask of a chain code at 1/scale of full resolution.
+// We fill the full-resolution mask a band of rows at a time (so only
+// a band, not the whole mask, is ever held at full resolution) and
+// count the set pixels of each block as we go, so the coverage is
+// exactly that of area-averaging the full-resolution mask.
+inline void computeChainCodeCoverage(const ChainCode& chainCode, const int scale, const FillRule fillRule, CoverageMask* coverage)
+{
+  std::vector<int> rows;
+  std::vector<int> cols;
+  getChainCodeVertices(chainCode, &rows, &cols);
+  const int fullTop = *std::min_element(rows.begin(), rows.end());
+  const int fullBottom = *std::max_element(rows.begin(), rows.end());
+  const int fullLeft = *std::min_element(cols.begin(), cols.end());
+  const int fullRight = *std::max_element(cols.begin(), cols.end());
+
+  coverage->scale = std::max(scale, 1);
+  coverage->top = floorDivide(fullTop, coverage->scale);
+  coverage->left = floorDivide(fullLeft, coverage->scale);
+  coverage->numRows = floorDivide(fullBottom, coverage->scale) - coverage->top + 1;
+  coverage->numCols = floorDivide(fullRight, coverage->scale) - coverage->left + 1;
+  std::vector<unsigned int> counts(static_cast<size_t>(coverage->numRows) * coverage->numCols, 0);
+
+  // Bands are whole numbers of blocks high, starting at the top of the
+  // first block.
+  const int bandRows = coverage->scale * std::max(64 / coverage->scale, 1);
+  const int fullLeftOfBlocks = coverage->left * coverage->scale;
+  BinaryMask band;
+  for(int bandTop = coverage->top * coverage->scale; bandTop <= fullBottom; bandTop += bandRows)
+    {
+      initBinaryMask(&band, bandTop, fullLeftOfBlocks, bandRows, coverage->numCols * coverage->scale);
+      fillChainCode(rows, cols, fillRule, &band);
+      for(int y = 0; y < band.numRows; y++)
+	{
+	  const int blockRow = floorDivide(bandTop, coverage->scale) + y / coverage->scale - coverage->top;
+	  if(blockRow >= coverage->numRows)
+	    {
+	      break;
+	    }
+	  const unsigned char* bits = &band.bits[static_cast<size_t>(y) * band.rowBytes];
+	  unsigned int* blockCounts = &counts[static_cast<size_t>(blockRow) * coverage->numCols];
+	  for(int b = 0; b < band.rowBytes; b++)
+	    {
+	      for(int x = 8 * b; bits[b] != 0 && x < 8 * b + 8; x++)
+		{
+		  blockCounts[x / coverage->scale] += (bits[b] >> (7 - x % 8)) & 1;
+		}
+	    }
+	}
+    }
+
+  const float blockArea = static_cast<float>(coverage->scale) * coverage->scale;
+  coverage->coverage.resize(counts.size());
+  for(size_t i = 0; i < counts.size(); i++)
+    {
+      coverage->coverage[i] = counts[i] / blockArea;
+    }
+}
+
+// Label images. A label image has a pixel for every pixel of the
+// mammogram (or, at scale s, for every s x s block of them, as
+// rasterizeChainCodeAtScale() makes them); each pixel inside the
+// boundary of an abnormality is set to the abnormality's number, and
+// each pixel inside one of its cores is set to its number in a second,
+// optional, label image. We paint all of an OVERLAY file's outlines
+// in one sweep down the rows: the crossings of every outline with
+// every row (and, at full resolution, the pixels on each chain) are
+// bucketed by row, and each row is then painted outline by outline.
+// Where outlines overlap, smaller ones are painted over larger ones,
+// so that every outline shows. Apart from a check of each row for
+// crossings, only the pixels that the outlines cover are visited.
+
+// A crossing of a row by an outline, or (with direction 0) a pixel on
+// an outline's chain code.
+struct LabelSweepItem
+{
+  unsigned int outline; // The position of the outline in the painting order.
+  double col;
+  int direction;
+};
+
+inline bool operator<(const LabelSweepItem& a, const LabelSweepItem& b)
+{
+  if(a.outline != b.outline)
+    {
+      return a.outline < b.outline;
+    }
+
+  return (a.col != b.col) ? (a.col < b.col) : (a.direction < b.direction);
+}
+
+// Paint the outlines of an OVERLAY file into label images of numRows x
+// numCols pixels at 1/scale of full resolution, whose rows are stride
+// labels apart; coreLabels may be NULL if the cores are not wanted.
+// The label images are not cleared first. Label is unsigned char or
+// unsigned short; abnormality numbers are truncated to fit.
+template <typename Label>
+inline void paintOverlayLabels(const Overlay& overlay,
+			       const int scale,
+			       const FillRule fillRule,
+			       const int numRows,
+			       const int numCols,
+			       const size_t stride,
+			       Label* labels,
+			       Label* coreLabels)
+{
+  // List the outlines to paint, largest first.
+  std::vector<std::pair<double, size_t> > order;
+  std::vector<const ChainCode*> chainCodes;
+  std::vector<Label*> outputs;
+  std::vector<Label> values;
+  for(size_t i = 0; i < overlay.abnormalities.size(); i++)
+    {
+      const Abnormality& abnormality = overlay.abnormalities[i];
+      for(size_t j = 0; j <= abnormality.cores.size() && (j == 0 || NULL != coreLabels); j++)
+	{
+	  OutlineFeatures features;
+	  chainCodes.push_back((j == 0) ? &abnormality.boundary : &abnormality.cores[j - 1]);
+	  computeOutlineFeatures(*chainCodes.back(), &features);
+	  order.push_back(std::make_pair(-features.area, order.size()));
+	  outputs.push_back((j == 0) ? labels : coreLabels);
+	  values.push_back(static_cast<Label>(abnormality.number));
+	}
+    }
+  std::stable_sort(order.begin(), order.end());
+
+  // Work out the polygon of each outline (scaled, if need be), and
+  // count the crossings and chain pixels on each row.
+  std::vector<std::vector<double> > polygonRows(order.size());
+  std::vector<std::vector<double> > polygonCols(order.size());
+  std::vector<std::vector<int> > chainRows(order.size());
+  std::vector<std::vector<int> > chainCols(order.size());
+  std::vector<int> rowStarts(numRows + 1, 0);
+  int fromRow = 0;
+  int toRow = 0;
+  for(size_t k = 0; k < order.size(); k++)
+    {
+      getChainCodeVertices(*chainCodes[order[k].second], &chainRows[k], &chainCols[k]);
+      polygonRows[k].resize(chainRows[k].size());
+      polygonCols[k].resize(chainCols[k].size());
+      for(size_t i = 0; i < chainRows[k].size(); i++)
+	{
+	  polygonRows[k][i] = (scale > 1) ? (chainRows[k][i] + 0.5) / scale - 0.5 : chainRows[k][i];
+	  polygonCols[k][i] = (scale > 1) ? (chainCols[k][i] + 0.5) / scale - 0.5 : chainCols[k][i];
+	}
+      if(scale > 1)
+	{
+	  // Chain pixels are only painted at full resolution (see
+	  // rasterizeChainCodeAtScale()).
+	  chainRows[k].clear();
+	  chainCols[k].clear();
+	}
+
+      const size_t numVertices = polygonRows[k].size();
+      for(size_t i = 0; i < numVertices; i++)
+	{
+	  getEdgeRows(polygonRows[k], i, (i + 1) % numVertices, 0, numRows, &fromRow, &toRow);
+	  for(int y = fromRow; y < toRow; y++)
+	    {
+	      rowStarts[y + 1]++;
+	    }
+	}
+      for(size_t i = 0; i < chainRows[k].size(); i++)
+	{
+	  if(chainRows[k][i] >= 0 && chainRows[k][i] < numRows)
+	    {
+	      rowStarts[chainRows[k][i] + 1]++;
+	    }
+	}
+    }
+  for(int y = 0; y < numRows; y++)
+    {
+      rowStarts[y + 1] += rowStarts[y];
+    }
+
+  // Bucket the crossings and chain pixels by row.
+  std::vector<int> next(rowStarts.begin(), rowStarts.end() - 1);
+  std::vector<LabelSweepItem> items(rowStarts[numRows]);
+  for(size_t k = 0; k < order.size(); k++)
+    {
+      const std::vector<double>& rows = polygonRows[k];
+      const std::vector<double>& cols = polygonCols[k];
+      const size_t numVertices = rows.size();
+      for(size_t i = 0; i < numVertices; i++)
+	{
+	  const size_t j = (i + 1) % numVertices;
+	  getEdgeRows(rows, i, j, 0, numRows, &fromRow, &toRow);
+	  if(fromRow >= toRow)
+	    {
+	      continue;
+	    }
+
+	  const double slope = (cols[j] - cols[i]) / (rows[j] - rows[i]);
+	  for(int y = fromRow; y < toRow; y++)
+	    {
+	      LabelSweepItem& item = items[next[y]++];
+	      item.outline = static_cast<unsigned int>(k);
+	      item.col = cols[i] + (y - rows[i]) * slope;
+	      item.direction = (rows[j] > rows[i]) ? 1 : -1;
+	    }
+	}
+      for(size_t i = 0; i < chainRows[k].size(); i++)
+	{
+	  if(chainRows[k][i] >= 0 && chainRows[k][i] < numRows)
+	    {
+	      LabelSweepItem& item = items[next[chainRows[k][i]]++];
+	      item.outline = static_cast<unsigned int>(k);
+	      item.col = chainCols[k][i];
+	      item.direction = 0;
+	    }
+	}
+    }
+
+  // Paint each row, outline by outline.
+  std::vector<std::pair<double, int> > crossings;
+  std::vector<std::pair<int, int> > spans;
+  for(int y = 0; y < numRows; y++)
+    {
+      std::sort(items.begin() + rowStarts[y], items.begin() + rowStarts[y + 1]);
+      for(int start = rowStarts[y], end = start; start < rowStarts[y + 1]; start = end)
+	{
+	  const unsigned int k = items[start].outline;
+	  Label* row = outputs[order[k].second] + static_cast<size_t>(y) * stride;
+	  const Label value = values[order[k].second];
+	  crossings.clear();
+	  for(end = start; end < rowStarts[y + 1] && items[end].outline == k; end++)
+	    {
+	      if(items[end].direction != 0)
+		{
+		  crossings.push_back(std::make_pair(items[end].col, items[end].direction));
+		}
+	      else if(items[end].col >= 0 && items[end].col < numCols)
+		{
+		  row[static_cast<int>(items[end].col)] = value;
+		}
+	    }
+
+	  getFillSpans(crossings.empty() ? NULL : &crossings[0], static_cast<int>(crossings.size()), fillRule, numCols, &spans);
+	  for(size_t i = 0; i < spans.size(); i++)
+	    {
+	      std::fill(row + spans[i].first, row + spans[i].second + 1, value);
+	    }
+	}
+    }
+}
+
+// A mask as it is stored in a mask file: its bounding box and either
+// the bit-packed rows of a BinaryMask (bitmapMaskEncoding) or, for
+// each row, the number of runs of set pixels and then the start
+// column (counting from the left of the mask) and length of each
+// run (runsMaskEncoding), all as 16-bit little-endian values. We use
+// whichever is smaller. abnormality and outline say which outline
+// the mask is of: outline 0 is the boundary and outline m the m-th
+// core.
+const unsigned int bitmapMaskEncoding = 0;
+const unsigned int runsMaskEncoding = 1;
+struct StoredMask
+{
+  unsigned int abnormality;
+  unsigned int outline;
+  int top;
+  int left;
+  int numRows;
+  int numCols;
+  unsigned int encoding;
+  std::vector<unsigned char> data;
+  std::vector<unsigned int> rowOffsets; // Where each row starts in data (for runsMaskEncoding).
+};
+
+// Append a 16-bit value to a byte vector, little-endian.
+inline void appendLittleEndian16(std::vector<unsigned char>* bytes, const unsigned int value)
+{
+  bytes->push_back(static_cast<unsigned char>(value & 0xff));
+  bytes->push_back(static_cast<unsigned char>((value >> 8) & 0xff));
+}
+
+inline unsigned int getLittleEndian16(const unsigned char* bytes)
+{
+  return static_cast<unsigned int>(bytes[0]) | (static_cast<unsigned int>(bytes[1]) << 8);
+}
+
+// Work out where each row of a run-length encoded mask starts.
+// Returns false if the data is too short for the mask's rows.
+inline bool indexMaskRuns(StoredMask* mask)
+{
+  mask->rowOffsets.resize(mask->numRows);
+  size_t offset = 0;
+  for(int y = 0; y < mask->numRows; y++)
+    {
+      if(offset + 2 > mask->data.size())
+	{
+	  return false;
+	}
+      mask->rowOffsets[y] = static_cast<unsigned int>(offset);
+      offset += 2 + 4 * static_cast<size_t>(getLittleEndian16(&mask->data[offset]));
+    }
+
+  return offset == mask->data.size();
+}
+
+// Store a mask, using whichever encoding is smaller.
+inline void encodeMask(const BinaryMask& mask, const unsigned int abnormality, const unsigned int outline, StoredMask* stored)
+{
+  stored->abnormality = abnormality;
+  stored->outline = outline;
+  stored->top = mask.top;
+  stored->left = mask.left;
+  stored->numRows = mask.numRows;
+  stored->numCols = mask.numCols;
+
+  // Run-length encode the rows, giving up if that gets bigger than
+  // the bitmap.
+  stored->data.clear();
+  bool runsAreSmaller = mask.numCols <= 65535;
+  for(int y = 0; y < mask.numRows && runsAreSmaller; y++)
+    {
+      const size_t countOffset = stored->data.size();
+      appendLittleEndian16(&stored->data, 0);
+      unsigned int numRuns = 0;
+      for(int x = 0; x < mask.numCols; )
+	{
+	  if(!getMaskPixel(mask, mask.top + y, mask.left + x))
+	    {
+	      x++;
+	      continue;
+	    }
+	  const int start = x;
+	  while(x < mask.numCols && getMaskPixel(mask, mask.top + y, mask.left + x))
+	    {
+	      x++;
+	    }
+	  appendLittleEndian16(&stored->data, static_cast<unsigned int>(start));
+	  appendLittleEndian16(&stored->data, static_cast<unsigned int>(x - start));
+	  numRuns++;
+	}
+      stored->data[countOffset] = static_cast<unsigned char>(numRuns & 0xff);
+      stored->data[countOffset + 1] = static_cast<unsigned char>(numRuns >> 8);
+      runsAreSmaller = stored->data.size() < mask.bits.size();
+    }
+
+  if(runsAreSmaller)
+    {
+      stored->encoding = runsMaskEncoding;
+      indexMaskRuns(stored);
+    }
+  else
+    {
+      stored->encoding = bitmapMaskEncoding;
+      stored->data = mask.bits;
+      stored->rowOffsets.clear();
+    }
+}
+
+// Decode the part of a stored mask that falls in the rectangle of
+// numRows x numCols pixels whose top-left pixel is at (top, left), in
+// image coordinates, into out: one byte per pixel, 1 where the mask
+// is set and 0 elsewhere, with rows stride bytes apart. Every pixel
+// of the rectangle is written, whether or not the mask covers it.
+inline void decodeMaskRegion(const StoredMask& mask,
+			     const int top,
+			     const int left,
+			     const int numRows,
+			     const int numCols,
+			     unsigned char* out,
+			     const size_t stride)
+{
+  for(int y = 0; y < numRows; y++)
+    {
+      memset(out + y * stride, 0, numCols);
+    }
+
+  // The part of the rectangle that the mask covers, in mask
+  // coordinates.
+  const int fromY = std::max(top - mask.top, 0);
+  const int toY = std::min(top + numRows - mask.top, mask.numRows);
+  const int fromX = std::max(left - mask.left, 0);
+  const int toX = std::min(left + numCols - mask.left, mask.numCols);
+  for(int y = fromY; y < toY; y++)
+    {
+      // Column x of the mask is row[x - shift].
+      unsigned char* row = out + (y + mask.top - top) * stride;
+      const int shift = left - mask.left;
+      if(mask.encoding == runsMaskEncoding)
+	{
+	  const unsigned char* runs = &mask.data[mask.rowOffsets[y]];
+	  const unsigned int numRuns = getLittleEndian16(runs);
+	  for(unsigned int r = 0; r < numRuns; r++)
+	    {
+	      const int start = std::max(static_cast<int>(getLittleEndian16(runs + 2 + 4 * r)), fromX);
+	      const int end = std::min(static_cast<int>(getLittleEndian16(runs + 2 + 4 * r) + getLittleEndian16(runs + 4 + 4 * r)), toX);
+	      if(start < end)
+		{
+		  memset(row + start - shift, 1, end - start);
+		}
+	    }
+	}
+      else
+	{
+	  const unsigned char* bits = &mask.data[static_cast<size_t>(y) * ((mask.numCols + 7) / 8)];
+	  for(int x = fromX; x < toX; x++)
+	    {
+	      row[x - shift] = (bits[x / 8] >> (7 - x % 8)) & 1;
+	    }
+	}
+    }
+}
+
+// Write a mask file. The format is as follows; all integers are
+// unsigned, 32 bits and little-endian (top and left are two's
+// complement, as outlines can stray off the image):
+//
+//   "DDSMMASK"            8 bytes of magic.
+//   version               Currently 2.
+//   scale                 The masks are at 1/scale of full resolution.
+//   num-masks
+//   for each mask:
+//     abnormality, outline
+//     top, left           The (reduced) image coordinates of the mask's top-left pixel.
+//     num-rows, num-cols  The size of the mask's bounding box.
+//     encoding            See StoredMask.
+//     data-size           The number of bytes of data that follow.
+//     data
+//
+// (Version 1 files had no scale; their masks are at full resolution.)
+// Returns true on success.
+inline bool writeMaskFile(const std::string& maskFile, const std::vector<StoredMask>& masks, const int scale)
+{
+  FILE* output = fopen(maskFile.c_str(), "wb");
+  if(NULL == output)
+    {
+      return false;
+    }
+
+  bool ok = (fwrite("DDSMMASK", 1, 8, output) == 8)
+    && writeLittleEndian32(output, 2)
+    && writeLittleEndian32(output, static_cast<unsigned int>(scale))
+    && writeLittleEndian32(output, static_cast<unsigned int>(masks.size()));
+  for(size_t i = 0; i < masks.size() && ok; i++)
+    {
+      const StoredMask& mask = masks[i];
+      ok = writeLittleEndian32(output, mask.abnormality)
+	&& writeLittleEndian32(output, mask.outline)
+	&& writeLittleEndian32(output, static_cast<unsigned int>(mask.top))
+	&& writeLittleEndian32(output, static_cast<unsigned int>(mask.left))
+	&& writeLittleEndian32(output, static_cast<unsigned int>(mask.numRows))
+	&& writeLittleEndian32(output, static_cast<unsigned int>(mask.numCols))
+	&& writeLittleEndian32(output, mask.encoding)
+	&& writeLittleEndian32(output, static_cast<unsigned int>(mask.data.size()))
+	&& (mask.data.empty() || fwrite(&mask.data[0], 1, mask.data.size(), output) == mask.data.size());
+    }
+
+  return (fclose(output) == 0) && ok;
+}
+
+// Read a mask file written by writeMaskFile(), and the scale of its
+// masks. Returns true on success.
+inline bool readMaskFile(const std::string& maskFile, std::vector<StoredMask>* masks, int* scale)
+{
+  FILE* input = fopen(maskFile.c_str(), "rb");
+  if(NULL == input)
+    {
+      return false;
+    }
+
+  char magic[8];
+  unsigned int version = 0;
+  unsigned int fileScale = 1;
+  unsigned int numMasks = 0;
+  bool ok = (fread(magic, 1, 8, input) == 8) && (memcmp(magic, "DDSMMASK", 8) == 0)
+    && readLittleEndian32(input, &version) && (version == 1 || version == 2)
+    && (version == 1 || (readLittleEndian32(input, &fileScale) && fileScale >= 1 && fileScale <= 65536))
+    && readLittleEndian32(input, &numMasks) && numMasks < 1000000;
+  *scale = static_cast<int>(fileScale);
+  masks->resize(ok ? numMasks : 0);
+  for(size_t i = 0; i < masks->size() && ok; i++)
+    {
+      StoredMask& mask = (*masks)[i];
+      unsigned int top = 0;
+      unsigned int left = 0;
+      unsigned int numRows = 0;
+      unsigned int numCols = 0;
+      unsigned int dataSize = 0;
+      ok = readLittleEndian32(input, &mask.abnormality)
+	&& readLittleEndian32(input, &mask.outline)
+	&& readLittleEndian32(input, &top)
+	&& readLittleEndian32(input, &left)
+	&& readLittleEndian32(input, &numRows) && numRows <= 65535
+	&& readLittleEndian32(input, &numCols) && numCols <= 65535
+	&& readLittleEndian32(input, &mask.encoding)
+	&& readLittleEndian32(input, &dataSize) && dataSize <= 65536 * 8192;
+      if(!ok)
+	{
+	  break;
+	}
+
+      mask.top = static_cast<int>(top);
+      mask.left = static_cast<int>(left);
+      mask.numRows = static_cast<int>(numRows);
+      mask.numCols = static_cast<int>(numCols);
+      mask.data.resize(dataSize);
+      ok = (dataSize == 0 || fread(&mask.data[0], 1, dataSize, input) == dataSize);
+      if(ok && mask.encoding == runsMaskEncoding)
+	{
+	  ok = indexMaskRuns(&mask);
+	}
+      else if(ok)
+	{
+	  ok = (mask.encoding == bitmapMaskEncoding) && (dataSize == numRows * ((numCols + 7) / 8));
+	}
+    }
+  fclose(input);
+
+  return ok;
+}
+
+#endif // DDSMMASK_H
@@ -0,0 +1,579 @@
+/*
+  The following is very brief; full program documentation can be found
+  by compiling this program as described and running it without
+  arguments, or by reading the displayProgramHelp() function.
+
+  This program reads a DDSM OVERLAY file (the ground truth for one
+  mammogram) and writes its contents as JSON: for each abnormality,
+  its lesion types, assessment, subtlety, pathology and the chain
+  codes of its boundary and cores. It does the job of
+  get_ddsm_groundtruth.m without needing MATLAB, and can also write
+  a table of the geometric features of each outline and the mask of
+  each outline.
+
+  Compilation: Compile this file using gcc: "g++ -Wall -O2 ddsmoverlay.c -o ddsmoverlay"
+*/
+
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "ddsmcore.h"
+#include "ddsmoverlay.h"
+#include "ddsmmask.h"
+
+// These are program error codes and messages.
+const int success = 0; // The code to return on program success.
+const int syntax_error = -1; // Exit code if the user invokes program incorrectly.
+const char* syntax_error_msg = ""; // We'll output a message manually if the program is not called correctly.
+const int file_error = -4;
+const char* file_error_msg = "A file error was detected at runtime.";
+const int overlay_error = -13;
+const char* overlay_error_msg = "Could not parse the OVERLAY file.";
+
+// This is the suffix applied to the input filename to create the
+// output (JSON) filename.
+const std::string outputSuffix = "-ddsmoverlay.json";
+
+// This is the suffix applied to the input filename to create the
+// feature table's filename.
+const std::string featuresSuffix = "-ddsmoverlay-features.csv";
+
+// This is inserted between the input filename and the abnormality
+// number and outline name to create the mask filenames.
+const std::string maskInfix = "-ddsmoverlay-";
+
+// This is the suffix applied to the input filename to create the
+// mask file's filename.
+const std::string maskFileSuffix = "-ddsmoverlay.masks";
+
+// These are the suffixes applied to the input filename to create the
+// label images' filenames.
+const std::string labelsSuffix = "-ddsmoverlay-labels.pgm";
+const std::string coreLabelsSuffix = "-ddsmoverlay-core-labels.pgm";
+
+// These are the optional arguments that may follow the mandatory ones.
+const std::string featuresOption = "--features";
+const std::string masksOption = "--masks";
+const std::string maskFileOption = "--mask-file";
+const std::string coverageOption = "--coverage";
+const std::string labelsOption = "--labels"; // Takes two values.
+const std::string coreLabelsOption = "--core-labels";
+const std::string scaleOption = "--scale"; // Takes a value.
+const std::string fillOption = "--fill"; // Takes a value.
+const std::string evenOddFillName = "even-odd";
+const std::string nonZeroFillName = "non-zero";
+
+// The largest reduction in resolution that --scale accepts.
+const int maxScale = 64;
+
+// The options that the user may specify after the mandatory
+// arguments.
+struct ProgramOptions
+{
+  bool features; // Whether to write the feature table.
+  bool masks; // Whether to write the mask of each outline.
+  bool maskFile; // Whether to write all the masks to a mask file.
+  bool coverage; // Whether to write the coverage mask of each outline.
+  int labelRows; // The size of the mammogram, for the label images (0 if there are none).
+  int labelCols;
+  bool coreLabels; // Whether to write the core label image as well.
+  int scale; // The masks are made at 1/scale of full resolution.
+  FillRule fillRule; // How to fill outlines that cross themselves.
+};
+
+
+// Display program help information.
+void displayProgramHelp()
+{
+  // We'll define the help message as an array of strings that we'll
+  // iterate over. The end of the array is marked with a special
+  // string called endString.
+  const std::string endString = "<<<END"; // Marks the end of the message.
+
+  // Here's the message array.
+  std::string
+    helpMessage[] =
+    {
+      "ddsmoverlay",
+      "===========\n",
+
+      "Convert a DDSM OVERLAY file to JSON.\n",
+
+      "Usage: ddsmoverlay <overlay-file> [--features] [--masks] [--mask-file]",
+      "                   [--coverage] [--labels <rows> <cols> [--core-labels]]",
+      "                   [--scale <n>] [--fill <rule>]\n",
+
+      "* <overlay-file> is the name of a DDSM .OVERLAY file.\n",
+
+      "The program writes the JSON file \"<overlay-file>-ddsmoverlay.json\" and writes its",
+      "name to standard output. The JSON holds the number of abnormalities and, for",
+      "each abnormality, its lesion types (a list, as there may be several), assessment,",
+      "subtlety, pathology and number of outlines (null where the OVERLAY file does not",
+      "record them), its boundary and a list of its cores. Each outline has the column",
+      "and row at which its chain code starts (as recorded in the OVERLAY file), its",
+      "length (number of steps) and its chain code, as a string of the digits 0 to 7.",
+      "Direction 0 is up (towards row 0), 2 is right, 4 is down, 6 is left and the odd",
+      "directions are the diagonals between them.\n",
+
+      "If --features is given, a table of the geometric features of each outline is",
+      "also written, as the CSV file \"<overlay-file>-ddsmoverlay-features.csv\", whose",
+      "name is written to standard output after the JSON file's name. The table has a",
+      "header line and then a line per outline: the overlay file, abnormality number,",
+      "outline (\"boundary\" or \"core<m>\"), assessment, subtlety and pathology, and",
+      "then the outline's area (of the polygon through the centres of the pixels that",
+      "the chain code visits), number of pixels (that its mask would have), perimeter",
+      "(diagonal steps counting sqrt(2)), centroid row and column, bounding box (top,",
+      "left, bottom and right, inclusive) and compactness (4 pi area / perimeter^2,",
+      "which is 1 for a circle). These are all computed from the chain code itself,",
+      "without making the outline's mask, so tables for the whole corpus are quick to",
+      "make; the tables of several files can simply be concatenated (without their",
+      "header lines).\n",
+
+      "If --masks is given, the mask of each outline (the pixels it passes through and",
+      "all the pixels it encloses) is also written, as a binary PBM file covering just",
+      "the outline's bounding box: \"<overlay-file>-ddsmoverlay-<n>-boundary.pbm\" for",
+      "the boundary of abnormality <n> and \"<overlay-file>-ddsmoverlay-<n>-core<m>.pbm\"",
+      "for its m-th core (counting from 1). The comment line of each PBM file gives the",
+      "row and column of the mammogram at which its top-left pixel lies, and the scale",
+      "(see --scale). The PBM files' names are written to standard output after the",
+      "names of the JSON file, feature table and mask file. The masks are made by a",
+      "scanline fill that only visits the bounding box of each outline.\n",
+
+      "If --mask-file is given, the masks of all the outlines are also written to the",
+      "single file \"<overlay-file>-ddsmoverlay.masks\", whose name is written to",
+      "standard output after the JSON file's name (and feature table's). Each mask is",
+      "stored as its bounding box and either its bit-packed rows or the runs of set",
+      "pixels on each row, whichever is smaller; see ddsmmask.h for the format and",
+      "for the functions that read it and decode a mask into any region of an image.\n",
+
+      "If --coverage is given, the coverage mask of each outline is also written, as an",
+      "8-bit PGM file \"<overlay-file>-ddsmoverlay-<n>-boundary-coverage.pgm\" (and",
+      "similarly for cores) whose pixels are the fraction, from 0 to 255, of the pixels",
+      "of the full-resolution mask that they cover. These names are written to standard",
+      "output after those of the PBM files. Coverage is only useful with --scale.\n",
+
+      "If --labels is given, with the number of rows and columns of the mammogram, a",
+      "label image the size of the mammogram is also written, as the PGM file",
+      "\"<overlay-file>-ddsmoverlay-labels.pgm\": each pixel inside the boundary of an",
+      "abnormality is set to the abnormality's number and all others are 0. Where",
+      "boundaries overlap, the smaller one wins. The file has 8-bit pixels, or 16-bit",
+      "ones if there are more than 255 abnormalities. With --core-labels, a second",
+      "label image, \"<overlay-file>-ddsmoverlay-core-labels.pgm\", is written in the same",
+      "way for the cores. All the outlines are painted in one sweep down the image that",
+      "only visits the pixels they cover. The names of the label images are written to",
+      "standard output last.\n",
+
+      "--scale <n> (from 1 to 64) makes the masks at 1/<n> of full resolution, each",
+      "mask pixel covering a block of <n> x <n> pixels of the mammogram (as a pixel of",
+      "the pyramid level written by \"ddsmraw2pnm --pyramid\" does when <n> is a power of",
+      "2); positions in the PBM comments and the mask file are then at that resolution,",
+      "and the label images are <n> times smaller in each direction (rounding up).",
+      "The binary masks are made by scaling each outline down and filling it, and set",
+      "the pixels of which at least about half are inside the outline; the coverage",
+      "masks are exactly the average of the full-resolution mask over each block.",
+      "Neither is made by rasterizing at full resolution first.\n",
+
+      "--fill <rule> chooses how outlines that cross themselves are filled: \"even-odd\"",
+      "(the default) or \"non-zero\".\n",
+
+      "If the OVERLAY file cannot be parsed, the number of the offending line is written",
+      "to standard error.",
+
+      endString
+    };
+
+  // Now print the message line by line.
+  unsigned int i = 0; // An iterator.
+  std::string thisLine = ""; // We'll change this.
+  while((thisLine = helpMessage[i]) != endString)
+    {
+      std::cout << thisLine << std::endl; // Print the line.
+      i++; // Increment iterator.
+    }
+}
+
+
+// Function that exits with an error code and a particular error
+// message.
+void exitWith(const int errorCode, const char* errorMsg)
+{
+  std::cerr << errorMsg << std::endl;
+  exit(errorCode);
+}
+
+
+// Write an integer field that may be missing (-1) as JSON.
+std::string jsonOptionalInteger(const int value)
+{
+  return (value < 0) ? "null" : std::to_string(value);
+}
+
+// Write an outline as a JSON object.
+void writeChainCode(FILE* output, const ChainCode& chainCode)
+{
+  std::string chain(chainCode.directions.size(), '0');
+  for(size_t i = 0; i < chainCode.directions.size(); i++)
+    {
+      chain[i] = static_cast<char>('0' + chainCode.directions[i]);
+    }
+
+  fprintf(output, "{\"start_col\": %d, \"start_row\": %d, \"length\": %u, \"chain\": \"%s\"}",
+	  chainCode.startCol, chainCode.startRow, static_cast<unsigned int>(chainCode.directions.size()), chain.c_str());
+}
+
+// Write the contents of an OVERLAY file as JSON. Returns true on
+// success.
+bool writeOverlayJson(const std::string& outputFile, const std::string& overlayFile, const Overlay& overlay)
+{
+  FILE* output = fopen(outputFile.c_str(), "w");
+  if(NULL == output)
+    {
+      return false;
+    }
+
+  fprintf(output, "{\n  \"overlay\": %s,\n", jsonString(overlayFile).c_str());
+  fprintf(output, "  \"total_abnormalities\": %d,\n", overlay.totalAbnormalities);
+  fprintf(output, "  \"abnormalities\": [");
+  for(size_t i = 0; i < overlay.abnormalities.size(); i++)
+    {
+      const Abnormality& abnormality = overlay.abnormalities[i];
+      fprintf(output, "%s\n    {\n", (i > 0) ? "," : "");
+      fprintf(output, "      \"abnormality\": %d,\n", abnormality.number);
+      fprintf(output, "      \"lesion_type\": [");
+      for(size_t j = 0; j < abnormality.lesionTypes.size(); j++)
+	{
+	  fprintf(output, "%s%s", (j > 0) ? ", " : "", jsonString(abnormality.lesionTypes[j]).c_str());
+	}
+      fprintf(output, "],\n");
+      fprintf(output, "      \"assessment\": %s,\n", jsonOptionalInteger(abnormality.assessment).c_str());
+      fprintf(output, "      \"subtlety\": %s,\n", jsonOptionalInteger(abnormality.subtlety).c_str());
+      fprintf(output, "      \"pathology\": %s,\n", abnormality.pathology.empty() ? "null" : jsonString(abnormality.pathology).c_str());
+      fprintf(output, "      \"total_outlines\": %s,\n", jsonOptionalInteger(abnormality.totalOutlines).c_str());
+      fprintf(output, "      \"boundary\": ");
+      writeChainCode(output, abnormality.boundary);
+      fprintf(output, ",\n      \"cores\": [");
+      for(size_t j = 0; j < abnormality.cores.size(); j++)
+	{
+	  fprintf(output, "%s\n        ", (j > 0) ? "," : "");
+	  writeChainCode(output, abnormality.cores[j]);
+	}
+      fprintf(output, "%s]\n    }", abnormality.cores.empty() ? "" : "\n      ");
+    }
+  fprintf(output, "%s]\n}\n", overlay.abnormalities.empty() ? "" : "\n  ");
+
+  const bool ok = !ferror(output);
+  return (fclose(output) == 0) && ok;
+}
+
+
+// Write the table of the geometric features of the outlines of an
+// OVERLAY file, as CSV. Returns true on success.
+bool writeFeatureTable(const std::string& featuresFile, const std::string& overlayFile, const Overlay& overlay)
+{
+  FILE* output = fopen(featuresFile.c_str(), "w");
+  if(NULL == output)
+    {
+      return false;
+    }
+
+  fprintf(output, "overlay,abnormality,outline,assessment,subtlety,pathology,area,pixels,perimeter,"
+	  "centroid_row,centroid_col,top,left,bottom,right,compactness\n");
+  for(size_t i = 0; i < overlay.abnormalities.size(); i++)
+    {
+      const Abnormality& abnormality = overlay.abnormalities[i];
+      for(size_t j = 0; j <= abnormality.cores.size(); j++)
+	{
+	  OutlineFeatures features;
+	  computeOutlineFeatures((j == 0) ? abnormality.boundary : abnormality.cores[j - 1], &features);
+	  fprintf(output, "\"%s\",%d,%s,%d,%d,%s,%.1f,%.1f,%.3f,%.3f,%.3f,%d,%d,%d,%d,%.4f\n",
+		  overlayFile.c_str(),
+		  abnormality.number,
+		  (j == 0) ? "boundary" : ("core" + std::to_string(j)).c_str(),
+		  abnormality.assessment,
+		  abnormality.subtlety,
+		  abnormality.pathology.c_str(),
+		  features.area,
+		  features.numPixels,
+		  features.perimeter,
+		  features.centroidRow,
+		  features.centroidCol,
+		  features.top,
+		  features.left,
+		  features.bottom,
+		  features.right,
+		  features.compactness);
+	}
+    }
+
+  const bool ok = !ferror(output);
+  return (fclose(output) == 0) && ok;
+}
+
+// Write a mask as a binary PBM file, noting where its top-left pixel
+// is (and its scale) in the comment line. Returns true on success.
+bool writePbmFile(const std::string& maskFile, const BinaryMask& mask, const int scale)
+{
+  FILE* output = fopen(maskFile.c_str(), "wb");
+  if(NULL == output)
+    {
+      return false;
+    }
+
+  fprintf(output, "P4\n# top-left row %d col %d scale %d\n%d %d\n", mask.top, mask.left, scale, mask.numCols, mask.numRows);
+  const bool ok = mask.bits.empty() || fwrite(&mask.bits[0], 1, mask.bits.size(), output) == mask.bits.size();
+
+  return (fclose(output) == 0) && ok;
+}
+
+// Write a coverage mask as an 8-bit PGM file, noting where its
+// top-left pixel is and its scale in the comment line. Returns true
+// on success.
+bool writeCoveragePgmFile(const std::string& coverageFile, const CoverageMask& coverage)
+{
+  FILE* output = fopen(coverageFile.c_str(), "wb");
+  if(NULL == output)
+    {
+      return false;
+    }
+
+  fprintf(output, "P5\n# top-left row %d col %d scale %d\n%d %d\n255\n",
+	  coverage.top, coverage.left, coverage.scale, coverage.numCols, coverage.numRows);
+  std::vector<unsigned char> bytes(coverage.coverage.size());
+  for(size_t i = 0; i < bytes.size(); i++)
+    {
+      bytes[i] = static_cast<unsigned char>(lround(255.0 * coverage.coverage[i]));
+    }
+  const bool ok = bytes.empty() || fwrite(&bytes[0], 1, bytes.size(), output) == bytes.size();
+
+  return (fclose(output) == 0) && ok;
+}
+
+// Write a label image as a PGM file, with 8-bit pixels if the labels
+// fit and 16-bit ones otherwise. Returns true on success.
+bool writeLabelPgmFile(const std::string& labelFile, const std::vector<unsigned short>& labels, const int numRows, const int numCols)
+{
+  FILE* output = fopen(labelFile.c_str(), "wb");
+  if(NULL == output)
+    {
+      return false;
+    }
+
+  // PGM files need a maximum value of at least 1.
+  const unsigned int maxLabel = std::max(1U, static_cast<unsigned int>(*std::max_element(labels.begin(), labels.end())));
+  fprintf(output, "P5\n%d %d\n%u\n", numCols, numRows, maxLabel);
+  std::vector<unsigned char> bytes;
+  for(size_t i = 0; i < labels.size(); i++)
+    {
+      // 16-bit values are written most significant byte first.
+      if(maxLabel > 255)
+	{
+	  bytes.push_back(static_cast<unsigned char>(labels[i] >> 8));
+	}
+      bytes.push_back(static_cast<unsigned char>(labels[i] & 0xff));
+    }
+  const bool ok = bytes.empty() || fwrite(&bytes[0], 1, bytes.size(), output) == bytes.size();
+
+  return (fclose(output) == 0) && ok;
+}
+
+// The name of a file for a mask of an outline:
+// <overlayFile>-ddsmoverlay-<abnormality>-<name><suffix>.
+std::string getOutlineMaskFile(const std::string& overlayFile, const int abnormality, const std::string& name, const std::string& suffix)
+{
+  return overlayFile + maskInfix + std::to_string(abnormality) + "-" + name + suffix;
+}
+
+
+// Entry point.
+int main(int argc, char* argv[])
+{
+  // Do some error checking to make sure that the user invoked us
+  // properly.
+  if(argc < 2)
+    {
+      // Output some help info and then exit.
+      displayProgramHelp();
+      exitWith(syntax_error, syntax_error_msg);
+    }
+
+  const std::string overlayFile = argv[1];
+
+  // Read any options that follow the mandatory arguments.
+  ProgramOptions options;
+  options.features = false;
+  options.masks = false;
+  options.maskFile = false;
+  options.coverage = false;
+  options.labelRows = 0;
+  options.labelCols = 0;
+  options.coreLabels = false;
+  options.scale = 1;
+  options.fillRule = evenOddFill;
+  for(int i = 2; i < argc; i++)
+    {
+      const std::string option = argv[i];
+      if(option.compare(featuresOption) == 0)
+	{
+	  options.features = true;
+	}
+      else if(option.compare(masksOption) == 0)
+	{
+	  options.masks = true;
+	}
+      else if(option.compare(maskFileOption) == 0)
+	{
+	  options.maskFile = true;
+	}
+      else if(option.compare(coverageOption) == 0)
+	{
+	  options.coverage = true;
+	}
+      else if(option.compare(labelsOption) == 0 && i + 2 < argc && atoi(argv[i + 1]) > 0 && atoi(argv[i + 2]) > 0)
+	{
+	  options.labelRows = atoi(argv[++i]);
+	  options.labelCols = atoi(argv[++i]);
+	}
+      else if(option.compare(coreLabelsOption) == 0)
+	{
+	  options.coreLabels = true;
+	}
+      else if(option.compare(scaleOption) == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 1 && atoi(argv[i + 1]) <= maxScale)
+	{
+	  options.scale = atoi(argv[++i]);
+	}
+      else if(option.compare(fillOption) == 0 && i + 1 < argc
+	      && (evenOddFillName.compare(argv[i + 1]) == 0 || nonZeroFillName.compare(argv[i + 1]) == 0))
+	{
+	  options.fillRule = (nonZeroFillName.compare(argv[++i]) == 0) ? nonZeroFill : evenOddFill;
+	}
+      else
+	{
+	  // Unknown option, so output some help info and then exit.
+	  displayProgramHelp();
+	  exitWith(syntax_error, syntax_error_msg);
+	}
+    }
+
+  if(options.coreLabels && options.labelRows == 0)
+    {
+      // The core labels need the size of the mammogram too.
+      displayProgramHelp();
+      exitWith(syntax_error, syntax_error_msg);
+    }
+
+  Overlay overlay;
+  int errorLine = 0;
+  if(!readOverlayFile(overlayFile, &overlay, &errorLine))
+    {
+      if(errorLine > 0)
+	{
+	  std::cerr << overlayFile << ":" << errorLine << ": ";
+	}
+      exitWith(overlay_error, overlay_error_msg);
+    }
+
+  const std::string outputFile = overlayFile + outputSuffix;
+  if(!writeOverlayJson(outputFile, overlayFile, overlay))
+    {
+      exitWith(file_error, file_error_msg);
+    }
+
+  // Rasterize the outlines, if we need to.
+  std::vector<std::string> outputFiles;
+  std::vector<std::string> coverageFiles;
+  std::vector<StoredMask> storedMasks;
+  for(size_t i = 0; i < overlay.abnormalities.size() && (options.masks || options.maskFile || options.coverage); i++)
+    {
+      const Abnormality& abnormality = overlay.abnormalities[i];
+      for(size_t j = 0; j <= abnormality.cores.size(); j++)
+	{
+	  const ChainCode& chainCode = (j == 0) ? abnormality.boundary : abnormality.cores[j - 1];
+	  const std::string name = (j == 0) ? "boundary" : "core" + std::to_string(j);
+	  BinaryMask mask;
+	  if(options.masks || options.maskFile)
+	    {
+	      rasterizeChainCodeAtScale(chainCode, options.scale, options.fillRule, &mask);
+	    }
+	  if(options.masks)
+	    {
+	      outputFiles.push_back(getOutlineMaskFile(overlayFile, abnormality.number, name, ".pbm"));
+	      if(!writePbmFile(outputFiles.back(), mask, options.scale))
+		{
+		  exitWith(file_error, file_error_msg);
+		}
+	    }
+	  if(options.maskFile)
+	    {
+	      storedMasks.push_back(StoredMask());
+	      encodeMask(mask, static_cast<unsigned int>(abnormality.number), static_cast<unsigned int>(j), &storedMasks.back());
+	    }
+	  if(options.coverage)
+	    {
+	      CoverageMask coverage;
+	      computeChainCodeCoverage(chainCode, options.scale, options.fillRule, &coverage);
+	      coverageFiles.push_back(getOutlineMaskFile(overlayFile, abnormality.number, name, "-coverage.pgm"));
+	      if(!writeCoveragePgmFile(coverageFiles.back(), coverage))
+		{
+		  exitWith(file_error, file_error_msg);
+		}
+	    }
+	}
+    }
+  outputFiles.insert(outputFiles.end(), coverageFiles.begin(), coverageFiles.end());
+  if(options.maskFile)
+    {
+      outputFiles.insert(outputFiles.begin(), overlayFile + maskFileSuffix);
+      if(!writeMaskFile(outputFiles.front(), storedMasks, options.scale))
+	{
+	  exitWith(file_error, file_error_msg);
+	}
+    }
+  if(options.features)
+    {
+      outputFiles.insert(outputFiles.begin(), overlayFile + featuresSuffix);
+      if(!writeFeatureTable(outputFiles.front(), overlayFile, overlay))
+	{
+	  exitWith(file_error, file_error_msg);
+	}
+    }
+
+  // Paint the label images, if we need to.
+  if(options.labelRows > 0)
+    {
+      const int numRows = (options.labelRows + options.scale - 1) / options.scale;
+      const int numCols = (options.labelCols + options.scale - 1) / options.scale;
+      std::vector<unsigned short> labels(static_cast<size_t>(numRows) * numCols, 0);
+      std::vector<unsigned short> coreLabels(options.coreLabels ? labels.size() : 0, 0);
+      paintOverlayLabels(overlay, options.scale, options.fillRule, numRows, numCols, numCols,
+			 &labels[0], options.coreLabels ? &coreLabels[0] : static_cast<unsigned short*>(NULL));
+      outputFiles.push_back(overlayFile + labelsSuffix);
+      if(!writeLabelPgmFile(outputFiles.back(), labels, numRows, numCols))
+	{
+	  exitWith(file_error, file_error_msg);
+	}
+      if(options.coreLabels)
+	{
+	  outputFiles.push_back(overlayFile + coreLabelsSuffix);
+	  if(!writeLabelPgmFile(outputFiles.back(), coreLabels, numRows, numCols))
+	    {
+	      exitWith(file_error, file_error_msg);
+	    }
+	}
+    }
+
+  // Everything's OK, so send the name of the JSON file (and of the
+  // feature table, mask file, PBM files, PGM files and label images,
+  // if any) to stdout.
+  std::cout << outputFile << std::endl;
+  for(size_t i = 0; i < outputFiles.size(); i++)
+    {
+      std::cout << outputFiles[i] << std::endl;
+    }
+
+  exit(success);
+}
@@ -0,0 +1,415 @@
+/*
+  DDSM OVERLAY files: the ground truth that radiologists recorded for
+  each abnormality of a mammogram (its lesion types, assessment,
+  subtlety and pathology) and the outlines they drew around it, as
+  chain codes. This header parses an OVERLAY file in a single
+  streaming pass into the compact structures below; it is the C++
+  counterpart of get_ddsm_groundtruth.m, and is used by ddsmoverlay
+  and the other programs in this directory that need the ground
+  truth.
+
+  An OVERLAY file looks like this (see
+  http://marathon.csee.usf.edu/Mammography/DDSM/case_description.html#OVERLAYFILE):
+
+    TOTAL_ABNORMALITIES 1
+    ABNORMALITY 1
+    LESION_TYPE MASS SHAPE IRREGULAR MARGINS SPICULATED
+    ASSESSMENT 4
+    SUBTLETY 3
+    PATHOLOGY MALIGNANT
+    TOTAL_OUTLINES 2
+    BOUNDARY
+    1652 2452 4 4 4 5 5 ... 3 2 #
+    CORE
+    1700 2500 4 4 5 ... 2 #
+
+  There may be several LESION_TYPE lines per abnormality, and each
+  abnormality has exactly one BOUNDARY and zero or more COREs.
+*/
+
+#ifndef DDSMOVERLAY_H
+#define DDSMOVERLAY_H
+
+#include <istream>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// The row and column offsets of the eight chain code directions:
+// direction 0 is up, 2 is right, 4 is down and 6 is left, and the odd
+// directions are the diagonals between them.
+const int chainCodeRowSteps[8] = {-1, -1, 0, 1, 1, 1, 0, -1};
+const int chainCodeColSteps[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+
+// An outline (a boundary or a core) drawn around an abnormality: the
+// column and row at which it starts (as recorded in the file) and the
+// direction (0 to 7) of each step from there.
+struct ChainCode
+{
+  int startCol;
+  int startRow;
+  std::vector<unsigned char> directions;
+};
+
+// One abnormality. Fields that the file did not record are -1 or
+// empty.
+struct Abnormality
+{
+  int number; // As given on the ABNORMALITY line.
+  std::vector<std::string> lesionTypes;
+  int assessment;
+  int subtlety;
+  std::string pathology;
+  int totalOutlines;
+  bool hasBoundary;
+  ChainCode boundary;
+  std::vector<ChainCode> cores;
+};
+
+// The contents of an OVERLAY file.
+struct Overlay
+{
+  int totalAbnormalities;
+  std::vector<Abnormality> abnormalities;
+};
+
+// Parse the integer that follows a keyword on a line (e.g. the 4 in
+// "ASSESSMENT 4"). Returns true on success.
+inline bool parseOverlayInteger(const std::string& line, const size_t keywordLength, int* value)
+{
+  const char* start = line.c_str() + keywordLength;
+  char* end = NULL;
+  const long parsed = strtol(start, &end, 10);
+  if(end == start || parsed < 0 || parsed > 1000000)
+    {
+      return false;
+    }
+  while(*end == ' ' || *end == '\t')
+    {
+      end++;
+    }
+
+  *value = static_cast<int>(parsed);
+  return *end == '\0';
+}
+
+// The text that follows a keyword on a line, without surrounding
+// whitespace.
+inline std::string overlayText(const std::string& line, const size_t keywordLength)
+{
+  const size_t start = line.find_first_not_of(" \t", keywordLength);
+  if(start == std::string::npos)
+    {
+      return "";
+    }
+
+  return line.substr(start, line.find_last_not_of(" \t") - start + 1);
+}
+
+// Whether a line starts with a keyword followed by whitespace or the
+// end of the line.
+inline bool isOverlayKeyword(const std::string& line, const char* keyword, const size_t keywordLength)
+{
+  return line.compare(0, keywordLength, keyword) == 0
+    && (line.size() == keywordLength || line[keywordLength] == ' ' || line[keywordLength] == '\t');
+}
+
+// Parse (more of) a chain code from a line. A chain code is the start
+// column and row followed by the directions and then "#"; it is
+// normally all on one line, but we let it continue over several.
+// numbersRead counts the numbers read so far (so we know when we are
+// reading the start column and row) and finished is set when the "#"
+// is reached. Returns false if the line holds anything else.
+inline bool parseChainCode(const std::string& line, ChainCode* chainCode, int* numbersRead, bool* finished)
+{
+  const char* p = line.c_str();
+  while(*p != '\0')
+    {
+      if(*p == ' ' || *p == '\t')
+	{
+	  p++;
+	}
+      else if(*p == '#')
+	{
+	  // Nothing but whitespace may follow the "#".
+	  *finished = true;
+	  for(p++; *p == ' ' || *p == '\t'; p++)
+	    {
+	    }
+	  return *p == '\0' && *numbersRead >= 2;
+	}
+      else if(*numbersRead < 2)
+	{
+	  char* end = NULL;
+	  const long value = strtol(p, &end, 10);
+	  if(end == p || value < 0 || value > 1000000)
+	    {
+	      return false;
+	    }
+	  if(*numbersRead == 0)
+	    {
+	      chainCode->startCol = static_cast<int>(value);
+	    }
+	  else
+	    {
+	      chainCode->startRow = static_cast<int>(value);
+	    }
+	  (*numbersRead)++;
+	  p = end;
+	}
+      else
+	{
+	  // Directions are single digits, separated by whitespace.
+	  if(*p < '0' || *p > '7' || (p[1] != ' ' && p[1] != '\t' && p[1] != '#' && p[1] != '\0'))
+	    {
+	      return false;
+	    }
+	  chainCode->directions.push_back(static_cast<unsigned char>(*p - '0'));
+	  (*numbersRead)++;
+	  p++;
+	}
+    }
+
+  return true;
+}
+
+// Parse an OVERLAY file from a stream, one line at a time. Returns
+// true on success; on failure, if errorLine is not NULL it is set to
+// the number (counting from 1) of the line that could not be parsed,
+// or to 0 if the file as a whole is inconsistent (e.g. it has fewer
+// abnormalities than it says, or an abnormality has no boundary).
+inline bool parseOverlay(std::istream& input, Overlay* overlay, int* errorLine)
+{
+  overlay->totalAbnormalities = -1;
+  overlay->abnormalities.clear();
+
+  // The chain code we are reading, if any.
+  ChainCode* chainCode = NULL;
+  int numbersRead = 0;
+  bool finished = false;
+
+  std::string line;
+  int lineNumber = 0;
+  bool ok = true;
+  while(ok && std::getline(input, line))
+    {
+      lineNumber++;
+
+      // Strip leading and trailing whitespace (including the carriage
+      // returns of files that have been through Windows).
+      const size_t start = line.find_first_not_of(" \t\r");
+      if(start == std::string::npos)
+	{
+	  continue;
+	}
+      line = line.substr(start, line.find_last_not_of(" \t\r") - start + 1);
+
+      Abnormality* abnormality = overlay->abnormalities.empty() ? NULL : &overlay->abnormalities.back();
+      if(NULL != chainCode)
+	{
+	  ok = parseChainCode(line, chainCode, &numbersRead, &finished);
+	  chainCode = finished ? NULL : chainCode;
+	}
+      else if(isOverlayKeyword(line, "TOTAL_ABNORMALITIES", 19))
+	{
+	  ok = parseOverlayInteger(line, 19, &overlay->totalAbnormalities);
+	}
+      else if(isOverlayKeyword(line, "ABNORMALITY", 11))
+	{
+	  Abnormality next;
+	  next.assessment = -1;
+	  next.subtlety = -1;
+	  next.totalOutlines = -1;
+	  next.hasBoundary = false;
+	  ok = parseOverlayInteger(line, 11, &next.number);
+	  overlay->abnormalities.push_back(next);
+	}
+      else if(NULL == abnormality)
+	{
+	  // Anything else must belong to an abnormality.
+	  ok = false;
+	}
+      else if(isOverlayKeyword(line, "LESION_TYPE", 11))
+	{
+	  abnormality->lesionTypes.push_back(overlayText(line, 11));
+	}
+      else if(isOverlayKeyword(line, "ASSESSMENT", 10))
+	{
+	  ok = parseOverlayInteger(line, 10, &abnormality->assessment);
+	}
+      else if(isOverlayKeyword(line, "SUBTLETY", 8))
+	{
+	  ok = parseOverlayInteger(line, 8, &abnormality->subtlety);
+	}
+      else if(isOverlayKeyword(line, "PATHOLOGY", 9))
+	{
+	  abnormality->pathology = overlayText(line, 9);
+	}
+      else if(isOverlayKeyword(line, "TOTAL_OUTLINES", 14))
+	{
+	  ok = parseOverlayInteger(line, 14, &abnormality->totalOutlines);
+	}
+      else if(line == "BOUNDARY" || line == "CORE")
+	{
+	  // The chain code starts on the next line.
+	  if(line == "BOUNDARY")
+	    {
+	      ok = !abnormality->hasBoundary;
+	      abnormality->hasBoundary = true;
+	      chainCode = &abnormality->boundary;
+	    }
+	  else
+	    {
+	      abnormality->cores.push_back(ChainCode());
+	      chainCode = &abnormality->cores.back();
+	    }
+	  chainCode->startCol = -1;
+	  chainCode->startRow = -1;
+	  chainCode->directions.clear();
+	  numbersRead = 0;
+	  finished = false;
+	}
+      // We ignore any other lines, as get_ddsm_groundtruth.m does.
+    }
+
+  if(!ok || input.bad())
+    {
+      if(NULL != errorLine)
+	{
+	  *errorLine = lineNumber;
+	}
+      return false;
+    }
+
+  // Check that the file is complete.
+  ok = (NULL == chainCode)
+    && overlay->totalAbnormalities == static_cast<int>(overlay->abnormalities.size());
+  for(size_t i = 0; i < overlay->abnormalities.size() && ok; i++)
+    {
+      ok = overlay->abnormalities[i].hasBoundary;
+    }
+  if(!ok && NULL != errorLine)
+    {
+      *errorLine = 0;
+    }
+
+  return ok;
+}
+
+// Parse an OVERLAY file. Returns true on success; see parseOverlay()
+// for errorLine.
+inline bool readOverlayFile(const std::string& overlayFile, Overlay* overlay, int* errorLine)
+{
+  std::ifstream input(overlayFile.c_str());
+  if(!input)
+    {
+      if(NULL != errorLine)
+	{
+	  *errorLine = 0;
+	}
+      return false;
+    }
+
+  return parseOverlay(input, overlay, errorLine);
+}
+
+// Geometric features of an outline, computed from its chain code
+// alone (so in time proportional to its length, without making its
+// mask). The outline is taken to be the polygon through the centres of
+// the pixels that the chain code visits, closed by joining the last
+// pixel to the first if the chain code doesn't return there itself.
+struct OutlineFeatures
+{
+  double area; // The area of the polygon, by Green's theorem.
+  double numPixels; // The number of pixels the mask of a simple outline has: by Pick's theorem, area + boundary points / 2 + 1.
+  double perimeter; // Straight steps count 1 and diagonal ones sqrt(2).
+  double centroidRow; // The centroid of the polygon.
+  double centroidCol;
+  int top; // The bounding box of the pixels visited.
+  int left;
+  int bottom;
+  int right;
+  double compactness; // 4 pi area / perimeter^2: 1 for a circle, less for anything else.
+};
+
+// Compute the geometric features of an outline.
+inline void computeOutlineFeatures(const ChainCode& chainCode, OutlineFeatures* features)
+{
+  int row = chainCode.startRow;
+  int col = chainCode.startCol;
+  features->top = features->bottom = row;
+  features->left = features->right = col;
+
+  // Accumulate twice the signed area and the first moments of the
+  // polygon one edge at a time (the shoelace formula), along with the
+  // numbers of straight and diagonal steps.
+  double twiceArea = 0.0;
+  double rowMoment = 0.0;
+  double colMoment = 0.0;
+  double sumRows = row;
+  double sumCols = col;
+  unsigned int numStraightSteps = 0;
+  unsigned int numDiagonalSteps = 0;
+  int lastRow = row; // The pixel the chain code ends at.
+  int lastCol = col;
+  const size_t numSteps = chainCode.directions.size();
+  for(size_t i = 0; i <= numSteps; i++)
+    {
+      // The last edge closes the polygon.
+      const int nextRow = (i < numSteps) ? row + chainCodeRowSteps[chainCode.directions[i]] : chainCode.startRow;
+      const int nextCol = (i < numSteps) ? col + chainCodeColSteps[chainCode.directions[i]] : chainCode.startCol;
+      const double cross = static_cast<double>(col) * nextRow - static_cast<double>(nextCol) * row;
+      twiceArea += cross;
+      rowMoment += (row + nextRow) * cross;
+      colMoment += (col + nextCol) * cross;
+      if(i < numSteps)
+	{
+	  ((chainCode.directions[i] & 1) ? numDiagonalSteps : numStraightSteps)++;
+	  sumRows += nextRow;
+	  sumCols += nextCol;
+	  features->top = std::min(features->top, nextRow);
+	  features->bottom = std::max(features->bottom, nextRow);
+	  features->left = std::min(features->left, nextCol);
+	  features->right = std::max(features->right, nextCol);
+	  lastRow = nextRow;
+	  lastCol = nextCol;
+	}
+      row = nextRow;
+      col = nextCol;
+    }
+
+  // The edge that closes the polygon is usually of length 0. Its
+  // lattice points (other than its first) are boundary points too: as
+  // many as the gcd of its extents.
+  const int closingRows = abs(lastRow - chainCode.startRow);
+  const int closingCols = abs(lastCol - chainCode.startCol);
+  const double closingLength = sqrt(static_cast<double>(closingRows) * closingRows + static_cast<double>(closingCols) * closingCols);
+  int closingPoints = closingRows;
+  for(int b = closingCols; b != 0; )
+    {
+      const int remainder = closingPoints % b;
+      closingPoints = b;
+      b = remainder;
+    }
+  features->area = fabs(twiceArea) / 2.0;
+  features->numPixels = features->area + (numSteps + closingPoints) / 2.0 + 1.0;
+  features->perimeter = numStraightSteps + sqrt(2.0) * numDiagonalSteps + closingLength;
+  if(twiceArea != 0.0)
+    {
+      features->centroidRow = rowMoment / (3.0 * twiceArea);
+      features->centroidCol = colMoment / (3.0 * twiceArea);
+    }
+  else
+    {
+      // The polygon has no area, so use the mean of its vertices.
+      features->centroidRow = sumRows / (numSteps + 1);
+      features->centroidCol = sumCols / (numSteps + 1);
+    }
+  features->compactness = (features->perimeter > 0.0) ? 4.0 * M_PI * features->area / (features->perimeter * features->perimeter) : 0.0;
+}
+
+#endif // DDSMOVERLAY_H
@@ -0,0 +1,573 @@
+/*
+  The following is very brief; full program documentation can be found
+  by compiling this program as described and running it without
+  arguments, or by reading the displayProgramHelp() function.
+
+  This program cuts fixed-size patches out of DDSM mammograms for
+  training detection models: one centred on each abnormality (with
+  the labels of its boundary and cores) and a number of negative ones
+  sampled at random from the breast away from every abnormality. It
+  reads the raw (LJPEG.1) files and the OVERLAY files of a whole job
+  of images and writes the patches to a few large shard files (see
+  ddsmpatches.h). Only the parts of the rows that the patches cover
+  are read and calibrated; no full image is ever converted.
+
+  Compilation: Compile this file using gcc: "g++ -Wall -O2 -pthread ddsmpatches.c -o ddsmpatches"
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <set>
+#include <utility>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#include "ddsmcore.h"
+#include "ddsmoverlay.h"
+#include "ddsmmask.h"
+#include "ddsmpatches.h"
+
+// These are program error codes and messages.
+const int success = 0; // The code to return on program success.
+const int syntax_error = -1; // Exit code if the user invokes program incorrectly.
+const char* syntax_error_msg = ""; // We'll output a message manually if the program is not called correctly.
+const int program_error = -6;
+const char* program_error_msg = "Sorry, there is a problem with the program's source code!";
+const int job_file_error = -9;
+const char* job_file_error_msg = "Could not read the job file.";
+const int shard_error = -16;
+const char* shard_error_msg = "Could not write the patch shards.";
+
+// These are the optional arguments that may follow the mandatory ones.
+const std::string sizeOption = "--size"; // Takes a value.
+const std::string negativesOption = "--negatives"; // Takes a value.
+const std::string breastThresholdOption = "--breast-threshold"; // Takes a value.
+const std::string breastFractionOption = "--breast-fraction"; // Takes a value.
+const std::string seedOption = "--seed"; // Takes a value.
+const std::string shardSizeOption = "--shard-size"; // Takes a value.
+const std::string threadsOption = "--threads"; // Takes a value.
+
+// The options that the user may specify after the mandatory
+// arguments.
+struct ProgramOptions
+{
+  int patchSize; // Patches are patchSize x patchSize pixels.
+  unsigned int numNegatives; // The number of negative patches to take from each image.
+  unsigned int breastThreshold; // Calibrated grey levels at least this bright are breast rather than air.
+  double breastFraction; // The fraction of a negative patch that must be breast.
+  unsigned int seed; // Seeds the sampling of negative patches.
+  unsigned long long shardSize; // The target size of each shard, in bytes.
+  unsigned int numThreads; // The number of images to process at once.
+};
+
+// For each negative patch we want, we draw this many candidates and
+// read them all; the first ones that are enough breast are kept.
+const unsigned int negativeCandidateFactor = 4;
+
+// We give up drawing candidates that don't overlap any abnormality
+// after this many draws per candidate.
+const unsigned int maxDrawsPerCandidate = 100;
+
+
+// Display program help information.
+void displayProgramHelp()
+{
+  // We'll define the help message as an array of strings that we'll
+  // iterate over. The end of the array is marked with a special
+  // string called endString.
+  const std::string endString = "<<<END"; // Marks the end of the message.
+
+  // Here's the message array.
+  std::string
+    helpMessage[] =
+    {
+      "ddsmpatches",
+      "===========\n",
+
+      "Cut lesion-centred and negative patches out of DDSM mammograms.\n",
+
+      "This program reads the raw (LJPEG.1) file and the OVERLAY file of each image in",
+      "a job and cuts out a patch of calibrated pixels (calibrated exactly as by",
+      "ddsmraw2pnm) centred on the boundary of each abnormality, along with its labels,",
+      "and a number of negative patches sampled at random from the breast, away from",
+      "every abnormality. Only the parts of the rows that the patches cover are read",
+      "from the raw file and calibrated. The patches are packed into a few large",
+      "shard files rather than one file each.\n",
+
+      "Usage: ddsmpatches <job-file> <output-prefix> [options]\n",
+
+      "* <job-file> lists the images to process, one per line:\n",
+
+      "  <some-ddsm-raw-file> <num-rows> <num-cols> <digitizer> [<overlay-file>]\n",
+
+      "  i.e. the arguments you would give to ddsmraw2pnm, followed by the image's",
+      "  OVERLAY file; images without one (e.g. normals) give only negative patches.",
+      "  Blank lines and lines starting with '#' are ignored.\n",
+
+      "* <output-prefix> names the shards: \"<output-prefix>-00000.patches\",",
+      "  \"<output-prefix>-00001.patches\" and so on. Their names are written to",
+      "  standard output. See ddsmpatches.h for the format and for functions to read",
+      "  them.\n",
+
+      "* [options] may be any of the following:\n",
+
+      "  --size <n>                Patches are <n> x <n> pixels (from 16 to 4096; the",
+      "                            default is 256). A patch is moved as little as",
+      "                            possible to keep it inside the image; images smaller",
+      "                            than a patch are skipped.",
+      "  --negatives <n>           Take <n> negative patches from each image (the",
+      "                            default is 4).",
+      "  --breast-threshold <v>    Calibrated grey levels of at least <v> are breast",
+      "                            rather than air (the default is 4096, an optical",
+      "                            density of about 3).",
+      "  --breast-fraction <f>     At least the fraction <f> of the pixels of a negative",
+      "                            patch must be breast (the default is 0.75).",
+      "  --seed <n>                Seed the sampling of negative patches (the default is",
+      "                            1); each image's samples depend only on the seed and",
+      "                            its name.",
+      "  --shard-size <MB>         Start a new shard once a shard reaches <MB> megabytes",
+      "                            (the default is 256).",
+      "  --threads <n>             Process <n> images at once (the default is the number",
+      "                            of processors).\n",
+
+      "A positive patch is centred on the centroid of its abnormality's boundary; its",
+      "labels are 1 inside the boundary and 2 inside any of its cores. Negative patches",
+      "overlap no abnormality's bounding box and have no labels. Where an image doesn't",
+      "have enough breast for all its negative patches, fewer are taken. Each image's",
+      "patches are consecutive in the shards, but the images may be in any order.\n",
+
+      "Images that could not be processed are reported on standard error and skipped;",
+      "the program returns zero if the shards were written.",
+
+      endString
+    };
+
+  // Now print the message line by line.
+  unsigned int i = 0; // An iterator.
+  std::string thisLine = ""; // We'll change this.
+  while((thisLine = helpMessage[i]) != endString)
+    {
+      std::cout << thisLine << std::endl; // Print the line.
+      i++; // Increment iterator.
+    }
+}
+
+
+// Function that exits with an error code and a particular error
+// message.
+void exitWith(const int errorCode, const char* errorMsg)
+{
+  std::cerr << errorMsg << std::endl;
+  exit(errorCode);
+}
+
+
+// Return the name of the image that a file belongs to, i.e. its base
+// name up to (but not including) ".LJPEG" (e.g. "A_1141_1.LEFT_MLO").
+std::string getImageName(const std::string& path)
+{
+  const size_t slash = path.find_last_of("/\\");
+  std::string name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+  const size_t suffix = name.find(".LJPEG");
+  if(suffix != std::string::npos)
+    {
+      name = name.substr(0, suffix);
+    }
+
+  return name;
+}
+
+// Hash an image name (FNV-1a), so that the negative patches of an
+// image depend only on the seed and its name, not on the order in
+// which the images are processed.
+unsigned int hashImageName(const std::string& name)
+{
+  unsigned int hash = 2166136261U;
+  for(size_t i = 0; i < name.size(); i++)
+    {
+      hash = (hash ^ static_cast<unsigned char>(name[i])) * 16777619U;
+    }
+
+  return hash;
+}
+
+// Clamp the first row (or column) of a patch so that the patch lies
+// inside an image with the given number of rows (or columns).
+int clampPatchStart(const int start, const int patchSize, const int size)
+{
+  return std::max(0, std::min(start, size - patchSize));
+}
+
+// Whether two rectangles (given by their inclusive bounds) overlap.
+bool rectanglesOverlap(const int top0, const int left0, const int bottom0, const int right0,
+		       const int top1, const int left1, const int bottom1, const int right1)
+{
+  return top0 <= bottom1 && top1 <= bottom0 && left0 <= right1 && left1 <= right0;
+}
+
+// Fill in the pixels of the given patches (all of patchSize square,
+// and inside the image) from a raw file, reading and calibrating only
+// what they cover (see readCalibratedRegions()). Returns an empty
+// string on success or a description of the problem otherwise.
+std::string readPatchPixels(FILE* input,
+			    const int numCols,
+			    CalibrationFunc calibrationFunc,
+			    const int patchSize,
+			    std::vector<Patch>* patches)
+{
+  std::vector<ImageRegion> regions(patches->size());
+  for(size_t i = 0; i < patches->size(); i++)
+    {
+      (*patches)[i].pixels.assign(static_cast<size_t>(patchSize) * patchSize, 0);
+      regions[i].top = (*patches)[i].top;
+      regions[i].left = (*patches)[i].left;
+      regions[i].numRows = patchSize;
+      regions[i].numCols = patchSize;
+    }
+
+  int failedRow = 0;
+  const bool ok = readCalibratedRegions(input, numCols, calibrationFunc, regions,
+					[patches, patchSize](const size_t i, const int y, const unsigned int* pixels)
+					{
+					  std::copy(pixels, pixels + patchSize, &(*patches)[i].pixels[static_cast<size_t>(y) * patchSize]);
+					},
+					&failedRow);
+
+  return ok ? "" : "could not read or calibrate row " + std::to_string(failedRow);
+}
+
+// Set the labels of a patch of an abnormality from the masks of its
+// boundary and cores.
+void labelPatch(const Abnormality& abnormality, const int patchSize, Patch* patch)
+{
+  patch->labels.assign(static_cast<size_t>(patchSize) * patchSize, outsideLabel);
+  for(size_t j = 0; j <= abnormality.cores.size(); j++)
+    {
+      BinaryMask mask;
+      rasterizeChainCode((j == 0) ? abnormality.boundary : abnormality.cores[j - 1], evenOddFill, &mask);
+      const unsigned char label = (j == 0) ? boundaryLabel : coreLabel;
+      const int fromRow = std::max(mask.top, patch->top);
+      const int toRow = std::min(mask.top + mask.numRows, patch->top + patchSize);
+      const int fromCol = std::max(mask.left, patch->left);
+      const int toCol = std::min(mask.left + mask.numCols, patch->left + patchSize);
+      for(int row = fromRow; row < toRow; row++)
+	{
+	  for(int col = fromCol; col < toCol; col++)
+	    {
+	      if(getMaskPixel(mask, row, col))
+		{
+		  patch->labels[static_cast<size_t>(row - patch->top) * patchSize + (col - patch->left)] = label;
+		}
+	    }
+	}
+    }
+}
+
+// The fraction of the pixels of a patch that are breast.
+double getBreastFraction(const Patch& patch, const unsigned int breastThreshold)
+{
+  size_t numBreast = 0;
+  for(size_t i = 0; i < patch.pixels.size(); i++)
+    {
+      numBreast += (patch.pixels[i] >= breastThreshold) ? 1 : 0;
+    }
+
+  return patch.pixels.empty() ? 0.0 : static_cast<double>(numBreast) / patch.pixels.size();
+}
+
+// Cut the patches out of one image, given its job line. Returns an
+// empty string on success or a description of the problem otherwise.
+std::string extractPatches(const std::string& jobLine, const ProgramOptions& options, std::vector<Patch>* patches)
+{
+  std::istringstream fields(jobLine);
+  std::vector<std::string> words;
+  std::string word;
+  while(fields >> word)
+    {
+      words.push_back(word);
+    }
+  if(words.size() != 4 && words.size() != 5)
+    {
+      return "expected four or five fields";
+    }
+
+  const std::string imageName = getImageName(words[0]);
+  const int numRows = atoi(words[1].c_str());
+  const int numCols = atoi(words[2].c_str());
+  CalibrationFunc calibrationFunc = getCalibrationFunction(words[3]);
+  const int patchSize = options.patchSize;
+  if(NULL == calibrationFunc)
+    {
+      return "unknown digitizer \"" + words[3] + "\"";
+    }
+  if(numRows < patchSize || numCols < patchSize)
+    {
+      return "the image is smaller than a patch";
+    }
+
+  Overlay overlay;
+  overlay.totalAbnormalities = 0;
+  int errorLine = 0;
+  if(words.size() == 5 && !readOverlayFile(words[4], &overlay, &errorLine))
+    {
+      return "could not parse the OVERLAY file" + ((errorLine > 0) ? " (line " + std::to_string(errorLine) + ")" : std::string());
+    }
+
+  // A positive patch centred on each abnormality's boundary. We note
+  // the bounding boxes of the boundaries so that negatives avoid them.
+  patches->clear();
+  std::vector<OutlineFeatures> boundaries(overlay.abnormalities.size());
+  for(size_t i = 0; i < overlay.abnormalities.size(); i++)
+    {
+      computeOutlineFeatures(overlay.abnormalities[i].boundary, &boundaries[i]);
+      Patch patch;
+      patch.imageName = imageName;
+      patch.abnormality = static_cast<unsigned int>(overlay.abnormalities[i].number);
+      patch.top = clampPatchStart(static_cast<int>(lround(boundaries[i].centroidRow)) - patchSize / 2, patchSize, numRows);
+      patch.left = clampPatchStart(static_cast<int>(lround(boundaries[i].centroidCol)) - patchSize / 2, patchSize, numCols);
+      patches->push_back(patch);
+    }
+  const size_t numPositives = patches->size();
+
+  // Draw the candidate negative patches.
+  std::mt19937 random(options.seed ^ hashImageName(imageName));
+  std::uniform_int_distribution<int> topDistribution(0, numRows - patchSize);
+  std::uniform_int_distribution<int> leftDistribution(0, numCols - patchSize);
+  const unsigned int numCandidates = options.numNegatives * negativeCandidateFactor;
+  for(unsigned int draw = 0; draw < numCandidates * maxDrawsPerCandidate && patches->size() < numPositives + numCandidates; draw++)
+    {
+      Patch patch;
+      patch.imageName = imageName;
+      patch.abnormality = 0;
+      patch.top = topDistribution(random);
+      patch.left = leftDistribution(random);
+      bool overlaps = false;
+      for(size_t i = 0; i < boundaries.size() && !overlaps; i++)
+	{
+	  overlaps = rectanglesOverlap(patch.top, patch.left, patch.top + patchSize - 1, patch.left + patchSize - 1,
+				       boundaries[i].top, boundaries[i].left, boundaries[i].bottom, boundaries[i].right);
+	}
+      if(!overlaps)
+	{
+	  patches->push_back(patch);
+	}
+    }
+
+  // Read all the patches in one pass down the image.
+  FILE* input = fopen(words[0].c_str(), "rb");
+  if(NULL == input)
+    {
+      return "could not open the raw file";
+    }
+  std::string problem = checkRawFileSize(input, numRows, numCols) ? "" : "the raw file's size does not match the image dimensions";
+  if(problem.empty())
+    {
+      problem = readPatchPixels(input, numCols, calibrationFunc, patchSize, patches);
+    }
+  fclose(input);
+  if(!problem.empty())
+    {
+      return problem;
+    }
+
+  // Label the positives and keep the first candidates that are enough
+  // breast.
+  for(size_t i = 0; i < numPositives; i++)
+    {
+      labelPatch(overlay.abnormalities[i], patchSize, &(*patches)[i]);
+    }
+  size_t numKept = numPositives;
+  for(size_t i = numPositives; i < patches->size() && numKept < numPositives + options.numNegatives; i++)
+    {
+      if(getBreastFraction((*patches)[i], options.breastThreshold) >= options.breastFraction)
+	{
+	  (*patches)[i].labels.assign(static_cast<size_t>(patchSize) * patchSize, outsideLabel);
+	  std::swap((*patches)[numKept++], (*patches)[i]);
+	}
+    }
+  patches->resize(numKept);
+
+  return "";
+}
+
+
+// Everything the worker threads share. Each thread claims the next
+// image using the atomic counter; the shard writer and the counts are
+// protected by the mutex.
+struct JobState
+{
+  std::vector<std::string> jobLines;
+  std::atomic<size_t> nextJob;
+  ProgramOptions options;
+
+  std::mutex mutex;
+  PatchShardWriter writer;
+  unsigned int numFailures;
+  unsigned long long numPositives;
+  unsigned long long numNegatives;
+};
+
+// The body of each worker thread: claim images until there are none
+// left, adding each image's patches to the shards.
+void processJobs(JobState* state)
+{
+  std::vector<Patch> patches;
+  size_t job = 0;
+  while((job = state->nextJob++) < state->jobLines.size())
+    {
+      const std::string& jobLine = state->jobLines[job];
+      const std::string problem = extractPatches(jobLine, state->options, &patches);
+
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if(!problem.empty())
+	{
+	  std::cerr << "Skipping \"" << jobLine << "\": " << problem << "." << std::endl;
+	  state->numFailures++;
+	  continue;
+	}
+      for(size_t i = 0; i < patches.size() && state->writer.ok; i++)
+	{
+	  addPatch(&state->writer, patches[i]);
+	  ((patches[i].abnormality > 0) ? state->numPositives : state->numNegatives)++;
+	}
+    }
+}
+
+
+// Entry point.
+int main(int argc, char* argv[])
+{
+  // Do some error checking to make sure that the user invoked us
+  // properly.
+  if(argc < 3)
+    {
+      // Output some help info and then exit.
+      displayProgramHelp();
+      exitWith(syntax_error, syntax_error_msg);
+    }
+
+  const std::string jobFile = argv[1];
+  const std::string outputPrefix = argv[2];
+
+  // Read any options that follow the mandatory arguments.
+  ProgramOptions options;
+  options.patchSize = 256;
+  options.numNegatives = 4;
+  options.breastThreshold = 4096;
+  options.breastFraction = 0.75;
+  options.seed = 1;
+  options.shardSize = 256ULL << 20;
+  options.numThreads = std::thread::hardware_concurrency();
+  options.numThreads = (options.numThreads > 0) ? options.numThreads : 1;
+  for(int i = 3; i < argc; i++)
+    {
+      const std::string option = argv[i];
+      if(option.compare(sizeOption) == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 16 && atoi(argv[i + 1]) <= 4096)
+	{
+	  options.patchSize = atoi(argv[++i]);
+	}
+      else if(option.compare(negativesOption) == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0)
+	{
+	  options.numNegatives = static_cast<unsigned int>(atoi(argv[++i]));
+	}
+      else if(option.compare(breastThresholdOption) == 0 && i + 1 < argc
+	      && atoi(argv[i + 1]) >= 0 && atoi(argv[i + 1]) <= static_cast<int>(maxUnsignedIntWithNumBits))
+	{
+	  options.breastThreshold = static_cast<unsigned int>(atoi(argv[++i]));
+	}
+      else if(option.compare(breastFractionOption) == 0 && i + 1 < argc && atof(argv[i + 1]) >= 0.0 && atof(argv[i + 1]) <= 1.0)
+	{
+	  options.breastFraction = atof(argv[++i]);
+	}
+      else if(option.compare(seedOption) == 0 && i + 1 < argc)
+	{
+	  options.seed = static_cast<unsigned int>(strtoul(argv[++i], NULL, 10));
+	}
+      else if(option.compare(shardSizeOption) == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+	{
+	  options.shardSize = static_cast<unsigned long long>(atoi(argv[++i])) << 20;
+	}
+      else if(option.compare(threadsOption) == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+	{
+	  options.numThreads = static_cast<unsigned int>(atoi(argv[++i]));
+	}
+      else
+	{
+	  // Unknown option, so output some help info and then exit.
+	  displayProgramHelp();
+	  exitWith(syntax_error, syntax_error_msg);
+	}
+    }
+
+  // Check the image sets (ranges) of the calibration functions to
+  // ensure that produce output with suitable ranges.
+  if(!checkCalibrationFunctions())
+    {
+      exitWith(program_error, program_error_msg);
+    }
+
+  // Read the job lines.
+  JobState state;
+  std::ifstream jobs(jobFile.c_str());
+  if(!jobs)
+    {
+      exitWith(job_file_error, job_file_error_msg);
+    }
+  std::string line;
+  while(std::getline(jobs, line))
+    {
+      // Strip leading and trailing whitespace.
+      const size_t start = line.find_first_not_of(" \t\r\n");
+      if(start == std::string::npos || line[start] == '#')
+	{
+	  continue;
+	}
+      state.jobLines.push_back(line.substr(start, line.find_last_not_of(" \t\r\n") - start + 1));
+    }
+  if(jobs.bad())
+    {
+      exitWith(job_file_error, job_file_error_msg);
+    }
+
+  // Process the images.
+  state.nextJob = 0;
+  state.options = options;
+  state.numFailures = 0;
+  state.numPositives = 0;
+  state.numNegatives = 0;
+  openPatchShardWriter(&state.writer, outputPrefix, options.patchSize, options.shardSize);
+  std::vector<std::thread> threads;
+  for(unsigned int t = 0; t < options.numThreads; t++)
+    {
+      threads.push_back(std::thread(processJobs, &state));
+    }
+  for(unsigned int t = 0; t < threads.size(); t++)
+    {
+      threads[t].join();
+    }
+
+  if(!closePatchShardWriter(&state.writer))
+    {
+      exitWith(shard_error, shard_error_msg);
+    }
+
+  std::cerr << "Wrote " << state.numPositives << " positive and " << state.numNegatives << " negative patches from "
+	    << state.jobLines.size() - state.numFailures << " images; skipped " << state.numFailures << "." << std::endl;
+
+  // Everything's OK, so send the names of the shards to stdout.
+  for(size_t i = 0; i < state.writer.shardFiles.size(); i++)
+    {
+      std::cout << state.writer.shardFiles[i] << std::endl;
+    }
+
+  exit(success);
+}
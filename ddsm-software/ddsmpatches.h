@@ -0,0 +1,303 @@
+/*
+  DDSM patch shards: fixed-size patches of calibrated mammograms (those
+  centred on abnormalities along with their labels, and negative ones
+  sampled from the breast) packed into a few large files rather than
+  one small file per patch. Shards are written by ddsmpatches and can
+  be read with the functions below.
+
+  A set of shards is named "<prefix>-00000.patches", "<prefix>-00001.patches"
+  and so on; a new shard is started once the current one reaches the
+  target size. Each shard stands alone. Its layout is as follows; all
+  integers are unsigned and little-endian, and are 32-bit unless
+  stated otherwise (top and left are two's complement):
+
+    "DDSMPTCH"          8 bytes of magic.
+    version             Currently 1.
+    patch-size          Patches are patch-size x patch-size pixels.
+    num-patches
+    index-offset        64-bit; where the index starts.
+    patch data          For each patch: its pixels (16-bit, row by row) and
+                        then its labels (one byte per pixel, row by row).
+    index               For each patch: its 64-bit offset, the image name
+                        (its length and then its characters), the abnormality
+                        number (0 for a negative patch), and the row (top)
+                        and column (left) of the mammogram at which its
+                        top-left pixel lies.
+
+  A label is 0 outside every outline, 1 inside the boundary of the
+  patch's abnormality and 2 inside one of its cores; the labels of a
+  negative patch are all 0.
+*/
+
+#ifndef DDSMPATCHES_H
+#define DDSMPATCHES_H
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "ddsmcore.h"
+
+// The size of a shard's header, before the patch data.
+const unsigned int patchShardHeaderSize = 28;
+
+// Labels of the pixels of a patch.
+const unsigned char outsideLabel = 0;
+const unsigned char boundaryLabel = 1;
+const unsigned char coreLabel = 2;
+
+// A patch, with the pixels and labels of patchSize x patchSize
+// pixels.
+struct Patch
+{
+  std::string imageName;
+  unsigned int abnormality; // 0 for a negative patch.
+  int top;
+  int left;
+  std::vector<unsigned short> pixels;
+  std::vector<unsigned char> labels;
+};
+
+// Where a patch is in a shard, and which patch it is.
+struct PatchIndexEntry
+{
+  unsigned long long offset;
+  std::string imageName;
+  unsigned int abnormality;
+  int top;
+  int left;
+};
+
+// The state of a set of shards that is being written.
+struct PatchShardWriter
+{
+  std::string prefix;
+  int patchSize;
+  unsigned long long targetSize; // Start a new shard once a shard is at least this big.
+  unsigned int shardNumber; // The number of the current shard.
+  FILE* file; // The current shard, or NULL if none is open.
+  unsigned long long offset; // Where the next patch goes in the current shard.
+  std::vector<PatchIndexEntry> index; // Of the current shard.
+  std::vector<std::string> shardFiles; // The names of all the shards started so far.
+  bool ok; // False once anything has gone wrong.
+};
+
+// The name of shard number n of a set of shards.
+inline std::string getPatchShardFile(const std::string& prefix, const unsigned int n)
+{
+  char number[16];
+  snprintf(number, sizeof(number), "%05u", n);
+  return prefix + "-" + number + ".patches";
+}
+
+// Start writing a set of shards of patches of patchSize x patchSize
+// pixels. No file is created until the first patch is added.
+inline void openPatchShardWriter(PatchShardWriter* writer,
+				 const std::string& prefix,
+				 const int patchSize,
+				 const unsigned long long targetSize)
+{
+  writer->prefix = prefix;
+  writer->patchSize = patchSize;
+  writer->targetSize = targetSize;
+  writer->shardNumber = 0;
+  writer->file = NULL;
+  writer->offset = 0;
+  writer->index.clear();
+  writer->shardFiles.clear();
+  writer->ok = true;
+}
+
+// Finish the current shard, if there is one: write its index and fill
+// in the number of patches and the index offset in its header, and
+// close it.
+inline void finishPatchShard(PatchShardWriter* writer)
+{
+  if(NULL == writer->file)
+    {
+      return;
+    }
+
+  const unsigned long long indexOffset = writer->offset;
+  for(size_t i = 0; i < writer->index.size() && writer->ok; i++)
+    {
+      const PatchIndexEntry& entry = writer->index[i];
+      writer->ok = writeLittleEndian64(writer->file, entry.offset)
+	&& writeLittleEndian32(writer->file, static_cast<unsigned int>(entry.imageName.size()))
+	&& fwrite(entry.imageName.data(), 1, entry.imageName.size(), writer->file) == entry.imageName.size()
+	&& writeLittleEndian32(writer->file, entry.abnormality)
+	&& writeLittleEndian32(writer->file, static_cast<unsigned int>(entry.top))
+	&& writeLittleEndian32(writer->file, static_cast<unsigned int>(entry.left));
+    }
+
+  writer->ok = writer->ok
+    && (fseek(writer->file, 16, SEEK_SET) == 0)
+    && writeLittleEndian32(writer->file, static_cast<unsigned int>(writer->index.size()))
+    && writeLittleEndian64(writer->file, indexOffset);
+  writer->ok = (fclose(writer->file) == 0) && writer->ok;
+  writer->file = NULL;
+  writer->index.clear();
+  writer->shardNumber++;
+}
+
+// Add a patch to the current shard, starting a new shard first if the
+// current one has reached the target size. Returns true on success.
+inline bool addPatch(PatchShardWriter* writer, const Patch& patch)
+{
+  if(NULL != writer->file && writer->offset >= writer->targetSize)
+    {
+      finishPatchShard(writer);
+    }
+
+  if(NULL == writer->file && writer->ok)
+    {
+      writer->shardFiles.push_back(getPatchShardFile(writer->prefix, writer->shardNumber));
+      writer->file = fopen(writer->shardFiles.back().c_str(), "wb");
+      writer->ok = (NULL != writer->file)
+	&& (fwrite("DDSMPTCH", 1, 8, writer->file) == 8)
+	&& writeLittleEndian32(writer->file, 1)
+	&& writeLittleEndian32(writer->file, static_cast<unsigned int>(writer->patchSize))
+	&& writeLittleEndian32(writer->file, 0)
+	&& writeLittleEndian32(writer->file, 0)
+	&& writeLittleEndian32(writer->file, 0);
+      writer->offset = patchShardHeaderSize;
+    }
+  if(!writer->ok)
+    {
+      return false;
+    }
+
+  PatchIndexEntry entry;
+  entry.offset = writer->offset;
+  entry.imageName = patch.imageName;
+  entry.abnormality = patch.abnormality;
+  entry.top = patch.top;
+  entry.left = patch.left;
+  writer->index.push_back(entry);
+
+  // The pixels are written little-endian, whatever the machine.
+  const size_t numPixels = static_cast<size_t>(writer->patchSize) * writer->patchSize;
+  std::vector<unsigned char> bytes(2 * numPixels);
+  for(size_t i = 0; i < numPixels; i++)
+    {
+      bytes[2 * i] = static_cast<unsigned char>(patch.pixels[i] & 0xff);
+      bytes[2 * i + 1] = static_cast<unsigned char>(patch.pixels[i] >> 8);
+    }
+  writer->ok = (fwrite(&bytes[0], 1, bytes.size(), writer->file) == bytes.size())
+    && (fwrite(&patch.labels[0], 1, numPixels, writer->file) == numPixels);
+  writer->offset += 3 * numPixels;
+  return writer->ok;
+}
+
+// Finish writing a set of shards. Returns true if every shard was
+// written successfully.
+inline bool closePatchShardWriter(PatchShardWriter* writer)
+{
+  finishPatchShard(writer);
+  return writer->ok;
+}
+
+
+// A shard opened for reading.
+struct PatchShard
+{
+  FILE* file;
+  int patchSize;
+  std::vector<PatchIndexEntry> index;
+};
+
+// Open a shard and read its index. Returns true on success; on
+// failure nothing needs to be closed.
+inline bool openPatchShard(const std::string& path, PatchShard* shard)
+{
+  shard->file = fopen(path.c_str(), "rb");
+  if(NULL == shard->file)
+    {
+      return false;
+    }
+
+  char magic[8];
+  unsigned int version = 0;
+  unsigned int patchSize = 0;
+  unsigned int numPatches = 0;
+  unsigned int low = 0;
+  unsigned int high = 0;
+  bool ok = (fread(magic, 1, 8, shard->file) == 8) && (memcmp(magic, "DDSMPTCH", 8) == 0)
+    && readLittleEndian32(shard->file, &version) && version == 1
+    && readLittleEndian32(shard->file, &patchSize) && patchSize > 0 && patchSize <= 4096
+    && readLittleEndian32(shard->file, &numPatches) && numPatches < 10000000
+    && readLittleEndian32(shard->file, &low) && readLittleEndian32(shard->file, &high);
+  ok = ok && fseek(shard->file, static_cast<long>((static_cast<unsigned long long>(high) << 32) | low), SEEK_SET) == 0;
+
+  shard->patchSize = static_cast<int>(patchSize);
+  shard->index.resize(ok ? numPatches : 0);
+  for(size_t i = 0; i < shard->index.size() && ok; i++)
+    {
+      PatchIndexEntry& entry = shard->index[i];
+      unsigned int length = 0;
+      unsigned int top = 0;
+      unsigned int left = 0;
+      ok = readLittleEndian32(shard->file, &low) && readLittleEndian32(shard->file, &high)
+	&& readLittleEndian32(shard->file, &length) && length <= 1024;
+      entry.offset = (static_cast<unsigned long long>(high) << 32) | low;
+      std::vector<char> name(length + 1, '\0');
+      ok = ok && fread(&name[0], 1, length, shard->file) == length
+	&& readLittleEndian32(shard->file, &entry.abnormality)
+	&& readLittleEndian32(shard->file, &top)
+	&& readLittleEndian32(shard->file, &left);
+      entry.imageName = std::string(&name[0], length);
+      entry.top = static_cast<int>(top);
+      entry.left = static_cast<int>(left);
+    }
+
+  if(!ok)
+    {
+      fclose(shard->file);
+      shard->file = NULL;
+    }
+  return ok;
+}
+
+// Read patch i of a shard. Returns true on success.
+inline bool readPatch(PatchShard* shard, const size_t i, Patch* patch)
+{
+  if(i >= shard->index.size())
+    {
+      return false;
+    }
+
+  const PatchIndexEntry& entry = shard->index[i];
+  const size_t numPixels = static_cast<size_t>(shard->patchSize) * shard->patchSize;
+  std::vector<unsigned char> bytes(2 * numPixels);
+  patch->labels.resize(numPixels);
+  if(fseek(shard->file, static_cast<long>(entry.offset), SEEK_SET) != 0
+     || fread(&bytes[0], 1, bytes.size(), shard->file) != bytes.size()
+     || fread(&patch->labels[0], 1, numPixels, shard->file) != numPixels)
+    {
+      return false;
+    }
+
+  patch->imageName = entry.imageName;
+  patch->abnormality = entry.abnormality;
+  patch->top = entry.top;
+  patch->left = entry.left;
+  patch->pixels.resize(numPixels);
+  for(size_t p = 0; p < numPixels; p++)
+    {
+      patch->pixels[p] = static_cast<unsigned short>(bytes[2 * p] | (bytes[2 * p + 1] << 8));
+    }
+  return true;
+}
+
+// Close a shard.
+inline void closePatchShard(PatchShard* shard)
+{
+  if(NULL != shard->file)
+    {
+      fclose(shard->file);
+      shard->file = NULL;
+    }
+}
+
+#endif // DDSMPATCHES_H
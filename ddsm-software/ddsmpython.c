@@ -0,0 +1,451 @@
+/*
+  Python bindings for the DDSM conversion (see libddsm.h), so that a
+  mammogram can be read straight into a calibrated array in Python,
+  without running ddsmraw2pnm and writing (and decoding) an image file:
+
+    import ddsm, numpy
+    image = ddsm.read("A_0069_1.LEFT_CC.LJPEG.1", 4541, 3001, "howtek-mgh")
+    pixels = numpy.asarray(image) # A 4541 x 3001 uint16 array; no copy is made.
+
+  ddsm.read() returns a ddsm.Image, which owns the pixels and exports
+  them through the buffer protocol as a 2-D array of unsigned 16-bit
+  integers, so numpy.asarray(), memoryview() and torch.frombuffer()
+  all share its memory rather than copying it; the pixels live as long
+  as anything still refers to them. The file is read and calibrated
+  with the interpreter lock released, so several threads (e.g. the
+  workers of a data loader) can read images at once.
+
+  ddsm.calibrate(array, digitizer) calibrates, in place, any writable
+  buffer of raw uint16 pixels (e.g. a numpy array), also without the
+  lock.
+
+  ddsm.Loader serves images by name, decoding them ahead on a pool of
+  threads (see ddsmloader.h), to keep a training loop fed:
+
+    loader = ddsm.Loader(names, info_file="info-file.txt", root="ddsm", threads=8, downsample=2)
+    for name, image in loader:
+        pixels = numpy.asarray(image)
+
+  Images that can't be found or loaded are skipped, and described in
+  loader.failures.
+
+  Compilation: Compile this file along with the library, using gcc:
+  "g++ -Wall -O2 -pthread -fPIC -shared $(python3-config --includes) ddsmpython.c libddsm.c -o ddsm$(python3-config --extension-suffix)"
+*/
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <structmember.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "libddsm.h"
+
+// An image: numRows x numCols pixels, row by row, which the image
+// owns; they were either allocated by ddsm.read(), or belong to an
+// image served by a loader (owner).
+struct ImageObject
+{
+  PyObject_HEAD
+  ddsm_image* owner;
+  uint16_t* pixels;
+  Py_ssize_t shape[2];
+  Py_ssize_t strides[2];
+};
+
+static void imageDealloc(ImageObject* self)
+{
+  if(NULL != self->owner)
+    {
+      ddsm_image_free(self->owner);
+    }
+  else
+    {
+      free(self->pixels);
+    }
+  Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+// Export the pixels as a 2-D array of unsigned shorts (format "H").
+static int imageGetBuffer(ImageObject* self, Py_buffer* view, int flags)
+{
+  view->obj = reinterpret_cast<PyObject*>(self);
+  view->buf = self->pixels;
+  view->len = self->shape[0] * self->shape[1] * static_cast<Py_ssize_t>(sizeof(uint16_t));
+  view->readonly = 0;
+  view->itemsize = sizeof(uint16_t);
+  view->format = (flags & PyBUF_FORMAT) ? const_cast<char*>("H") : NULL;
+  view->ndim = (flags & PyBUF_ND) ? 2 : 1; // Without a shape, the consumer sees bytes.
+  view->shape = (flags & PyBUF_ND) ? self->shape : NULL;
+  view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+  view->suboffsets = NULL;
+  view->internal = NULL;
+  Py_INCREF(self);
+  return 0;
+}
+
+static PyObject* imageGetRows(ImageObject* self, void*)
+{
+  return PyLong_FromSsize_t(self->shape[0]);
+}
+
+static PyObject* imageGetCols(ImageObject* self, void*)
+{
+  return PyLong_FromSsize_t(self->shape[1]);
+}
+
+static PyBufferProcs imageBufferProcs =
+  {
+    reinterpret_cast<getbufferproc>(imageGetBuffer),
+    NULL
+  };
+
+static PyGetSetDef imageGetSet[] =
+  {
+    {const_cast<char*>("rows"), reinterpret_cast<getter>(imageGetRows), NULL, const_cast<char*>("The number of rows."), NULL},
+    {const_cast<char*>("cols"), reinterpret_cast<getter>(imageGetCols), NULL, const_cast<char*>("The number of columns."), NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+  };
+
+static PyTypeObject ImageType =
+  {
+    PyVarObject_HEAD_INIT(NULL, 0)
+  };
+
+// Raise the Python exception that corresponds to a libddsm return
+// code.
+static PyObject* raiseDdsmError(const int code)
+{
+  PyObject* type = (code == DDSM_ERROR_FILE) ? PyExc_OSError : PyExc_ValueError;
+  PyErr_SetString(type, ddsm_error_string(code));
+  return NULL;
+}
+
+// ddsm.read(path, rows, cols, digitizer, calibrate=True)
+static PyObject* ddsmRead(PyObject*, PyObject* args, PyObject* kwargs)
+{
+  static const char* keywords[] = {"path", "rows", "cols", "digitizer", "calibrate", NULL};
+  PyObject* pathBytes = NULL;
+  int numRows = 0;
+  int numCols = 0;
+  const char* digitizerName = NULL;
+  int calibrate = 1;
+  if(!PyArg_ParseTupleAndKeywords(args, kwargs, "O&iis|p", const_cast<char**>(keywords),
+				  PyUnicode_FSConverter, &pathBytes, &numRows, &numCols, &digitizerName, &calibrate))
+    {
+      return NULL;
+    }
+
+  const int digitizer = ddsm_digitizer_from_name(digitizerName);
+  if(digitizer < 0 || numRows < 1 || numCols < 1)
+    {
+      Py_DECREF(pathBytes);
+      return raiseDdsmError(DDSM_ERROR_ARGUMENT);
+    }
+
+  ImageObject* image = PyObject_New(ImageObject, &ImageType);
+  if(NULL == image)
+    {
+      Py_DECREF(pathBytes);
+      return NULL;
+    }
+  const size_t numPixels = static_cast<size_t>(numRows) * numCols;
+  image->owner = NULL;
+  image->pixels = static_cast<uint16_t*>(malloc(numPixels * sizeof(uint16_t)));
+  image->shape[0] = numRows;
+  image->shape[1] = numCols;
+  image->strides[0] = static_cast<Py_ssize_t>(numCols * sizeof(uint16_t));
+  image->strides[1] = sizeof(uint16_t);
+  if(NULL == image->pixels)
+    {
+      Py_DECREF(pathBytes);
+      Py_DECREF(image);
+      return PyErr_NoMemory();
+    }
+
+  int status = DDSM_OK;
+  const char* path = PyBytes_AS_STRING(pathBytes);
+  Py_BEGIN_ALLOW_THREADS
+  status = ddsm_decode_raw(path, numRows, numCols, image->pixels);
+  if(status == DDSM_OK && calibrate)
+    {
+      status = ddsm_calibrate(image->pixels, numPixels, digitizer);
+    }
+  Py_END_ALLOW_THREADS
+  Py_DECREF(pathBytes);
+
+  if(status != DDSM_OK)
+    {
+      Py_DECREF(image);
+      return raiseDdsmError(status);
+    }
+  return reinterpret_cast<PyObject*>(image);
+}
+
+// ddsm.calibrate(buffer, digitizer)
+static PyObject* ddsmCalibrate(PyObject*, PyObject* args)
+{
+  Py_buffer view;
+  const char* digitizerName = NULL;
+  if(!PyArg_ParseTuple(args, "w*s", &view, &digitizerName))
+    {
+      return NULL;
+    }
+
+  // The buffer must hold contiguous unsigned shorts.
+  const int digitizer = ddsm_digitizer_from_name(digitizerName);
+  if(digitizer < 0 || view.itemsize != sizeof(uint16_t) || view.len % sizeof(uint16_t) != 0
+     || !PyBuffer_IsContiguous(&view, 'A')
+     || (NULL != view.format && strcmp(view.format, "H") != 0 && strcmp(view.format, "<H") != 0 && strcmp(view.format, "=H") != 0))
+    {
+      PyBuffer_Release(&view);
+      return raiseDdsmError(DDSM_ERROR_ARGUMENT);
+    }
+
+  int status = DDSM_OK;
+  Py_BEGIN_ALLOW_THREADS
+  status = ddsm_calibrate(static_cast<uint16_t*>(view.buf), static_cast<size_t>(view.len) / sizeof(uint16_t), digitizer);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&view);
+
+  if(status != DDSM_OK)
+    {
+      return raiseDdsmError(status);
+    }
+  Py_RETURN_NONE;
+}
+
+// A loader, and the problems with the images it has skipped.
+struct LoaderObject
+{
+  PyObject_HEAD
+  ddsm_loader* loader;
+  PyObject* failures; // A list of strings.
+};
+
+static PyTypeObject LoaderType =
+  {
+    PyVarObject_HEAD_INIT(NULL, 0)
+  };
+
+static PyMemberDef loaderMembers[] =
+  {
+    {const_cast<char*>("failures"), T_OBJECT_EX, offsetof(LoaderObject, failures), READONLY,
+     const_cast<char*>("Descriptions of the images that were skipped.")},
+    {NULL, 0, 0, 0, NULL}
+  };
+
+// ddsm.Loader(names, info_file="info-file.txt", root=".", threads=4,
+// ahead=8, memory_budget=2**30, downsample=0, shuffle=True, seed=0)
+static int loaderInit(LoaderObject* self, PyObject* args, PyObject* kwargs)
+{
+  static const char* keywords[] = {"names", "info_file", "root", "threads", "ahead", "memory_budget",
+				   "downsample", "shuffle", "seed", NULL};
+  PyObject* namesObject = NULL;
+  const char* infoFile = "info-file.txt";
+  const char* root = ".";
+  int numThreads = 4;
+  int numAhead = 8;
+  unsigned long long memoryBudget = 1ULL << 30;
+  int downsampleLevels = 0;
+  int shuffle = 1;
+  unsigned int seed = 0;
+  if(!PyArg_ParseTupleAndKeywords(args, kwargs, "O|ssiiKipI", const_cast<char**>(keywords), &namesObject, &infoFile, &root,
+				  &numThreads, &numAhead, &memoryBudget, &downsampleLevels, &shuffle, &seed))
+    {
+      return -1;
+    }
+
+  PyObject* sequence = PySequence_Fast(namesObject, "names must be a sequence of image names");
+  if(NULL == sequence)
+    {
+      return -1;
+    }
+  std::vector<const char*> names;
+  for(Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(sequence); i++)
+    {
+      const char* name = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(sequence, i));
+      if(NULL == name)
+	{
+	  Py_DECREF(sequence);
+	  return -1;
+	}
+      names.push_back(name);
+    }
+
+  ddsm_loader_close(self->loader);
+  self->loader = NULL;
+  int status = DDSM_OK;
+  Py_BEGIN_ALLOW_THREADS
+  status = ddsm_loader_open(infoFile, root, names.empty() ? NULL : &names[0], names.size(), numThreads, numAhead,
+			    static_cast<size_t>(memoryBudget), downsampleLevels, shuffle, seed, &self->loader);
+  Py_END_ALLOW_THREADS
+  Py_DECREF(sequence);
+  if(status != DDSM_OK)
+    {
+      self->loader = NULL;
+      raiseDdsmError(status);
+      return -1;
+    }
+
+  Py_XDECREF(self->failures);
+  self->failures = PyList_New(0);
+  for(size_t i = 0; i < ddsm_loader_num_failures(self->loader) && NULL != self->failures; i++)
+    {
+      PyObject* failure = PyUnicode_FromString(ddsm_loader_failure(self->loader, i));
+      if(NULL == failure || PyList_Append(self->failures, failure) < 0)
+	{
+	  Py_XDECREF(failure);
+	  return -1;
+	}
+      Py_DECREF(failure);
+    }
+  return (NULL == self->failures) ? -1 : 0;
+}
+
+static void loaderDealloc(LoaderObject* self)
+{
+  Py_BEGIN_ALLOW_THREADS
+  ddsm_loader_close(self->loader);
+  Py_END_ALLOW_THREADS
+  Py_XDECREF(self->failures);
+  Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+}
+
+static Py_ssize_t loaderLength(LoaderObject* self)
+{
+  return (NULL == self->loader) ? 0 : static_cast<Py_ssize_t>(ddsm_loader_num_images(self->loader));
+}
+
+// Serve the next image that could be loaded, as a (name, Image) pair,
+// waiting for it without the interpreter lock.
+static PyObject* loaderNext(LoaderObject* self)
+{
+  while(NULL != self->loader)
+    {
+      ddsm_image* served = NULL;
+      int status = DDSM_OK;
+      Py_BEGIN_ALLOW_THREADS
+      status = ddsm_loader_next(self->loader, &served);
+      Py_END_ALLOW_THREADS
+      if(status == DDSM_END)
+	{
+	  return NULL; // Stops the iteration.
+	}
+      if(status != DDSM_OK)
+	{
+	  PyObject* failure = PyUnicode_FromString(ddsm_image_problem(served));
+	  ddsm_image_free(served);
+	  if(NULL == failure || PyList_Append(self->failures, failure) < 0)
+	    {
+	      Py_XDECREF(failure);
+	      return NULL;
+	    }
+	  Py_DECREF(failure);
+	  continue;
+	}
+
+      ImageObject* image = PyObject_New(ImageObject, &ImageType);
+      if(NULL == image)
+	{
+	  ddsm_image_free(served);
+	  return NULL;
+	}
+      image->owner = served;
+      image->pixels = ddsm_image_pixels(served);
+      image->shape[0] = ddsm_image_rows(served);
+      image->shape[1] = ddsm_image_cols(served);
+      image->strides[0] = static_cast<Py_ssize_t>(image->shape[1] * sizeof(uint16_t));
+      image->strides[1] = sizeof(uint16_t);
+      return Py_BuildValue("(sN)", ddsm_image_name(served), reinterpret_cast<PyObject*>(image));
+    }
+
+  return NULL;
+}
+
+static PySequenceMethods loaderSequenceMethods =
+  {
+    reinterpret_cast<lenfunc>(loaderLength)
+  };
+
+static PyMethodDef ddsmMethods[] =
+  {
+    {"read", reinterpret_cast<PyCFunction>(reinterpret_cast<void (*)(void)>(ddsmRead)), METH_VARARGS | METH_KEYWORDS,
+     "read(path, rows, cols, digitizer, calibrate=True)\n\n"
+     "Read a raw (\"LJPEG.1\") file of rows x cols pixels and, unless calibrate\n"
+     "is False, calibrate it for the digitizer (\"dba\", \"howtek-mgh\",\n"
+     "\"howtek-ismd\" or \"lumisys\") as ddsmraw2pnm does. Returns an Image,\n"
+     "which numpy.asarray() turns into a uint16 array without copying it."},
+    {"calibrate", ddsmCalibrate, METH_VARARGS,
+     "calibrate(buffer, digitizer)\n\n"
+     "Calibrate a writable, contiguous buffer of raw uint16 pixels in place."},
+    {NULL, NULL, 0, NULL}
+  };
+
+static PyModuleDef ddsmModule =
+  {
+    PyModuleDef_HEAD_INIT,
+    "ddsm",
+    "Read and calibrate DDSM mammograms (see ddsmraw2pnm).",
+    -1,
+    ddsmMethods,
+    NULL, NULL, NULL, NULL
+  };
+
+PyMODINIT_FUNC PyInit_ddsm(void)
+{
+  ImageType.tp_name = "ddsm.Image";
+  ImageType.tp_basicsize = sizeof(ImageObject);
+  ImageType.tp_dealloc = reinterpret_cast<destructor>(imageDealloc);
+  ImageType.tp_flags = Py_TPFLAGS_DEFAULT;
+  ImageType.tp_doc = "A calibrated mammogram; use numpy.asarray() (or memoryview()) to get at its pixels.";
+  ImageType.tp_as_buffer = &imageBufferProcs;
+  ImageType.tp_getset = imageGetSet;
+  if(PyType_Ready(&ImageType) < 0)
+    {
+      return NULL;
+    }
+
+  LoaderType.tp_name = "ddsm.Loader";
+  LoaderType.tp_basicsize = sizeof(LoaderObject);
+  LoaderType.tp_dealloc = reinterpret_cast<destructor>(loaderDealloc);
+  LoaderType.tp_flags = Py_TPFLAGS_DEFAULT;
+  LoaderType.tp_doc =
+    "Loader(names, info_file=\"info-file.txt\", root=\".\", threads=4, ahead=8, memory_budget=2**30,\n"
+    "       downsample=0, shuffle=True, seed=0)\n\n"
+    "Iterate over (name, Image) pairs for the named images, decoded ahead on\n"
+    "threads; see ddsmloader.h.";
+  LoaderType.tp_new = PyType_GenericNew;
+  LoaderType.tp_init = reinterpret_cast<initproc>(loaderInit);
+  LoaderType.tp_iter = PyObject_SelfIter;
+  LoaderType.tp_iternext = reinterpret_cast<iternextfunc>(loaderNext);
+  LoaderType.tp_members = loaderMembers;
+  LoaderType.tp_as_sequence = &loaderSequenceMethods;
+  if(PyType_Ready(&LoaderType) < 0)
+    {
+      return NULL;
+    }
+
+  PyObject* module = PyModule_Create(&ddsmModule);
+  if(NULL == module)
+    {
+      return NULL;
+    }
+  Py_INCREF(&ImageType);
+  if(PyModule_AddObject(module, "Image", reinterpret_cast<PyObject*>(&ImageType)) < 0)
+    {
+      Py_DECREF(&ImageType);
+      Py_DECREF(module);
+      return NULL;
+    }
+  Py_INCREF(&LoaderType);
+  if(PyModule_AddObject(module, "Loader", reinterpret_cast<PyObject*>(&LoaderType)) < 0)
+    {
+      Py_DECREF(&LoaderType);
+      Py_DECREF(module);
+      return NULL;
+    }
+  return module;
+}
@@ -8,9 +8,11 @@
   format (see http://netpbm.sourceforge.net/doc/pgm.html as of 15 Dec
   2005); from this format you should be able to convert the image to
   an actual standard image file format (e.g. by using the ImageMagick
-  'convert' program: convert -depth 16 infile.pnm outfile.png)!
+  'convert' program: convert -depth 16 infile.pnm outfile.png)! To
+  convert in-process, on buffers rather than files, use the libddsm
+  library instead (see libddsm.h).
 
-  Compilation: Compile this file using gcc: "g++ -Wall -O2 ddsmraw2pnm.c -o ddsmraw2pnm"
+  Compilation: Compile this file using gcc: "g++ -Wall -O2 -pthread ddsmraw2pnm.c -o ddsmraw2pnm"
 */
 
 #include <iostream>
@@ -18,6 +20,22 @@
 #include <cstdlib>
 #include <cstdio>
 #include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "ddsmcore.h"
+#include "ddsmtiles.h"
 
 // These are program error codes and messages.
 const int success = 0; // The code to return on program success.
@@ -34,25 +52,306 @@ const char* pnm_error_msg = "Could not create the PNM file.";
 const int program_error = -6;
 const char* program_error_msg = "Sorry, there is a problem with the program's source code!";
 const int image_size_error = -7; // Used to indicate the specified number of rows and cols seems to be wrong given size of the input file.
+const int histogram_error = -8;
+const char* histogram_error_msg = "Could not write the histogram file.";
+const int tiled_error = -9;
+const char* tiled_error_msg = "Could not write the tiled image file.";
+const int roi_error = -17;
+const char* roi_error_msg = "Each region of interest must lie inside the image.";
 
 // This is the suffix applied to the input filename to create the outfile filename.
 const std::string outputSuffix = "-ddsmraw2pnm.pnm";
 
-// Define the three digitizer names.
-const std::string dba = "dba";
-const std::string howtek_mgh = "howtek-mgh";
-const std::string howtek_ismd = "howtek-ismd";
-const std::string lumisys = "lumisys";
+// This is the suffix applied to the output filename to create the
+// histogram (sidecar) filename.
+const std::string histogramSuffix = ".hist";
+
+// This is inserted between the input filename and ".pnm" (followed
+// by the level number) to create the filenames of the pyramid levels.
+const std::string pyramidLevelInfix = "-ddsmraw2pnm-level";
+
+// This is the suffix applied to the input filename to create the
+// tiled image filename.
+const std::string tiledSuffix = "-ddsmraw2pnm.tiles";
+
+// This is inserted between the input filename and ".pnm" (followed
+// by the region's number) to create the filenames of the regions of
+// interest.
+const std::string roiInfix = "-ddsmraw2pnm-roi";
+
+// These are the optional arguments that may follow the four
+// mandatory ones.
+const std::string perfCountersOption = "--perf-counters";
+const std::string histogramOption = "--histogram";
+const std::string threadsOption = "--threads"; // Takes a value.
+const std::string pyramidOption = "--pyramid"; // Takes a value.
+const std::string tiledOption = "--tiled"; // Takes a value.
+const std::string roiOption = "--roi"; // Takes a value.
+const std::string roiFileOption = "--roi-file"; // Takes a value.
+const std::string cropOption = "--crop";
+const std::string cropThresholdOption = "--crop-threshold"; // Takes a value.
+const std::string cropMarginOption = "--crop-margin"; // Takes a value.
+const std::string outputOption = "--output"; // Takes a value.
+
+// The file name that stands for standard input (as the input file) or
+// standard output (as the output file).
+const std::string standardStreamName = "-";
+
+// The options that the user may specify after the mandatory
+// arguments. They all default to off (and one thread).
+struct ProgramOptions
+{
+  bool perfCounters; // Report hardware performance counters for each kernel.
+  bool histogram; // Write raw and calibrated histograms to a sidecar file.
+  unsigned int numThreads; // The number of threads used to calibrate each band of rows.
+  unsigned int numPyramidLevels; // The number of downsampled levels to write (0 for none).
+  int tileSize; // The tile size for the tiled image file (0 for no tiled image file).
+  std::vector<ImageRegion> rois; // The regions of interest to convert instead of the whole image.
+  bool crop; // Convert only the bounding box of the breast.
+  int cropThreshold; // The grey level that separates breast from air (-1 to choose it automatically).
+  int cropMargin; // How far to widen the bounding box of the breast on each side.
+  std::string outputFile; // The PNM file to write ("-" for standard output), or empty for the default.
+};
+
+// We read and calibrate the image in bands of this many rows; the
+// rows of a band are shared between the calibration threads.
+const int numBandRows = 64;
+
+
+// Hardware performance counters. When the user asks for them (using
+// the --perf-counters option), we count events separately for each of
+// the "kernels" that make up the conversion (i.e. unpacking the raw
+// byte pairs, calibrating the pixel values and encoding the PNM
+// text), so that we can see where the time goes and whether changes
+// to those kernels actually help. We use the Linux perf_event_open
+// system call directly so that no external tools are needed.
+
+// Identify the events we count. The task clock is a software event
+// and so is almost always available (even inside virtual machines);
+// the others are hardware events, which may not be.
+enum PerfEvent
+  {
+    taskClockEvent = 0, // Nanoseconds spent running the kernel.
+    cyclesEvent,
+    instructionsEvent,
+    cacheMissesEvent,
+    branchMissesEvent,
+    numPerfEvents
+  };
+
+// Identify the kernels we count events for.
+enum ConversionKernel
+  {
+    unpackKernel = 0, // Turn raw byte pairs into pixel values.
+    calibrateKernel, // Apply the digitizer calibration function.
+    encodeKernel, // Write the PNM text.
+    pyramidKernel, // Downsample and encode the pyramid levels.
+    tileKernel, // Compress and write the tiles of the tiled image.
+    numConversionKernels
+  };
+const char* conversionKernelNames[numConversionKernels] = {"unpack", "calibrate", "encode", "pyramid", "tile"};
+
+// The counters for one kernel. All of the events that could be opened
+// are in a single group (led by the task clock event) so that they
+// are always scheduled onto the hardware together.
+struct PerfCounterGroup
+{
+  int fds[numPerfEvents]; // File descriptors; -1 if the event could not be opened.
+  int leaderFd; // The group leader (i.e. fds[taskClockEvent]), or -1.
+  double values[numPerfEvents]; // Counts, filled in by readPerfCounterGroup().
+  bool valid[numPerfEvents]; // Whether values[i] is meaningful.
+};
+
+#ifdef __linux__
+// Open a single counter for this process (on any CPU), excluding
+// events that occur in the kernel. Returns -1 on failure.
+int openPerfCounter(const unsigned int type, const unsigned long long config, const int groupFd)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = (groupFd == -1) ? 1 : 0; // Only the leader starts disabled.
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, groupFd, 0));
+}
+#endif
+
+// Open the counters for one kernel. Returns true if at least the
+// group leader could be opened, false otherwise (in which case errno
+// says why).
+bool openPerfCounterGroup(PerfCounterGroup* group)
+{
+  for(unsigned int i = 0; i < numPerfEvents; i++)
+    {
+      group->fds[i] = -1;
+      group->values[i] = 0.0;
+      group->valid[i] = false;
+    }
+  group->leaderFd = -1;
+
+#ifdef __linux__
+  group->leaderFd = openPerfCounter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, -1);
+  if(group->leaderFd == -1)
+    {
+      return false;
+    }
+  group->fds[taskClockEvent] = group->leaderFd;
+
+  // The hardware events are optional; we simply report them as not
+  // available if they can't be opened.
+  group->fds[cyclesEvent] = openPerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, group->leaderFd);
+  group->fds[instructionsEvent] = openPerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, group->leaderFd);
+  group->fds[cacheMissesEvent] = openPerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, group->leaderFd);
+  group->fds[branchMissesEvent] = openPerfCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, group->leaderFd);
+  return true;
+#else
+  errno = ENOSYS;
+  return false;
+#endif
+}
+
+// Start counting events for a kernel. Does nothing if the group
+// could not be opened.
+inline void startPerfCounterGroup(PerfCounterGroup* group)
+{
+#ifdef __linux__
+  if(group->leaderFd != -1)
+    {
+      ioctl(group->leaderFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+}
+
+// Stop counting events for a kernel. Does nothing if the group could
+// not be opened.
+inline void stopPerfCounterGroup(PerfCounterGroup* group)
+{
+#ifdef __linux__
+  if(group->leaderFd != -1)
+    {
+      ioctl(group->leaderFd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+}
+
+// Read the accumulated counts for a kernel into group->values. If the
+// kernel shared the hardware with other users of the counters (so
+// that the group was only running for part of the time it was
+// enabled) the counts are scaled up accordingly.
+void readPerfCounterGroup(PerfCounterGroup* group)
+{
+#ifdef __linux__
+  if(group->leaderFd == -1)
+    {
+      return;
+    }
+
+  // The layout is: number of events, time enabled, time running, then
+  // one value per event in the order they were added to the group.
+  unsigned long long buffer[3 + numPerfEvents];
+  if(read(group->leaderFd, buffer, sizeof(buffer)) < static_cast<ssize_t>(3 * sizeof(unsigned long long)))
+    {
+      return;
+    }
+
+  const double scale = (buffer[2] > 0) ? static_cast<double>(buffer[1]) / static_cast<double>(buffer[2]) : 0.0;
+  unsigned int valueIndex = 0;
+  for(unsigned int i = 0; i < numPerfEvents && valueIndex < buffer[0]; i++)
+    {
+      if(group->fds[i] != -1)
+	{
+	  group->values[i] = scale * static_cast<double>(buffer[3 + valueIndex]);
+	  group->valid[i] = true;
+	  valueIndex++;
+	}
+    }
+#endif
+}
+
+// Close the counters for a kernel.
+void closePerfCounterGroup(PerfCounterGroup* group)
+{
+#ifdef __linux__
+  for(unsigned int i = 0; i < numPerfEvents; i++)
+    {
+      if(group->fds[i] != -1)
+	{
+	  close(group->fds[i]);
+	  group->fds[i] = -1;
+	}
+    }
+  group->leaderFd = -1;
+#endif
+}
 
-// Define the maximum Optical Density value that will map to an output
-// grey level value of 65535.
-const double maxOD = 4.0;
+// Print one column of the performance counter report: the value
+// divided by the number of megapixels, or "n/a" if the event was not
+// available.
+void printPerfCounterColumn(const bool valid, const double value, const double megapixels)
+{
+  if(valid)
+    {
+      fprintf(stderr, " %14.0f", value / megapixels);
+    }
+  else
+    {
+      fprintf(stderr, " %14s", "n/a");
+    }
+}
 
-// Define the number of bits used to represent the raw data and the
-// output data. The define the maximum unsigned integer that can be
-// represented using that number of bits.
-const unsigned int numBits = 16;
-const unsigned int maxUnsignedIntWithNumBits = 65535;
+// Print the performance counter report for all kernels (and their
+// total) to standard error; standard output is reserved for the name
+// of the output file. All counts are per megapixel.
+void reportPerfCounters(PerfCounterGroup groups[numConversionKernels], const unsigned int numPixels)
+{
+  const double megapixels = static_cast<double>(numPixels) / 1.0e6;
+  if(megapixels <= 0.0)
+    {
+      return;
+    }
+
+  // Work out the totals over all kernels; an event is only valid in
+  // the total if it was valid for every kernel.
+  PerfCounterGroup total;
+  for(unsigned int e = 0; e < numPerfEvents; e++)
+    {
+      total.values[e] = 0.0;
+      total.valid[e] = true;
+      for(unsigned int k = 0; k < numConversionKernels; k++)
+	{
+	  total.values[e] += groups[k].values[e];
+	  total.valid[e] = total.valid[e] && groups[k].valid[e];
+	}
+    }
+
+  fprintf(stderr, "Performance counters per megapixel (%.3f megapixels):\n", megapixels);
+  fprintf(stderr, "%-10s %14s %14s %14s %6s %14s %14s\n",
+	  "kernel", "task-clock-ns", "cycles", "instructions", "IPC", "cache-misses", "branch-misses");
+  for(unsigned int k = 0; k <= numConversionKernels; k++)
+    {
+      const PerfCounterGroup& group = (k < numConversionKernels) ? groups[k] : total;
+      fprintf(stderr, "%-10s", (k < numConversionKernels) ? conversionKernelNames[k] : "total");
+      printPerfCounterColumn(group.valid[taskClockEvent], group.values[taskClockEvent], megapixels);
+      printPerfCounterColumn(group.valid[cyclesEvent], group.values[cyclesEvent], megapixels);
+      printPerfCounterColumn(group.valid[instructionsEvent], group.values[instructionsEvent], megapixels);
+      if(group.valid[cyclesEvent] && group.valid[instructionsEvent] && group.values[cyclesEvent] > 0.0)
+	{
+	  fprintf(stderr, " %6.2f", group.values[instructionsEvent] / group.values[cyclesEvent]);
+	}
+      else
+	{
+	  fprintf(stderr, " %6s", "n/a");
+	}
+      printPerfCounterColumn(group.valid[cacheMissesEvent], group.values[cacheMissesEvent], megapixels);
+      printPerfCounterColumn(group.valid[branchMissesEvent], group.values[branchMissesEvent], megapixels);
+      fprintf(stderr, "\n");
+    }
+}
 
 
 // Display program help information.
@@ -82,13 +381,15 @@ void displayProgramHelp()
       "optical density for all images produced by ddsmraw2pnm; see below for more",
       "details).\n",
 
-      "Usage: ddsmraw2pnm <some-ddsm-raw-file> <num-rows> <num-cols> <digitizer>\n",
+      "Usage: ddsmraw2pnm <some-ddsm-raw-file> <num-rows> <num-cols> <digitizer> [options]\n",
 
       "* <some-ddsm-raw-file> is an \"LJPEG.1\" file produced by the DDSM's \"jpeg\"",
       "  program. On x86 Linux for example, call \"jpeg -d -s A_0069_1.LEFT_CC.LJPEG\",",
       "  where A_0069_1.LEFT_CC.LJPEG is a DDSM mammogram file. (Be careful to check",
       "  the endianness of your computer---this code was tested on Linux running on",
-      "  an x86 processor.)\n",
+      "  an x86 processor.) If it is \"-\", the raw data is read from standard input",
+      "  (e.g. a pipe), in which case the PNM file is written to standard output",
+      "  unless --output says otherwise.\n",
 
       "* <num-rows> and <num-cols> specify the dimensions of the image; these can",
       "  be obtained from the \".ics\" file for the case.\n",
@@ -97,6 +398,102 @@ void displayProgramHelp()
       "  \"lumisys\" and is used to select a normalisation function which maps",
       "  the raw grey level values in the \"LJPEG.1\" file to optical densities.\n",
 
+      "* [options] may be any of the following:\n",
+
+      "  --perf-counters  Count hardware events (using Linux's perf_event_open)",
+      "                   separately for the kernels that unpack, calibrate and",
+      "                   encode the pixels, and print cycles, instructions, IPC,",
+      "                   cache misses and branch mispredictions per megapixel to",
+      "                   standard error. Events the machine can't count (e.g. in",
+      "                   many virtual machines) are reported as \"n/a\"; see",
+      "                   /proc/sys/kernel/perf_event_paranoid if none can be counted.",
+      "                   Only the main thread is counted, so use this with one thread.\n",
+
+      "  --histogram      Also compute the histograms of the raw and of the calibrated",
+      "                   grey levels (in the same pass over the data) and write them to",
+      "                   \"<output-file>.hist\". This is a compact binary file; all",
+      "                   integers are unsigned, 32-bit and little-endian. It holds the",
+      "                   magic string \"DDSMHIST\", a version number (1), the number",
+      "                   of rows and cols, the digitizer name (16 bytes, padded with",
+      "                   NULs) and then the raw and calibrated histograms, each as a",
+      "                   count of non-empty bins followed by that many (grey level,",
+      "                   number of pixels) pairs.\n",
+
+      "  --threads <n>    Calibrate the image using <n> threads (the default is 1).\n",
+
+      "  --pyramid <n>    Also write <n> (from 1 to 8) downsampled versions of the image,",
+      "                   made in the same pass over the data. Level k is 2^k times",
+      "                   smaller in each direction than the full image, each of its",
+      "                   pixels being the mean of the block of 2^k x 2^k calibrated",
+      "                   pixels that it covers (blocks at the right and bottom edges",
+      "                   may be smaller, so level k has ceil(<num-rows> / 2^k) rows,",
+      "                   etc.). Level k is written to the PNM file",
+      "                   \"<some-ddsm-raw-file>-ddsmraw2pnm-level<k>.pnm\" and its name",
+      "                   is written to standard output after the full image's.\n",
+
+      "  --tiled <size>   Also write the calibrated image (and its pyramid levels, if",
+      "                   --pyramid is given) to the tiled image file",
+      "                   \"<some-ddsm-raw-file>-ddsmraw2pnm.tiles\", whose name is",
+      "                   written to standard output after the PNM files'. The image",
+      "                   is stored as independently (and losslessly) compressed tiles",
+      "                   of <size> x <size> pixels (<size> is from 8 to 4096; 256 is a",
+      "                   good choice) with an index, so that any rectangle can be read",
+      "                   by decoding only the tiles it touches; see ddsmtiles.h for the",
+      "                   format and functions to read it, or use the ddsmtiles program.\n",
+
+      "  --roi <x>,<y>,<w>,<h>",
+      "                   Convert only the region of interest <w> pixels wide and <h>",
+      "                   high whose top-left pixel is in column <x> and row <y>",
+      "                   (counting from 0), instead of the whole image. This may be",
+      "                   given several times; each region is written to its own PNM",
+      "                   file, \"<some-ddsm-raw-file>-ddsmraw2pnm-roi<n>.pnm\" for the",
+      "                   n-th region (counting from 1), whose second comment line",
+      "                   gives the region's position in the image. Only the parts of",
+      "                   the rows that the regions cover are read (by seeking in the",
+      "                   raw file) and calibrated, so the work is proportional to their",
+      "                   area. The regions' file names are written to standard output",
+      "                   in order. Regions must lie inside the image, and can't be",
+      "                   combined with --histogram, --pyramid or --tiled.\n",
+
+      "  --roi-file <file>",
+      "                   As --roi, for each line of <file> (e.g. \"1200,800,512,512\");",
+      "                   blank lines and lines starting with '#' are ignored.\n",
+
+      "  --crop           Write only the bounding box of the breast, rather than the",
+      "                   whole image (much of which is air), to the usual PNM file. A",
+      "                   first pass over the raw file finds the box: it counts, for",
+      "                   every row and column, the calibrated pixels that are at least",
+      "                   as bright as a threshold, and the box spans the rows and",
+      "                   columns at least 1% of whose pixels are. The threshold is",
+      "                   chosen from the histogram of calibrated grey levels (by Otsu's",
+      "                   method) and rounded down to a multiple of 1024. Only the box is",
+      "                   then read again and calibrated. The PNM file's second comment",
+      "                   line gives the column and row of the image at which the box's",
+      "                   top-left pixel lies, so that OVERLAY coordinates can be mapped",
+      "                   to it by subtracting them. If no breast is found, the whole",
+      "                   image is written. Can't be combined with --roi, --histogram,",
+      "                   --pyramid or --tiled.\n",
+
+      "  --crop-threshold <v>",
+      "                   With --crop, treat calibrated grey levels of at least <v> (from",
+      "                   0 to 65535) as breast, instead of choosing the threshold.\n",
+
+      "  --crop-margin <n>",
+      "                   With --crop, widen the box by <n> pixels on each side, within",
+      "                   the image (the default is 16).\n",
+
+      "  --output <file>  Write the PNM file to <file> rather than the usual name; if",
+      "                   <file> is \"-\", write it to standard output (e.g. a pipe into",
+      "                   \"convert -depth 16 pnm:- <png-file>\"), so that it never",
+      "                   touches the disk. The names of the other files that options",
+      "                   write (the histogram, pyramid level, tiled image and region",
+      "                   of interest files) are made from <some-ddsm-raw-file> as",
+      "                   usual, or from <file> if the raw data is read from standard",
+      "                   input; so when both are \"-\", those options can't be given.",
+      "                   Reading the raw data for --roi and --crop needs seeking, so if",
+      "                   standard input is a pipe it is first copied into an anonymous",
+      "                   in-memory file (a memfd on Linux, or else a temporary file).\n",
+
       "On success, the ddsmraw2pnm program will produce a PNM file with the name",
       "\"<some-ddsm-raw-file>-ddsmraw2pnm.pnm\" (overwiting the file if it already",
       "exists), writing the name of the output file to standard output and returning",
@@ -104,7 +501,8 @@ void displayProgramHelp()
       "will be printed to standard error and the program will return a non-zero value",
       "to the caller to indicate failure (see the code for the meanings of the error",
       "codes). The output PNM file may be partially written even on failure, so",
-      "programs that call ddsmraw2pnm do need to check the program's exit code.\n",
+      "programs that call ddsmraw2pnm do need to check the program's exit code.",
+      "When the PNM file is written to standard output, no file names are written.\n",
 
       "The data in the PNM file will be calibrated and normalised according",
       "to the digitizer that was used to digitize the mammogram in",
@@ -155,352 +553,661 @@ void exitWith(const int errorCode, const char* errorMsg)
   exit(errorCode);
 }
 
-// Check that the input values does not lie outside of the range 0 to
-// 65535. Return true if the input value is in the range, otherwise
-// return false.
-inline bool checkRange(unsigned int i)
+// Write the header of a PNM file for an image with the given
+// dimensions. If extraComment is not empty, it is written as a second
+// comment line.
+void writePnmHeader(FILE* output,
+		    const int numRows,
+		    const int numCols,
+		    bool (*calibrationFunc)(unsigned int* retVal, unsigned int raw),
+		    const std::string& extraComment = "")
 {
-  const bool retVal = (i <= maxUnsignedIntWithNumBits);
-  if(!retVal)
+  fprintf(output, "P2\n");
+  fprintf(output, (getPnmCommentString(calibrationFunc)).c_str());
+  if(!extraComment.empty())
     {
-      std::cout << "Data outside range. Data is: " << i << std::endl;
+      fprintf(output, "# %s\n", extraComment.c_str());
     }
-
-  return retVal;
+  fprintf(output, "%u\n", numCols);
+  fprintf(output, "%u\n", numRows);
+  fprintf(output, "%u\n", maxUnsignedIntWithNumBits);  // Here we assume 16-bit data.
 }
 
-// Convert an optical density value to our normalised grey level
-// quantity. retVal must point to a memory location that we can write
-// to (i.e, it will return the result) and od is the optical density
-// value we operate on. This functio will return true if everything is
-// OK, otherwise it will return false.
-inline bool od2NormGreyLevel(unsigned int* retVal, const double od)
+// Return the name of the PNM file for a level of the pyramid (level
+// 1 being half the size of the full-resolution image, and so on).
+std::string getPyramidLevelFile(const std::string& inputFile, const unsigned int level)
 {
-  *retVal = static_cast<unsigned int>((static_cast<double>(maxUnsignedIntWithNumBits) / maxOD) * od);
-  if(*retVal > maxUnsignedIntWithNumBits)
-    {
-      // There's a problem.
-      std::cout << "Optical density value was out of range; value was " << od << std::endl;
-      return false;
-    }
-
-  // The dat from the digitizer is inverted, so uninvert.
-  *retVal = maxUnsignedIntWithNumBits - *retVal;
-
-  // Now perform quadratic companding, so we give more binary
-  // precision to the high grey levels. The quadratic maps zero to
-  // zero and 65535 to 65535 and is quadratic in between.
-  *retVal = static_cast<unsigned int>((1.0/static_cast<double>(maxUnsignedIntWithNumBits)) * (static_cast<double>(*retVal) * static_cast<double>(*retVal)));
-
-  // Force things to be in range.
-  /* 
-     if(*retVal > maxUnsignedIntWithNumBits)
-     {
-     *retVal = maxUnsignedIntWithNumBits;
-     }
-  */
+  char number[16];
+  snprintf(number, sizeof(number), "%u", level);
+  return inputFile + pyramidLevelInfix + number + ".pnm";
+}
 
-  // Everything's OK.
-  return true;
+// Return the name of the PNM file for the n-th region of interest
+// (counting from 1).
+std::string getRoiFile(const std::string& inputFile, const unsigned int n)
+{
+  char number[16];
+  snprintf(number, sizeof(number), "%u", n);
+  return inputFile + roiInfix + number + ".pnm";
 }
 
-// The calibration function for the dba digitizer. retVal must point
-// to a memory location we can write an unsigned int to; raw is the
-// input argument. We return true if everything was OK, false
-// otherwise.
-inline bool dbaCalibration(unsigned int* retVal, unsigned int raw)
+// Parse a region of interest given as "<x>,<y>,<w>,<h>". Returns true
+// if the text is a region with a positive width and height.
+bool parseRoi(const std::string& text, ImageRegion* region)
 {
-  double rawDouble = 0.0;
+  char trailing = '\0';
+  return sscanf(text.c_str(), " %d , %d , %d , %d %c", &region->left, &region->top, &region->numCols, &region->numRows, &trailing) == 4
+    && region->left >= 0 && region->top >= 0 && region->numCols > 0 && region->numRows > 0;
+}
 
-  if(0 != raw)
+// Read regions of interest from a file, one per line. Returns true on
+// success.
+bool readRoiFile(const std::string& roiFile, std::vector<ImageRegion>* rois)
+{
+  std::ifstream input(roiFile.c_str());
+  std::string line;
+  bool ok = static_cast<bool>(input);
+  while(ok && std::getline(input, line))
     {
-      // Need to correct for input that is over 64064, as the equation
-      // below will give -ve results for such data!
-      if(raw > 64064)
-	{
-	  raw = 64064;
-	}
-
-      // Need to correct for input that is less than 4, as this will
-      // generate optical density values that are greater than 4.0
-      // (which is currently set as the value of maxOD).
-      if(raw < 4)
+      const size_t start = line.find_first_not_of(" \t\r\n");
+      if(start == std::string::npos || line[start] == '#')
 	{
-	  raw = 4;
+	  continue;
 	}
 
-      rawDouble = static_cast<double>(raw);
-      rawDouble = (log10(rawDouble) - 4.80662) / (-1.07553);
-      // Above eqn from: http://marathon.csee.usf.edu/Mammography/DDSM/calibrate/DBA_Scanner_info.html
+      ImageRegion region;
+      ok = parseRoi(line.substr(0, line.find_last_not_of(" \t\r\n") + 1), &region);
+      rois->push_back(region);
     }
 
-  // Now convert to our normalised grey level.
-  return od2NormGreyLevel(retVal, rawDouble); // Returns true if OK, false otherwise.
+  return ok && !input.bad();
 }
 
-// The calibration function for the howtek-ismd digitizer. retVal must
-// point to a memory location we can write an unsigned int to; raw is
-// the input argument. We return true if everything was OK, false
-// otherwise.
-inline bool howtekMghCalibration(unsigned int* retVal, unsigned int raw)
+// Copy the rest of input into an anonymous file held in memory (a
+// memfd on Linux, or else a temporary file, which the system removes
+// when it is closed) and return it, positioned at its start, so that it
+// can be seeked in. Returns NULL on failure.
+FILE* copyToMemoryFile(FILE* input)
 {
-  // Need to correct for input values that are over 4006, as the eqn
-  // below gives -ve results for such data.
-  if(raw > 4006)
+  FILE* copy = NULL;
+#if defined(__linux__) && defined(SYS_memfd_create)
+  const int fd = static_cast<int>(syscall(SYS_memfd_create, "ddsmraw2pnm", 0));
+  if(fd >= 0)
     {
-      raw = 4006; 
+      copy = fdopen(fd, "w+b");
+      if(NULL == copy)
+	{
+	  close(fd);
+	}
+    }
+#endif
+  if(NULL == copy)
+    {
+      copy = tmpfile();
+    }
+  if(NULL == copy)
+    {
+      return NULL;
     }
 
-  // Convert from raw to optical density.
-  double od = 3.789 + ((-0.00094568) * static_cast<double>(raw));
+  std::vector<unsigned char> buffer(1 << 20);
+  size_t numBytesRead = 0;
+  bool ok = true;
+  while(ok && (numBytesRead = fread(&buffer[0], 1, buffer.size(), input)) > 0)
+    {
+      ok = (fwrite(&buffer[0], 1, numBytesRead, copy) == numBytesRead);
+    }
+  if(!ok || ferror(input) || fseek(copy, 0, SEEK_SET) != 0)
+    {
+      fclose(copy);
+      return NULL;
+    }
 
-  // Now convert to our normalised grey level.
-  return od2NormGreyLevel(retVal, od); // Returns true if OK, false otherwise.
+  return copy;
 }
 
-// The calibration function for the howtek-ismd digitizer. retVal must
-// point to a memory location we can write an unsigned int to; raw is
-// the input argument. We return true if everything was OK, false
-// otherwise.
-inline bool howtekIsmdCalibration(unsigned int* retVal, unsigned int raw)
+// Open the raw file to read ("-" being standard input). If seekable is
+// true and standard input can't be seeked in (e.g. it is a pipe), it is
+// copied into memory first (see copyToMemoryFile()). Returns NULL on
+// failure.
+FILE* openInputFile(const std::string& inputFile, const bool seekable)
 {
-  // Need to correct for input values that are over 4003, as the eqn
-  // below gives -ve results for such data.
-  if(raw > 4003)
+  if(inputFile != standardStreamName)
     {
-      raw = 4003; 
-    }  
+      return fopen(inputFile.c_str(), "rb");
+    }
 
-  // Convert from raw to optical density.
-  double od = 3.96604096240593 + ((-0.00099055807612) * static_cast<double>(raw));
+  if(seekable && fseek(stdin, 0, SEEK_END) != 0)
+    {
+      return copyToMemoryFile(stdin);
+    }
+  if(seekable && fseek(stdin, 0, SEEK_SET) != 0)
+    {
+      return NULL;
+    }
 
-  // Now convert to our normalised grey level.
-  return od2NormGreyLevel(retVal, od); // Returns true if OK, false otherwise.
+  return stdin;
 }
 
-// The calibration function for the lumisys digitizer.
-inline bool lumisysCalibration(unsigned int* retVal, unsigned int raw)
+// Open a PNM file to write ("-" being standard output). Returns NULL on
+// failure.
+FILE* openOutputFile(const std::string& outputFile)
 {
-  // Need to correct for input values that are less than 58, as the
-  // eqn below gives results over 4.0 (our choice for maxOD, but check
-  // this!) for such data.
-  if(raw < 61)
-    {
-      raw = 61; 
-    }  
+  return (outputFile == standardStreamName) ? stdout : fopen(outputFile.c_str(), "wb");
+}
 
-  // Need to correct for input values that are over 4097, as the eqn
-  // below gives -ve results for such data.
-  if(raw > 4097)
-    {
-      raw = 4097; 
-    }
+// Write a row of calibrated pixel values to the PNM file. The PNM
+// specification says that the file should have no more than 70
+// characters per line. The counter pointed to by charColCounter
+// (which carries over from one row to the next), along with the
+// assumption that each pixel value will have no more than 5
+// characters, allows us to insert a newline character at appropriate
+// points.
+inline void encodeRow(FILE* output, const unsigned int* pixels, const int numCols, int* charColCounter)
+{
+  const int maxCharsPerPixel = 5;
+  const int breakAroundCol = 50; // Put newlines at about column number 50.
 
-  // Convert from raw to optical density.
-  double od = (static_cast<double>(raw) - 4096.99) / (-1009.01);
+  for(int col = 0; col < numCols; col++)
+    {
+      // Now write this pixel value to output.
+      fprintf(output, "%u ", pixels[col]);
 
-  // Now convert to our normalised grey level.
-  return od2NormGreyLevel(retVal, od); // Returns true if OK, false otherwise.
+      // Increment the character column counter and check to see
+      // if we need a newline.
+      (*charColCounter)++;
+      if(((*charColCounter) * maxCharsPerPixel) >= breakAroundCol)
+	{
+	  fprintf(output, "\n");
+	  *charColCounter = 0;
+	}
+    }
 }
 
-// Return a comment string that will be embedded in the PNM file
-// (ImageMagick's convert utility maintains the comment). We pass in a
-// function pointer which lets us work out which digitizer was used
-// and therefore how many bits/pixel the scanner operated at.
-std::string getPnmCommentString(bool (*calibrationFunc)(unsigned int* retVal, unsigned int raw))
+// Calibrate rows firstRow up to (but not including) endRow of a band
+// of unpacked pixels, in place. If histograms is not NULL, the raw
+// and calibrated values are counted into it. The result (true if all
+// went well) is written to *ok; this function is run by each of the
+// calibration threads, each with its own rows and histograms.
+void calibrateBandRows(unsigned int* bandPixels,
+		       const int numCols,
+		       const int firstRow,
+		       const int endRow,
+		       bool (*calibrationFunc)(unsigned int* retVal, unsigned int raw),
+		       PixelHistograms* histograms,
+		       bool* ok)
 {
-  // Define the number of bits per pixel used by the digitizers.
-  unsigned char bitsPerPixel = 12;
-  if(calibrationFunc == dbaCalibration)
+  *ok = true;
+  for(int row = firstRow; row < endRow && *ok; row++)
     {
-      // Only the DBA scanner digitized at 16 bits per pixel.
-      bitsPerPixel = 16;
-    }
+      unsigned int* pixels = bandPixels + (static_cast<size_t>(row) * numCols);
+      if(NULL != histograms)
+	{
+	  histogramRow(pixels, numCols, histograms->raw);
+	}
 
-  std::string retVal = "# Generated by ddsmraw2pnm. Original data was digitized at ";
-  retVal += bitsPerPixel;
-  retVal += " bits/pixel.\n";
-  return retVal;
+      *ok = calibrateRow(pixels, numCols, calibrationFunc);
+
+      if(NULL != histograms && *ok)
+	{
+	  histogramRow(pixels, numCols, histograms->calibrated);
+	}
+    }
 }
 
 // Make the PNM file. Return a non-zero return value if things didn't
-// go well. The last argument is a pointer to one of the calibration
-// functions; we apply calibration by calling that function after
-// reading each pixel value from the file. We also use the calibration
-// function pointer to write a comment to the PNM file which specifies
-// how many bits/pixel the original digitizer operated at (though we
-// normalise the data we output so it is comparable across all
-// digitizers).
+// go well. The calibrationFunc argument is a pointer to one of the
+// calibration functions; we apply calibration by calling that
+// function on each pixel value read from the file. We also use the
+// calibration function pointer to write a comment to the PNM file
+// which specifies how many bits/pixel the original digitizer operated
+// at (though we normalise the data we output so it is comparable
+// across all digitizers). We work a band of rows at a time: each band
+// is read and unpacked, calibrated (by options.numThreads threads)
+// and then encoded. If histograms is not NULL, it will be filled in
+// with the histograms of the raw and calibrated pixel values. If
+// levelOutputs is not empty, levelOutputs[k] is the PNM file for level
+// k + 1 of the pyramid, which we build from the calibrated rows as we
+// go. If tiledWriter is not NULL, the full image and the pyramid
+// levels (as its levels 0, 1, ...) are also written to it.
 int makePnmFile(FILE* input,
 		FILE* output,
 		const int numRows,
 		const int numCols,
-                bool (*calibrationFunc)(unsigned int* retVal, unsigned int raw))
+                bool (*calibrationFunc)(unsigned int* retVal, unsigned int raw),
+		const ProgramOptions& options,
+		PixelHistograms* histograms,
+		const std::vector<FILE*>& levelOutputs,
+		TiledImageWriter* tiledWriter)
 {
-  fprintf(output, "P2\n");
-  fprintf(output, (getPnmCommentString(calibrationFunc)).c_str());
-  fprintf(output, "%u\n", numCols);
-  fprintf(output, "%u\n", numRows);
-  fprintf(output, "%u\n", maxUnsignedIntWithNumBits);  // Here we assume 16-bit data.
-  
-  // A byte-sized buffer, a record of whether we are reading an odd or
-  // even-numbered byte and the pixel value of the current pixel.
-  bool oddByte = true; // We start on byte 1, an odd byte.
-  unsigned int thisPixel = 0; // This will be used to hold the value of each pixel.
+  writePnmHeader(output, numRows, numCols, calibrationFunc);
+
+  // Set up the pyramid levels, if any, each with its own PNM file
+  // (and so its own character column counter; see encodeRow()).
+  std::vector<PyramidLevel> pyramid;
+  initPyramid(&pyramid, static_cast<unsigned int>(levelOutputs.size()), numRows, numCols);
+  std::vector<int> levelCharColCounters(levelOutputs.size(), 0);
+  for(unsigned int k = 0; k < levelOutputs.size(); k++)
+    {
+      writePnmHeader(levelOutputs[k], pyramid[k].numRows, pyramid[k].numCols, calibrationFunc);
+    }
+
+  // Buffers for the raw bytes and pixel values of the current band.
+  std::vector<unsigned char> rawBytes(2 * static_cast<size_t>(numCols) * numBandRows);
+  std::vector<unsigned int> pixels(static_cast<size_t>(numCols) * numBandRows);
+
+  // The state of each calibration thread. Each thread counts into
+  // its own histograms (so that they don't have to synchronise); we
+  // merge them at the end.
+  struct CalibrationThreadState
+  {
+    bool ok; // Whether the thread's rows were calibrated without error.
+    PixelHistograms histograms;
+  };
+  const unsigned int numThreads = (options.numThreads > 0) ? options.numThreads : 1;
+  std::vector<CalibrationThreadState> threadStates(numThreads);
+  for(unsigned int t = 0; t < numThreads && NULL != histograms; t++)
+    {
+      clearHistograms(&threadStates[t].histograms);
+    }
 
   // Count how many values we read, so we can verify that the file
   // will at least have the correct header for the volume of data it
   // will carry.
   unsigned int numPixels = 0;
 
-  // The PNM specification says that the file should have no more than
-  // 70 characters per line. The following counter, along with the
-  // assumption that each pixel value will have no more than 5
-  // characters, allows us to insert a newline character at
-  // appropriate points.
+  // Counts characters written on the current line of the PNM file;
+  // see encodeRow().
   int charColCounter = 0;
-  const int maxCharsPerPixel = 5;
-  const int breakAroundCol = 50; // Put newlines at about column number 50.
-
-  // For debugging.
-  unsigned int minPixelValue = maxUnsignedIntWithNumBits;
-  unsigned int maxPixelValue = 0;
 
-  // Keeps track if the calibration function thinks things are OK.
-  bool okSoFar = true;
+  // Open the performance counters for each kernel if the user asked
+  // for them. If we can't, we say so but carry on with the
+  // conversion.
+  PerfCounterGroup perfCounters[numConversionKernels];
+  for(unsigned int k = 0; k < numConversionKernels; k++)
+    {
+      perfCounters[k].leaderFd = -1; // Makes starting and stopping the counters do nothing.
+    }
+  bool perfCountersOpen = false;
+  if(options.perfCounters)
+    {
+      perfCountersOpen = true;
+      for(unsigned int k = 0; k < numConversionKernels; k++)
+	{
+	  perfCountersOpen = openPerfCounterGroup(&perfCounters[k]) && perfCountersOpen;
+	}
+      if(!perfCountersOpen)
+	{
+	  std::cerr << "Could not open performance counters (" << strerror(errno) << "); check "
+		    << "/proc/sys/kernel/perf_event_paranoid. Continuing without them." << std::endl;
+	}
+    }
 
   // Read the data in and write the rest of the PNM file.
-  unsigned char thisByte[1];
-
-  unsigned int byteValue = 0; // We'll read the value of the byte into here.
-  while(!feof(input))
+  int retVal = 0; // Assume everything will be OK.
+  for(int bandStart = 0; bandStart < numRows && retVal == 0; bandStart += numBandRows)
     {
-      fread(thisByte, 1, 1, input);
+      const int bandRows = (numRows - bandStart < numBandRows) ? (numRows - bandStart) : numBandRows;
+      const size_t bandBytes = 2 * static_cast<size_t>(numCols) * bandRows;
+      const size_t numBytesRead = fread(&rawBytes[0], 1, bandBytes, input);
 
       // See if a read error occurred.
       if(ferror(input))
 	{
-	  std::cout << "A file read error occurred." << std::endl;
-	  return -1;
+	  std::cerr << "A file read error occurred." << std::endl;
+	  retVal = -1;
+	  break;
 	}
 
-      // See if byte value makes sense.
-      byteValue = static_cast<unsigned int>(*thisByte);
-      if(byteValue < 0
-	 ||
-	 byteValue > 255)
+      // See if we ran out of data.
+      if(numBytesRead != bandBytes)
 	{
-	  std::cout << "Error: Read a byte that seemed to have the value " << byteValue << std::endl;
-	  return -1; // Quit---something is wrong.
+	  numPixels += static_cast<unsigned int>(numBytesRead / 2);
+	  retVal = image_size_error;
+	  break;
 	}
 
-      // Write the next pixel value if we have read an 'even' byte,
-      // otherwise accumulate.
-      if(oddByte)
+      // The rows of a band are contiguous, so the row kernels can
+      // treat the whole band as one long row.
+      startPerfCounterGroup(&perfCounters[unpackKernel]);
+      unpackRow(&rawBytes[0], &pixels[0], numCols * bandRows);
+      stopPerfCounterGroup(&perfCounters[unpackKernel]);
+
+      // Share the rows of the band out between the threads; this
+      // thread does the first share itself. (Only this thread's work
+      // is seen by the performance counters.)
+      startPerfCounterGroup(&perfCounters[calibrateKernel]);
+      const int rowsPerThread = (bandRows + numThreads - 1) / numThreads;
+      std::vector<std::thread> threads;
+      for(unsigned int t = 1; t < numThreads; t++)
 	{
-	  thisPixel = (256 * byteValue); // Most significant byte.
+	  const int firstRow = std::min(static_cast<int>(t) * rowsPerThread, bandRows);
+	  const int endRow = std::min(firstRow + rowsPerThread, bandRows);
+	  threads.push_back(std::thread(calibrateBandRows, &pixels[0], numCols, firstRow, endRow, calibrationFunc,
+					(NULL != histograms) ? &threadStates[t].histograms : NULL, &threadStates[t].ok));
 	}
-      else
+      calibrateBandRows(&pixels[0], numCols, 0, std::min(rowsPerThread, bandRows), calibrationFunc,
+			(NULL != histograms) ? &threadStates[0].histograms : NULL, &threadStates[0].ok);
+      for(unsigned int t = 0; t < threads.size(); t++)
 	{
-	  thisPixel += byteValue; // Least significant byte.
-
-	  // Now apply calibration to the pixel value.
-	  okSoFar = (*calibrationFunc)(&thisPixel, thisPixel);
+	  threads[t].join();
+	}
+      stopPerfCounterGroup(&perfCounters[calibrateKernel]);
 
-	  // Check to make sure the range is OK.
-	  if(!checkRange(thisPixel) || !okSoFar)
+      for(unsigned int t = 0; t < numThreads; t++)
+	{
+	  if(!threadStates[t].ok)
 	    {
-	      std::cout << "Error: A pixel value error was detected. Pixel value is: " << thisPixel << std::endl;
-	      return -1;
+	      retVal = -1;
 	    }
-	  
-	  // Now write this pixel value to output.
-	  fprintf(output, "%u ", thisPixel);
-
-	  // Increment the character column counter and check to see
-	  // if we need a newline.
-	  charColCounter++;
-	  if((charColCounter * maxCharsPerPixel) >= breakAroundCol)
+	}
+      if(retVal != 0)
+	{
+	  break;
+	}
+
+      startPerfCounterGroup(&perfCounters[encodeKernel]);
+      encodeRow(output, &pixels[0], numCols * bandRows, &charColCounter);
+      stopPerfCounterGroup(&perfCounters[encodeKernel]);
+
+      // Feed the calibrated rows into the pyramid, writing each
+      // downsampled row as soon as it is finished; the pyramid carries
+      // its partial sums over from one band to the next.
+      for(int row = 0; row < bandRows && (!pyramid.empty() || NULL != tiledWriter); row++)
+	{
+	  const unsigned int* rowPixels = &pixels[static_cast<size_t>(row) * numCols];
+
+	  startPerfCounterGroup(&perfCounters[pyramidKernel]);
+	  if(!pyramid.empty())
 	    {
-	      fprintf(output, "\n");
-	      charColCounter = 0;
+	      addRowToPyramid(pyramid, rowPixels, numCols, bandStart + row == numRows - 1);
+	      for(unsigned int k = 0; k < pyramid.size(); k++)
+		{
+		  if(pyramid[k].rowReady)
+		    {
+		      encodeRow(levelOutputs[k], &pyramid[k].row[0], pyramid[k].numCols, &levelCharColCounters[k]);
+		    }
+		}
 	    }
+	  stopPerfCounterGroup(&perfCounters[pyramidKernel]);
 
-	  // Increment the count of the pixels we've read.
-	  numPixels++;
+	  // Add the full-resolution row and any finished pyramid rows
+	  // to the tiled image.
+	  startPerfCounterGroup(&perfCounters[tileKernel]);
+	  if(NULL != tiledWriter)
+	    {
+	      addTiledImageRow(tiledWriter, 0, rowPixels);
+	      for(unsigned int k = 0; k < pyramid.size(); k++)
+		{
+		  if(pyramid[k].rowReady)
+		    {
+		      addTiledImageRow(tiledWriter, k + 1, &pyramid[k].row[0]);
+		    }
+		}
+	    }
+	  stopPerfCounterGroup(&perfCounters[tileKernel]);
+	}
 
-	  // Debugging.
-	  if(thisPixel < minPixelValue){minPixelValue = thisPixel;}
-	  if(thisPixel > maxPixelValue){maxPixelValue = thisPixel;}
+      // Increment the count of the pixels we've read.
+      numPixels += numCols * bandRows;
+    }
 
+  // There should be no data left over.
+  if(retVal == 0)
+    {
+      size_t numBytesLeft = 0;
+      size_t numBytesRead = 0;
+      while((numBytesRead = fread(&rawBytes[0], 1, rawBytes.size(), input)) > 0)
+	{
+	  numBytesLeft += numBytesRead;
+	}
+      if(numBytesLeft > 0)
+	{
+	  numPixels += static_cast<unsigned int>(numBytesLeft / 2);
+	  retVal = image_size_error;
 	}
-
-      // Invert oddByte.
-      oddByte = !oddByte;
     }
 
-  //std::cout << "Min raw pixel value was: " << minPixelValue << std::endl;
-  //std::cout << "Max raw pixel value was: " << maxPixelValue << std::endl;
+  if(retVal == image_size_error)
+    {
+      std::cerr << "Error: The specified number of pixels seems to be incorrect for the input file. We read " << std::endl
+		<< numPixels << " pixels, which is not equal to " << numRows << " x " << numCols << "." << std::endl;
+    }
 
-  // Setup a return value.
-  int retVal = -1; // Assume error.
+  // Merge the threads' histograms.
+  if(NULL != histograms && retVal == 0)
+    {
+      clearHistograms(histograms);
+      for(unsigned int t = 0; t < numThreads; t++)
+	{
+	  mergeHistograms(histograms, threadStates[t].histograms);
+	}
+    }
 
-  if(numPixels == (unsigned int)(numRows * numCols))
+  // Report and close the performance counters.
+  if(perfCountersOpen && retVal == 0)
     {
-      retVal = 0; // It's OK.
+      for(unsigned int k = 0; k < numConversionKernels; k++)
+	{
+	  readPerfCounterGroup(&perfCounters[k]);
+	}
+      reportPerfCounters(perfCounters, numPixels);
     }
-  else
+  if(options.perfCounters)
     {
-      std::cout << "Error: The specified number of pixels seems to be incorrect for the input file. We read " << std::endl
-		<< numPixels << " pixels, which is not equal to " << numRows << " x " << numCols << "." << std::endl;
-      retVal = image_size_error;
+      for(unsigned int k = 0; k < numConversionKernels; k++)
+	{
+	  closePerfCounterGroup(&perfCounters[k]);
+	}
     }
 
   return retVal;
 }
 
+// Make a PNM file for each region of interest (whose files are
+// roiOutputs) in one pass down the rows of the raw file, reading and
+// calibrating only the pixels that the regions cover (see
+// readCalibratedRegions()). The second comment line of each file says
+// what the region is (e.g. "Region of interest") and where it lies.
+// Return a non-zero value if things didn't go well.
+int makeRoiFiles(FILE* input,
+		 const int numRows,
+		 const int numCols,
+		 bool (*calibrationFunc)(unsigned int* retVal, unsigned int raw),
+		 const std::vector<ImageRegion>& rois,
+		 const std::vector<FILE*>& roiOutputs,
+		 const char* description)
+{
+  if(!checkRawFileSize(input, numRows, numCols))
+    {
+      std::cerr << "Error: The specified number of pixels seems to be incorrect for the input file." << std::endl;
+      return image_size_error;
+    }
+
+  for(unsigned int i = 0; i < rois.size(); i++)
+    {
+      char comment[128];
+      snprintf(comment, sizeof(comment), "%s at col %d row %d of a %d x %d image.",
+	       description, rois[i].left, rois[i].top, numRows, numCols);
+      writePnmHeader(roiOutputs[i], rois[i].numRows, rois[i].numCols, calibrationFunc, comment);
+    }
+
+  // Each region's PNM file has its own character column counter (see
+  // encodeRow()).
+  std::vector<int> charColCounters(rois.size(), 0);
+  int failedRow = 0;
+  const bool ok = readCalibratedRegions(input, numCols, calibrationFunc, rois,
+					[&](const size_t i, const int, const unsigned int* pixels)
+					{
+					  encodeRow(roiOutputs[i], pixels, rois[i].numCols, &charColCounters[i]);
+					},
+					&failedRow);
+  if(!ok)
+    {
+      std::cerr << "Error: Could not read or calibrate row " << failedRow << "." << std::endl;
+      return -1;
+    }
 
-// This function checks the calibration functions to make sure they
-// produce output with a suitable range of values. The function
-// returns true if the functions are OK and false otherwise.
-bool checkCalibrationFunctions(void)
+  return 0;
+}
+
+// Convert just the regions of interest, as described in
+// displayProgramHelp(), and exit. The regions are read from input and
+// their files are named after nameFile.
+void convertRois(FILE* input,
+		 const std::string& nameFile,
+		 const int numRows,
+		 const int numCols,
+		 bool (*calibrationFunc)(unsigned int* retVal, unsigned int raw),
+		 const std::vector<ImageRegion>& rois)
 {
-  // Define an array of functions pointers to test.
-  bool (*calibrationFuncs[4])(unsigned int*, unsigned int) = 
+  for(unsigned int i = 0; i < rois.size(); i++)
     {
-      dbaCalibration, howtekMghCalibration, howtekIsmdCalibration, lumisysCalibration
-    };
+      if(rois[i].left + rois[i].numCols > numCols || rois[i].top + rois[i].numRows > numRows)
+	{
+	  exitWith(roi_error, roi_error_msg);
+	}
+    }
+
+  std::vector<FILE*> roiOutputs;
+  bool roiOutputsOk = true;
+  for(unsigned int i = 0; i < rois.size() && roiOutputsOk; i++)
+    {
+      FILE* roiOutput = fopen(getRoiFile(nameFile, i + 1).c_str(), "wb");
+      roiOutputsOk = (NULL != roiOutput);
+      if(NULL != roiOutput)
+	{
+	  roiOutputs.push_back(roiOutput);
+	}
+    }
+
+  int status = roiOutputsOk ? makeRoiFiles(input, numRows, numCols, calibrationFunc, rois, roiOutputs, "Region of interest") : file_error;
+
+  // Cleanup.
+  fclose(input);
+  for(unsigned int i = 0; i < roiOutputs.size(); i++)
+    {
+      status = (fclose(roiOutputs[i]) == 0 || status != 0) ? status : file_error;
+    }
+
+  if(status == file_error)
+    {
+      exitWith(file_error, file_error_msg);
+    }
+  else if(status != 0)
+    {
+      exitWith(pnm_error, pnm_error_msg);
+    }
+
+  // Everything's OK, so send the names of the PNM files to stdout.
+  for(unsigned int i = 0; i < rois.size(); i++)
+    {
+      std::cout << getRoiFile(nameFile, i + 1) << std::endl;
+    }
 
-  // Define an array of digitizer names for output.
-  std::string digitizerNames[4] = {dba, howtek_mgh, howtek_ismd, lumisys};
+  exit(success);
+}
 
-  // Iterate over the digitizer/calibration functions.
-  bool (*thisCalibrationFunc)(unsigned int*, unsigned int) = NULL;
-  for(unsigned int i = 0; i < 4; i++)
+// Find the bounding box of the breast in a raw file, as described in
+// displayProgramHelp(): one pass unpacks every row and calibrates it
+// by table look-up, counting the grey levels into the projections.
+// Return a non-zero value if things didn't go well.
+int scanForBreast(FILE* input,
+		  const int numRows,
+		  const int numCols,
+		  bool (*calibrationFunc)(unsigned int* retVal, unsigned int raw),
+		  const ProgramOptions& options,
+		  ImageRegion* region)
+{
+  std::vector<unsigned int> calibrationTable;
+  if(!makeCalibrationTable(calibrationFunc, &calibrationTable))
+    {
+      return -1;
+    }
+  if(!checkRawFileSize(input, numRows, numCols))
     {
-      thisCalibrationFunc = calibrationFuncs[i];
+      std::cerr << "Error: The specified number of pixels seems to be incorrect for the input file." << std::endl;
+      return image_size_error;
+    }
 
-      // Iterate over every possible input value and see if calling
-      // the calibration function on it gives a result that is out of
-      // bounds.
-      unsigned int outVal = 0; // This is where we'll store the returned value from the calibration functions.
-      for(unsigned int inVal = 0; inVal <= maxUnsignedIntWithNumBits; inVal++)
+  BreastProjections projections;
+  initBreastProjections(&projections, numRows, numCols);
+  std::vector<unsigned char> rawBytes(2 * static_cast<size_t>(numCols) * numBandRows);
+  std::vector<unsigned int> pixels(static_cast<size_t>(numCols) * numBandRows);
+  for(int bandStart = 0; bandStart < numRows; bandStart += numBandRows)
+    {
+      const int bandRows = std::min(numRows - bandStart, numBandRows);
+      const size_t bandBytes = 2 * static_cast<size_t>(numCols) * bandRows;
+      if(fread(&rawBytes[0], 1, bandBytes, input) != bandBytes)
 	{
-	  // Call the function.
-	  (*thisCalibrationFunc)(&outVal, inVal);
+	  std::cerr << "A file read error occurred." << std::endl;
+	  return -1;
+	}
 
-	  // Test the return value.
-	  if(outVal > maxUnsignedIntWithNumBits)
-	    {
-	      std::cout << "The calibration function for the " << digitizerNames[i] << " digitizer has a range problem." << std::endl;
-	      std::cout << "The input value that generated this error was " << inVal << std::endl;
-	      return false; // It's broken.
-	    }
+      unpackRow(&rawBytes[0], &pixels[0], numCols * bandRows);
+      for(size_t i = 0; i < static_cast<size_t>(numCols) * bandRows; i++)
+	{
+	  pixels[i] = calibrationTable[pixels[i]];
+	}
+      for(int row = 0; row < bandRows; row++)
+	{
+	  addRowToBreastProjections(&projections, bandStart + row, &pixels[static_cast<size_t>(row) * numCols]);
 	}
     }
 
-  // If we get here, everything's OK.
-  return true;
+  const unsigned int threshold = (options.cropThreshold >= 0) ?
+    static_cast<unsigned int>(options.cropThreshold) : getOtsuThreshold(projections.histogram);
+  if(!findBreastRegion(projections, threshold, options.cropMargin, region))
+    {
+      std::cerr << "No breast was found (with a threshold of " << threshold << "); writing the whole image." << std::endl;
+    }
+
+  return 0;
+}
+
+// Convert just the bounding box of the breast (read from input), as
+// described in displayProgramHelp(), and exit.
+void convertBreast(FILE* input,
+		   const std::string& outputFile,
+		   const int numRows,
+		   const int numCols,
+		   bool (*calibrationFunc)(unsigned int* retVal, unsigned int raw),
+		   const ProgramOptions& options)
+{
+  FILE* output = openOutputFile(outputFile);
+  if(NULL == output)
+    {
+      fclose(input);
+      exitWith(file_error, file_error_msg);
+    }
+
+  std::vector<ImageRegion> regions(1);
+  int status = scanForBreast(input, numRows, numCols, calibrationFunc, options, &regions[0]);
+  if(status == 0)
+    {
+      status = makeRoiFiles(input, numRows, numCols, calibrationFunc, regions, std::vector<FILE*>(1, output), "Breast region");
+    }
+
+  // Cleanup.
+  fclose(input);
+  status = (fclose(output) == 0 || status != 0) ? status : file_error;
+
+  if(status == file_error)
+    {
+      exitWith(file_error, file_error_msg);
+    }
+  else if(status != 0)
+    {
+      exitWith(pnm_error, pnm_error_msg);
+    }
+
+  // Everything's OK, so send the name of the PNM file to stdout (unless
+  // that's where the PNM file went).
+  if(outputFile != standardStreamName)
+    {
+      std::cout << outputFile << std::endl;
+    }
+  exit(success);
 }
 
 
@@ -509,13 +1216,99 @@ int main(int argc, char* argv[])
 {
   // Do some error checking to make sure that the user invoked us
   // properly.
-  if(argc != 5)
+  if(argc < 5)
     {
       // Output some help info and then exit.
       displayProgramHelp();
       exitWith(syntax_error, syntax_error_msg);
     }
 
+  // Read any options that follow the mandatory arguments.
+  ProgramOptions options;
+  options.perfCounters = false;
+  options.histogram = false;
+  options.numThreads = 1;
+  options.numPyramidLevels = 0;
+  options.tileSize = 0;
+  options.crop = false;
+  options.cropThreshold = -1;
+  options.cropMargin = 16;
+  for(int i = 5; i < argc; i++)
+    {
+      const std::string option = argv[i];
+      ImageRegion region;
+      if(option.compare(perfCountersOption) == 0)
+	{
+	  options.perfCounters = true;
+	}
+      else if(option.compare(histogramOption) == 0)
+	{
+	  options.histogram = true;
+	}
+      else if(option.compare(threadsOption) == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+	{
+	  options.numThreads = static_cast<unsigned int>(atoi(argv[i + 1]));
+	  i++; // Skip the value.
+	}
+      else if(option.compare(pyramidOption) == 0 && i + 1 < argc
+	      && atoi(argv[i + 1]) > 0 && atoi(argv[i + 1]) <= static_cast<int>(maxPyramidLevels))
+	{
+	  options.numPyramidLevels = static_cast<unsigned int>(atoi(argv[i + 1]));
+	  i++; // Skip the value.
+	}
+      else if(option.compare(tiledOption) == 0 && i + 1 < argc
+	      && atoi(argv[i + 1]) >= 8 && atoi(argv[i + 1]) <= 4096)
+	{
+	  options.tileSize = atoi(argv[i + 1]);
+	  i++; // Skip the value.
+	}
+      else if(option.compare(roiOption) == 0 && i + 1 < argc && parseRoi(argv[i + 1], &region))
+	{
+	  options.rois.push_back(region);
+	  i++; // Skip the value.
+	}
+      else if(option.compare(roiFileOption) == 0 && i + 1 < argc && readRoiFile(argv[i + 1], &options.rois))
+	{
+	  i++; // Skip the value.
+	}
+      else if(option.compare(cropOption) == 0)
+	{
+	  options.crop = true;
+	}
+      else if(option.compare(cropThresholdOption) == 0 && i + 1 < argc
+	      && atoi(argv[i + 1]) >= 0 && atoi(argv[i + 1]) <= static_cast<int>(maxUnsignedIntWithNumBits))
+	{
+	  options.cropThreshold = atoi(argv[i + 1]);
+	  i++; // Skip the value.
+	}
+      else if(option.compare(cropMarginOption) == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0)
+	{
+	  options.cropMargin = atoi(argv[i + 1]);
+	  i++; // Skip the value.
+	}
+      else if(option.compare(outputOption) == 0 && i + 1 < argc && argv[i + 1][0] != '\0')
+	{
+	  options.outputFile = argv[i + 1];
+	  i++; // Skip the value.
+	}
+      else
+	{
+	  // Unknown option, so output some help info and then exit.
+	  displayProgramHelp();
+	  exitWith(syntax_error, syntax_error_msg);
+	}
+    }
+
+  // Regions of interest and the breast crop replace the whole image,
+  // so they can't be combined with each other or with the options that
+  // add to it.
+  const bool wholeImageOptions = options.histogram || options.numPyramidLevels > 0 || options.tileSize > 0;
+  if((!options.rois.empty() && (options.crop || wholeImageOptions)) || (options.crop && wholeImageOptions))
+    {
+      displayProgramHelp();
+      exitWith(syntax_error, syntax_error_msg);
+    }
+
   // Get the name of the file to read and the number of rows and cols
   // that the output image must have and the digitizer that was used.
   const std::string inputFile = argv[1];
@@ -535,75 +1328,150 @@ int main(int argc, char* argv[])
   // Choose the appropriate calibration function to apply to the grey
   // levels (yielding optical density values) based upon the name of
   // the digitizer. Exit if we've got an illegal digitizer name.
-  bool (*calibrationFunc)(unsigned int*, unsigned int) = NULL; // Will be set to point to one of the three calibration functions.
-  //
-  if(digitizer.compare(dba) == 0)
+  bool (*calibrationFunc)(unsigned int*, unsigned int) = getCalibrationFunction(digitizer);
+  if(NULL == calibrationFunc)
     {
-      calibrationFunc = dbaCalibration;
-    }
-  else if(digitizer.compare(howtek_mgh) == 0)
-    {
-      calibrationFunc = howtekMghCalibration;
-    }
-  else if(digitizer.compare(howtek_ismd) == 0)
-    {
-      calibrationFunc = howtekIsmdCalibration;
-    }
-  else if(digitizer.compare(lumisys) == 0)
-    {
-      calibrationFunc = lumisysCalibration;
+      exitWith(syntax_error, syntax_error_msg);
     }
-  else
+
+  // Make a filename for the PNM file that will be created, unless the
+  // user chose one. If the file already exists, it will be
+  // overwritten! The other files are named after the input file, or
+  // after the output file when reading standard input; if both are
+  // standard streams, there is nothing to name them after.
+  const bool readingStdin = (inputFile == standardStreamName);
+  const std::string outputFile = !options.outputFile.empty() ? options.outputFile
+    : (readingStdin ? standardStreamName : inputFile + outputSuffix);
+  const std::string nameFile = readingStdin ? outputFile : inputFile;
+  if(nameFile == standardStreamName && (wholeImageOptions || !options.rois.empty()))
     {
+      displayProgramHelp();
       exitWith(syntax_error, syntax_error_msg);
     }
-    
-
-  // Make a filename for the PNM file that will be created. If the
-  // file already exists, it will be overwritten!
-  const std::string outputFile = inputFile + outputSuffix;
 
   // Make sure that the number of rows and cols are sensible.
   if(numRows < 1) { exitWith(rows_not_positive_error, rows_not_positive_error_msg); }
   if(numCols < 1) { exitWith(cols_not_positive_error, cols_not_positive_error_msg); }
 
-  // Open the input and output files for reading.
-  FILE* input = fopen(inputFile.c_str(), "rb");
-  FILE* output = fopen(outputFile.c_str(), "wb");
-
-  if(NULL == input && NULL == output)
+  // Open the input file for reading; only the regions of interest and
+  // the breast crop seek in it.
+  const bool seekable = !options.rois.empty() || options.crop;
+  FILE* input = openInputFile(inputFile, seekable);
+  if(NULL == input)
     {
-      // No files to close.
       exitWith(file_error, file_error_msg);
     }
-  else if(NULL != input && NULL == output)
+
+  // If the user only wants regions of interest, convert just those.
+  if(!options.rois.empty())
+    {
+      convertRois(input, nameFile, numRows, numCols, calibrationFunc, options.rois);
+    }
+  else if(options.crop)
+    {
+      convertBreast(input, outputFile, numRows, numCols, calibrationFunc, options);
+    }
+
+  // Open the output file for writing.
+  FILE* output = openOutputFile(outputFile);
+  if(NULL == output)
     {
       fclose(input);
       exitWith(file_error, file_error_msg);
     }
-  else if(NULL == input && NULL != output)
+
+  // Open the PNM files for the pyramid levels, if we are making them.
+  std::vector<FILE*> levelOutputs;
+  bool levelOutputsOk = true;
+  for(unsigned int k = 1; k <= options.numPyramidLevels; k++)
     {
-      fclose(output);
-      exitWith(file_error, file_error_msg);
+      FILE* levelOutput = fopen(getPyramidLevelFile(nameFile, k).c_str(), "wb");
+      levelOutputsOk = levelOutputsOk && (NULL != levelOutput);
+      if(NULL != levelOutput)
+	{
+	  levelOutputs.push_back(levelOutput);
+	}
     }
 
-  // Let's now make the PNM file.
-  const int status = makePnmFile(input, output, numRows, numCols, calibrationFunc);
-  if(status != 0)
+  // Open the tiled image file, if we are making one. Its levels are
+  // the full image followed by the pyramid levels.
+  const std::string tiledFile = nameFile + tiledSuffix;
+  FILE* tiledOutput = NULL;
+  TiledImageWriter tiledWriter;
+  if(options.tileSize > 0)
     {
-      // There was an error.
-      fclose(input);
-      fclose(output);
-      exitWith(pnm_error, pnm_error_msg);
+      std::vector<std::pair<int, int> > levelDims(1, std::make_pair(numRows, numCols));
+      std::vector<PyramidLevel> pyramid;
+      initPyramid(&pyramid, options.numPyramidLevels, numRows, numCols);
+      for(unsigned int k = 0; k < pyramid.size(); k++)
+	{
+	  levelDims.push_back(std::make_pair(pyramid[k].numRows, pyramid[k].numCols));
+	}
+
+      tiledOutput = fopen(tiledFile.c_str(), "wb");
+      levelOutputsOk = levelOutputsOk && (NULL != tiledOutput)
+	&& openTiledImageWriter(&tiledWriter, tiledOutput, options.tileSize, levelDims);
     }
 
+  // Let's now make the PNM file.
+  PixelHistograms histograms;
+  int status = levelOutputsOk ?
+    makePnmFile(input, output, numRows, numCols, calibrationFunc, options,
+		options.histogram ? &histograms : NULL, levelOutputs,
+		(NULL != tiledOutput) ? &tiledWriter : NULL) : file_error;
+
+  // Finish the tiled image file.
+  if(NULL != tiledOutput)
+    {
+      const bool tiledOk = (status == 0) && closeTiledImageWriter(&tiledWriter);
+      status = (fclose(tiledOutput) == 0 && tiledOk) ? status : ((status == 0) ? tiled_error : status);
+    }
 
   // Cleanup.
   fclose(input);
   fclose(output);
+  for(unsigned int k = 0; k < levelOutputs.size(); k++)
+    {
+      fclose(levelOutputs[k]);
+    }
 
-  // Everything's OK, so send the name of the PNM file to stdout.
-  std::cout << outputFile << std::endl;
+  if(status == file_error)
+    {
+      exitWith(file_error, file_error_msg);
+    }
+  else if(status == tiled_error)
+    {
+      exitWith(tiled_error, tiled_error_msg);
+    }
+  else if(status != 0)
+    {
+      // There was an error.
+      exitWith(pnm_error, pnm_error_msg);
+    }
+
+  // Write the histograms alongside the PNM file if the user wants
+  // them.
+  const std::string histogramFile = ((outputFile == standardStreamName) ? nameFile + outputSuffix : outputFile) + histogramSuffix;
+  if(options.histogram && !writeHistogramFile(histogramFile, numRows, numCols, digitizer, histograms))
+    {
+      exitWith(histogram_error, histogram_error_msg);
+    }
+
+  // Everything's OK, so send the name of the PNM file to stdout,
+  // followed by the names of any pyramid level files, unless the PNM
+  // file itself went to stdout.
+  if(outputFile != standardStreamName)
+    {
+      std::cout << outputFile << std::endl;
+      for(unsigned int k = 1; k <= options.numPyramidLevels; k++)
+	{
+	  std::cout << getPyramidLevelFile(nameFile, k) << std::endl;
+	}
+      if(options.tileSize > 0)
+	{
+	  std::cout << tiledFile << std::endl;
+	}
+    }
 
   // Exit with a success exit code.
   exit(success);
@@ -0,0 +1,431 @@
+/*
+  The following is very brief; full program documentation can be found
+  by compiling this program as described and running it without
+  arguments, or by reading the displayProgramHelp() function.
+
+  This program converts a list of DDSM mammograms (found through
+  info-file.txt, as get-ddsm-mammo finds them) and packs the
+  calibrated images, their masks and their metadata into a few large
+  tar shards (see ddsmshards.h) rather than one file per image, so that
+  training jobs can stream them at sequential disk bandwidth. Images
+  are decoded ahead on several threads by the image loader (see
+  ddsmloader.h) while the shards are written in order.
+
+  Compilation: Compile this file using gcc: "g++ -Wall -O2 -pthread ddsmshards.c -o ddsmshards"
+*/
+
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <thread>
+
+#include "ddsmcore.h"
+#include "ddsmoverlay.h"
+#include "ddsmmask.h"
+#include "ddsmloader.h"
+#include "ddsmshards.h"
+
+// These are program error codes and messages.
+const int success = 0; // The code to return on program success.
+const int syntax_error = -1; // Exit code if the user invokes program incorrectly.
+const char* syntax_error_msg = ""; // We'll output a message manually if the program is not called correctly.
+const int program_error = -6;
+const char* program_error_msg = "Sorry, there is a problem with the program's source code!";
+const int job_file_error = -9;
+const char* job_file_error_msg = "Could not read the list of images.";
+const int info_file_error = -14;
+const char* info_file_error_msg = "Could not read the info file.";
+const int shard_error = -18;
+const char* shard_error_msg = "Could not write the shards.";
+
+// This is the name of the file that lists the files on the DDSM FTP
+// server (as used by get-ddsm-mammo), through which we find the
+// images.
+const std::string defaultInfoFile = "info-file.txt";
+
+// These are the optional arguments that may follow the mandatory ones.
+const std::string infoOption = "--info"; // Takes a value.
+const std::string rootOption = "--root"; // Takes a value.
+const std::string downsampleOption = "--downsample"; // Takes a value.
+const std::string shardSizeOption = "--shard-size"; // Takes a value.
+const std::string threadsOption = "--threads"; // Takes a value.
+const std::string memoryOption = "--memory"; // Takes a value.
+const std::string shuffleOption = "--shuffle";
+const std::string seedOption = "--seed"; // Takes a value.
+
+// The options that the user may specify after the mandatory
+// arguments.
+struct ProgramOptions
+{
+  std::string infoFile; // The info file that lists the images' files.
+  std::string root; // Where the images' files are.
+  unsigned int downsampleLevels; // Write level k of each image's pyramid (0 for full resolution).
+  unsigned long long shardSize; // The target size of each shard, in bytes.
+  unsigned int numThreads; // The number of images to decode at once.
+  unsigned long long memoryBudget; // For the images decoded ahead, in bytes.
+  bool shuffle; // Write the images in a random order.
+  unsigned int seed; // The seed of the random order.
+};
+
+
+// Display program help information.
+void displayProgramHelp()
+{
+  // We'll define the help message as an array of strings that we'll
+  // iterate over. The end of the array is marked with a special
+  // string called endString.
+  const std::string endString = "<<<END"; // Marks the end of the message.
+
+  // Here's the message array.
+  std::string
+    helpMessage[] =
+    {
+      "ddsmshards",
+      "==========\n",
+
+      "Convert DDSM mammograms into a few large tar shards for streaming.\n",
+
+      "This program converts each image in a list (calibrated exactly as by",
+      "ddsmraw2pnm, and optionally downsampled) and packs it, with a mask of its",
+      "abnormalities and its metadata, into tar files of a target size, in the layout",
+      "used by WebDataset. A corpus is then a handful of files that can be read at",
+      "sequential disk bandwidth, rather than one file per image. Images are decoded",
+      "ahead on several threads while the shards are written.\n",
+
+      "Usage: ddsmshards <image-list> <output-prefix> [options]\n",
+
+      "* <image-list> lists the names of the images to convert (e.g.",
+      "  A_1509_1.RIGHT_CC), one per line. Blank lines and lines starting with '#'",
+      "  are ignored. Each image's .ics, LJPEG.1 (as written by \"jpeg -d -s\") and",
+      "  OVERLAY files are found through the info file.\n",
+
+      "* <output-prefix> names the shards: \"<output-prefix>-00000.tar\",",
+      "  \"<output-prefix>-00001.tar\" and so on, each with an index",
+      "  \"<output-prefix>-00000.tar.idx\" giving where each member's data is. Their",
+      "  names are written to standard output. See ddsmshards.h for the layout.\n",
+
+      "* [options] may be any of the following:\n",
+
+      "  --info <info-file>   The file listing the DDSM FTP server's files (the default",
+      "                       is info-file.txt).",
+      "  --root <dir>         Where the images' files are (the default is the current",
+      "                       directory). Each file is looked for at <dir>/<path>, where",
+      "                       <path> is its path on the FTP server, and then at",
+      "                       <dir>/<name>, where <name> is its file name.",
+      "  --downsample <k>     Write each image 2^k times smaller in each direction (k",
+      "                       is from 0 to 8; the default is 0), each pixel being the",
+      "                       mean of the block it covers, as ddsmraw2pnm --pyramid does.",
+      "  --shard-size <MB>    Start a new shard once a shard reaches <MB> megabytes (the",
+      "                       default is 1024).",
+      "  --threads <n>        Decode <n> images at once (the default is the number of",
+      "                       processors).",
+      "  --memory <MB>        Keep at most <MB> megabytes of images decoded ahead (the",
+      "                       default is 2048).",
+      "  --shuffle            Write the images in a random order, rather than in the",
+      "                       order of the list.",
+      "  --seed <n>           Seed the random order (the default is 1).\n",
+
+      "Each image is a sample whose key is its name with '.' replaced by '-', made of",
+      "the members <key>.pgm (the calibrated image, as a binary PGM file with 16-bit",
+      "samples), <key>.mask.pgm (if the image has an OVERLAY file: a binary PGM file",
+      "with 8-bit samples, each the number of the abnormality whose boundary holds",
+      "the pixel, or 0) and <key>.json (the image's name, digitizer and dimensions,",
+      "and its abnormalities' lesion types, assessment, subtlety, pathology and",
+      "bounding boxes, in full-resolution pixels).\n",
+
+      "Images that could not be found or converted are reported on standard error and",
+      "skipped; the program returns zero if the shards were written.",
+
+      endString
+    };
+
+  // Now print the message line by line.
+  unsigned int i = 0; // An iterator.
+  std::string thisLine = ""; // We'll change this.
+  while((thisLine = helpMessage[i]) != endString)
+    {
+      std::cout << thisLine << std::endl; // Print the line.
+      i++; // Increment iterator.
+    }
+}
+
+
+// Function that exits with an error code and a particular error
+// message.
+void exitWith(const int errorCode, const char* errorMsg)
+{
+  std::cerr << errorMsg << std::endl;
+  exit(errorCode);
+}
+
+
+// Encode an image as a binary PGM file, with samples of one byte (if
+// maxValue is at most 255) or two bytes (most significant first).
+template <typename Pixel>
+std::vector<unsigned char> encodeBinaryPgm(const Pixel* pixels, const int numRows, const int numCols, const unsigned int maxValue)
+{
+  char header[64];
+  const int headerSize = snprintf(header, sizeof(header), "P5\n%d %d\n%u\n", numCols, numRows, maxValue);
+  const size_t numPixels = static_cast<size_t>(numRows) * numCols;
+  const size_t bytesPerPixel = (maxValue > 255) ? 2 : 1;
+  std::vector<unsigned char> pgm(header, header + headerSize);
+  pgm.resize(headerSize + bytesPerPixel * numPixels);
+  unsigned char* samples = &pgm[headerSize];
+  for(size_t i = 0; i < numPixels; i++)
+    {
+      if(bytesPerPixel == 2)
+	{
+	  samples[2 * i] = static_cast<unsigned char>(pixels[i] >> 8);
+	  samples[2 * i + 1] = static_cast<unsigned char>(pixels[i] & 0xff);
+	}
+      else
+	{
+	  samples[i] = static_cast<unsigned char>(pixels[i]);
+	}
+    }
+
+  return pgm;
+}
+
+// Write an integer field that may be missing (-1) as JSON.
+std::string jsonOptionalInteger(const int value)
+{
+  return (value < 0) ? "null" : std::to_string(value);
+}
+
+// The metadata of an image as JSON: what its .ics file says about it,
+// how it was converted and, if overlay is not NULL, its abnormalities.
+std::string getImageJson(const ImageSource& source, const LoadedImage& image, const int scale, const Overlay* overlay)
+{
+  std::string json = "{\"name\": " + jsonString(source.name)
+    + ", \"digitizer\": " + jsonString(source.digitizer)
+    + ", \"original_rows\": " + std::to_string(source.numRows)
+    + ", \"original_cols\": " + std::to_string(source.numCols)
+    + ", \"rows\": " + std::to_string(image.numRows)
+    + ", \"cols\": " + std::to_string(image.numCols)
+    + ", \"scale\": " + std::to_string(scale)
+    + ", \"abnormalities\": ";
+  if(NULL == overlay)
+    {
+      return json + "null}\n";
+    }
+
+  json += "[";
+  for(size_t i = 0; i < overlay->abnormalities.size(); i++)
+    {
+      const Abnormality& abnormality = overlay->abnormalities[i];
+      OutlineFeatures boundary;
+      computeOutlineFeatures(abnormality.boundary, &boundary);
+      json += std::string((i > 0) ? ", " : "") + "{\"abnormality\": " + std::to_string(abnormality.number) + ", \"lesion_type\": [";
+      for(size_t j = 0; j < abnormality.lesionTypes.size(); j++)
+	{
+	  json += ((j > 0) ? ", " : "") + jsonString(abnormality.lesionTypes[j]);
+	}
+      json += "], \"assessment\": " + jsonOptionalInteger(abnormality.assessment)
+	+ ", \"subtlety\": " + jsonOptionalInteger(abnormality.subtlety)
+	+ ", \"pathology\": " + (abnormality.pathology.empty() ? std::string("null") : jsonString(abnormality.pathology))
+	+ ", \"bbox\": [" + std::to_string(boundary.top) + ", " + std::to_string(boundary.left) + ", "
+	+ std::to_string(boundary.bottom) + ", " + std::to_string(boundary.right) + "]"
+	+ ", \"num_cores\": " + std::to_string(abnormality.cores.size()) + "}";
+    }
+
+  return json + "]}\n";
+}
+
+// Add an image's sample to the shards. Returns an empty string on
+// success, or otherwise a description of the problem (if the image
+// couldn't be converted; whether the shards could be written is in
+// writer->ok).
+std::string addSample(TarShardWriter* writer, const ImageSource& source, const LoadedImage& image, const int scale)
+{
+  Overlay overlay;
+  overlay.totalAbnormalities = 0;
+  int errorLine = 0;
+  if(!source.overlayFile.empty() && !readOverlayFile(source.overlayFile, &overlay, &errorLine))
+    {
+      return "could not parse the OVERLAY file" + ((errorLine > 0) ? " (line " + std::to_string(errorLine) + ")" : std::string());
+    }
+
+  const std::string key = getSampleKey(source.name);
+  const std::vector<unsigned char> pgm = encodeBinaryPgm(&image.pixels[0], image.numRows, image.numCols, maxUnsignedIntWithNumBits);
+  const std::string json = getImageJson(source, image, scale, source.overlayFile.empty() ? NULL : &overlay);
+  beginTarSample(writer);
+  addTarMember(writer, key + ".pgm", &pgm[0], pgm.size());
+  if(!source.overlayFile.empty())
+    {
+      std::vector<unsigned char> labels(static_cast<size_t>(image.numRows) * image.numCols, 0);
+      paintOverlayLabels(overlay, scale, evenOddFill, image.numRows, image.numCols, image.numCols,
+			 &labels[0], static_cast<unsigned char*>(NULL));
+      const std::vector<unsigned char> mask = encodeBinaryPgm(&labels[0], image.numRows, image.numCols, 255);
+      addTarMember(writer, key + ".mask.pgm", &mask[0], mask.size());
+    }
+  addTarMember(writer, key + ".json", json.data(), json.size());
+  return "";
+}
+
+
+// Entry point.
+int main(int argc, char* argv[])
+{
+  // Do some error checking to make sure that the user invoked us
+  // properly.
+  if(argc < 3)
+    {
+      // Output some help info and then exit.
+      displayProgramHelp();
+      exitWith(syntax_error, syntax_error_msg);
+    }
+
+  const std::string listFile = argv[1];
+  const std::string outputPrefix = argv[2];
+
+  // Read any options that follow the mandatory arguments.
+  ProgramOptions options;
+  options.infoFile = defaultInfoFile;
+  options.root = ".";
+  options.downsampleLevels = 0;
+  options.shardSize = 1024ULL << 20;
+  options.numThreads = std::thread::hardware_concurrency();
+  options.numThreads = (options.numThreads > 0) ? options.numThreads : 1;
+  options.memoryBudget = 2048ULL << 20;
+  options.shuffle = false;
+  options.seed = 1;
+  for(int i = 3; i < argc; i++)
+    {
+      const std::string option = argv[i];
+      if(option.compare(infoOption) == 0 && i + 1 < argc)
+	{
+	  options.infoFile = argv[++i];
+	}
+      else if(option.compare(rootOption) == 0 && i + 1 < argc)
+	{
+	  options.root = argv[++i];
+	}
+      else if(option.compare(downsampleOption) == 0 && i + 1 < argc
+	      && atoi(argv[i + 1]) >= 0 && atoi(argv[i + 1]) <= static_cast<int>(maxPyramidLevels))
+	{
+	  options.downsampleLevels = static_cast<unsigned int>(atoi(argv[++i]));
+	}
+      else if(option.compare(shardSizeOption) == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+	{
+	  options.shardSize = static_cast<unsigned long long>(atoi(argv[++i])) << 20;
+	}
+      else if(option.compare(threadsOption) == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+	{
+	  options.numThreads = static_cast<unsigned int>(atoi(argv[++i]));
+	}
+      else if(option.compare(memoryOption) == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+	{
+	  options.memoryBudget = static_cast<unsigned long long>(atoi(argv[++i])) << 20;
+	}
+      else if(option.compare(shuffleOption) == 0)
+	{
+	  options.shuffle = true;
+	}
+      else if(option.compare(seedOption) == 0 && i + 1 < argc)
+	{
+	  options.seed = static_cast<unsigned int>(strtoul(argv[++i], NULL, 10));
+	}
+      else
+	{
+	  // Unknown option, so output some help info and then exit.
+	  displayProgramHelp();
+	  exitWith(syntax_error, syntax_error_msg);
+	}
+    }
+
+  // Check the image sets (ranges) of the calibration functions to
+  // ensure that produce output with suitable ranges.
+  if(!checkCalibrationFunctions())
+    {
+      exitWith(program_error, program_error_msg);
+    }
+
+  // Read the list of images.
+  std::vector<std::string> names;
+  std::ifstream list(listFile.c_str());
+  if(!list)
+    {
+      exitWith(job_file_error, job_file_error_msg);
+    }
+  std::string line;
+  while(std::getline(list, line))
+    {
+      // Strip leading and trailing whitespace.
+      const size_t start = line.find_first_not_of(" \t\r\n");
+      if(start == std::string::npos || line[start] == '#')
+	{
+	  continue;
+	}
+      names.push_back(line.substr(start, line.find_last_not_of(" \t\r\n") - start + 1));
+    }
+  if(list.bad())
+    {
+      exitWith(job_file_error, job_file_error_msg);
+    }
+
+  // Find the images.
+  std::vector<ImageSource> sources;
+  std::vector<std::string> failures;
+  if(!resolveImageSources(options.infoFile, options.root, names, &sources, &failures))
+    {
+      exitWith(info_file_error, info_file_error_msg);
+    }
+  for(size_t i = 0; i < failures.size(); i++)
+    {
+      std::cerr << "Skipping " << failures[i] << "." << std::endl;
+    }
+
+  // Decode the images ahead while we write them to the shards in the
+  // order the loader serves them.
+  ImageLoaderOptions loaderOptions;
+  loaderOptions.numThreads = options.numThreads;
+  loaderOptions.numAhead = 2 * options.numThreads;
+  loaderOptions.memoryBudget = options.memoryBudget;
+  loaderOptions.downsampleLevels = options.downsampleLevels;
+  loaderOptions.shuffle = options.shuffle;
+  loaderOptions.seed = options.seed;
+  ImageLoader loader;
+  if(!openImageLoader(&loader, sources, loaderOptions))
+    {
+      exitWith(program_error, program_error_msg);
+    }
+
+  TarShardWriter writer;
+  openTarShardWriter(&writer, outputPrefix, options.shardSize);
+  LoadedImage image;
+  size_t numWritten = 0;
+  size_t numFailures = failures.size();
+  while(writer.ok && nextLoadedImage(&loader, &image))
+    {
+      const std::string problem = image.problem.empty()
+	? addSample(&writer, sources[image.source], image, 1 << options.downsampleLevels) : image.problem;
+      if(!problem.empty())
+	{
+	  std::cerr << "Skipping " << image.name << ": " << problem << "." << std::endl;
+	  numFailures++;
+	  continue;
+	}
+      numWritten++;
+    }
+  closeImageLoader(&loader);
+
+  if(!closeTarShardWriter(&writer))
+    {
+      exitWith(shard_error, shard_error_msg);
+    }
+
+  std::cerr << "Wrote " << numWritten << " images to " << writer.shardFiles.size() << " shards; skipped "
+	    << numFailures << "." << std::endl;
+
+  // Everything's OK, so send the names of the shards to stdout.
+  for(size_t i = 0; i < writer.shardFiles.size(); i++)
+    {
+      std::cout << writer.shardFiles[i] << std::endl;
+    }
+
+  exit(success);
+}
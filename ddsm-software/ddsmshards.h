@@ -0,0 +1,239 @@
+/*
+  DDSM sample shards: converted images, their masks and their metadata
+  packed into a few large tar files (in the layout used by WebDataset),
+  so that a corpus is a handful of files that can be streamed at
+  sequential disk bandwidth, rather than tens of thousands of small
+  ones. Shards are written by ddsmshards and can be read by any tar
+  reader; each one also has an index that lets a reader seek straight
+  to a member.
+
+  A set of shards is named "<prefix>-00000.tar", "<prefix>-00001.tar"
+  and so on; a new shard is started (between samples, so that a sample
+  is never split) once the current one reaches the target size. Each
+  shard is a complete POSIX (ustar) tar file. A sample is consecutive
+  members sharing a key (the image name with its '.' replaced by '-',
+  as WebDataset takes everything after the first '.' to be the
+  extension), e.g.
+
+    A_1509_1-RIGHT_CC.pgm         The calibrated image (binary 16-bit PGM).
+    A_1509_1-RIGHT_CC.mask.pgm    Its labels (binary 8-bit PGM), if it has an OVERLAY file.
+    A_1509_1-RIGHT_CC.json        Its metadata.
+
+  The index of "<prefix>-00000.tar" is the text file
+  "<prefix>-00000.tar.idx", which has a line for each member: its
+  name, the offset in the shard at which its data (not its header)
+  starts, and its size in bytes, separated by spaces.
+
+  Members are written with a modification time of 0 and no owner, so
+  converting the same images with the same options gives identical
+  shards.
+*/
+
+#ifndef DDSMSHARDS_H
+#define DDSMSHARDS_H
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+// Tar files are made of blocks of this many bytes.
+const unsigned int tarBlockSize = 512;
+
+// Where a member's data is in a shard.
+struct TarIndexEntry
+{
+  std::string member;
+  unsigned long long offset;
+  unsigned long long size;
+};
+
+// The state of a set of shards that is being written.
+struct TarShardWriter
+{
+  std::string prefix;
+  unsigned long long targetSize; // Start a new shard once a shard is at least this big.
+  unsigned int shardNumber; // The number of the current shard.
+  FILE* file; // The current shard, or NULL if none is open.
+  unsigned long long offset; // Where the next member's header goes in the current shard.
+  std::vector<TarIndexEntry> index; // Of the current shard.
+  std::vector<std::string> shardFiles; // The names of all the shards started so far.
+  bool ok; // False once anything has gone wrong.
+};
+
+// The name of shard number n of a set of shards.
+inline std::string getTarShardFile(const std::string& prefix, const unsigned int n)
+{
+  char number[16];
+  snprintf(number, sizeof(number), "%05u", n);
+  return prefix + "-" + number + ".tar";
+}
+
+// The name of the index of a shard.
+inline std::string getTarIndexFile(const std::string& shardFile)
+{
+  return shardFile + ".idx";
+}
+
+// The key of an image's sample.
+inline std::string getSampleKey(const std::string& imageName)
+{
+  std::string key = imageName;
+  std::replace(key.begin(), key.end(), '.', '-');
+  return key;
+}
+
+// Start writing a set of shards. No file is created until the first
+// sample is started.
+inline void openTarShardWriter(TarShardWriter* writer, const std::string& prefix, const unsigned long long targetSize)
+{
+  writer->prefix = prefix;
+  writer->targetSize = targetSize;
+  writer->shardNumber = 0;
+  writer->file = NULL;
+  writer->offset = 0;
+  writer->index.clear();
+  writer->shardFiles.clear();
+  writer->ok = true;
+}
+
+// Finish the current shard, if there is one: end the archive (with two
+// empty blocks), close it and write its index.
+inline void finishTarShard(TarShardWriter* writer)
+{
+  if(NULL == writer->file)
+    {
+      return;
+    }
+
+  const std::vector<char> end(2 * tarBlockSize, '\0');
+  writer->ok = (fwrite(&end[0], 1, end.size(), writer->file) == end.size()) && writer->ok;
+  writer->ok = (fclose(writer->file) == 0) && writer->ok;
+  writer->file = NULL;
+
+  FILE* indexFile = fopen(getTarIndexFile(writer->shardFiles.back()).c_str(), "w");
+  writer->ok = (NULL != indexFile) && writer->ok;
+  for(size_t i = 0; i < writer->index.size() && writer->ok; i++)
+    {
+      writer->ok = fprintf(indexFile, "%s %llu %llu\n", writer->index[i].member.c_str(),
+			   writer->index[i].offset, writer->index[i].size) > 0;
+    }
+  if(NULL != indexFile)
+    {
+      writer->ok = (fclose(indexFile) == 0) && writer->ok;
+    }
+  writer->index.clear();
+  writer->shardNumber++;
+}
+
+// Start a sample, starting a new shard first if the current one has
+// reached the target size. Returns true on success.
+inline bool beginTarSample(TarShardWriter* writer)
+{
+  if(NULL != writer->file && writer->offset >= writer->targetSize)
+    {
+      finishTarShard(writer);
+    }
+
+  if(NULL == writer->file && writer->ok)
+    {
+      writer->shardFiles.push_back(getTarShardFile(writer->prefix, writer->shardNumber));
+      writer->file = fopen(writer->shardFiles.back().c_str(), "wb");
+      writer->ok = (NULL != writer->file);
+      writer->offset = 0;
+    }
+
+  return writer->ok;
+}
+
+// Fill in a ustar header for a regular file. Returns false if the name
+// is too long for the header.
+inline bool makeTarHeader(const std::string& name, const unsigned long long size, unsigned char header[tarBlockSize])
+{
+  if(name.size() > 100)
+    {
+      return false;
+    }
+
+  memset(header, 0, tarBlockSize);
+  memcpy(header, name.data(), name.size()); // The name.
+  memcpy(header + 100, "0000644", 7); // The mode.
+  memcpy(header + 108, "0000000", 7); // The owner's user ID.
+  memcpy(header + 116, "0000000", 7); // The owner's group ID.
+  snprintf(reinterpret_cast<char*>(header + 124), 12, "%011llo", size); // The size.
+  memcpy(header + 136, "00000000000", 11); // The modification time.
+  header[156] = '0'; // A regular file.
+  memcpy(header + 257, "ustar", 6); // The magic, with its NUL.
+  memcpy(header + 263, "00", 2); // The version.
+
+  // The checksum is of the header with the checksum field as spaces.
+  memset(header + 148, ' ', 8);
+  unsigned int checksum = 0;
+  for(unsigned int i = 0; i < tarBlockSize; i++)
+    {
+      checksum += header[i];
+    }
+  snprintf(reinterpret_cast<char*>(header + 148), 8, "%06o", checksum);
+  header[155] = ' ';
+  return true;
+}
+
+// Add a member to the current sample (see beginTarSample()). Returns
+// true on success.
+inline bool addTarMember(TarShardWriter* writer, const std::string& name, const void* data, const size_t size)
+{
+  unsigned char header[tarBlockSize];
+  writer->ok = writer->ok && (NULL != writer->file) && makeTarHeader(name, size, header);
+  if(!writer->ok)
+    {
+      return false;
+    }
+
+  // The data is padded to a whole number of blocks.
+  const size_t padding = (tarBlockSize - size % tarBlockSize) % tarBlockSize;
+  const std::vector<char> zeros(padding, '\0');
+  writer->ok = (fwrite(header, 1, tarBlockSize, writer->file) == tarBlockSize)
+    && (fwrite(data, 1, size, writer->file) == size)
+    && (padding == 0 || fwrite(&zeros[0], 1, padding, writer->file) == padding);
+
+  TarIndexEntry entry;
+  entry.member = name;
+  entry.offset = writer->offset + tarBlockSize;
+  entry.size = size;
+  writer->index.push_back(entry);
+  writer->offset += tarBlockSize + size + padding;
+  return writer->ok;
+}
+
+// Finish writing a set of shards. Returns true if every shard (and
+// index) was written successfully.
+inline bool closeTarShardWriter(TarShardWriter* writer)
+{
+  finishTarShard(writer);
+  return writer->ok;
+}
+
+// Read the index of a shard. Returns true on success.
+inline bool readTarIndex(const std::string& indexFile, std::vector<TarIndexEntry>* index)
+{
+  std::ifstream input(indexFile.c_str());
+  std::string line;
+  index->clear();
+  while(std::getline(input, line))
+    {
+      std::istringstream fields(line);
+      TarIndexEntry entry;
+      if(!(fields >> entry.member >> entry.offset >> entry.size))
+	{
+	  return false;
+	}
+      index->push_back(entry);
+    }
+
+  return !input.bad() && input.eof();
+}
+
+#endif // DDSMSHARDS_H
@@ -0,0 +1,917 @@
+/*
+  The following is very brief; full program documentation can be found
+  by compiling this program as described and running it without
+  arguments, or by reading the displayProgramHelp() function.
+
+  This program computes statistics over a whole corpus of DDSM
+  mammograms (the histograms of raw and calibrated grey levels, their
+  percentiles, how often each calibration function clamps its input
+  and the distribution of image dimensions), aggregated for the whole
+  corpus, for each digitizer and for each DDSM volume. It reads either
+  the histogram files written by "ddsmraw2pnm --histogram" or the raw
+  (LJPEG.1) files themselves, using several threads, and checkpoints
+  its progress so that an interrupted job can be resumed.
+
+  Compilation: Compile this file using gcc: "g++ -Wall -O2 -pthread ddsmstats.c -o ddsmstats"
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <utility>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <unistd.h>
+
+#include "ddsmcore.h"
+
+// These are program error codes and messages.
+const int success = 0; // The code to return on program success.
+const int syntax_error = -1; // Exit code if the user invokes program incorrectly.
+const char* syntax_error_msg = ""; // We'll output a message manually if the program is not called correctly.
+const int file_error = -4;
+const char* file_error_msg = "A file error was detected at runtime.";
+const int program_error = -6;
+const char* program_error_msg = "Sorry, there is a problem with the program's source code!";
+const int job_file_error = -9;
+const char* job_file_error_msg = "Could not read the job file.";
+const int checkpoint_error = -10;
+const char* checkpoint_error_msg = "Could not read or write the checkpoint file.";
+const int report_error = -11;
+const char* report_error_msg = "Could not write the report file.";
+
+// This is the suffix applied to the report filename to create the
+// checkpoint filename.
+const std::string checkpointSuffix = ".checkpoint";
+
+// This is the name of the file that lists the files on the DDSM FTP
+// server (as used by get-ddsm-mammo), from which we work out which
+// volume each image belongs to.
+const std::string defaultInfoFile = "info-file.txt";
+
+// These are the optional arguments that may follow the mandatory ones.
+const std::string threadsOption = "--threads"; // Takes a value.
+const std::string infoOption = "--info"; // Takes a value.
+const std::string checkpointEveryOption = "--checkpoint-every"; // Takes a value.
+
+// The options that the user may specify after the mandatory
+// arguments.
+struct ProgramOptions
+{
+  unsigned int numThreads; // The number of images to process at once.
+  std::string infoFile; // The info file used to map images to volumes.
+  unsigned int checkpointEvery; // How many images each thread processes between checkpoints.
+};
+
+// We read raw files in bands of this many rows.
+const int numBandRows = 64;
+
+// The percentiles we report for the raw and calibrated grey levels.
+const double reportedPercentiles[] = {1.0, 5.0, 25.0, 50.0, 75.0, 95.0, 99.0};
+const unsigned int numReportedPercentiles = sizeof(reportedPercentiles) / sizeof(reportedPercentiles[0]);
+
+
+// Display program help information.
+void displayProgramHelp()
+{
+  // We'll define the help message as an array of strings that we'll
+  // iterate over. The end of the array is marked with a special
+  // string called endString.
+  const std::string endString = "<<<END"; // Marks the end of the message.
+
+  // Here's the message array.
+  std::string
+    helpMessage[] =
+    {
+      "ddsmstats",
+      "=========\n",
+
+      "Compute grey level and image dimension statistics over a corpus of DDSM mammograms.\n",
+
+      "This program aggregates, over every image in a job, the histograms of the raw",
+      "and of the calibrated grey levels (as produced by ddsmraw2pnm), percentiles of",
+      "both, how often each digitizer's calibration function had to clamp raw values",
+      "that were out of its range, and the distribution of image dimensions. The",
+      "statistics are reported for the whole corpus, for each digitizer and for each",
+      "DDSM volume (e.g. \"cancer_08\"), so that the claim that calibrated grey levels",
+      "are comparable across the four digitizers can be checked at corpus scale.\n",
+
+      "Usage: ddsmstats <job-file> <report-file> [options]\n",
+
+      "* <job-file> lists the images to process, one per line. Each line is either:\n",
+
+      "  - the name of a histogram file written by \"ddsmraw2pnm --histogram\" (which is",
+      "    by far the quickest way to run a job over an already converted corpus), or\n",
+
+      "  - <some-ddsm-raw-file> <num-rows> <num-cols> <digitizer>, i.e. the arguments",
+      "    you would give to ddsmraw2pnm for a raw (LJPEG.1) file.\n",
+
+      "  Blank lines and lines starting with '#' are ignored.\n",
+
+      "* <report-file> is the name of the (JSON) report file to write.\n",
+
+      "* [options] may be any of the following:\n",
+
+      "  --threads <n>           Process <n> images at once (the default is the number",
+      "                          of processors).",
+      "  --info <info-file>      The file listing the DDSM FTP server's files, used to",
+      "                          find each image's volume (the default is info-file.txt).",
+      "                          Images that can't be found are put in volume \"unknown\".",
+      "  --checkpoint-every <n>  Merge each thread's partial results and checkpoint after",
+      "                          every <n> images it processes (the default is 100).\n",
+
+      "Progress is checkpointed to \"<report-file>.checkpoint\", which holds the merged",
+      "statistics and the list of job lines that have been processed. If the program",
+      "is interrupted, run it again with the same arguments and it will carry on where",
+      "it left off; adding lines to the job file and running it again only processes",
+      "the new lines. Delete the checkpoint file to start from scratch.\n",
+
+      "On success the program writes the name of the report file to standard output",
+      "and returns zero. Images that could not be processed are listed in the report",
+      "(and are not checkpointed, so they will be tried again next time).",
+
+      endString
+    };
+
+  // Now print the message line by line.
+  unsigned int i = 0; // An iterator.
+  std::string thisLine = ""; // We'll change this.
+  while((thisLine = helpMessage[i]) != endString)
+    {
+      std::cout << thisLine << std::endl; // Print the line.
+      i++; // Increment iterator.
+    }
+}
+
+
+// Function that exits with an error code and a particular error
+// message.
+void exitWith(const int errorCode, const char* errorMsg)
+{
+  std::cerr << errorMsg << std::endl;
+  exit(errorCode);
+}
+
+
+// The statistics for a group of images (e.g. all those digitized by
+// one digitizer). The histograms use 64-bit counts as a corpus has far
+// more than 2^32 pixels.
+struct GroupStats
+{
+  unsigned long long numImages;
+  unsigned long long numPixels;
+  unsigned long long numLowClamped; // Raw values clamped up to the calibration function's minimum.
+  unsigned long long numHighClamped; // Raw values clamped down to the calibration function's maximum.
+  std::vector<unsigned long long> raw; // Histogram of raw grey levels.
+  std::vector<unsigned long long> calibrated; // Histogram of calibrated grey levels.
+  std::map<std::pair<int, int>, unsigned long long> dimensions; // Number of images with each (rows, cols).
+};
+
+// The statistics for all groups, keyed by group name: "all",
+// "digitizer:<name>" and "volume:<name>". Also records which job
+// lines have been processed, so that the two are always checkpointed
+// together.
+struct CorpusStats
+{
+  std::map<std::string, GroupStats> groups;
+  std::set<std::string> completedJobs;
+};
+
+// The statistics for a single image.
+struct ImageStats
+{
+  int numRows;
+  int numCols;
+  std::string digitizer;
+  std::string volume;
+  PixelHistograms histograms;
+};
+
+// Return the statistics for the named group, creating empty ones if
+// necessary.
+GroupStats& getGroup(CorpusStats* stats, const std::string& name)
+{
+  std::map<std::string, GroupStats>::iterator it = stats->groups.find(name);
+  if(it == stats->groups.end())
+    {
+      GroupStats empty;
+      empty.numImages = 0;
+      empty.numPixels = 0;
+      empty.numLowClamped = 0;
+      empty.numHighClamped = 0;
+      empty.raw.assign(numHistogramBins, 0);
+      empty.calibrated.assign(numHistogramBins, 0);
+      it = stats->groups.insert(std::make_pair(name, empty)).first;
+    }
+
+  return it->second;
+}
+
+// Add the statistics for one image to a group.
+void addImageToGroup(GroupStats& group, const ImageStats& image)
+{
+  unsigned long long numLow = 0;
+  unsigned long long numHigh = 0;
+  countClampedPixels(getCalibrationFunction(image.digitizer), image.histograms.raw, &numLow, &numHigh);
+
+  group.numImages++;
+  group.numPixels += static_cast<unsigned long long>(image.numRows) * image.numCols;
+  group.numLowClamped += numLow;
+  group.numHighClamped += numHigh;
+  for(unsigned int v = 0; v < numHistogramBins; v++)
+    {
+      group.raw[v] += image.histograms.raw[v];
+      group.calibrated[v] += image.histograms.calibrated[v];
+    }
+  group.dimensions[std::make_pair(image.numRows, image.numCols)]++;
+}
+
+// Add the statistics for one image to all the groups it belongs to,
+// and record that its job line has been processed.
+void addImage(CorpusStats* stats, const std::string& jobLine, const ImageStats& image)
+{
+  addImageToGroup(getGroup(stats, "all"), image);
+  addImageToGroup(getGroup(stats, "digitizer:" + image.digitizer), image);
+  addImageToGroup(getGroup(stats, "volume:" + image.volume), image);
+  stats->completedJobs.insert(jobLine);
+}
+
+// Merge one set of (e.g. a thread's partial) statistics into another.
+void mergeCorpusStats(CorpusStats* into, const CorpusStats& from)
+{
+  for(std::map<std::string, GroupStats>::const_iterator it = from.groups.begin(); it != from.groups.end(); ++it)
+    {
+      const GroupStats& source = it->second;
+      GroupStats& group = getGroup(into, it->first);
+      group.numImages += source.numImages;
+      group.numPixels += source.numPixels;
+      group.numLowClamped += source.numLowClamped;
+      group.numHighClamped += source.numHighClamped;
+      for(unsigned int v = 0; v < numHistogramBins; v++)
+	{
+	  group.raw[v] += source.raw[v];
+	  group.calibrated[v] += source.calibrated[v];
+	}
+      for(std::map<std::pair<int, int>, unsigned long long>::const_iterator d = source.dimensions.begin();
+	  d != source.dimensions.end(); ++d)
+	{
+	  group.dimensions[d->first] += d->second;
+	}
+    }
+
+  into->completedJobs.insert(from.completedJobs.begin(), from.completedJobs.end());
+}
+
+
+// Return the name of the image that a file belongs to, i.e. its base
+// name up to (but not including) ".LJPEG"; for example, both
+// "dir/A_1141_1.LEFT_MLO.LJPEG.1" and
+// "A_1141_1.LEFT_MLO.LJPEG.1-ddsmraw2pnm.pnm.hist" belong to
+// "A_1141_1.LEFT_MLO".
+std::string getImageName(const std::string& path)
+{
+  const size_t slash = path.find_last_of("/\\");
+  std::string name = (slash == std::string::npos) ? path : path.substr(slash + 1);
+  const size_t suffix = name.find(".LJPEG");
+  if(suffix != std::string::npos)
+    {
+      name = name.substr(0, suffix);
+    }
+
+  return name;
+}
+
+// Read the info file and return a map from each image name to the
+// name of the volume (e.g. "cancer_08") that holds it. The info file
+// lists paths such as
+// "/pub/DDSM/cases/cancers/cancer_08/case1509/A_1509_1.RIGHT_CC.LJPEG".
+// If the file can't be read we return an empty map.
+std::map<std::string, std::string> readVolumes(const std::string& infoFile)
+{
+  std::map<std::string, std::string> volumes;
+  std::ifstream info(infoFile.c_str());
+  std::string line;
+  while(std::getline(info, line))
+    {
+      // Strip any trailing whitespace (e.g. a carriage return).
+      line = line.substr(0, line.find_last_not_of(" \t\r\n") + 1);
+
+      const size_t suffix = line.rfind(".LJPEG");
+      if(suffix == std::string::npos || suffix + 6 != line.size())
+	{
+	  continue; // Not an image.
+	}
+
+      // The volume is the directory above the case directory.
+      const size_t nameStart = line.rfind('/');
+      const size_t caseStart = (nameStart == std::string::npos || nameStart == 0) ? std::string::npos : line.rfind('/', nameStart - 1);
+      const size_t volumeStart = (caseStart == std::string::npos || caseStart == 0) ? std::string::npos : line.rfind('/', caseStart - 1);
+      if(volumeStart == std::string::npos)
+	{
+	  continue;
+	}
+
+      volumes[getImageName(line)] = line.substr(volumeStart + 1, caseStart - volumeStart - 1);
+    }
+
+  return volumes;
+}
+
+
+// Compute the statistics for a raw (LJPEG.1) file. The calibration
+// tables are indexed by the same digitizer names as
+// getCalibrationFunction(). Returns an empty string on success or a
+// description of the problem otherwise.
+std::string processRawFile(const std::string& rawFile,
+			   const std::map<std::string, std::vector<unsigned int> >& calibrationTables,
+			   ImageStats* image)
+{
+  std::map<std::string, std::vector<unsigned int> >::const_iterator table = calibrationTables.find(image->digitizer);
+  if(table == calibrationTables.end())
+    {
+      return "unknown digitizer \"" + image->digitizer + "\"";
+    }
+  if(image->numRows < 1 || image->numCols < 1)
+    {
+      return "the number of rows and cols must be positive";
+    }
+
+  FILE* input = fopen(rawFile.c_str(), "rb");
+  if(NULL == input)
+    {
+      return "could not open the file";
+    }
+
+  clearHistograms(&image->histograms);
+  std::vector<unsigned char> rawBytes(2 * static_cast<size_t>(image->numCols) * numBandRows);
+  std::vector<unsigned int> pixels(static_cast<size_t>(image->numCols) * numBandRows);
+  std::string problem = "";
+  for(int bandStart = 0; bandStart < image->numRows && problem.empty(); bandStart += numBandRows)
+    {
+      const int bandRows = std::min(image->numRows - bandStart, numBandRows);
+      const size_t bandBytes = 2 * static_cast<size_t>(image->numCols) * bandRows;
+      if(fread(&rawBytes[0], 1, bandBytes, input) != bandBytes)
+	{
+	  problem = ferror(input) ? "a file read error occurred" : "the file is smaller than the image dimensions say";
+	  break;
+	}
+
+      unpackRow(&rawBytes[0], &pixels[0], image->numCols * bandRows);
+      histogramRow(&pixels[0], image->numCols * bandRows, image->histograms.raw);
+    }
+
+  if(problem.empty() && fgetc(input) != EOF)
+    {
+      problem = "the file is larger than the image dimensions say";
+    }
+  fclose(input);
+
+  // Calibrate the histogram rather than the pixels.
+  for(unsigned int v = 0; v < numHistogramBins && problem.empty(); v++)
+    {
+      image->histograms.calibrated[table->second[v]] += image->histograms.raw[v];
+    }
+
+  return problem;
+}
+
+// Compute the statistics for one line of the job file. Returns an
+// empty string on success or a description of the problem otherwise.
+std::string processJob(const std::string& jobLine,
+		       const std::map<std::string, std::string>& volumes,
+		       const std::map<std::string, std::vector<unsigned int> >& calibrationTables,
+		       ImageStats* image)
+{
+  std::istringstream fields(jobLine);
+  std::vector<std::string> words;
+  std::string word;
+  while(fields >> word)
+    {
+      words.push_back(word);
+    }
+
+  std::string problem = "";
+  if(words.size() == 1)
+    {
+      if(!readHistogramFile(words[0], &image->numRows, &image->numCols, &image->digitizer, &image->histograms))
+	{
+	  problem = "could not read the histogram file";
+	}
+      else if(NULL == getCalibrationFunction(image->digitizer))
+	{
+	  problem = "unknown digitizer \"" + image->digitizer + "\"";
+	}
+    }
+  else if(words.size() == 4)
+    {
+      image->numRows = atoi(words[1].c_str());
+      image->numCols = atoi(words[2].c_str());
+      image->digitizer = words[3];
+      problem = processRawFile(words[0], calibrationTables, image);
+    }
+  else
+    {
+      problem = "expected a histogram file name or four fields";
+    }
+
+  const std::map<std::string, std::string>::const_iterator volume = volumes.find(getImageName(words.empty() ? "" : words[0]));
+  image->volume = (volume == volumes.end()) ? "unknown" : volume->second;
+  return problem;
+}
+
+
+// Read a 64-bit little-endian unsigned integer. Returns true on
+// success.
+bool readLittleEndian64(FILE* input, unsigned long long* value)
+{
+  unsigned int low = 0;
+  unsigned int high = 0;
+  const bool ok = readLittleEndian32(input, &low) && readLittleEndian32(input, &high);
+  *value = (static_cast<unsigned long long>(high) << 32) | low;
+  return ok;
+}
+
+// Write a string as its length followed by its characters. Returns
+// true on success.
+bool writeString(FILE* output, const std::string& s)
+{
+  return writeLittleEndian32(output, static_cast<unsigned int>(s.size()))
+    && fwrite(s.data(), 1, s.size(), output) == s.size();
+}
+
+// Read a string written by writeString(). Returns true on success.
+bool readString(FILE* input, std::string* s)
+{
+  unsigned int length = 0;
+  if(!readLittleEndian32(input, &length) || length > 65536)
+    {
+      return false;
+    }
+
+  std::vector<char> buffer(length + 1, '\0');
+  const bool ok = fread(&buffer[0], 1, length, input) == length;
+  *s = std::string(&buffer[0], length);
+  return ok;
+}
+
+// Write a histogram with 64-bit counts sparsely, as for
+// writeSparseHistogram(). Returns true on success.
+bool writeSparseHistogram64(FILE* output, const std::vector<unsigned long long>& histogram)
+{
+  unsigned int numNonEmptyBins = 0;
+  for(unsigned int v = 0; v < histogram.size(); v++)
+    {
+      numNonEmptyBins += (histogram[v] > 0) ? 1 : 0;
+    }
+
+  bool ok = writeLittleEndian32(output, numNonEmptyBins);
+  for(unsigned int v = 0; v < histogram.size() && ok; v++)
+    {
+      if(histogram[v] > 0)
+	{
+	  ok = writeLittleEndian32(output, v) && writeLittleEndian64(output, histogram[v]);
+	}
+    }
+
+  return ok;
+}
+
+// Read a histogram written by writeSparseHistogram64(). Returns true
+// on success.
+bool readSparseHistogram64(FILE* input, std::vector<unsigned long long>& histogram)
+{
+  unsigned int numNonEmptyBins = 0;
+  bool ok = readLittleEndian32(input, &numNonEmptyBins) && numNonEmptyBins <= histogram.size();
+  for(unsigned int i = 0; i < numNonEmptyBins && ok; i++)
+    {
+      unsigned int v = 0;
+      unsigned long long count = 0;
+      ok = readLittleEndian32(input, &v) && readLittleEndian64(input, &count) && v < histogram.size();
+      if(ok)
+	{
+	  histogram[v] = count;
+	}
+    }
+
+  return ok;
+}
+
+// Write the checkpoint file. We write to a temporary file, flush it to
+// disk and then rename it over the checkpoint file, so that the
+// checkpoint file is always complete even if we are interrupted. The
+// format is (integers are little-endian; see the functions above):
+//
+//   "DDSMSTCK", version (1)
+//   number of completed job lines, then each job line
+//   number of groups, then for each group: its name, number of images,
+//   number of pixels, numbers of low and high clamped pixels, number
+//   of distinct dimensions followed by (rows, cols, count) for each,
+//   then the raw and calibrated histograms.
+//
+// Returns true on success.
+bool writeCheckpoint(const std::string& checkpointFile, const CorpusStats& stats)
+{
+  const std::string tempFile = checkpointFile + ".tmp";
+  FILE* output = fopen(tempFile.c_str(), "wb");
+  if(NULL == output)
+    {
+      return false;
+    }
+
+  bool ok = (fwrite("DDSMSTCK", 1, 8, output) == 8) && writeLittleEndian32(output, 1);
+
+  ok = ok && writeLittleEndian32(output, static_cast<unsigned int>(stats.completedJobs.size()));
+  for(std::set<std::string>::const_iterator it = stats.completedJobs.begin(); it != stats.completedJobs.end() && ok; ++it)
+    {
+      ok = writeString(output, *it);
+    }
+
+  ok = ok && writeLittleEndian32(output, static_cast<unsigned int>(stats.groups.size()));
+  for(std::map<std::string, GroupStats>::const_iterator it = stats.groups.begin(); it != stats.groups.end() && ok; ++it)
+    {
+      const GroupStats& group = it->second;
+      ok = writeString(output, it->first)
+	&& writeLittleEndian64(output, group.numImages)
+	&& writeLittleEndian64(output, group.numPixels)
+	&& writeLittleEndian64(output, group.numLowClamped)
+	&& writeLittleEndian64(output, group.numHighClamped)
+	&& writeLittleEndian32(output, static_cast<unsigned int>(group.dimensions.size()));
+      for(std::map<std::pair<int, int>, unsigned long long>::const_iterator d = group.dimensions.begin();
+	  d != group.dimensions.end() && ok; ++d)
+	{
+	  ok = writeLittleEndian32(output, d->first.first)
+	    && writeLittleEndian32(output, d->first.second)
+	    && writeLittleEndian64(output, d->second);
+	}
+      ok = ok && writeSparseHistogram64(output, group.raw) && writeSparseHistogram64(output, group.calibrated);
+    }
+
+  ok = ok && (fflush(output) == 0) && (fsync(fileno(output)) == 0);
+  ok = (fclose(output) == 0) && ok;
+  ok = ok && (rename(tempFile.c_str(), checkpointFile.c_str()) == 0);
+  return ok;
+}
+
+// Read the checkpoint file into stats (which should be empty). If
+// there is no checkpoint file we leave stats empty and return true;
+// otherwise we return true if the file could be read.
+bool readCheckpoint(const std::string& checkpointFile, CorpusStats* stats)
+{
+  FILE* input = fopen(checkpointFile.c_str(), "rb");
+  if(NULL == input)
+    {
+      return true; // Nothing to resume.
+    }
+
+  char magic[8];
+  unsigned int version = 0;
+  unsigned int count = 0;
+  bool ok = (fread(magic, 1, 8, input) == 8) && (memcmp(magic, "DDSMSTCK", 8) == 0);
+  ok = ok && readLittleEndian32(input, &version) && version == 1;
+
+  ok = ok && readLittleEndian32(input, &count);
+  for(unsigned int i = 0; i < count && ok; i++)
+    {
+      std::string jobLine;
+      ok = readString(input, &jobLine);
+      stats->completedJobs.insert(jobLine);
+    }
+
+  ok = ok && readLittleEndian32(input, &count);
+  for(unsigned int i = 0; i < count && ok; i++)
+    {
+      std::string name;
+      unsigned int numDimensions = 0;
+      ok = readString(input, &name);
+      GroupStats& group = getGroup(stats, name);
+      ok = ok && readLittleEndian64(input, &group.numImages)
+	&& readLittleEndian64(input, &group.numPixels)
+	&& readLittleEndian64(input, &group.numLowClamped)
+	&& readLittleEndian64(input, &group.numHighClamped)
+	&& readLittleEndian32(input, &numDimensions);
+      for(unsigned int d = 0; d < numDimensions && ok; d++)
+	{
+	  unsigned int rows = 0;
+	  unsigned int cols = 0;
+	  unsigned long long images = 0;
+	  ok = readLittleEndian32(input, &rows) && readLittleEndian32(input, &cols) && readLittleEndian64(input, &images);
+	  group.dimensions[std::make_pair(static_cast<int>(rows), static_cast<int>(cols))] = images;
+	}
+      ok = ok && readSparseHistogram64(input, group.raw) && readSparseHistogram64(input, group.calibrated);
+    }
+
+  fclose(input);
+  return ok;
+}
+
+
+// Write the summary of one grey level histogram as a JSON object:
+// the minimum, maximum and mean grey level and the percentiles in
+// reportedPercentiles.
+void writeHistogramSummary(FILE* output, const std::vector<unsigned long long>& histogram)
+{
+  unsigned long long total = 0;
+  double sum = 0.0;
+  int minValue = -1;
+  int maxValue = -1;
+  for(unsigned int v = 0; v < histogram.size(); v++)
+    {
+      if(histogram[v] > 0)
+	{
+	  minValue = (minValue < 0) ? static_cast<int>(v) : minValue;
+	  maxValue = static_cast<int>(v);
+	  total += histogram[v];
+	  sum += static_cast<double>(v) * static_cast<double>(histogram[v]);
+	}
+    }
+
+  fprintf(output, "{\"min\": %d, \"max\": %d, \"mean\": %.3f, \"percentiles\": {",
+	  minValue, maxValue, (total > 0) ? sum / static_cast<double>(total) : 0.0);
+
+  // The p-th percentile is the smallest grey level such that at least
+  // p% of the pixels are no brighter than it.
+  unsigned long long cumulative = 0;
+  unsigned int v = 0;
+  for(unsigned int p = 0; p < numReportedPercentiles; p++)
+    {
+      const double target = (reportedPercentiles[p] / 100.0) * static_cast<double>(total);
+      while(v < histogram.size() && (cumulative == 0 || static_cast<double>(cumulative) < target))
+	{
+	  cumulative += histogram[v];
+	  v++;
+	}
+      fprintf(output, "%s\"%g\": %d", (p > 0) ? ", " : "", reportedPercentiles[p], (total > 0) ? static_cast<int>(v) - 1 : -1);
+    }
+
+  fprintf(output, "}}");
+}
+
+// Write the report file (as JSON). Returns true on success.
+bool writeReport(const std::string& reportFile, const CorpusStats& stats, const std::vector<std::string>& failures)
+{
+  FILE* output = fopen(reportFile.c_str(), "wb");
+  if(NULL == output)
+    {
+      return false;
+    }
+
+  fprintf(output, "{\n  \"images\": %u,\n  \"failures\": [", static_cast<unsigned int>(stats.completedJobs.size()));
+  for(unsigned int i = 0; i < failures.size(); i++)
+    {
+      fprintf(output, "%s\n    %s", (i > 0) ? "," : "", jsonString(failures[i]).c_str());
+    }
+  fprintf(output, "%s],\n  \"groups\": {", failures.empty() ? "" : "\n  ");
+
+  bool first = true;
+  for(std::map<std::string, GroupStats>::const_iterator it = stats.groups.begin(); it != stats.groups.end(); ++it)
+    {
+      const GroupStats& group = it->second;
+      const double numPixels = (group.numPixels > 0) ? static_cast<double>(group.numPixels) : 1.0;
+      fprintf(output, "%s\n    %s: {\n", first ? "" : ",", jsonString(it->first).c_str());
+      fprintf(output, "      \"images\": %llu,\n      \"pixels\": %llu,\n", group.numImages, group.numPixels);
+
+      // Summarise the dimensions, then list them all.
+      int minRows = 0, maxRows = 0, minCols = 0, maxCols = 0;
+      double sumRows = 0.0, sumCols = 0.0;
+      for(std::map<std::pair<int, int>, unsigned long long>::const_iterator d = group.dimensions.begin();
+	  d != group.dimensions.end(); ++d)
+	{
+	  const bool firstDimension = (d == group.dimensions.begin());
+	  minRows = (firstDimension || d->first.first < minRows) ? d->first.first : minRows;
+	  maxRows = (firstDimension || d->first.first > maxRows) ? d->first.first : maxRows;
+	  minCols = (firstDimension || d->first.second < minCols) ? d->first.second : minCols;
+	  maxCols = (firstDimension || d->first.second > maxCols) ? d->first.second : maxCols;
+	  sumRows += static_cast<double>(d->first.first) * static_cast<double>(d->second);
+	  sumCols += static_cast<double>(d->first.second) * static_cast<double>(d->second);
+	}
+      const double numImages = (group.numImages > 0) ? static_cast<double>(group.numImages) : 1.0;
+      fprintf(output, "      \"rows\": {\"min\": %d, \"max\": %d, \"mean\": %.1f},\n", minRows, maxRows, sumRows / numImages);
+      fprintf(output, "      \"cols\": {\"min\": %d, \"max\": %d, \"mean\": %.1f},\n", minCols, maxCols, sumCols / numImages);
+      fprintf(output, "      \"dimensions\": [");
+      for(std::map<std::pair<int, int>, unsigned long long>::const_iterator d = group.dimensions.begin();
+	  d != group.dimensions.end(); ++d)
+	{
+	  fprintf(output, "%s[%d, %d, %llu]", (d == group.dimensions.begin()) ? "" : ", ", d->first.first, d->first.second, d->second);
+	}
+      fprintf(output, "],\n");
+
+      fprintf(output, "      \"raw\": ");
+      writeHistogramSummary(output, group.raw);
+      fprintf(output, ",\n      \"calibrated\": ");
+      writeHistogramSummary(output, group.calibrated);
+      fprintf(output, ",\n      \"clamped\": {\"low\": %llu, \"high\": %llu, \"low_rate\": %.6g, \"high_rate\": %.6g}\n    }",
+	      group.numLowClamped, group.numHighClamped,
+	      static_cast<double>(group.numLowClamped) / numPixels, static_cast<double>(group.numHighClamped) / numPixels);
+      first = false;
+    }
+
+  fprintf(output, "\n  }\n}\n");
+  return fclose(output) == 0;
+}
+
+
+// Everything the worker threads share. The merged statistics, the
+// failures and the checkpoint file are protected by the mutex; each
+// thread claims the next job using the atomic counter.
+struct JobState
+{
+  std::vector<std::string> jobLines; // The job lines still to process.
+  std::atomic<size_t> nextJob;
+  std::map<std::string, std::string> volumes;
+  std::map<std::string, std::vector<unsigned int> > calibrationTables;
+  unsigned int checkpointEvery;
+  std::string checkpointFile;
+
+  std::mutex mutex;
+  CorpusStats merged;
+  std::vector<std::string> failures;
+  bool checkpointOk;
+};
+
+// Merge a thread's partial statistics into the shared ones, write a
+// checkpoint and empty the partial statistics.
+void mergeAndCheckpoint(JobState* state, CorpusStats* partial)
+{
+  std::lock_guard<std::mutex> lock(state->mutex);
+  if(partial->completedJobs.empty())
+    {
+      return;
+    }
+
+  mergeCorpusStats(&state->merged, *partial);
+  *partial = CorpusStats();
+  if(!writeCheckpoint(state->checkpointFile, state->merged))
+    {
+      state->checkpointOk = false;
+    }
+}
+
+// The body of each worker thread: claim jobs until there are none
+// left, accumulating into partial statistics that are merged (and
+// checkpointed) every state->checkpointEvery images.
+void processJobs(JobState* state)
+{
+  CorpusStats partial;
+  unsigned int numSinceCheckpoint = 0;
+  ImageStats image;
+  size_t job = 0;
+  while((job = state->nextJob++) < state->jobLines.size())
+    {
+      const std::string& jobLine = state->jobLines[job];
+      const std::string problem = processJob(jobLine, state->volumes, state->calibrationTables, &image);
+      if(!problem.empty())
+	{
+	  std::lock_guard<std::mutex> lock(state->mutex);
+	  std::cerr << "Skipping \"" << jobLine << "\": " << problem << "." << std::endl;
+	  state->failures.push_back(jobLine + ": " + problem);
+	  continue;
+	}
+
+      addImage(&partial, jobLine, image);
+      if(++numSinceCheckpoint >= state->checkpointEvery)
+	{
+	  mergeAndCheckpoint(state, &partial);
+	  numSinceCheckpoint = 0;
+	}
+    }
+
+  mergeAndCheckpoint(state, &partial);
+}
+
+
+// Entry point.
+int main(int argc, char* argv[])
+{
+  // Do some error checking to make sure that the user invoked us
+  // properly.
+  if(argc < 3)
+    {
+      // Output some help info and then exit.
+      displayProgramHelp();
+      exitWith(syntax_error, syntax_error_msg);
+    }
+
+  const std::string jobFile = argv[1];
+  const std::string reportFile = argv[2];
+
+  // Read any options that follow the mandatory arguments.
+  ProgramOptions options;
+  options.numThreads = std::thread::hardware_concurrency();
+  options.numThreads = (options.numThreads > 0) ? options.numThreads : 1;
+  options.infoFile = defaultInfoFile;
+  options.checkpointEvery = 100;
+  for(int i = 3; i < argc; i++)
+    {
+      const std::string option = argv[i];
+      if(option.compare(threadsOption) == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+	{
+	  options.numThreads = static_cast<unsigned int>(atoi(argv[++i]));
+	}
+      else if(option.compare(infoOption) == 0 && i + 1 < argc)
+	{
+	  options.infoFile = argv[++i];
+	}
+      else if(option.compare(checkpointEveryOption) == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+	{
+	  options.checkpointEvery = static_cast<unsigned int>(atoi(argv[++i]));
+	}
+      else
+	{
+	  // Unknown option, so output some help info and then exit.
+	  displayProgramHelp();
+	  exitWith(syntax_error, syntax_error_msg);
+	}
+    }
+
+  // Check the image sets (ranges) of the calibration functions to
+  // ensure that produce output with suitable ranges, and make the
+  // look-up tables we use to calibrate raw histograms.
+  if(!checkCalibrationFunctions())
+    {
+      exitWith(program_error, program_error_msg);
+    }
+  JobState state;
+  const std::string digitizers[4] = {dba, howtek_mgh, howtek_ismd, lumisys};
+  for(unsigned int i = 0; i < 4; i++)
+    {
+      if(!makeCalibrationTable(getCalibrationFunction(digitizers[i]), &state.calibrationTables[digitizers[i]]))
+	{
+	  exitWith(program_error, program_error_msg);
+	}
+    }
+
+  // Resume from the checkpoint, if there is one.
+  state.checkpointFile = reportFile + checkpointSuffix;
+  state.checkpointOk = true;
+  if(!readCheckpoint(state.checkpointFile, &state.merged))
+    {
+      exitWith(checkpoint_error, checkpoint_error_msg);
+    }
+
+  // Read the job lines we have not yet processed.
+  std::ifstream jobs(jobFile.c_str());
+  if(!jobs)
+    {
+      exitWith(job_file_error, job_file_error_msg);
+    }
+  std::string line;
+  std::set<std::string> seen;
+  while(std::getline(jobs, line))
+    {
+      // Strip leading and trailing whitespace.
+      const size_t start = line.find_first_not_of(" \t\r\n");
+      if(start == std::string::npos || line[start] == '#')
+	{
+	  continue;
+	}
+      line = line.substr(start, line.find_last_not_of(" \t\r\n") - start + 1);
+      if(state.merged.completedJobs.count(line) == 0 && seen.insert(line).second)
+	{
+	  state.jobLines.push_back(line);
+	}
+    }
+  if(jobs.bad())
+    {
+      exitWith(job_file_error, job_file_error_msg);
+    }
+
+  std::cerr << "Processing " << state.jobLines.size() << " images ("
+	    << state.merged.completedJobs.size() << " already done)." << std::endl;
+
+  // Process the jobs.
+  state.volumes = readVolumes(options.infoFile);
+  state.nextJob = 0;
+  state.checkpointEvery = options.checkpointEvery;
+  std::vector<std::thread> threads;
+  for(unsigned int t = 0; t < options.numThreads; t++)
+    {
+      threads.push_back(std::thread(processJobs, &state));
+    }
+  for(unsigned int t = 0; t < threads.size(); t++)
+    {
+      threads[t].join();
+    }
+
+  if(!state.checkpointOk)
+    {
+      exitWith(checkpoint_error, checkpoint_error_msg);
+    }
+
+  if(!writeReport(reportFile, state.merged, state.failures))
+    {
+      exitWith(report_error, report_error_msg);
+    }
+
+  // Everything's OK, so send the name of the report file to stdout.
+  std::cout << reportFile << std::endl;
+
+  exit(success);
+}
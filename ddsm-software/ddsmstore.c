@@ -0,0 +1,527 @@
+/*
+  The following is very brief; full program documentation can be found
+  by compiling this program as described and running it without
+  arguments, or by reading the displayProgramHelp() function.
+
+  This program builds and reads DDSM image stores (see ddsmstore.h):
+  single files holding many calibrated images, each with its pyramid
+  levels and the metadata of its .ics and OVERLAY files, that can be
+  looked up by image name. It builds a store from a list of images
+  (found through info-file.txt, as get-ddsm-mammo finds them), decoding
+  and compressing them on several threads, and it lists a store,
+  shows an image's metadata or extracts a level of an image.
+
+  Compilation: Compile this file using gcc: "g++ -Wall -O2 -pthread ddsmstore.c -o ddsmstore"
+*/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <set>
+#include <thread>
+#include <mutex>
+
+#include "ddsmcore.h"
+#include "ddsmtiles.h"
+#include "ddsmloader.h"
+#include "ddsmstore.h"
+
+// These are program error codes and messages.
+const int success = 0; // The code to return on program success.
+const int syntax_error = -1; // Exit code if the user invokes program incorrectly.
+const char* syntax_error_msg = ""; // We'll output a message manually if the program is not called correctly.
+const int file_error = -4;
+const char* file_error_msg = "A file error was detected at runtime.";
+const int program_error = -6;
+const char* program_error_msg = "Sorry, there is a problem with the program's source code!";
+const int job_file_error = -9;
+const char* job_file_error_msg = "Could not read the list of images.";
+const int region_error = -12;
+const char* region_error_msg = "Could not read the level; does the image have it?";
+const int info_file_error = -14;
+const char* info_file_error_msg = "Could not read the info file.";
+const int store_error = -19;
+const char* store_error_msg = "Could not write the store.";
+const int image_error = -20;
+const char* image_error_msg = "The image is not in the store.";
+
+// This is the name of the file that lists the files on the DDSM FTP
+// server (as used by get-ddsm-mammo), through which we find the
+// images.
+const std::string defaultInfoFile = "info-file.txt";
+
+// The program's commands.
+const std::string buildCommand = "build";
+const std::string listCommand = "list";
+const std::string showCommand = "show";
+const std::string getCommand = "get";
+
+// These are the optional arguments that may follow the mandatory ones
+// of the build command.
+const std::string infoOption = "--info"; // Takes a value.
+const std::string rootOption = "--root"; // Takes a value.
+const std::string levelsOption = "--levels"; // Takes a value.
+const std::string tileSizeOption = "--tile-size"; // Takes a value.
+const std::string threadsOption = "--threads"; // Takes a value.
+const std::string memoryOption = "--memory"; // Takes a value.
+
+// The options that the user may specify after the mandatory
+// arguments of the build command.
+struct ProgramOptions
+{
+  std::string infoFile; // The info file that lists the images' files.
+  std::string root; // Where the images' files are.
+  unsigned int numLevels; // The number of pyramid levels to store with each image.
+  int tileSize;
+  unsigned int numThreads; // The number of images to decode (and to compress) at once.
+  unsigned long long memoryBudget; // For the images decoded ahead, in bytes.
+};
+
+
+// Display program help information.
+void displayProgramHelp()
+{
+  // We'll define the help message as an array of strings that we'll
+  // iterate over. The end of the array is marked with a special
+  // string called endString.
+  const std::string endString = "<<<END"; // Marks the end of the message.
+
+  // Here's the message array.
+  std::string
+    helpMessage[] =
+    {
+      "ddsmstore",
+      "=========\n",
+
+      "Build a store of DDSM mammograms that can be looked up by name, or read one.\n",
+
+      "Usage: ddsmstore build <image-list> <store-file> [options]",
+      "       ddsmstore list <store-file>",
+      "       ddsmstore show <store-file> <image-name>",
+      "       ddsmstore get <store-file> <image-name> [<level>]\n",
+
+      "A store is a single file holding many images, each calibrated exactly as by",
+      "ddsmraw2pnm and stored (losslessly compressed, in tiles, as by \"ddsmraw2pnm",
+      "--tiled\") with its pyramid levels and the text of its case's .ics file and of",
+      "its OVERLAY file. A hash index finds any image by name without reading",
+      "anything else. A store is read through a memory map and never changes once",
+      "written, so any number of programs can read it at once. See ddsmstore.h for",
+      "the layout.\n",
+
+      "build: Build <store-file> from the images named in <image-list> (e.g.",
+      "  A_1509_1.RIGHT_CC), one per line; blank lines and lines starting with '#' are",
+      "  ignored. Each image's .ics, LJPEG.1 (as written by \"jpeg -d -s\") and OVERLAY",
+      "  files are found through the info file. The store is written to",
+      "  \"<store-file>.tmp\" and only renamed to <store-file> once it is complete, so a",
+      "  store is never seen half-written. Images that could not be found or",
+      "  converted are reported on standard error and skipped. The name of the store",
+      "  is written to standard output. [options] may be any of the following:\n",
+
+      "  --info <info-file>   The file listing the DDSM FTP server's files (the default",
+      "                       is info-file.txt).",
+      "  --root <dir>         Where the images' files are (the default is the current",
+      "                       directory). Each file is looked for at <dir>/<path>, where",
+      "                       <path> is its path on the FTP server, and then at",
+      "                       <dir>/<name>, where <name> is its file name.",
+      "  --levels <n>         Store levels 1 to <n> (0 to 8; the default is 4) of each",
+      "                       image's pyramid as well as the full image; level k is 2^k",
+      "                       times smaller in each direction.",
+      "  --tile-size <n>      Store tiles of <n> x <n> pixels (the default is 256).",
+      "  --threads <n>        Decode and compress <n> images at once (the default is",
+      "                       the number of processors).",
+      "  --memory <MB>        Keep at most <MB> megabytes of images decoded ahead (the",
+      "                       default is 2048).\n",
+
+      "list: Write the name, digitizer, dimensions, number of levels and compressed",
+      "  size of each image in <store-file> to standard output.\n",
+
+      "show: Write the digitizer and the dimensions of each level of the image named",
+      "  <image-name>, then the text of its .ics file and of its OVERLAY file, to",
+      "  standard output.\n",
+
+      "get: Write <level> (the default is 0, the full image) of the image named",
+      "  <image-name> to the binary 16-bit PNM file \"<image-name>-<level>.pnm\" and its",
+      "  name to standard output.",
+
+      endString
+    };
+
+  // Now print the message line by line.
+  unsigned int i = 0; // An iterator.
+  std::string thisLine = ""; // We'll change this.
+  while((thisLine = helpMessage[i]) != endString)
+    {
+      std::cout << thisLine << std::endl; // Print the line.
+      i++; // Increment iterator.
+    }
+}
+
+
+// Function that exits with an error code and a particular error
+// message.
+void exitWith(const int errorCode, const char* errorMsg)
+{
+  std::cerr << errorMsg << std::endl;
+  exit(errorCode);
+}
+
+
+// Read a whole text file into text. Returns true on success.
+bool readTextFile(const std::string& path, std::string* text)
+{
+  std::ifstream input(path.c_str(), std::ios::binary);
+  std::ostringstream contents;
+  contents << input.rdbuf();
+  *text = contents.str();
+  return !input.fail();
+}
+
+// Write 16-bit pixels to a binary PNM file. Returns true on success.
+bool writeBinaryPnmFile(const std::string& outputFile, const std::vector<unsigned short>& pixels, const int numRows, const int numCols)
+{
+  FILE* output = fopen(outputFile.c_str(), "wb");
+  if(NULL == output)
+    {
+      return false;
+    }
+
+  // Binary PNM files hold 16-bit values most significant byte first.
+  fprintf(output, "P5\n%d %d\n%u\n", numCols, numRows, maxUnsignedIntWithNumBits);
+  std::vector<unsigned char> bytes(2 * pixels.size());
+  for(size_t i = 0; i < pixels.size(); i++)
+    {
+      bytes[2 * i] = static_cast<unsigned char>(pixels[i] >> 8);
+      bytes[2 * i + 1] = static_cast<unsigned char>(pixels[i] & 0xff);
+    }
+  const bool ok = fwrite(&bytes[0], 1, bytes.size(), output) == bytes.size();
+
+  return (fclose(output) == 0) && ok;
+}
+
+
+// The state shared by the threads that compress images into a store.
+struct BuildState
+{
+  ImageLoader* loader;
+  StoreWriter* writer;
+  const std::vector<ImageSource>* sources;
+  const ProgramOptions* options;
+  std::mutex mutex; // Guards the members below.
+  size_t numStored;
+  size_t numFailures;
+};
+
+// The work of each compressing thread: take the next image from the
+// loader (which hands each thread a different one), compress it and
+// its pyramid, and add it to the store, until the images run out or
+// the store can't be written.
+void runBuildJobs(BuildState* state)
+{
+  LoadedImage image;
+  StorePayload payload;
+  bool writing = true;
+  while(writing && nextLoadedImage(state->loader, &image))
+    {
+      const ImageSource& source = (*state->sources)[image.source];
+      std::string icsText;
+      std::string overlayText;
+      std::string problem = image.problem;
+      if(problem.empty() && !readTextFile(source.icsFile, &icsText))
+	{
+	  problem = source.icsFile + ": could not be read";
+	}
+      if(problem.empty() && !source.overlayFile.empty() && !readTextFile(source.overlayFile, &overlayText))
+	{
+	  problem = source.overlayFile + ": could not be read";
+	}
+
+      if(problem.empty())
+	{
+	  compressStoreImage(&image.pixels[0], image.numRows, image.numCols, state->options->numLevels, state->options->tileSize, &payload);
+	  image.pixels.clear();
+	  writing = addStoreImage(state->writer, source.name, source.digitizer, icsText, overlayText, payload);
+	}
+
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if(problem.empty())
+	{
+	  state->numStored++;
+	}
+      else
+	{
+	  std::cerr << "Skipping " << image.name << ": " << problem << "." << std::endl;
+	  state->numFailures++;
+	}
+    }
+}
+
+// Build a store. Returns the program's exit code.
+int buildStore(int argc, char* argv[])
+{
+  const std::string listFile = argv[2];
+  const std::string storeFile = argv[3];
+
+  // Read any options that follow the mandatory arguments.
+  ProgramOptions options;
+  options.infoFile = defaultInfoFile;
+  options.root = ".";
+  options.numLevels = 4;
+  options.tileSize = 256;
+  options.numThreads = std::thread::hardware_concurrency();
+  options.numThreads = (options.numThreads > 0) ? options.numThreads : 1;
+  options.memoryBudget = 2048ULL << 20;
+  for(int i = 4; i < argc; i++)
+    {
+      const std::string option = argv[i];
+      if(option.compare(infoOption) == 0 && i + 1 < argc)
+	{
+	  options.infoFile = argv[++i];
+	}
+      else if(option.compare(rootOption) == 0 && i + 1 < argc)
+	{
+	  options.root = argv[++i];
+	}
+      else if(option.compare(levelsOption) == 0 && i + 1 < argc
+	      && atoi(argv[i + 1]) >= 0 && atoi(argv[i + 1]) <= static_cast<int>(maxPyramidLevels))
+	{
+	  options.numLevels = static_cast<unsigned int>(atoi(argv[++i]));
+	}
+      else if(option.compare(tileSizeOption) == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 16 && atoi(argv[i + 1]) <= 4096)
+	{
+	  options.tileSize = atoi(argv[++i]);
+	}
+      else if(option.compare(threadsOption) == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+	{
+	  options.numThreads = static_cast<unsigned int>(atoi(argv[++i]));
+	}
+      else if(option.compare(memoryOption) == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+	{
+	  options.memoryBudget = static_cast<unsigned long long>(atoi(argv[++i])) << 20;
+	}
+      else
+	{
+	  // Unknown option, so output some help info and then exit.
+	  displayProgramHelp();
+	  exitWith(syntax_error, syntax_error_msg);
+	}
+    }
+
+  // Check the image sets (ranges) of the calibration functions to
+  // ensure that produce output with suitable ranges.
+  if(!checkCalibrationFunctions())
+    {
+      exitWith(program_error, program_error_msg);
+    }
+
+  // Read the list of images; a store holds each name at most once.
+  std::vector<std::string> names;
+  std::set<std::string> namesSeen;
+  std::ifstream list(listFile.c_str());
+  if(!list)
+    {
+      exitWith(job_file_error, job_file_error_msg);
+    }
+  std::string line;
+  while(std::getline(list, line))
+    {
+      // Strip leading and trailing whitespace.
+      const size_t start = line.find_first_not_of(" \t\r\n");
+      if(start == std::string::npos || line[start] == '#')
+	{
+	  continue;
+	}
+      const std::string name = line.substr(start, line.find_last_not_of(" \t\r\n") - start + 1);
+      if(namesSeen.insert(name).second)
+	{
+	  names.push_back(name);
+	}
+    }
+  if(list.bad())
+    {
+      exitWith(job_file_error, job_file_error_msg);
+    }
+
+  // Find the images.
+  std::vector<ImageSource> sources;
+  std::vector<std::string> failures;
+  if(!resolveImageSources(options.infoFile, options.root, names, &sources, &failures))
+    {
+      exitWith(info_file_error, info_file_error_msg);
+    }
+  for(size_t i = 0; i < failures.size(); i++)
+    {
+      std::cerr << "Skipping " << failures[i] << "." << std::endl;
+    }
+
+  // Decode the images on the loader's threads while our own threads
+  // compress them and add them to the store.
+  ImageLoaderOptions loaderOptions;
+  loaderOptions.numThreads = options.numThreads;
+  loaderOptions.numAhead = 2 * options.numThreads;
+  loaderOptions.memoryBudget = options.memoryBudget;
+  loaderOptions.downsampleLevels = 0;
+  loaderOptions.shuffle = false;
+  loaderOptions.seed = 0;
+  ImageLoader loader;
+  if(!openImageLoader(&loader, sources, loaderOptions))
+    {
+      exitWith(program_error, program_error_msg);
+    }
+
+  StoreWriter writer;
+  if(!openStoreWriter(&writer, storeFile, options.tileSize))
+    {
+      closeImageLoader(&loader);
+      exitWith(store_error, store_error_msg);
+    }
+
+  BuildState state;
+  state.loader = &loader;
+  state.writer = &writer;
+  state.sources = &sources;
+  state.options = &options;
+  state.numStored = 0;
+  state.numFailures = failures.size();
+  std::vector<std::thread> threads;
+  for(unsigned int t = 0; t < options.numThreads; t++)
+    {
+      threads.push_back(std::thread(runBuildJobs, &state));
+    }
+  for(unsigned int t = 0; t < threads.size(); t++)
+    {
+      threads[t].join();
+    }
+  closeImageLoader(&loader);
+
+  if(!closeStoreWriter(&writer))
+    {
+      exitWith(store_error, store_error_msg);
+    }
+
+  std::cerr << "Stored " << state.numStored << " images; skipped " << state.numFailures << "." << std::endl;
+
+  // Everything's OK, so send the name of the store to stdout.
+  std::cout << storeFile << std::endl;
+  return success;
+}
+
+// List the images in a store.
+void listStore(const Store& store)
+{
+  const std::vector<unsigned long long> offsets = getStoreImageOffsets(store);
+  StoreImage image;
+  for(size_t i = 0; i < offsets.size(); i++)
+    {
+      if(!readStoreImage(store, offsets[i], &image))
+	{
+	  exitWith(file_error, file_error_msg);
+	}
+
+      unsigned long long numBytes = 0;
+      for(unsigned int k = 0; k < image.levels.size(); k++)
+	{
+	  for(size_t t = 0; t < image.levels[k].index.size(); t++)
+	    {
+	      numBytes += image.levels[k].index[t].size;
+	    }
+	}
+      std::cout << image.name << " " << image.digitizer << " " << image.levels[0].numRows << " x " << image.levels[0].numCols
+		<< ", " << image.levels.size() << " levels, " << numBytes << " bytes" << std::endl;
+    }
+}
+
+// Show an image's metadata.
+void showStoreImage(const StoreImage& image)
+{
+  std::cout << "Digitizer: " << image.digitizer << std::endl;
+  for(unsigned int k = 0; k < image.levels.size(); k++)
+    {
+      std::cout << "Level " << k << ": " << image.levels[k].numRows << " rows x " << image.levels[k].numCols << " cols" << std::endl;
+    }
+  std::cout << "\n.ics file:\n" << image.icsText;
+  std::cout << "\nOVERLAY file:\n" << (image.overlayText.empty() ? "(none)\n" : image.overlayText);
+}
+
+
+// Entry point.
+int main(int argc, char* argv[])
+{
+  // Do some error checking to make sure that the user invoked us
+  // properly.
+  const std::string command = (argc > 1) ? argv[1] : "";
+  if(!((command == buildCommand && argc >= 4)
+       || (command == listCommand && argc == 3)
+       || (command == showCommand && argc == 4)
+       || (command == getCommand && (argc == 4 || argc == 5))))
+    {
+      // Output some help info and then exit.
+      displayProgramHelp();
+      exitWith(syntax_error, syntax_error_msg);
+    }
+
+  if(command == buildCommand)
+    {
+      exit(buildStore(argc, argv));
+    }
+
+  const std::string storeFile = argv[2];
+  Store store;
+  if(!openStore(storeFile, &store))
+    {
+      exitWith(file_error, file_error_msg);
+    }
+
+  if(command == listCommand)
+    {
+      listStore(store);
+      closeStore(&store);
+      exit(success);
+    }
+
+  const std::string name = argv[3];
+  StoreImage image;
+  if(!findStoreImage(store, name, &image))
+    {
+      closeStore(&store);
+      exitWith(image_error, image_error_msg);
+    }
+
+  if(command == showCommand)
+    {
+      showStoreImage(image);
+      closeStore(&store);
+      exit(success);
+    }
+
+  const std::string levelString = (argc == 5) ? argv[4] : "0";
+  const int level = atoi(levelString.c_str());
+  if(level < 0 || level >= static_cast<int>(image.levels.size()))
+    {
+      closeStore(&store);
+      exitWith(region_error, region_error_msg);
+    }
+
+  const TiledLevel& tiledLevel = image.levels[level];
+  std::vector<unsigned short> pixels(static_cast<size_t>(tiledLevel.numRows) * tiledLevel.numCols);
+  const bool ok = readStoreRegion(store, image, static_cast<unsigned int>(level), 0, 0, tiledLevel.numCols, tiledLevel.numRows, &pixels[0]);
+  closeStore(&store);
+  if(!ok)
+    {
+      exitWith(region_error, region_error_msg);
+    }
+
+  const std::string outputFile = name + "-" + levelString + ".pnm";
+  if(!writeBinaryPnmFile(outputFile, pixels, tiledLevel.numRows, tiledLevel.numCols))
+    {
+      exitWith(file_error, file_error_msg);
+    }
+
+  // Everything's OK, so send the name of the PNM file to stdout.
+  std::cout << outputFile << std::endl;
+
+  exit(success);
+}
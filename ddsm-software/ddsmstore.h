@@ -0,0 +1,548 @@
+/*
+  The DDSM image store: a single file holding many calibrated images,
+  each with its pyramid levels and the metadata of its .ics and
+  OVERLAY files, with a hash index so that any image can be found by
+  name (e.g. "A_1141_1.LEFT_MLO") without reading anything else. Stores
+  are written by "ddsmstore build" and read with the functions below
+  (or with the ddsmstore program).
+
+  A store is read through a read-only memory map and is never modified
+  once written (a store is written to a temporary file that is renamed
+  into place when it is complete), so any number of threads and
+  processes can read it at once without locking.
+
+  The file layout is as follows; all integers are unsigned and
+  little-endian, and are 32-bit unless stated otherwise:
+
+    "DDSMSTOR"          8 bytes of magic.
+    version             Currently 1.
+    num-images
+    num-buckets         The size of the hash table; a power of two, at least
+                        twice num-images.
+    tile-size           As in a tiled image file (see ddsmtiles.h).
+    table-offset        64-bit; where the hash table starts.
+    images              For each image, its tiles and then its record.
+    hash table          For each bucket: the 64-bit hash of the name of an
+                        image and the 64-bit offset of its record, or two
+                        zeros for an empty bucket.
+
+  An image's record is its name, its digitizer (e.g. "howtek-mgh"), the
+  text of its case's .ics file and the text of its OVERLAY file (empty
+  if it has none), each as a length and then its characters, followed
+  by num-levels (level 0 is the full image; level k is 2^k times
+  smaller) and, for each level, num-rows, num-cols and then, for each
+  tile (row-major), its 64-bit offset and its size. Tiles are
+  compressed as in a tiled image file.
+
+  An image is in bucket hash & (num-buckets - 1), where hash is the
+  64-bit FNV-1a hash of its name, or in the first empty-or-matching
+  bucket after it (wrapping around).
+*/
+
+#ifndef DDSMSTORE_H
+#define DDSMSTORE_H
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ddsmcore.h"
+#include "ddsmtiles.h"
+
+// The size of a store's header, before the first image.
+const unsigned int storeHeaderSize = 32;
+
+// The 64-bit FNV-1a hash of an image name.
+inline unsigned long long hashImageName(const char* name, const size_t length)
+{
+  unsigned long long hash = 14695981039346656037ULL;
+  for(size_t i = 0; i < length; i++)
+    {
+      hash = (hash ^ static_cast<unsigned char>(name[i])) * 1099511628211ULL;
+    }
+  return hash;
+}
+
+// An image's tiles as they are compressed, before they are added to a
+// store: the index of each level, with offsets from the start of
+// tiles.
+struct StorePayload
+{
+  std::vector<TiledLevel> levels;
+  std::vector<unsigned char> tiles;
+};
+
+// Compress the tiles of one level of an image.
+inline void compressStoreLevel(const unsigned short* pixels, const int numRows, const int numCols, const int tileSize, StorePayload* payload)
+{
+  payload->levels.push_back(TiledLevel());
+  TiledLevel& level = payload->levels.back();
+  initTiledLevel(&level, numRows, numCols, tileSize);
+  for(int tileRow = 0; tileRow < level.numTileRows; tileRow++)
+    {
+      for(int tileCol = 0; tileCol < level.numTileCols; tileCol++)
+	{
+	  const int x = tileCol * tileSize;
+	  const int y = tileRow * tileSize;
+	  TileIndexEntry& entry = level.index[static_cast<size_t>(tileRow) * level.numTileCols + tileCol];
+	  entry.offset = payload->tiles.size();
+	  compressTile(pixels + static_cast<size_t>(y) * numCols + x, numCols,
+		       std::min(tileSize, numCols - x), std::min(tileSize, numRows - y), &payload->tiles);
+	  entry.size = static_cast<unsigned int>(payload->tiles.size() - entry.offset);
+	}
+    }
+}
+
+// Compress a calibrated image and numLevels levels of its pyramid
+// (see addRowToPyramid()) into tiles.
+inline void compressStoreImage(const unsigned short* pixels,
+			       const int numRows,
+			       const int numCols,
+			       const unsigned int numLevels,
+			       const int tileSize,
+			       StorePayload* payload)
+{
+  payload->levels.clear();
+  payload->tiles.clear();
+  compressStoreLevel(pixels, numRows, numCols, tileSize, payload);
+  if(numLevels == 0)
+    {
+      return;
+    }
+
+  std::vector<PyramidLevel> pyramid;
+  initPyramid(&pyramid, numLevels, numRows, numCols);
+  std::vector<std::vector<unsigned short> > levelPixels(numLevels);
+  std::vector<int> numRowsDone(numLevels, 0);
+  for(unsigned int k = 0; k < numLevels; k++)
+    {
+      levelPixels[k].resize(static_cast<size_t>(pyramid[k].numRows) * pyramid[k].numCols);
+    }
+
+  std::vector<unsigned int> row(numCols);
+  for(int r = 0; r < numRows; r++)
+    {
+      std::copy(pixels + static_cast<size_t>(r) * numCols, pixels + static_cast<size_t>(r + 1) * numCols, row.begin());
+      addRowToPyramid(pyramid, &row[0], numCols, r == numRows - 1);
+      for(unsigned int k = 0; k < numLevels; k++)
+	{
+	  if(pyramid[k].rowReady)
+	    {
+	      std::copy(pyramid[k].row.begin(), pyramid[k].row.end(),
+			levelPixels[k].begin() + static_cast<size_t>(numRowsDone[k]++) * pyramid[k].numCols);
+	    }
+	}
+    }
+
+  for(unsigned int k = 0; k < numLevels; k++)
+    {
+      compressStoreLevel(&levelPixels[k][0], pyramid[k].numRows, pyramid[k].numCols, tileSize, payload);
+    }
+}
+
+// The state of a store that is being written. Images may be added
+// from several threads at once.
+struct StoreWriter
+{
+  std::string storeFile;
+  std::string tempFile; // Written, and renamed to storeFile once complete.
+  int tileSize;
+
+  std::mutex mutex; // Guards the members below.
+  FILE* file;
+  unsigned long long offset; // Where the next image goes.
+  std::vector<std::string> names; // Of the images added so far.
+  std::vector<unsigned long long> recordOffsets; // Of the images added so far.
+  bool ok; // False once anything has gone wrong.
+};
+
+// Write a string as its length and then its characters.
+inline bool writeStoreString(FILE* output, const std::string& s)
+{
+  return writeLittleEndian32(output, static_cast<unsigned int>(s.size()))
+    && (s.empty() || fwrite(s.data(), 1, s.size(), output) == s.size());
+}
+
+// Start writing a store. Returns true on success.
+inline bool openStoreWriter(StoreWriter* writer, const std::string& storeFile, const int tileSize)
+{
+  writer->storeFile = storeFile;
+  writer->tempFile = storeFile + ".tmp";
+  writer->tileSize = tileSize;
+  writer->names.clear();
+  writer->recordOffsets.clear();
+  writer->file = fopen(writer->tempFile.c_str(), "wb");
+
+  // Write the header, with placeholders for what we don't know yet.
+  const std::vector<char> header(storeHeaderSize, '\0');
+  writer->ok = (NULL != writer->file) && (fwrite(&header[0], 1, header.size(), writer->file) == header.size());
+  writer->offset = storeHeaderSize;
+  return writer->ok;
+}
+
+// Add an image (compressed by compressStoreImage()) and its metadata
+// to a store. Returns true on success.
+inline bool addStoreImage(StoreWriter* writer,
+			  const std::string& name,
+			  const std::string& digitizer,
+			  const std::string& icsText,
+			  const std::string& overlayText,
+			  const StorePayload& payload)
+{
+  std::lock_guard<std::mutex> lock(writer->mutex);
+  if(!writer->ok)
+    {
+      return false;
+    }
+
+  const unsigned long long tilesOffset = writer->offset;
+  writer->ok = payload.tiles.empty() || fwrite(&payload.tiles[0], 1, payload.tiles.size(), writer->file) == payload.tiles.size();
+  const unsigned long long recordOffset = tilesOffset + payload.tiles.size();
+  writer->ok = writer->ok
+    && writeStoreString(writer->file, name)
+    && writeStoreString(writer->file, digitizer)
+    && writeStoreString(writer->file, icsText)
+    && writeStoreString(writer->file, overlayText)
+    && writeLittleEndian32(writer->file, static_cast<unsigned int>(payload.levels.size()));
+  unsigned long long recordSize = 5 * 4 + name.size() + digitizer.size() + icsText.size() + overlayText.size();
+  for(size_t k = 0; k < payload.levels.size() && writer->ok; k++)
+    {
+      const TiledLevel& level = payload.levels[k];
+      writer->ok = writeLittleEndian32(writer->file, static_cast<unsigned int>(level.numRows))
+	&& writeLittleEndian32(writer->file, static_cast<unsigned int>(level.numCols));
+      for(size_t t = 0; t < level.index.size() && writer->ok; t++)
+	{
+	  writer->ok = writeLittleEndian64(writer->file, tilesOffset + level.index[t].offset)
+	    && writeLittleEndian32(writer->file, level.index[t].size);
+	}
+      recordSize += 8 + 12 * level.index.size();
+    }
+
+  writer->offset = recordOffset + recordSize;
+  writer->names.push_back(name);
+  writer->recordOffsets.push_back(recordOffset);
+  return writer->ok;
+}
+
+// Finish writing a store: write the hash table, fill in the header and
+// rename the store into place. Returns true if the whole store was
+// written successfully; otherwise the temporary file is removed.
+inline bool closeStoreWriter(StoreWriter* writer)
+{
+  if(NULL == writer->file)
+    {
+      return false;
+    }
+
+  unsigned int numBuckets = 2;
+  while(numBuckets < 2 * writer->names.size())
+    {
+      numBuckets *= 2;
+    }
+  std::vector<unsigned long long> hashes(numBuckets, 0);
+  std::vector<unsigned long long> offsets(numBuckets, 0);
+  for(size_t i = 0; i < writer->names.size(); i++)
+    {
+      const unsigned long long hash = hashImageName(writer->names[i].data(), writer->names[i].size());
+      unsigned int bucket = static_cast<unsigned int>(hash & (numBuckets - 1));
+      while(offsets[bucket] != 0)
+	{
+	  bucket = (bucket + 1) & (numBuckets - 1);
+	}
+      hashes[bucket] = hash;
+      offsets[bucket] = writer->recordOffsets[i];
+    }
+
+  const unsigned long long tableOffset = writer->offset;
+  for(unsigned int b = 0; b < numBuckets && writer->ok; b++)
+    {
+      writer->ok = writeLittleEndian64(writer->file, hashes[b]) && writeLittleEndian64(writer->file, offsets[b]);
+    }
+
+  writer->ok = writer->ok
+    && (fseek(writer->file, 0, SEEK_SET) == 0)
+    && (fwrite("DDSMSTOR", 1, 8, writer->file) == 8)
+    && writeLittleEndian32(writer->file, 1)
+    && writeLittleEndian32(writer->file, static_cast<unsigned int>(writer->names.size()))
+    && writeLittleEndian32(writer->file, numBuckets)
+    && writeLittleEndian32(writer->file, static_cast<unsigned int>(writer->tileSize))
+    && writeLittleEndian64(writer->file, tableOffset)
+    && (fflush(writer->file) == 0)
+    && (fsync(fileno(writer->file)) == 0);
+  writer->ok = (fclose(writer->file) == 0) && writer->ok;
+  writer->file = NULL;
+
+  writer->ok = writer->ok && rename(writer->tempFile.c_str(), writer->storeFile.c_str()) == 0;
+  if(!writer->ok)
+    {
+      remove(writer->tempFile.c_str());
+    }
+  return writer->ok;
+}
+
+
+// A store opened for reading. Nothing in it changes once it is open,
+// so it can be shared by any number of threads.
+struct Store
+{
+  const unsigned char* data; // The memory map of the whole file.
+  size_t size;
+  unsigned int numImages;
+  unsigned int numBuckets;
+  int tileSize;
+  unsigned long long tableOffset;
+};
+
+// An image's record, as read from a store.
+struct StoreImage
+{
+  std::string name;
+  std::string digitizer;
+  std::string icsText;
+  std::string overlayText; // Empty if the image has no OVERLAY file.
+  std::vector<TiledLevel> levels; // With offsets from the start of the store.
+};
+
+// Reads integers and strings from a store's memory map, checking that
+// they are inside it; ok is cleared by any read past the end.
+struct StoreCursor
+{
+  const Store* store;
+  unsigned long long position;
+  bool ok;
+};
+
+inline unsigned int getStore32(StoreCursor* cursor)
+{
+  if(!cursor->ok || cursor->position + 4 > cursor->store->size)
+    {
+      cursor->ok = false;
+      return 0;
+    }
+
+  const unsigned char* bytes = cursor->store->data + cursor->position;
+  cursor->position += 4;
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<unsigned int>(bytes[3]) << 24);
+}
+
+inline unsigned long long getStore64(StoreCursor* cursor)
+{
+  const unsigned long long low = getStore32(cursor);
+  return low | (static_cast<unsigned long long>(getStore32(cursor)) << 32);
+}
+
+inline std::string getStoreString(StoreCursor* cursor)
+{
+  const unsigned int length = getStore32(cursor);
+  if(!cursor->ok || cursor->position + length > cursor->store->size)
+    {
+      cursor->ok = false;
+      return "";
+    }
+
+  cursor->position += length;
+  return std::string(reinterpret_cast<const char*>(cursor->store->data + cursor->position - length), length);
+}
+
+// Map a store into memory and check its header. Returns true on
+// success; on failure nothing needs to be closed.
+inline bool openStore(const std::string& path, Store* store)
+{
+  store->data = NULL;
+  store->size = 0;
+  const int fd = open(path.c_str(), O_RDONLY);
+  if(fd < 0)
+    {
+      return false;
+    }
+
+  struct stat status;
+  void* map = MAP_FAILED;
+  if(fstat(fd, &status) == 0 && status.st_size >= static_cast<off_t>(storeHeaderSize))
+    {
+      map = mmap(NULL, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    }
+  close(fd); // The map stays valid.
+  if(map == MAP_FAILED)
+    {
+      return false;
+    }
+  store->data = static_cast<const unsigned char*>(map);
+  store->size = static_cast<size_t>(status.st_size);
+
+  StoreCursor cursor = {store, 8, true};
+  const unsigned int version = getStore32(&cursor);
+  store->numImages = getStore32(&cursor);
+  store->numBuckets = getStore32(&cursor);
+  store->tileSize = static_cast<int>(getStore32(&cursor));
+  store->tableOffset = getStore64(&cursor);
+  const bool ok = (memcmp(store->data, "DDSMSTOR", 8) == 0) && version == 1
+    && store->numBuckets >= 2 && (store->numBuckets & (store->numBuckets - 1)) == 0
+    && store->numImages < store->numBuckets
+    && store->tileSize > 0 && store->tileSize <= 65536
+    && store->tableOffset <= store->size && (store->size - store->tableOffset) / 16 >= store->numBuckets;
+  if(!ok)
+    {
+      munmap(const_cast<unsigned char*>(store->data), store->size);
+      store->data = NULL;
+    }
+  return ok;
+}
+
+// Read the record of an image from a store. Returns false if the
+// store is damaged.
+inline bool readStoreImage(const Store& store, const unsigned long long recordOffset, StoreImage* image)
+{
+  StoreCursor cursor = {&store, recordOffset, true};
+  image->name = getStoreString(&cursor);
+  image->digitizer = getStoreString(&cursor);
+  image->icsText = getStoreString(&cursor);
+  image->overlayText = getStoreString(&cursor);
+  const unsigned int numLevels = getStore32(&cursor);
+  image->levels.resize((cursor.ok && numLevels <= maxPyramidLevels + 1) ? numLevels : 0);
+  cursor.ok = cursor.ok && image->levels.size() == numLevels;
+  for(unsigned int k = 0; k < image->levels.size() && cursor.ok; k++)
+    {
+      const unsigned int numRows = getStore32(&cursor);
+      const unsigned int numCols = getStore32(&cursor);
+      cursor.ok = cursor.ok && numRows > 0 && numCols > 0 && numRows < 1000000 && numCols < 1000000;
+      if(cursor.ok)
+	{
+	  initTiledLevel(&image->levels[k], static_cast<int>(numRows), static_cast<int>(numCols), store.tileSize);
+	}
+      for(size_t t = 0; t < image->levels[k].index.size() && cursor.ok; t++)
+	{
+	  TileIndexEntry& entry = image->levels[k].index[t];
+	  entry.offset = getStore64(&cursor);
+	  entry.size = getStore32(&cursor);
+	  cursor.ok = cursor.ok && entry.offset <= store.size && store.size - entry.offset >= entry.size;
+	}
+    }
+
+  return cursor.ok;
+}
+
+// Return the record offsets of every image in a store, in the order of
+// the hash table.
+inline std::vector<unsigned long long> getStoreImageOffsets(const Store& store)
+{
+  std::vector<unsigned long long> offsets;
+  StoreCursor cursor = {&store, store.tableOffset, true};
+  for(unsigned int b = 0; b < store.numBuckets; b++)
+    {
+      getStore64(&cursor); // The hash.
+      const unsigned long long offset = getStore64(&cursor);
+      if(offset != 0)
+	{
+	  offsets.push_back(offset);
+	}
+    }
+  return offsets;
+}
+
+// Find an image in a store by name. Returns false if it isn't there
+// (or the store is damaged).
+inline bool findStoreImage(const Store& store, const std::string& name, StoreImage* image)
+{
+  const unsigned long long hash = hashImageName(name.data(), name.size());
+  unsigned int bucket = static_cast<unsigned int>(hash & (store.numBuckets - 1));
+  for(unsigned int probes = 0; probes < store.numBuckets; probes++)
+    {
+      StoreCursor cursor = {&store, store.tableOffset + 16ULL * bucket, true};
+      const unsigned long long bucketHash = getStore64(&cursor);
+      const unsigned long long offset = getStore64(&cursor);
+      if(offset == 0)
+	{
+	  return false;
+	}
+
+      // Only read the record of an image whose name has the same hash,
+      // and then only its name unless it matches.
+      StoreCursor nameCursor = {&store, offset, true};
+      if(bucketHash == hash && getStoreString(&nameCursor) == name && nameCursor.ok)
+	{
+	  return readStoreImage(store, offset, image);
+	}
+      bucket = (bucket + 1) & (store.numBuckets - 1);
+    }
+
+  return false;
+}
+
+// Read the rectangle of level k of an image whose top-left pixel is
+// (x, y) and which is w pixels wide and h high into out (w * h values,
+// row by row), decoding only the tiles that the rectangle touches, as
+// readTiledImageRegion() does. Returns true on success (false if the
+// rectangle isn't entirely inside the level or the store is damaged).
+inline bool readStoreRegion(const Store& store,
+			    const StoreImage& image,
+			    const unsigned int k,
+			    const int x,
+			    const int y,
+			    const int w,
+			    const int h,
+			    unsigned short* out)
+{
+  if(k >= image.levels.size() || x < 0 || y < 0 || w < 1 || h < 1)
+    {
+      return false;
+    }
+  const TiledLevel& level = image.levels[k];
+  if(x + w > level.numCols || y + h > level.numRows)
+    {
+      return false;
+    }
+
+  const int tileSize = store.tileSize;
+  std::vector<unsigned short> tile(static_cast<size_t>(tileSize) * tileSize);
+  for(int tileRow = y / tileSize; tileRow <= (y + h - 1) / tileSize; tileRow++)
+    {
+      for(int tileCol = x / tileSize; tileCol <= (x + w - 1) / tileSize; tileCol++)
+	{
+	  // The tiles are read straight from the memory map.
+	  const TileIndexEntry& entry = level.index[static_cast<size_t>(tileRow) * level.numTileCols + tileCol];
+	  const int tileX = tileCol * tileSize;
+	  const int tileY = tileRow * tileSize;
+	  const int tileCols = std::min(tileSize, level.numCols - tileX);
+	  const int tileRows = std::min(tileSize, level.numRows - tileY);
+	  if(!decompressTile(store.data + entry.offset, entry.size, tileCols, tileRows, &tile[0], tileCols))
+	    {
+	      return false;
+	    }
+
+	  // Copy the part of the tile that overlaps the rectangle.
+	  const int fromX = std::max(x, tileX);
+	  const int toX = std::min(x + w, tileX + tileCols);
+	  const int fromY = std::max(y, tileY);
+	  const int toY = std::min(y + h, tileY + tileRows);
+	  for(int row = fromY; row < toY; row++)
+	    {
+	      memcpy(out + static_cast<size_t>(row - y) * w + (fromX - x),
+		     &tile[static_cast<size_t>(row - tileY) * tileCols + (fromX - tileX)],
+		     (toX - fromX) * sizeof(unsigned short));
+	    }
+	}
+    }
+
+  return true;
+}
+
+// Unmap a store.
+inline void closeStore(Store* store)
+{
+  if(NULL != store->data)
+    {
+      munmap(const_cast<unsigned char*>(store->data), store->size);
+      store->data = NULL;
+    }
+}
+
+#endif // DDSMSTORE_H
@@ -0,0 +1,188 @@
+/*
+  The following is very brief; full program documentation can be found
+  by compiling this program as described and running it without
+  arguments, or by reading the displayProgramHelp() function.
+
+  This program reads tiled image files written by "ddsmraw2pnm
+  --tiled": it either describes a file or extracts a rectangle from
+  one of its levels (decoding only the tiles the rectangle touches)
+  and writes it as a 16-bit PNM file.
+
+  Compilation: Compile this file using gcc: "g++ -Wall -O2 ddsmtiles.c -o ddsmtiles"
+*/
+
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "ddsmcore.h"
+#include "ddsmtiles.h"
+
+// These are program error codes and messages.
+const int success = 0; // The code to return on program success.
+const int syntax_error = -1; // Exit code if the user invokes program incorrectly.
+const char* syntax_error_msg = ""; // We'll output a message manually if the program is not called correctly.
+const int file_error = -4;
+const char* file_error_msg = "A file error was detected at runtime.";
+const int region_error = -12;
+const char* region_error_msg = "Could not read the region; is it inside the level?";
+
+
+// Display program help information.
+void displayProgramHelp()
+{
+  // We'll define the help message as an array of strings that we'll
+  // iterate over. The end of the array is marked with a special
+  // string called endString.
+  const std::string endString = "<<<END"; // Marks the end of the message.
+
+  // Here's the message array.
+  std::string
+    helpMessage[] =
+    {
+      "ddsmtiles",
+      "=========\n",
+
+      "Describe a tiled image file, or extract a rectangle from it.\n",
+
+      "Usage: ddsmtiles <tiles-file>",
+      "       ddsmtiles <tiles-file> <level> <x> <y> <width> <height>\n",
+
+      "* <tiles-file> is a file written by \"ddsmraw2pnm --tiled\".\n",
+
+      "With only a <tiles-file>, the program prints the tile size and the dimensions",
+      "and compressed size of each level.\n",
+
+      "Otherwise, the rectangle of <level> (0 is the full image, k is the image",
+      "downsampled by 2^k) whose top-left pixel is at column <x> and row <y> (counting",
+      "from 0) and which is <width> x <height> pixels is extracted. Only the tiles that",
+      "the rectangle touches are read and decoded, so this is quick however big the",
+      "image is. The rectangle is written to the binary 16-bit PNM file",
+      "\"<tiles-file>-<level>-<x>-<y>-<width>x<height>.pnm\" and the name of that file is",
+      "written to standard output.",
+
+      endString
+    };
+
+  // Now print the message line by line.
+  unsigned int i = 0; // An iterator.
+  std::string thisLine = ""; // We'll change this.
+  while((thisLine = helpMessage[i]) != endString)
+    {
+      std::cout << thisLine << std::endl; // Print the line.
+      i++; // Increment iterator.
+    }
+}
+
+
+// Function that exits with an error code and a particular error
+// message.
+void exitWith(const int errorCode, const char* errorMsg)
+{
+  std::cerr << errorMsg << std::endl;
+  exit(errorCode);
+}
+
+
+// Print a description of a tiled image.
+void describeTiledImage(const TiledImage& image)
+{
+  std::cout << "Tile size: " << image.tileSize << " x " << image.tileSize << std::endl;
+  for(unsigned int k = 0; k < image.levels.size(); k++)
+    {
+      const TiledLevel& level = image.levels[k];
+      unsigned long long numBytes = 0;
+      for(size_t t = 0; t < level.index.size(); t++)
+	{
+	  numBytes += level.index[t].size;
+	}
+
+      std::cout << "Level " << k << ": " << level.numRows << " rows x " << level.numCols << " cols, "
+		<< level.numTileRows << " x " << level.numTileCols << " tiles, "
+		<< numBytes << " bytes compressed ("
+		<< (8.0 * static_cast<double>(numBytes)) / (static_cast<double>(level.numRows) * level.numCols)
+		<< " bits/pixel)" << std::endl;
+    }
+}
+
+// Write 16-bit pixels to a binary PNM file. Returns true on success.
+bool writeBinaryPnmFile(const std::string& outputFile, const std::vector<unsigned short>& pixels, const int numRows, const int numCols)
+{
+  FILE* output = fopen(outputFile.c_str(), "wb");
+  if(NULL == output)
+    {
+      return false;
+    }
+
+  // Binary PNM files hold 16-bit values most significant byte first.
+  fprintf(output, "P5\n%d %d\n%u\n", numCols, numRows, maxUnsignedIntWithNumBits);
+  std::vector<unsigned char> bytes(2 * pixels.size());
+  for(size_t i = 0; i < pixels.size(); i++)
+    {
+      bytes[2 * i] = static_cast<unsigned char>(pixels[i] >> 8);
+      bytes[2 * i + 1] = static_cast<unsigned char>(pixels[i] & 0xff);
+    }
+  const bool ok = fwrite(&bytes[0], 1, bytes.size(), output) == bytes.size();
+
+  return (fclose(output) == 0) && ok;
+}
+
+
+// Entry point.
+int main(int argc, char* argv[])
+{
+  // Do some error checking to make sure that the user invoked us
+  // properly.
+  if(argc != 2 && argc != 7)
+    {
+      // Output some help info and then exit.
+      displayProgramHelp();
+      exitWith(syntax_error, syntax_error_msg);
+    }
+
+  const std::string tiledFile = argv[1];
+  TiledImage image;
+  if(!openTiledImage(tiledFile, &image))
+    {
+      exitWith(file_error, file_error_msg);
+    }
+
+  if(argc == 2)
+    {
+      describeTiledImage(image);
+      closeTiledImage(&image);
+      exit(success);
+    }
+
+  const int level = atoi(argv[2]);
+  const int x = atoi(argv[3]);
+  const int y = atoi(argv[4]);
+  const int width = atoi(argv[5]);
+  const int height = atoi(argv[6]);
+  if(level < 0 || width < 1 || height < 1)
+    {
+      closeTiledImage(&image);
+      exitWith(region_error, region_error_msg);
+    }
+
+  std::vector<unsigned short> region(static_cast<size_t>(width) * height);
+  const bool ok = readTiledImageRegion(&image, static_cast<unsigned int>(level), x, y, width, height, &region[0]);
+  closeTiledImage(&image);
+  if(!ok)
+    {
+      exitWith(region_error, region_error_msg);
+    }
+
+  const std::string outputFile = tiledFile + "-" + argv[2] + "-" + argv[3] + "-" + argv[4] + "-" + argv[5] + "x" + argv[6] + ".pnm";
+  if(!writeBinaryPnmFile(outputFile, region, height, width))
+    {
+      exitWith(file_error, file_error_msg);
+    }
+
+  // Everything's OK, so send the name of the PNM file to stdout.
+  std::cout << outputFile << std::endl;
+
+  exit(success);
+}
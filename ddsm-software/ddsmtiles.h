@@ -0,0 +1,528 @@
+/*
+  The DDSM tiled image format: a calibrated image (and optionally its
+  pyramid levels) stored as independently compressed, fixed-size
+  tiles with an index of where each tile is, so that any rectangle of
+  any level can be read by decoding only the tiles it touches. Files
+  in this format are written by "ddsmraw2pnm --tiled" and can be read
+  with the functions below (or with the ddsmtiles program).
+
+  The file layout is as follows; all integers are unsigned and
+  little-endian, and are 32-bit unless stated otherwise:
+
+    "DDSMTILE"          8 bytes of magic.
+    version             Currently 1.
+    tile-size           Tiles are tile-size x tile-size pixels (smaller at
+                        the right and bottom edges of each level).
+    num-levels          Level 0 is the full image; level k is 2^k times smaller.
+    index-offset        64-bit; where the index starts.
+    tile data           The compressed tiles, in no particular order.
+    index               For each level: num-rows, num-cols, then for each
+                        tile (row-major): its 64-bit offset and its size.
+
+  Each tile is compressed losslessly on its own: every pixel is
+  predicted from its left, upper and upper-left neighbours within the
+  tile (the "median edge detector" predictor used by JPEG-LS), and
+  the prediction errors are Rice coded in groups of 16, each group
+  with its own Rice parameter.
+*/
+
+#ifndef DDSMTILES_H
+#define DDSMTILES_H
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "ddsmcore.h"
+
+// The number of prediction errors that share a Rice parameter.
+const int riceGroupSize = 16;
+
+// Rice codes whose unary part would be at least this long are
+// replaced by this many 1 bits followed by the 16-bit value.
+const unsigned int riceEscapeLength = 16;
+
+// Writes bits to a byte vector, most significant bit first.
+struct BitWriter
+{
+  std::vector<unsigned char>* bytes;
+  unsigned long long buffer; // Bits not yet written, in the low numBits bits.
+  int numBits;
+};
+
+inline void writeBits(BitWriter* writer, const unsigned int value, const int numBits)
+{
+  writer->buffer = (writer->buffer << numBits) | (value & ((1ULL << numBits) - 1));
+  writer->numBits += numBits;
+  while(writer->numBits >= 8)
+    {
+      writer->numBits -= 8;
+      writer->bytes->push_back(static_cast<unsigned char>(writer->buffer >> writer->numBits));
+    }
+}
+
+inline void flushBits(BitWriter* writer)
+{
+  if(writer->numBits > 0)
+    {
+      writeBits(writer, 0, 8 - writer->numBits);
+    }
+}
+
+// Reads bits written by a BitWriter. Reading past the end yields
+// zeros and sets overrun.
+struct BitReader
+{
+  const unsigned char* bytes;
+  size_t numBytes;
+  size_t position; // The next byte to load into buffer.
+  unsigned long long buffer;
+  int numBits;
+  bool overrun;
+};
+
+inline unsigned int readBits(BitReader* reader, const int numBits)
+{
+  while(reader->numBits < numBits)
+    {
+      unsigned char byte = 0;
+      if(reader->position < reader->numBytes)
+	{
+	  byte = reader->bytes[reader->position];
+	}
+      else
+	{
+	  reader->overrun = true;
+	}
+      reader->position++;
+      reader->buffer = (reader->buffer << 8) | byte;
+      reader->numBits += 8;
+    }
+
+  reader->numBits -= numBits;
+  return static_cast<unsigned int>((reader->buffer >> reader->numBits) & ((1ULL << numBits) - 1));
+}
+
+// Predict a pixel from its left (a), upper (b) and upper-left (c)
+// neighbours.
+inline unsigned int predictPixel(const unsigned int a, const unsigned int b, const unsigned int c)
+{
+  if(c >= std::max(a, b))
+    {
+      return std::min(a, b);
+    }
+  else if(c <= std::min(a, b))
+    {
+      return std::max(a, b);
+    }
+
+  return a + b - c;
+}
+
+// Compute the prediction errors of a tile of w x h pixels (whose rows
+// are stride pixels apart), mapped to unsigned values (0, -1, 1, -2,
+// ... map to 0, 1, 2, 3, ...) modulo 2^16.
+template <typename Pixel>
+inline void computeTileErrors(const Pixel* pixels, const int stride, const int w, const int h, std::vector<unsigned int>* errors)
+{
+  errors->resize(static_cast<size_t>(w) * h);
+  for(int y = 0; y < h; y++)
+    {
+      const Pixel* row = pixels + static_cast<size_t>(y) * stride;
+      const Pixel* up = (y > 0) ? row - stride : row; // Not used on the first row.
+      for(int x = 0; x < w; x++)
+	{
+	  unsigned int prediction = 0;
+	  if(y == 0)
+	    {
+	      prediction = (x == 0) ? 0 : row[x - 1];
+	    }
+	  else if(x == 0)
+	    {
+	      prediction = up[0];
+	    }
+	  else
+	    {
+	      prediction = predictPixel(row[x - 1], up[x], up[x - 1]);
+	    }
+
+	  const int difference = static_cast<short>(static_cast<unsigned short>(row[x] - prediction));
+	  (*errors)[static_cast<size_t>(y) * w + x] = (difference >= 0) ? 2 * difference : -2 * difference - 1;
+	}
+    }
+}
+
+// Compress a tile of w x h pixels (whose rows are stride pixels
+// apart; values must fit in 16 bits), appending the result to out.
+template <typename Pixel>
+inline void compressTile(const Pixel* pixels, const int stride, const int w, const int h, std::vector<unsigned char>* out)
+{
+  std::vector<unsigned int> errors;
+  computeTileErrors(pixels, stride, w, h, &errors);
+
+  BitWriter writer = {out, 0, 0};
+  for(size_t start = 0; start < errors.size(); start += riceGroupSize)
+    {
+      const size_t end = std::min(errors.size(), start + riceGroupSize);
+
+      // Choose the Rice parameter from the mean error of the group.
+      unsigned long long sum = 0;
+      for(size_t i = start; i < end; i++)
+	{
+	  sum += errors[i];
+	}
+      const unsigned long long mean = sum / (end - start);
+      unsigned int k = 0;
+      while(k < 15 && (1ULL << (k + 1)) <= mean)
+	{
+	  k++;
+	}
+      writeBits(&writer, k, 4);
+
+      for(size_t i = start; i < end; i++)
+	{
+	  const unsigned int quotient = errors[i] >> k;
+	  if(quotient < riceEscapeLength)
+	    {
+	      writeBits(&writer, (1U << (quotient + 1)) - 2, quotient + 1); // quotient 1s then a 0.
+	      writeBits(&writer, errors[i], k);
+	    }
+	  else
+	    {
+	      writeBits(&writer, (1U << riceEscapeLength) - 1, riceEscapeLength);
+	      writeBits(&writer, errors[i], 16);
+	    }
+	}
+    }
+  flushBits(&writer);
+}
+
+// Decompress a tile written by compressTile() into w x h pixels whose
+// rows are stride pixels apart. Returns true on success.
+inline bool decompressTile(const unsigned char* data,
+			   const size_t size,
+			   const int w,
+			   const int h,
+			   unsigned short* pixels,
+			   const int stride)
+{
+  BitReader reader = {data, size, 0, 0, 0, false};
+  unsigned int k = 0;
+  size_t i = 0;
+  for(int y = 0; y < h; y++)
+    {
+      unsigned short* row = pixels + static_cast<size_t>(y) * stride;
+      const unsigned short* up = (y > 0) ? row - stride : row; // Not used on the first row.
+      for(int x = 0; x < w; x++, i++)
+	{
+	  if(i % riceGroupSize == 0)
+	    {
+	      k = readBits(&reader, 4);
+	    }
+
+	  unsigned int quotient = 0;
+	  while(quotient < riceEscapeLength && readBits(&reader, 1) == 1)
+	    {
+	      quotient++;
+	    }
+	  const unsigned int error = (quotient < riceEscapeLength) ? ((quotient << k) | readBits(&reader, k)) : readBits(&reader, 16);
+	  if(reader.overrun)
+	    {
+	      return false;
+	    }
+
+	  unsigned int prediction = 0;
+	  if(y == 0)
+	    {
+	      prediction = (x == 0) ? 0 : row[x - 1];
+	    }
+	  else if(x == 0)
+	    {
+	      prediction = up[0];
+	    }
+	  else
+	    {
+	      prediction = predictPixel(row[x - 1], up[x], up[x - 1]);
+	    }
+
+	  const int difference = (error & 1) ? -static_cast<int>((error + 1) / 2) : static_cast<int>(error / 2);
+	  row[x] = static_cast<unsigned short>(prediction + difference);
+	}
+    }
+
+  return true;
+}
+
+
+// Where a tile is in a tiled image file.
+struct TileIndexEntry
+{
+  unsigned long long offset;
+  unsigned int size;
+};
+
+// One level of a tiled image.
+struct TiledLevel
+{
+  int numRows;
+  int numCols;
+  int numTileRows; // The number of rows of tiles.
+  int numTileCols; // The number of columns of tiles.
+  std::vector<TileIndexEntry> index; // Row-major.
+};
+
+// Set up the dimensions of a tiled level.
+inline void initTiledLevel(TiledLevel* level, const int numRows, const int numCols, const int tileSize)
+{
+  level->numRows = numRows;
+  level->numCols = numCols;
+  level->numTileRows = (numRows + tileSize - 1) / tileSize;
+  level->numTileCols = (numCols + tileSize - 1) / tileSize;
+  level->index.assign(static_cast<size_t>(level->numTileRows) * level->numTileCols, TileIndexEntry());
+}
+
+// The state of a tiled image file that is being written. Rows are
+// added to each level in order; once a level has a whole row of tiles
+// buffered, the tiles are compressed and written.
+struct TiledImageWriter
+{
+  FILE* file;
+  int tileSize;
+  std::vector<TiledLevel> levels;
+  std::vector<std::vector<unsigned short> > buffers; // One row of tiles for each level.
+  std::vector<int> numRowsAdded; // For each level.
+  unsigned long long offset; // Where the next tile goes.
+  bool ok; // False once anything has gone wrong.
+};
+
+// Start writing a tiled image to file (which must be open for writing
+// in binary mode, and seekable). levelDims holds the (rows, cols) of
+// each level, starting with the full image. Returns true on success.
+inline bool openTiledImageWriter(TiledImageWriter* writer,
+				 FILE* file,
+				 const int tileSize,
+				 const std::vector<std::pair<int, int> >& levelDims)
+{
+  writer->file = file;
+  writer->tileSize = tileSize;
+  writer->levels.resize(levelDims.size());
+  writer->buffers.resize(levelDims.size());
+  writer->numRowsAdded.assign(levelDims.size(), 0);
+  for(unsigned int k = 0; k < levelDims.size(); k++)
+    {
+      initTiledLevel(&writer->levels[k], levelDims[k].first, levelDims[k].second, tileSize);
+      writer->buffers[k].assign(static_cast<size_t>(tileSize) * levelDims[k].second, 0);
+    }
+
+  // Write the header, with a placeholder for the index offset.
+  writer->ok = (fwrite("DDSMTILE", 1, 8, file) == 8)
+    && writeLittleEndian32(file, 1)
+    && writeLittleEndian32(file, static_cast<unsigned int>(tileSize))
+    && writeLittleEndian32(file, static_cast<unsigned int>(levelDims.size()))
+    && writeLittleEndian32(file, 0)
+    && writeLittleEndian32(file, 0);
+  writer->offset = 28;
+  return writer->ok;
+}
+
+// Compress and write the buffered row of tiles of a level.
+inline void writeTileRow(TiledImageWriter* writer, const unsigned int k)
+{
+  TiledLevel& level = writer->levels[k];
+  const int tileRow = (writer->numRowsAdded[k] - 1) / writer->tileSize;
+  const int tileRows = writer->numRowsAdded[k] - tileRow * writer->tileSize;
+  std::vector<unsigned char> compressed;
+  for(int tileCol = 0; tileCol < level.numTileCols && writer->ok; tileCol++)
+    {
+      const int x = tileCol * writer->tileSize;
+      const int tileCols = std::min(writer->tileSize, level.numCols - x);
+      compressed.clear();
+      compressTile(&writer->buffers[k][x], level.numCols, tileCols, tileRows, &compressed);
+
+      TileIndexEntry& entry = level.index[static_cast<size_t>(tileRow) * level.numTileCols + tileCol];
+      entry.offset = writer->offset;
+      entry.size = static_cast<unsigned int>(compressed.size());
+      writer->ok = compressed.empty() || fwrite(&compressed[0], 1, compressed.size(), writer->file) == compressed.size();
+      writer->offset += compressed.size();
+    }
+}
+
+// Add the next row of (calibrated) pixels to a level.
+inline void addTiledImageRow(TiledImageWriter* writer, const unsigned int k, const unsigned int* pixels)
+{
+  TiledLevel& level = writer->levels[k];
+  const int bufferRow = writer->numRowsAdded[k] % writer->tileSize;
+  unsigned short* row = &writer->buffers[k][static_cast<size_t>(bufferRow) * level.numCols];
+  for(int x = 0; x < level.numCols; x++)
+    {
+      row[x] = static_cast<unsigned short>(pixels[x]);
+    }
+
+  writer->numRowsAdded[k]++;
+  if(bufferRow == writer->tileSize - 1 || writer->numRowsAdded[k] == level.numRows)
+    {
+      writeTileRow(writer, k);
+    }
+}
+
+// Finish writing a tiled image: write the index and fill in its
+// offset in the header. The file is not closed. Returns true if the
+// whole file was written successfully.
+inline bool closeTiledImageWriter(TiledImageWriter* writer)
+{
+  const unsigned long long indexOffset = writer->offset;
+  for(unsigned int k = 0; k < writer->levels.size() && writer->ok; k++)
+    {
+      const TiledLevel& level = writer->levels[k];
+      writer->ok = (writer->numRowsAdded[k] == level.numRows)
+	&& writeLittleEndian32(writer->file, static_cast<unsigned int>(level.numRows))
+	&& writeLittleEndian32(writer->file, static_cast<unsigned int>(level.numCols));
+      for(size_t t = 0; t < level.index.size() && writer->ok; t++)
+	{
+	  writer->ok = writeLittleEndian64(writer->file, level.index[t].offset)
+	    && writeLittleEndian32(writer->file, level.index[t].size);
+	}
+    }
+
+  writer->ok = writer->ok
+    && (fseek(writer->file, 20, SEEK_SET) == 0)
+    && writeLittleEndian64(writer->file, indexOffset)
+    && (fseek(writer->file, 0, SEEK_END) == 0);
+  return writer->ok;
+}
+
+
+// A tiled image file opened for reading.
+struct TiledImage
+{
+  FILE* file;
+  int tileSize;
+  std::vector<TiledLevel> levels;
+};
+
+// Open a tiled image file and read its index. Returns true on
+// success; on failure nothing needs to be closed.
+inline bool openTiledImage(const std::string& path, TiledImage* image)
+{
+  image->file = fopen(path.c_str(), "rb");
+  if(NULL == image->file)
+    {
+      return false;
+    }
+
+  char magic[8];
+  unsigned int version = 0;
+  unsigned int tileSize = 0;
+  unsigned int numLevels = 0;
+  unsigned int low = 0;
+  unsigned int high = 0;
+  bool ok = (fread(magic, 1, 8, image->file) == 8) && (memcmp(magic, "DDSMTILE", 8) == 0)
+    && readLittleEndian32(image->file, &version) && version == 1
+    && readLittleEndian32(image->file, &tileSize) && tileSize > 0 && tileSize <= 65536
+    && readLittleEndian32(image->file, &numLevels) && numLevels <= maxPyramidLevels + 1
+    && readLittleEndian32(image->file, &low) && readLittleEndian32(image->file, &high);
+  ok = ok && fseek(image->file, static_cast<long>((static_cast<unsigned long long>(high) << 32) | low), SEEK_SET) == 0;
+
+  image->tileSize = static_cast<int>(tileSize);
+  image->levels.resize(ok ? numLevels : 0);
+  for(unsigned int k = 0; k < image->levels.size() && ok; k++)
+    {
+      unsigned int numRows = 0;
+      unsigned int numCols = 0;
+      ok = readLittleEndian32(image->file, &numRows) && readLittleEndian32(image->file, &numCols)
+	&& numRows > 0 && numCols > 0 && numRows < 1000000 && numCols < 1000000;
+      if(ok)
+	{
+	  initTiledLevel(&image->levels[k], static_cast<int>(numRows), static_cast<int>(numCols), image->tileSize);
+	}
+      for(size_t t = 0; ok && t < image->levels[k].index.size(); t++)
+	{
+	  TileIndexEntry& entry = image->levels[k].index[t];
+	  ok = readLittleEndian32(image->file, &low) && readLittleEndian32(image->file, &high)
+	    && readLittleEndian32(image->file, &entry.size);
+	  entry.offset = (static_cast<unsigned long long>(high) << 32) | low;
+	}
+    }
+
+  if(!ok)
+    {
+      fclose(image->file);
+      image->file = NULL;
+    }
+  return ok;
+}
+
+// Read the rectangle of level k whose top-left pixel is (x, y) and
+// which is w pixels wide and h high into out (w * h values, row by
+// row). Only the tiles that the rectangle touches are read and
+// decoded. Returns true on success (false if the rectangle isn't
+// entirely inside the level or the file is damaged).
+inline bool readTiledImageRegion(TiledImage* image,
+				 const unsigned int k,
+				 const int x,
+				 const int y,
+				 const int w,
+				 const int h,
+				 unsigned short* out)
+{
+  if(k >= image->levels.size() || x < 0 || y < 0 || w < 1 || h < 1)
+    {
+      return false;
+    }
+  const TiledLevel& level = image->levels[k];
+  if(x + w > level.numCols || y + h > level.numRows)
+    {
+      return false;
+    }
+
+  const int tileSize = image->tileSize;
+  std::vector<unsigned char> compressed;
+  std::vector<unsigned short> tile(static_cast<size_t>(tileSize) * tileSize);
+  for(int tileRow = y / tileSize; tileRow <= (y + h - 1) / tileSize; tileRow++)
+    {
+      for(int tileCol = x / tileSize; tileCol <= (x + w - 1) / tileSize; tileCol++)
+	{
+	  const TileIndexEntry& entry = level.index[static_cast<size_t>(tileRow) * level.numTileCols + tileCol];
+	  const int tileX = tileCol * tileSize;
+	  const int tileY = tileRow * tileSize;
+	  const int tileCols = std::min(tileSize, level.numCols - tileX);
+	  const int tileRows = std::min(tileSize, level.numRows - tileY);
+
+	  compressed.resize(entry.size);
+	  if(fseek(image->file, static_cast<long>(entry.offset), SEEK_SET) != 0
+	     || (entry.size > 0 && fread(&compressed[0], 1, entry.size, image->file) != entry.size)
+	     || !decompressTile(entry.size > 0 ? &compressed[0] : NULL, entry.size, tileCols, tileRows, &tile[0], tileCols))
+	    {
+	      return false;
+	    }
+
+	  // Copy the part of the tile that overlaps the rectangle.
+	  const int fromX = std::max(x, tileX);
+	  const int toX = std::min(x + w, tileX + tileCols);
+	  const int fromY = std::max(y, tileY);
+	  const int toY = std::min(y + h, tileY + tileRows);
+	  for(int row = fromY; row < toY; row++)
+	    {
+	      memcpy(out + static_cast<size_t>(row - y) * w + (fromX - x),
+		     &tile[static_cast<size_t>(row - tileY) * tileCols + (fromX - tileX)],
+		     (toX - fromX) * sizeof(unsigned short));
+	    }
+	}
+    }
+
+  return true;
+}
+
+// Close a tiled image file.
+inline void closeTiledImage(TiledImage* image)
+{
+  if(NULL != image->file)
+    {
+      fclose(image->file);
+      image->file = NULL;
+    }
+}
+
+#endif // DDSMTILES_H
@@ -0,0 +1,376 @@
+/*
+  The implementation of libddsm, the DDSM conversion library; see
+  libddsm.h for the interface and how to build the library. Everything
+  here is a thin layer over ddsmcore.h, which ddsmraw2pnm also uses, so
+  that converting in-process and converting with ddsmraw2pnm give the
+  same grey levels and (for DDSM_FORMAT_PNM_PLAIN) the same bytes.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "ddsmcore.h"
+#include "ddsmloader.h"
+#include "libddsm.h"
+
+// The opaque types of the interface.
+struct ddsm_loader
+{
+  ImageLoader loader;
+  std::vector<std::string> failures;
+};
+
+struct ddsm_image
+{
+  LoadedImage image;
+};
+
+namespace
+{
+  // The digitizers' calibration functions, indexed by DDSM_DBA etc.
+  const CalibrationFunc digitizerCalibrationFuncs[4] =
+    {
+      dbaCalibration, howtekMghCalibration, howtekIsmdCalibration, lumisysCalibration
+    };
+  const std::string digitizerNames[4] = {dba, howtek_mgh, howtek_ismd, lumisys};
+
+  bool isDigitizer(const int digitizer)
+  {
+    return digitizer >= DDSM_DBA && digitizer <= DDSM_LUMISYS;
+  }
+
+  // The calibration look-up table of a digitizer (see
+  // makeCalibrationTable()), built the first time it is needed. The
+  // tables are function-local statics, so building them is
+  // thread-safe; an empty table means that the calibration function
+  // reported a problem.
+  const std::vector<unsigned short>& getCalibrationTable(const int digitizer)
+  {
+    struct Tables
+    {
+      std::vector<unsigned short> tables[4];
+      Tables()
+      {
+	for(int d = 0; d < 4; d++)
+	  {
+	    std::vector<unsigned int> table;
+	    if(makeCalibrationTable(digitizerCalibrationFuncs[d], &table))
+	      {
+		tables[d].assign(table.begin(), table.end());
+	      }
+	  }
+      }
+    };
+    static const Tables tables;
+    return tables.tables[digitizer];
+  }
+
+  // Append n pixels to a plain PNM image, breaking lines as
+  // ddsmraw2pnm's encodeRow() does (the counter carries over from one
+  // call to the next).
+  void appendPlainPnmPixels(std::string* out, const uint16_t* pixels, const size_t n, int* charColCounter)
+  {
+    const int maxCharsPerPixel = 5;
+    const int breakAroundCol = 50;
+
+    char digits[8];
+    for(size_t i = 0; i < n; i++)
+      {
+	// Write the value backwards and then copy it in order.
+	unsigned int value = pixels[i];
+	int numDigits = 0;
+	do
+	  {
+	    digits[numDigits++] = static_cast<char>('0' + value % 10);
+	    value /= 10;
+	  }
+	while(value > 0);
+	while(numDigits > 0)
+	  {
+	    *out += digits[--numDigits];
+	  }
+	*out += ' ';
+
+	(*charColCounter)++;
+	if(((*charColCounter) * maxCharsPerPixel) >= breakAroundCol)
+	  {
+	    *out += '\n';
+	    *charColCounter = 0;
+	  }
+      }
+  }
+
+  // The header of a PNM image of the given format.
+  std::string getPnmHeader(const int numRows, const int numCols, const int digitizer, const int format)
+  {
+    char dimensions[64];
+    snprintf(dimensions, sizeof(dimensions), "%u\n%u\n%u\n", numCols, numRows, maxUnsignedIntWithNumBits);
+    return std::string((format == DDSM_FORMAT_PNM_RAW) ? "P5\n" : "P2\n")
+      + getPnmCommentString(digitizerCalibrationFuncs[digitizer]) + dimensions;
+  }
+}
+
+extern "C" int ddsm_api_version(void)
+{
+  return DDSM_API_VERSION;
+}
+
+extern "C" const char* ddsm_error_string(int code)
+{
+  switch(code)
+    {
+    case DDSM_OK:
+      return "Success.";
+    case DDSM_ERROR_ARGUMENT:
+      return "An argument is out of range.";
+    case DDSM_ERROR_FILE:
+      return "The raw file could not be opened or read.";
+    case DDSM_ERROR_IMAGE_SIZE:
+      return "The raw file does not hold the specified number of pixels.";
+    case DDSM_ERROR_CALIBRATION:
+      return "A calibration function reported a problem.";
+    }
+
+  return "Unknown error.";
+}
+
+extern "C" int ddsm_digitizer_from_name(const char* name)
+{
+  for(int d = 0; d < 4 && NULL != name; d++)
+    {
+      if(digitizerNames[d].compare(name) == 0)
+	{
+	  return d;
+	}
+    }
+
+  return DDSM_ERROR_ARGUMENT;
+}
+
+extern "C" int ddsm_decode_raw_buffer(const unsigned char* bytes, size_t num_bytes, uint16_t* pixels, size_t num_pixels)
+{
+  if(NULL == bytes || NULL == pixels)
+    {
+      return DDSM_ERROR_ARGUMENT;
+    }
+  if(num_bytes != 2 * num_pixels)
+    {
+      return DDSM_ERROR_IMAGE_SIZE;
+    }
+
+  for(size_t i = 0; i < num_pixels; i++)
+    {
+      pixels[i] = static_cast<uint16_t>((bytes[2 * i] << 8) | bytes[2 * i + 1]); // Most significant byte first.
+    }
+  return DDSM_OK;
+}
+
+extern "C" int ddsm_decode_raw(const char* path, int num_rows, int num_cols, uint16_t* pixels)
+{
+  if(NULL == path || NULL == pixels || num_rows < 1 || num_cols < 1)
+    {
+      return DDSM_ERROR_ARGUMENT;
+    }
+
+  FILE* input = fopen(path, "rb");
+  if(NULL == input)
+    {
+      return DDSM_ERROR_FILE;
+    }
+  if(!checkRawFileSize(input, num_rows, num_cols))
+    {
+      fclose(input);
+      return DDSM_ERROR_IMAGE_SIZE;
+    }
+
+  // Decode a band of rows at a time, so that the raw bytes never take
+  // more than a band's worth of memory.
+  const int bandRows = 64;
+  std::vector<unsigned char> rawBytes(2 * static_cast<size_t>(num_cols) * bandRows);
+  int retVal = DDSM_OK;
+  for(int bandStart = 0; bandStart < num_rows && retVal == DDSM_OK; bandStart += bandRows)
+    {
+      const size_t numPixels = static_cast<size_t>(num_cols) * std::min(bandRows, num_rows - bandStart);
+      retVal = (fread(&rawBytes[0], 1, 2 * numPixels, input) == 2 * numPixels)
+	? ddsm_decode_raw_buffer(&rawBytes[0], 2 * numPixels, pixels + static_cast<size_t>(bandStart) * num_cols, numPixels)
+	: DDSM_ERROR_FILE;
+    }
+
+  fclose(input);
+  return retVal;
+}
+
+extern "C" int ddsm_calibrate(uint16_t* pixels, size_t num_pixels, int digitizer)
+{
+  if((NULL == pixels && num_pixels > 0) || !isDigitizer(digitizer))
+    {
+      return DDSM_ERROR_ARGUMENT;
+    }
+
+  const std::vector<unsigned short>& table = getCalibrationTable(digitizer);
+  if(table.empty())
+    {
+      return DDSM_ERROR_CALIBRATION;
+    }
+  for(size_t i = 0; i < num_pixels; i++)
+    {
+      pixels[i] = table[pixels[i]];
+    }
+  return DDSM_OK;
+}
+
+extern "C" size_t ddsm_encode(const uint16_t* pixels, int num_rows, int num_cols, int digitizer, int format,
+			      unsigned char* buffer, size_t buffer_size)
+{
+  if(NULL == pixels || num_rows < 1 || num_cols < 1 || !isDigitizer(digitizer)
+     || (format != DDSM_FORMAT_PNM_PLAIN && format != DDSM_FORMAT_PNM_RAW))
+    {
+      return 0;
+    }
+
+  const size_t numPixels = static_cast<size_t>(num_rows) * num_cols;
+  const std::string header = getPnmHeader(num_rows, num_cols, digitizer, format);
+  if(format == DDSM_FORMAT_PNM_RAW)
+    {
+      // The size is known without encoding anything.
+      const size_t size = header.size() + 2 * numPixels;
+      if(NULL != buffer && buffer_size >= size)
+	{
+	  memcpy(buffer, header.data(), header.size());
+	  unsigned char* samples = buffer + header.size();
+	  for(size_t i = 0; i < numPixels; i++)
+	    {
+	      samples[2 * i] = static_cast<unsigned char>(pixels[i] >> 8);
+	      samples[2 * i + 1] = static_cast<unsigned char>(pixels[i] & 0xff);
+	    }
+	}
+      return size;
+    }
+
+  // A plain image's size depends on its values, so encode it a row at
+  // a time, copying each row out while it fits.
+  std::string row;
+  size_t size = header.size();
+  if(NULL != buffer && buffer_size >= size)
+    {
+      memcpy(buffer, header.data(), header.size());
+    }
+  int charColCounter = 0;
+  for(int r = 0; r < num_rows; r++)
+    {
+      row.clear();
+      appendPlainPnmPixels(&row, pixels + static_cast<size_t>(r) * num_cols, num_cols, &charColCounter);
+      if(NULL != buffer && buffer_size >= size + row.size())
+	{
+	  memcpy(buffer + size, row.data(), row.size());
+	}
+      size += row.size();
+    }
+
+  return size;
+}
+
+extern "C" int ddsm_loader_open(const char* info_file, const char* root, const char* const* names, size_t num_names,
+				int num_threads, int num_ahead, size_t memory_budget, int downsample_levels,
+				int shuffle, unsigned int seed, ddsm_loader** loader)
+{
+  if(NULL == info_file || NULL == root || (NULL == names && num_names > 0) || NULL == loader
+     || num_threads < 1 || num_ahead < 0 || downsample_levels < 0 || downsample_levels > static_cast<int>(maxPyramidLevels))
+    {
+      return DDSM_ERROR_ARGUMENT;
+    }
+
+  std::vector<std::string> imageNames(names, names + num_names);
+  std::vector<ImageSource> sources;
+  ddsm_loader* newLoader = new ddsm_loader;
+  if(!resolveImageSources(info_file, root, imageNames, &sources, &newLoader->failures))
+    {
+      delete newLoader;
+      return DDSM_ERROR_FILE;
+    }
+
+  ImageLoaderOptions options;
+  options.numThreads = static_cast<unsigned int>(num_threads);
+  options.numAhead = static_cast<unsigned int>(num_ahead);
+  options.memoryBudget = memory_budget;
+  options.downsampleLevels = static_cast<unsigned int>(downsample_levels);
+  options.shuffle = (shuffle != 0);
+  options.seed = seed;
+  if(!openImageLoader(&newLoader->loader, sources, options))
+    {
+      delete newLoader;
+      return DDSM_ERROR_CALIBRATION;
+    }
+
+  *loader = newLoader;
+  return DDSM_OK;
+}
+
+extern "C" size_t ddsm_loader_num_images(const ddsm_loader* loader)
+{
+  return loader->loader.order.size();
+}
+
+extern "C" size_t ddsm_loader_num_failures(const ddsm_loader* loader)
+{
+  return loader->failures.size();
+}
+
+extern "C" const char* ddsm_loader_failure(const ddsm_loader* loader, size_t i)
+{
+  return (i < loader->failures.size()) ? loader->failures[i].c_str() : NULL;
+}
+
+extern "C" int ddsm_loader_next(ddsm_loader* loader, ddsm_image** image)
+{
+  ddsm_image* newImage = new ddsm_image;
+  if(!nextLoadedImage(&loader->loader, &newImage->image))
+    {
+      delete newImage;
+      return DDSM_END;
+    }
+
+  *image = newImage;
+  return newImage->image.problem.empty() ? DDSM_OK : DDSM_ERROR_FILE;
+}
+
+extern "C" void ddsm_loader_close(ddsm_loader* loader)
+{
+  if(NULL != loader)
+    {
+      closeImageLoader(&loader->loader);
+      delete loader;
+    }
+}
+
+extern "C" const char* ddsm_image_name(const ddsm_image* image)
+{
+  return image->image.name.c_str();
+}
+
+extern "C" const char* ddsm_image_problem(const ddsm_image* image)
+{
+  return image->image.problem.c_str();
+}
+
+extern "C" int ddsm_image_rows(const ddsm_image* image)
+{
+  return image->image.pixels.empty() ? 0 : image->image.numRows;
+}
+
+extern "C" int ddsm_image_cols(const ddsm_image* image)
+{
+  return image->image.pixels.empty() ? 0 : image->image.numCols;
+}
+
+extern "C" uint16_t* ddsm_image_pixels(ddsm_image* image)
+{
+  return image->image.pixels.empty() ? NULL : &image->image.pixels[0];
+}
+
+extern "C" void ddsm_image_free(ddsm_image* image)
+{
+  delete image;
+}
@@ -0,0 +1,167 @@
+/*
+  libddsm: the DDSM conversion as a library, so that a program can
+  convert mammograms in-process (on its own buffers) instead of running
+  ddsmraw2pnm and reading its PNM file back from disk. The interface is
+  plain C, so that it can be called from C, C++ and anything with a C
+  foreign function interface; the library itself is built from
+  libddsm.c, which uses the same calibration code (ddsmcore.h) as
+  ddsmraw2pnm, so the two give identical grey levels.
+
+  Compilation: "g++ -Wall -O2 -pthread -fPIC -shared libddsm.c -o libddsm.so"
+  (or "g++ -Wall -O2 -pthread -c libddsm.c" and "ar rcs libddsm.a libddsm.o"
+  for a static library).
+
+  A typical conversion, with error checking left out:
+
+    size_t numPixels = (size_t) numRows * numCols;
+    uint16_t* pixels = malloc(numPixels * sizeof(uint16_t));
+    ddsm_decode_raw("A_0069_1.LEFT_CC.LJPEG.1", numRows, numCols, pixels);
+    ddsm_calibrate(pixels, numPixels, ddsm_digitizer_from_name("howtek-mgh"));
+    size_t size = ddsm_encode(pixels, numRows, numCols, DDSM_HOWTEK_MGH, DDSM_FORMAT_PNM_PLAIN, NULL, 0);
+    unsigned char* pnm = malloc(size);
+    ddsm_encode(pixels, numRows, numCols, DDSM_HOWTEK_MGH, DDSM_FORMAT_PNM_PLAIN, pnm, size);
+
+  The conversion functions keep no state between calls (other than
+  calibration tables that are built once and never change), so they
+  may be called from several threads at once. Apart from loaders and
+  the images they serve (see ddsm_loader_open()), which have their own
+  functions to free them, the library never allocates memory that the
+  caller must free, and it never prints anything to standard output
+  (only a calibration function found to be broken is reported, on
+  standard error).
+*/
+
+#ifndef LIBDDSM_H
+#define LIBDDSM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The version of the interface; it changes only if a function's
+   signature or behaviour changes incompatibly. */
+#define DDSM_API_VERSION 1
+
+/* Return codes. Every function that can fail returns DDSM_OK (0) on
+   success and one of the negative codes below otherwise. */
+#define DDSM_OK 0
+#define DDSM_ERROR_ARGUMENT -1 /* An argument is out of range (e.g. an unknown digitizer). */
+#define DDSM_ERROR_FILE -2 /* The raw file could not be opened or read. */
+#define DDSM_ERROR_IMAGE_SIZE -3 /* The raw file does not hold num_rows x num_cols pixels. */
+#define DDSM_ERROR_CALIBRATION -4 /* A calibration function reported a problem. */
+#define DDSM_END 1 /* A loader has served every image. */
+
+/* The digitizers, each of which has its own calibration function. */
+#define DDSM_DBA 0
+#define DDSM_HOWTEK_MGH 1
+#define DDSM_HOWTEK_ISMD 2
+#define DDSM_LUMISYS 3
+
+/* The formats that ddsm_encode() can produce. */
+#define DDSM_FORMAT_PNM_PLAIN 0 /* "Plain" (text) PGM, byte for byte as written by ddsmraw2pnm. */
+#define DDSM_FORMAT_PNM_RAW 1 /* Binary PGM (P5) with 16-bit, big-endian samples. */
+
+/* Return DDSM_API_VERSION as the library was built, so that a caller
+   can check that it was compiled against the same interface. */
+int ddsm_api_version(void);
+
+/* Return a short description of a return code. */
+const char* ddsm_error_string(int code);
+
+/* Return the digitizer (e.g. DDSM_HOWTEK_MGH) with the given name, as
+   used by ddsmraw2pnm and the DDSM's ".ics" files ("dba",
+   "howtek-mgh", "howtek-ismd" or "lumisys"), or DDSM_ERROR_ARGUMENT if
+   the name is unknown. */
+int ddsm_digitizer_from_name(const char* name);
+
+/* Read a raw ("LJPEG.1") file, as written by the DDSM's "jpeg -d -s",
+   of num_rows x num_cols pixels into pixels, which must have room for
+   num_rows * num_cols values. The values are the raw (uncalibrated)
+   grey levels, row by row. */
+int ddsm_decode_raw(const char* path, int num_rows, int num_cols, uint16_t* pixels);
+
+/* As ddsm_decode_raw(), but from the bytes of a raw file that are
+   already in memory (2 * num_pixels bytes, most significant byte of
+   each pixel first). */
+int ddsm_decode_raw_buffer(const unsigned char* bytes, size_t num_bytes, uint16_t* pixels, size_t num_pixels);
+
+/* Calibrate num_pixels raw grey levels, in place, for the given
+   digitizer: each becomes the normalised grey level that ddsmraw2pnm
+   would write. The pixels may be any span of an image (e.g. a single
+   row or a region), as each is calibrated independently. */
+int ddsm_calibrate(uint16_t* pixels, size_t num_pixels, int digitizer);
+
+/* Encode an image of num_rows x num_cols calibrated pixels in the
+   given format, writing it to buffer if buffer_size is big enough.
+   The digitizer is recorded in the file's comment, as ddsmraw2pnm
+   does. Returns the size of the encoded image in bytes (whether or not
+   it was written, so that a caller can call this with a NULL buffer
+   to find the size it needs), or 0 if an argument is out of range. If
+   buffer_size is too small, the contents of buffer are undefined. */
+size_t ddsm_encode(const uint16_t* pixels, int num_rows, int num_cols, int digitizer, int format,
+		   unsigned char* buffer, size_t buffer_size);
+
+/* A loader serves calibrated images, given their names, in a shuffled
+   order, decoding the next few on a pool of threads while the caller
+   works on the current one; see ddsmloader.h for the details. */
+typedef struct ddsm_loader ddsm_loader;
+
+/* An image served by a loader, which owns its pixels. */
+typedef struct ddsm_image ddsm_image;
+
+/* Start a loader over the images with the given names (e.g.
+   "A_1509_1.RIGHT_CC"), which are found through info_file (the DDSM's
+   info-file.txt): each image's .ics and LJPEG.1 files are looked for
+   under root, at their path on the FTP server or directly in root.
+   Names that can't be found are left out (see
+   ddsm_loader_failure()). num_threads threads decode images; at most
+   num_ahead images beyond the one being waited for are decoded ahead,
+   and those decoded and not yet served take at most memory_budget
+   bytes (though one image is always allowed). Images are served at
+   full resolution, or downsampled by 2^downsample_levels (from 1 to 8)
+   in each direction, and in a random order (from seed) if shuffle is
+   non-zero. On success, *loader must be closed with
+   ddsm_loader_close(). */
+int ddsm_loader_open(const char* info_file, const char* root, const char* const* names, size_t num_names,
+		     int num_threads, int num_ahead, size_t memory_budget, int downsample_levels,
+		     int shuffle, unsigned int seed, ddsm_loader** loader);
+
+/* The number of images that a loader will serve. */
+size_t ddsm_loader_num_images(const ddsm_loader* loader);
+
+/* The number of names that a loader couldn't find, and a description
+   of the i-th problem. */
+size_t ddsm_loader_num_failures(const ddsm_loader* loader);
+const char* ddsm_loader_failure(const ddsm_loader* loader, size_t i);
+
+/* Wait for the next image. Returns DDSM_END once every image has been
+   served, and otherwise sets *image, which must be freed with
+   ddsm_image_free(): DDSM_OK if the image was loaded, or an error if
+   it wasn't (in which case it has a name but no pixels). Several
+   threads may call this at once; each gets a different image. */
+int ddsm_loader_next(ddsm_loader* loader, ddsm_image** image);
+
+/* Stop a loader, whether or not it has served every image, and free
+   it. Images it has served stay valid. */
+void ddsm_loader_close(ddsm_loader* loader);
+
+/* An image's name, dimensions and calibrated pixels (row by row),
+   and, if it couldn't be loaded, a description of the problem (or
+   otherwise an empty string). */
+const char* ddsm_image_name(const ddsm_image* image);
+const char* ddsm_image_problem(const ddsm_image* image);
+int ddsm_image_rows(const ddsm_image* image);
+int ddsm_image_cols(const ddsm_image* image);
+uint16_t* ddsm_image_pixels(ddsm_image* image);
+
+/* Free an image served by a loader. */
+void ddsm_image_free(ddsm_image* image);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBDDSM_H */